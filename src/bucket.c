@@ -20,9 +20,7 @@
 #include "autoconf.h"
 #include "gdbmdefs.h"
 #include <limits.h>
-
-#define GDBM_MAX_DIR_SIZE INT_MAX
-#define GDBM_MAX_DIR_HALF (GDBM_MAX_DIR_SIZE / 2)
+#include <stddef.h>
 
 /* Initializing a new hash buckets sets all bucket entries to -1 hash value. */
 void
@@ -57,6 +55,1309 @@ gdbm_dir_entry_valid_p (GDBM_FILE dbf, int dir_index)
          && dbf->dir[dir_index] >= dbf->header->block_size;
 }
     
+/* Bucket cache index.
+
+   To avoid scanning the whole bucket cache on each lookup, cache entries
+   are indexed by their bucket address in dbf->cache_index.  This is an
+   open addressing hash table with linear probing.  It is kept at most
+   half full, so that a lookup examines only a couple of slots no matter
+   how big the cache is. */
+
+/* Return the home slot for the bucket address ADR. */
+static inline size_t
+cache_index_home (GDBM_FILE dbf, off_t adr)
+{
+  unsigned long long h = adr;
+
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h & (dbf->cache_index_size - 1);
+}
+
+/* Return the number of slots in the cache index for a cache of SIZE
+   entries. */
+static size_t
+cache_index_size_for (size_t size)
+{
+  size_t n = 2;
+
+  while (n < 2 * size)
+    n <<= 1;
+  return n;
+}
+
+/* Add the cache entry INDEX to the cache index. */
+static void
+cache_index_insert (GDBM_FILE dbf, int index)
+{
+  size_t slot = cache_index_home (dbf, dbf->bucket_cache[index].ca_adr);
+
+  while (dbf->cache_index[slot] != -1)
+    slot = (slot + 1) & (dbf->cache_index_size - 1);
+  dbf->cache_index[slot] = index;
+}
+
+/* Remove the cache entry INDEX from the cache index.  The entry must
+   still hold its bucket address. */
+static void
+cache_index_remove (GDBM_FILE dbf, int index)
+{
+  size_t mask = dbf->cache_index_size - 1;
+  size_t slot = cache_index_home (dbf, dbf->bucket_cache[index].ca_adr);
+  size_t next, home;
+
+  while (dbf->cache_index[slot] != index)
+    {
+      if (dbf->cache_index[slot] == -1)
+	return;
+      slot = (slot + 1) & mask;
+    }
+
+  /* Empty the slot and move other elements to guarantee that they
+     can be found.  This is the same technique as used by gdbm_delete. */
+  dbf->cache_index[slot] = -1;
+  next = (slot + 1) & mask;
+  while (dbf->cache_index[next] != -1)
+    {
+      home = cache_index_home (dbf,
+			       dbf->bucket_cache[dbf->cache_index[next]].ca_adr);
+      if ((slot < next && (home <= slot || home > next))
+	  || (slot > next && home <= slot && home > next))
+	{
+	  dbf->cache_index[slot] = dbf->cache_index[next];
+	  dbf->cache_index[next] = -1;
+	  slot = next;
+	}
+      next = (next + 1) & mask;
+    }
+}
+
+/* Return the index of the cache entry holding the bucket at address ADR,
+   or -1 if it is not in the cache. */
+int
+_gdbm_cache_lookup (GDBM_FILE dbf, off_t adr)
+{
+  size_t slot;
+  int index;
+
+  if (dbf->cache_index == NULL)
+    return -1;
+  slot = cache_index_home (dbf, adr);
+  while ((index = dbf->cache_index[slot]) != -1)
+    {
+      if (dbf->bucket_cache[index].ca_adr == adr)
+	return index;
+      slot = (slot + 1) & (dbf->cache_index_size - 1);
+    }
+  return -1;
+}
+
+/* Assign the bucket address ADR to the (invalidated) cache entry INDEX. */
+void
+_gdbm_cache_entry_set_adr (GDBM_FILE dbf, int index, off_t adr)
+{
+  dbf->bucket_cache[index].ca_adr = adr;
+  dbf->bucket_cache[index].ca_hashes_valid = FALSE;
+  cache_index_insert (dbf, index);
+}
+
+/* Move the bucket in the cache entry INDEX to the file address ADR.
+   The bucket is written there by the next update. */
+void
+_gdbm_cache_entry_relocate (GDBM_FILE dbf, int index, off_t adr)
+{
+  cache_index_remove (dbf, index);
+  dbf->bucket_cache[index].ca_adr = adr;
+  cache_index_insert (dbf, index);
+  _gdbm_cache_set_changed (dbf, &dbf->bucket_cache[index]);
+}
+
+/* Bucket cache replacement policies.
+
+   GDBM_CACHE_FIFO   Entries are reused in round-robin order, no matter
+		     how often they are accessed.  This is the traditional
+		     GDBM behavior.
+   GDBM_CACHE_LRU    The least recently used entry is reused.
+   GDBM_CACHE_CLOCK  Approximation of LRU: each access sets the reference
+		     bit of the entry.  The clock hand skips entries with
+		     the bit set, clearing it.
+   GDBM_CACHE_SLRU   Segmented LRU.  Newly read buckets enter the
+		     probationary segment.  Buckets accessed again are
+		     promoted to the protected segment, which takes at
+		     most SLRU_PROTECTED_SIZE entries.  Victims are taken
+		     from the probationary segment first, so that a scan
+		     over the database does not flush frequently used
+		     buckets.
+
+   Invalidated entries are moved to the tail of the probationary list
+   (or get their reference bit cleared), so that they are reused
+   first. */
+
+#define SLRU_PROTECTED_SIZE(dbf) ((dbf)->cache_size * 4 / 5)
+
+#define CACHE_POLICY_LISTS(dbf) \
+  ((dbf)->cache_policy == GDBM_CACHE_LRU \
+   || (dbf)->cache_policy == GDBM_CACHE_SLRU)
+
+/* Remove the cache entry INDEX from its recency list. */
+static void
+cache_list_unlink (GDBM_FILE dbf, int index)
+{
+  cache_elem *elem = &dbf->bucket_cache[index];
+  cache_list *list = &dbf->cache_lru[(int) elem->ca_list];
+
+  if (elem->ca_prev == -1)
+    list->head = elem->ca_next;
+  else
+    dbf->bucket_cache[elem->ca_prev].ca_next = elem->ca_next;
+  if (elem->ca_next == -1)
+    list->tail = elem->ca_prev;
+  else
+    dbf->bucket_cache[elem->ca_next].ca_prev = elem->ca_prev;
+  list->count--;
+}
+
+/* Insert the cache entry INDEX at the head of the recency list N. */
+static void
+cache_list_push_head (GDBM_FILE dbf, int n, int index)
+{
+  cache_elem *elem = &dbf->bucket_cache[index];
+  cache_list *list = &dbf->cache_lru[n];
+
+  elem->ca_list = n;
+  elem->ca_prev = -1;
+  elem->ca_next = list->head;
+  if (list->head == -1)
+    list->tail = index;
+  else
+    dbf->bucket_cache[list->head].ca_prev = index;
+  list->head = index;
+  list->count++;
+}
+
+/* Insert the cache entry INDEX at the tail of the recency list N. */
+static void
+cache_list_push_tail (GDBM_FILE dbf, int n, int index)
+{
+  cache_elem *elem = &dbf->bucket_cache[index];
+  cache_list *list = &dbf->cache_lru[n];
+
+  elem->ca_list = n;
+  elem->ca_next = -1;
+  elem->ca_prev = list->tail;
+  if (list->tail == -1)
+    list->head = index;
+  else
+    dbf->bucket_cache[list->tail].ca_next = index;
+  list->tail = index;
+  list->count++;
+}
+
+/* Reset the replacement policy state: put all cache entries in the
+   probationary list in index order and clear their reference bits. */
+void
+_gdbm_cache_policy_reset (GDBM_FILE dbf)
+{
+  size_t index;
+
+  dbf->cache_lru[0].head = dbf->cache_lru[1].head = -1;
+  dbf->cache_lru[0].tail = dbf->cache_lru[1].tail = -1;
+  dbf->cache_lru[0].count = dbf->cache_lru[1].count = 0;
+  for (index = 0; index < dbf->cache_size; index++)
+    {
+      dbf->bucket_cache[index].ca_ref = FALSE;
+      cache_list_push_tail (dbf, 0, index);
+    }
+}
+
+/* Record an access to the cache entry INDEX. */
+static void
+cache_touch (GDBM_FILE dbf, int index)
+{
+  cache_elem *elem = &dbf->bucket_cache[index];
+
+  elem->ca_epoch = dbf->cache_epoch;
+
+  switch (dbf->cache_policy)
+    {
+    case GDBM_CACHE_LRU:
+      if (dbf->cache_lru[0].head != index)
+	{
+	  cache_list_unlink (dbf, index);
+	  cache_list_push_head (dbf, 0, index);
+	}
+      break;
+
+    case GDBM_CACHE_SLRU:
+      if (elem->ca_list == 1 && dbf->cache_lru[1].head == index)
+	break;
+      cache_list_unlink (dbf, index);
+      cache_list_push_head (dbf, 1, index);
+      if (dbf->cache_lru[1].count > SLRU_PROTECTED_SIZE (dbf))
+	{
+	  /* Demote the least recently used protected entry. */
+	  int tail = dbf->cache_lru[1].tail;
+	  cache_list_unlink (dbf, tail);
+	  cache_list_push_head (dbf, 0, tail);
+	}
+      break;
+
+    case GDBM_CACHE_CLOCK:
+      elem->ca_ref = TRUE;
+      break;
+    }
+}
+
+/* Record that the cache entry INDEX has been (re)loaded with a new
+   bucket. */
+static void
+cache_insert (GDBM_FILE dbf, int index)
+{
+  dbf->bucket_cache[index].ca_epoch = dbf->cache_epoch;
+
+  switch (dbf->cache_policy)
+    {
+    case GDBM_CACHE_LRU:
+    case GDBM_CACHE_SLRU:
+      cache_list_unlink (dbf, index);
+      cache_list_push_head (dbf, 0, index);
+      break;
+
+    case GDBM_CACHE_CLOCK:
+      dbf->bucket_cache[index].ca_ref = TRUE;
+      break;
+    }
+}
+
+/* Record that the cache entry INDEX has been invalidated. */
+static void
+cache_release (GDBM_FILE dbf, int index)
+{
+  switch (dbf->cache_policy)
+    {
+    case GDBM_CACHE_LRU:
+    case GDBM_CACHE_SLRU:
+      cache_list_unlink (dbf, index);
+      cache_list_push_tail (dbf, 0, index);
+      break;
+
+    case GDBM_CACHE_CLOCK:
+      dbf->bucket_cache[index].ca_ref = FALSE;
+      break;
+    }
+}
+
+/* Select the cache entry to be reused.  Neither the entry holding the
+   current bucket, nor the entry KEEP (unless it is -1) is selected. */
+static int
+cache_victim (GDBM_FILE dbf, int keep)
+{
+  int current = dbf->cache_entry ? dbf->cache_entry - dbf->bucket_cache : -1;
+  size_t hand;
+  int n, index;
+
+  switch (dbf->cache_policy)
+    {
+    case GDBM_CACHE_LRU:
+    case GDBM_CACHE_SLRU:
+      for (n = 0; n < 2; n++)
+	for (index = dbf->cache_lru[n].tail; index != -1;
+	     index = dbf->bucket_cache[index].ca_prev)
+	  if (index != current && index != keep)
+	    return index;
+      break;
+
+    case GDBM_CACHE_CLOCK:
+      hand = dbf->last_read;
+      for (;;)
+	{
+	  hand = (hand + 1) % dbf->cache_size;
+	  if (hand == current || hand == keep)
+	    continue;
+	  if (!dbf->bucket_cache[hand].ca_ref)
+	    break;
+	  dbf->bucket_cache[hand].ca_ref = FALSE;
+	}
+      dbf->last_read = hand;
+      return hand;
+    }
+
+  /* GDBM_CACHE_FIFO */
+  hand = dbf->last_read;
+  do
+    hand = (hand + 1) % dbf->cache_size;
+  while (hand == current || hand == keep);
+  dbf->last_read = hand;
+  return hand;
+}
+
+/* Get a cache entry to load a new bucket into, other than KEEP.  The
+   victim entry is written to disk if it has been changed, and
+   invalidated.  Return its index, or -1 on error. */
+static int
+cache_evict (GDBM_FILE dbf, int keep)
+{
+  int index = cache_victim (dbf, keep);
+
+  if (dbf->bucket_cache[index].ca_adr)
+    dbf->cache_stats.evictions++;
+  if (dbf->bucket_cache[index].ca_changed)
+    {
+      if (_gdbm_write_bucket (dbf, &dbf->bucket_cache[index]))
+	return -1;
+      dbf->cache_stats.writebacks++;
+    }
+  _gdbm_cache_entry_invalidate (dbf, index);
+  cache_insert (dbf, index);
+  return index;
+}
+
+/* Zero-copy bucket access.
+
+   A database opened for reading only never modifies its buckets.  If
+   it is memory-mapped, a bucket that lies entirely within the mapped
+   region is not copied into the cache: the cache entry points directly
+   to its image in the region instead.  Memory for the bucket buffers is
+   then allocated only when a bucket has to be read by other means, so
+   that the heap usage of the cache does not grow with its size.
+
+   The pointers become invalid when the region is unmapped or remapped.
+   Before that happens, _gdbm_cache_unmap drops the entries that point
+   into the region, except for the current one, which is copied to a
+   buffer of its own because callers may still be using it. */
+
+/* Required alignment of a hash_bucket structure. */
+#define BUCKET_ALIGNMENT \
+  offsetof (struct { char c; hash_bucket b; }, b)
+
+/* Return true if buckets of DBF can be accessed without copying. */
+static inline int
+cache_zero_copy (GDBM_FILE dbf)
+{
+#if HAVE_MMAP
+  return dbf->read_write == GDBM_READER && dbf->memory_mapping;
+#else
+  return 0;
+#endif
+}
+
+/* Return a pointer to the image of the bucket at ADR in the mapped
+   region, or NULL if it is not mapped or not suitably aligned.  The
+   region starts on a page boundary, so the image is aligned if ADR
+   is. */
+static hash_bucket *
+cache_mapped_bucket (GDBM_FILE dbf, off_t adr)
+{
+#if HAVE_MMAP
+  if (adr % BUCKET_ALIGNMENT == 0)
+    return _gdbm_mapped_ptr (dbf, adr, dbf->header->bucket_size);
+#endif
+  return NULL;
+}
+
+/* Make sure the cache entry INDEX has a bucket buffer of its own.
+   Return 0 on success and -1 on error. */
+static int
+cache_entry_buffer (GDBM_FILE dbf, int index)
+{
+  if (dbf->bucket_cache[index].ca_bucket == NULL)
+    {
+      dbf->bucket_cache[index].ca_bucket = malloc (dbf->header->bucket_size);
+      if (dbf->bucket_cache[index].ca_bucket == NULL)
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, TRUE);
+	  return -1;
+	}
+    }
+  return 0;
+}
+
+/* The mapped region of DBF is about to be unmapped.  Invalidate the
+   cache entries pointing into it, and copy the current bucket to the
+   heap if it is one of them.  Return 0 on success and -1 on error. */
+int
+_gdbm_cache_unmap (GDBM_FILE dbf)
+{
+  size_t index;
+  int current;
+  hash_bucket *bucket;
+
+  if (dbf->bucket_cache == NULL)
+    return 0;
+  current = dbf->cache_entry - dbf->bucket_cache;
+  for (index = 0; index < dbf->cache_size; index++)
+    if (dbf->bucket_cache[index].ca_mapped && (int) index != current)
+      _gdbm_cache_entry_invalidate (dbf, index);
+
+  if (!dbf->cache_entry->ca_mapped)
+    return 0;
+  bucket = malloc (dbf->header->bucket_size);
+  if (bucket == NULL)
+    {
+      _gdbm_cache_entry_invalidate (dbf, current);
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, TRUE);
+      return -1;
+    }
+  memcpy (bucket, dbf->cache_entry->ca_bucket, dbf->header->bucket_size);
+  dbf->cache_entry->ca_bucket = bucket;
+  dbf->cache_entry->ca_mapped = FALSE;
+  dbf->bucket = bucket;
+  return 0;
+}
+
+/* Initialize the bucket cache. */
+int
+_gdbm_init_cache (GDBM_FILE dbf, size_t size)
+{
+  int index;
+
+  if (dbf->bucket_cache == NULL)
+    {
+      dbf->bucket_cache = calloc (size, sizeof(cache_elem));
+      if (dbf->bucket_cache == NULL)
+        {
+          GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, TRUE);
+          return -1;
+        }
+      dbf->cache_size = size;
+
+      dbf->cache_index_size = cache_index_size_for (size);
+      dbf->cache_index = malloc (dbf->cache_index_size
+				 * sizeof (dbf->cache_index[0]));
+      if (dbf->cache_index == NULL)
+	{
+          GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, TRUE);
+	  return -1;
+	}
+      for (index = 0; index < dbf->cache_index_size; index++)
+	dbf->cache_index[index] = -1;
+
+      dbf->cache_dirty = malloc (size * sizeof (dbf->cache_dirty[0]));
+      if (dbf->cache_dirty == NULL)
+	{
+          GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, TRUE);
+	  return -1;
+	}
+      dbf->cache_dirty_count = 0;
+
+      for (index = 0; index < size; index++)
+        {
+	  if (!cache_zero_copy (dbf))
+	    {
+	      (dbf->bucket_cache[index]).ca_bucket =
+		malloc (dbf->header->bucket_size);
+	      if ((dbf->bucket_cache[index]).ca_bucket == NULL)
+		{
+		  GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, TRUE);
+		  return -1;
+		}
+	    }
+	  dbf->bucket_cache[index].ca_epoch = dbf->cache_epoch - 1;
+	  _gdbm_cache_entry_invalidate (dbf, index);
+        }
+      _gdbm_cache_policy_reset (dbf);
+      dbf->bucket = dbf->bucket_cache[0].ca_bucket;
+      dbf->cache_entry = &dbf->bucket_cache[0];
+    }
+  return 0;
+}
+
+void
+_gdbm_cache_entry_invalidate (GDBM_FILE dbf, int index)
+{
+  if (dbf->bucket_cache[index].ca_adr)
+    {
+      cache_index_remove (dbf, index);
+      cache_release (dbf, index);
+    }
+  if (dbf->bucket_cache[index].ca_mapped)
+    {
+      dbf->bucket_cache[index].ca_bucket = NULL;
+      dbf->bucket_cache[index].ca_mapped = FALSE;
+    }
+  dbf->bucket_cache[index].ca_adr = 0;
+  dbf->bucket_cache[index].ca_changed = FALSE;
+  dbf->bucket_cache[index].ca_filter_valid = FALSE;
+  dbf->bucket_cache[index].ca_hashes_valid = FALSE;
+}
+
+/* Free the bucket cache and all memory associated with it. */
+void
+_gdbm_cache_free (GDBM_FILE dbf)
+{
+  size_t index;
+
+  if (dbf->bucket_cache != NULL)
+    {
+      for (index = 0; index < dbf->cache_size; index++)
+	{
+	  if (!dbf->bucket_cache[index].ca_mapped)
+	    free (dbf->bucket_cache[index].ca_bucket);
+	  free (dbf->bucket_cache[index].ca_filter);
+	  free (dbf->bucket_cache[index].ca_hashes);
+	}
+      free (dbf->bucket_cache);
+      dbf->bucket_cache = NULL;
+    }
+  free (dbf->cache_index);
+  dbf->cache_index = NULL;
+  dbf->cache_index_size = 0;
+  free (dbf->cache_dirty);
+  dbf->cache_dirty = NULL;
+  dbf->cache_dirty_count = 0;
+  dbf->cache_size = 0;
+}
+
+/* Drop all buckets from the cache without writing the changed ones. */
+void
+_gdbm_cache_discard (GDBM_FILE dbf)
+{
+  size_t index;
+
+  if (dbf->bucket_cache == NULL)
+    return;
+  for (index = 0; index < dbf->cache_size; index++)
+    {
+      _gdbm_cache_entry_invalidate (dbf, index);
+      dbf->bucket_cache[index].ca_dirty = FALSE;
+    }
+  dbf->cache_dirty_count = 0;
+  _gdbm_cache_policy_reset (dbf);
+  dbf->bucket = dbf->bucket_cache[0].ca_bucket;
+  dbf->cache_entry = &dbf->bucket_cache[0];
+}
+
+/* Mark the bucket in cache entry ELEM as changed, so that it is
+   written out by the next update. */
+void
+_gdbm_cache_set_changed (GDBM_FILE dbf, cache_elem *elem)
+{
+  elem->ca_changed = TRUE;
+  if (!elem->ca_dirty)
+    {
+      elem->ca_dirty = TRUE;
+      dbf->cache_dirty[dbf->cache_dirty_count++] = elem - dbf->bucket_cache;
+    }
+}
+
+/* Rebuild the cache index from scratch. */
+static void
+cache_index_rebuild (GDBM_FILE dbf)
+{
+  size_t index;
+
+  for (index = 0; index < dbf->cache_index_size; index++)
+    dbf->cache_index[index] = -1;
+  for (index = 0; index < dbf->cache_size; index++)
+    if (dbf->bucket_cache[index].ca_adr)
+      cache_index_insert (dbf, index);
+}
+
+/* Fill ORDER with the indices of all cache entries, from the most
+   valuable one to the least valuable one according to the replacement
+   policy.  The current entry comes first, and the invalidated entries
+   come last. */
+static void
+cache_order (GDBM_FILE dbf, size_t *order)
+{
+  int current = dbf->cache_entry - dbf->bucket_cache;
+  size_t n = 0;
+  int pass, index;
+
+  order[n++] = current;
+  for (pass = 0; pass < 2; pass++)
+    {
+      if (CACHE_POLICY_LISTS (dbf))
+	{
+	  int k;
+
+	  /* Protected entries first */
+	  for (k = 1; k >= 0; k--)
+	    for (index = dbf->cache_lru[k].head; index != -1;
+		 index = dbf->bucket_cache[index].ca_next)
+	      if (index != current
+		  && (dbf->bucket_cache[index].ca_adr != 0) == (pass == 0))
+		order[n++] = index;
+	}
+      else
+	{
+	  /* Most recently loaded entries first */
+	  size_t hand = dbf->last_read % dbf->cache_size;
+	  size_t i;
+
+	  for (i = 0; i < dbf->cache_size; i++)
+	    {
+	      index = (hand + dbf->cache_size - i) % dbf->cache_size;
+	      if (index != current
+		  && (dbf->bucket_cache[index].ca_adr != 0) == (pass == 0))
+		order[n++] = index;
+	    }
+	}
+    }
+}
+
+/* Change the number of entries in the bucket cache to SIZE.  When
+   shrinking the cache, the least valuable entries (according to the
+   replacement policy) are dropped, after writing them to disk if they
+   have been changed.  The entry holding the current bucket is always
+   kept.  Return 0 on success and -1 on error. */
+int
+_gdbm_cache_resize (GDBM_FILE dbf, size_t size)
+{
+  size_t *order;
+  cache_elem *new_cache;
+  int *new_index;
+  int *new_dirty;
+  size_t new_index_size;
+  size_t i, kept, pos;
+  int list_policy = CACHE_POLICY_LISTS (dbf);
+
+  if (size < GDBM_MIN_CACHESIZE)
+    size = GDBM_MIN_CACHESIZE;
+  if (dbf->bucket_cache == NULL)
+    return _gdbm_init_cache (dbf, size);
+  if (size == dbf->cache_size)
+    return 0;
+
+  order = calloc (dbf->cache_size, sizeof (order[0]));
+  if (!order)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+      return -1;
+    }
+  cache_order (dbf, order);
+  kept = size < dbf->cache_size ? size : dbf->cache_size;
+
+  /* Flush the entries that will be dropped. */
+  for (i = kept; i < dbf->cache_size; i++)
+    {
+      cache_elem *elem = &dbf->bucket_cache[order[i]];
+      if (elem->ca_changed)
+	{
+	  if (_gdbm_write_bucket (dbf, elem))
+	    {
+	      free (order);
+	      return -1;
+	    }
+	  dbf->cache_stats.writebacks++;
+	}
+    }
+
+  /* Allocate new structures. */
+  new_index_size = cache_index_size_for (size);
+  new_cache = calloc (size, sizeof (new_cache[0]));
+  new_index = malloc (new_index_size * sizeof (new_index[0]));
+  new_dirty = malloc (size * sizeof (new_dirty[0]));
+  if (!new_cache || !new_index || !new_dirty)
+    {
+      free (new_cache);
+      free (new_index);
+      free (new_dirty);
+      free (order);
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+      return -1;
+    }
+
+  /* In FIFO and CLOCK modes the entries are placed so that the least
+     valuable ones come right after the clock hand, which is set to the
+     last entry.  Otherwise, the order of entries does not matter. */
+  for (i = kept; i < size; i++)
+    {
+      pos = list_policy ? i : size - 1 - i;
+      new_cache[pos].ca_adr = 0;
+      new_cache[pos].ca_epoch = dbf->cache_epoch - 1;
+      if (cache_zero_copy (dbf))
+	continue;
+      new_cache[pos].ca_bucket = malloc (dbf->header->bucket_size);
+      if (new_cache[pos].ca_bucket == NULL)
+	{
+	  while (i-- > kept)
+	    free (new_cache[list_policy ? i : size - 1 - i].ca_bucket);
+	  free (new_cache);
+	  free (new_index);
+	  free (new_dirty);
+	  free (order);
+	  GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+	  return -1;
+	}
+    }
+
+  for (i = 0; i < kept; i++)
+    new_cache[list_policy ? i : size - 1 - i] = dbf->bucket_cache[order[i]];
+  for (i = kept; i < dbf->cache_size; i++)
+    {
+      cache_elem *elem = &dbf->bucket_cache[order[i]];
+      if (elem->ca_adr)
+	dbf->cache_stats.evictions++;
+      if (!elem->ca_mapped)
+	free (elem->ca_bucket);
+      free (elem->ca_filter);
+      free (elem->ca_hashes);
+    }
+  free (order);
+  free (dbf->bucket_cache);
+  free (dbf->cache_index);
+  free (dbf->cache_dirty);
+
+  dbf->bucket_cache = new_cache;
+  dbf->cache_size = size;
+  dbf->cache_index = new_index;
+  dbf->cache_index_size = new_index_size;
+  cache_index_rebuild (dbf);
+
+  /* The entries have moved: rebuild the dirty list. */
+  dbf->cache_dirty = new_dirty;
+  dbf->cache_dirty_count = 0;
+  for (i = 0; i < size; i++)
+    {
+      dbf->bucket_cache[i].ca_dirty = FALSE;
+      if (dbf->bucket_cache[i].ca_changed)
+	_gdbm_cache_set_changed (dbf, &dbf->bucket_cache[i]);
+    }
+
+  dbf->cache_entry = &dbf->bucket_cache[list_policy ? 0 : size - 1];
+  dbf->bucket = dbf->cache_entry->ca_bucket;
+  dbf->last_read = size - 1;
+
+  /* Rebuild the recency lists, preserving the order of entries. */
+  dbf->cache_lru[0].head = dbf->cache_lru[1].head = -1;
+  dbf->cache_lru[0].tail = dbf->cache_lru[1].tail = -1;
+  dbf->cache_lru[0].count = dbf->cache_lru[1].count = 0;
+  for (i = 0; i < size; i++)
+    cache_list_push_tail (dbf, list_policy ? dbf->bucket_cache[i].ca_list : 0,
+			  i);
+  while (dbf->cache_lru[1].count > SLRU_PROTECTED_SIZE (dbf))
+    {
+      int tail = dbf->cache_lru[1].tail;
+      cache_list_unlink (dbf, tail);
+      cache_list_push_head (dbf, 0, tail);
+    }
+  return 0;
+}
+
+/* Automatic cache sizing.
+
+   When a memory budget is set (GDBM_SETCACHEBYTES), the cache starts
+   with DEFAULT_CACHESIZE entries and is resized at the end of each
+   tuning window.  A window ends after the number of cache misses
+   reaches the cache size, or after CACHE_TUNE_WINDOW times as many
+   accesses, whichever happens first.  At that point:
+
+   - if more than 1/CACHE_TUNE_MISS_RATIO of the accesses missed the
+     cache, the cache is doubled;
+   - otherwise, if less than a quarter of the cache entries have been
+     used during the window, the cache is shrunk to twice the number of
+     used entries.
+
+   The cache size never exceeds the number of entries that fit in the
+   budget, nor the number of buckets in the database (plus two, to
+   accommodate a bucket split).  It is never less than
+   GDBM_MIN_CACHESIZE. */
+
+#define CACHE_TUNE_WINDOW     16
+#define CACHE_TUNE_MISS_RATIO 16
+
+/* Return the number of distinct buckets referenced from the
+   directory. */
+static size_t
+bucket_count (GDBM_FILE dbf)
+{
+  if (dbf->bucket_count == 0)
+    {
+      size_t i, n = 1;
+
+      for (i = 1; i < GDBM_DIR_COUNT (dbf); i++)
+	if (dbf->dir[i] != dbf->dir[i-1])
+	  n++;
+      dbf->bucket_count = n;
+    }
+  return dbf->bucket_count;
+}
+
+/* Return the maximum cache size allowed in automatic mode. */
+static size_t
+cache_auto_max (GDBM_FILE dbf)
+{
+  size_t n = dbf->cache_bytes / (sizeof (cache_elem)
+				 + dbf->header->bucket_size
+				 + 2 * sizeof (dbf->cache_index[0]));
+  size_t nb = bucket_count (dbf) + 2;
+
+  if (n > nb)
+    n = nb;
+  if (n < GDBM_MIN_CACHESIZE)
+    n = GDBM_MIN_CACHESIZE;
+  return n;
+}
+
+/* Return the initial size of the bucket cache. */
+static size_t
+cache_initial_size (GDBM_FILE dbf)
+{
+  if (dbf->cache_bytes)
+    {
+      size_t n = cache_auto_max (dbf);
+      if (n < DEFAULT_CACHESIZE)
+	return n;
+    }
+  return DEFAULT_CACHESIZE;
+}
+
+/* Start a new tuning window. */
+static void
+cache_tune_reset (GDBM_FILE dbf)
+{
+  dbf->cache_epoch++;
+  dbf->cache_tune_hits = dbf->cache_stats.hits;
+  dbf->cache_tune_misses = dbf->cache_stats.misses;
+}
+
+/* Resize the cache, if the current tuning window has ended.  This is
+   called on each bucket look-up.  Return -1 on fatal error, 0
+   otherwise. */
+static int
+cache_auto_tune (GDBM_FILE dbf)
+{
+  gdbm_count_t misses = dbf->cache_stats.misses - dbf->cache_tune_misses;
+  gdbm_count_t accesses = misses
+                          + dbf->cache_stats.hits - dbf->cache_tune_hits;
+  size_t size = dbf->cache_size;
+  size_t max, used, i;
+
+  if (misses < size && accesses < CACHE_TUNE_WINDOW * size)
+    return 0;
+
+  for (i = used = 0; i < dbf->cache_size; i++)
+    if (dbf->bucket_cache[i].ca_epoch == dbf->cache_epoch)
+      used++;
+  cache_tune_reset (dbf);
+
+  max = cache_auto_max (dbf);
+  if (size > max)
+    size = max;
+  else if (misses * CACHE_TUNE_MISS_RATIO > accesses)
+    size = size * 2 < max ? size * 2 : max;
+  else if (used < size / 4)
+    size = used * 2;
+
+  if (size != dbf->cache_size
+      && _gdbm_cache_resize (dbf, size)
+      && gdbm_last_errno (dbf) != GDBM_MALLOC_ERROR)
+    return -1;
+  return 0;
+}
+
+/* Set the memory budget for automatic cache sizing.  Zero disables
+   automatic sizing. */
+int
+_gdbm_cache_set_bytes (GDBM_FILE dbf, size_t bytes)
+{
+  dbf->cache_bytes = bytes;
+  if (bytes && dbf->bucket_cache != NULL)
+    {
+      cache_tune_reset (dbf);
+      if (dbf->cache_size > cache_auto_max (dbf))
+	return _gdbm_cache_resize (dbf, cache_auto_max (dbf));
+    }
+  return 0;
+}
+
+/* Negative lookup filters.
+
+   When enabled (GDBM_SETBUCKETFILTER), each cached bucket gets a Bloom
+   filter of the hash values of its elements.  A look-up for a key
+   whose hash value the filter of its bucket does not contain can fail
+   right away, without walking the probe sequence.
+
+   The filter is built from the bucket table when the bucket is loaded
+   into the cache, and kept up to date when elements are added to the
+   bucket.  Removing an element from a Bloom filter is not possible, so
+   deleting a key, as well as splitting the bucket, invalidates the
+   filter.  It will be rebuilt on the next look-up. */
+
+/* Number of filter bits per bucket element. */
+#define BUCKET_FILTER_BITS_PER_ELEM 8
+/* Number of bits set for each hash value. */
+#define BUCKET_FILTER_HASHES 3
+
+/* Return the size of a bucket filter in bytes.  It is a power of two. */
+static size_t
+bucket_filter_size (GDBM_FILE dbf)
+{
+  size_t bits = (size_t) dbf->header->bucket_elems
+                  * BUCKET_FILTER_BITS_PER_ELEM;
+  size_t size = 8;
+
+  while (size * 8 < bits)
+    size <<= 1;
+  return size;
+}
+
+/* Set (if SET is true) or test the filter bits for HASH_VAL in FILTER
+   of SIZE bytes.  Return 1 if all the bits are set. */
+static inline int
+bucket_filter_bits (unsigned char *filter, size_t size, int hash_val,
+		    int set)
+{
+  unsigned long long g = (unsigned) hash_val * 0x9e3779b97f4a7c15ULL;
+  size_t mask = size * 8 - 1;
+  size_t h1 = (size_t) (g >> 32);
+  size_t h2 = (size_t) (g >> 7) | 1;
+  int i;
+
+  for (i = 0; i < BUCKET_FILTER_HASHES; i++, h1 += h2)
+    {
+      size_t bit = h1 & mask;
+      if (set)
+	filter[bit >> 3] |= 1 << (bit & 7);
+      else if (!(filter[bit >> 3] & (1 << (bit & 7))))
+	return 0;
+    }
+  return 1;
+}
+
+/* Build the filter for the cache entry ELEM.  Return 0 on success and
+   -1 if there is not enough memory (which is not an error: the bucket
+   is simply looked up without a filter). */
+static int
+bucket_filter_build (GDBM_FILE dbf, cache_elem *elem)
+{
+  size_t size = bucket_filter_size (dbf);
+  int i;
+
+  if (elem->ca_filter == NULL)
+    {
+      elem->ca_filter = malloc (size);
+      if (elem->ca_filter == NULL)
+	return -1;
+    }
+  memset (elem->ca_filter, 0, size);
+  for (i = 0; i < dbf->header->bucket_elems; i++)
+    {
+      int hash_val = elem->ca_bucket->h_table[i].hash_value;
+      if (hash_val != -1)
+	bucket_filter_bits (elem->ca_filter, size, hash_val, 1);
+    }
+  elem->ca_filter_valid = TRUE;
+  return 0;
+}
+
+/* Return 0 if the current bucket certainly contains no element with
+   the hash value HASH_VAL, and 1 if it might contain one. */
+int
+_gdbm_bucket_filter_test (GDBM_FILE dbf, int hash_val)
+{
+  cache_elem *elem = dbf->cache_entry;
+
+  if (!elem->ca_filter_valid && bucket_filter_build (dbf, elem))
+    return 1;
+  return bucket_filter_bits (elem->ca_filter, bucket_filter_size (dbf),
+			     hash_val, 0);
+}
+
+/* An element with hash value HASH_VAL has been added to the current
+   bucket.  Update its filter. */
+void
+_gdbm_bucket_filter_add (GDBM_FILE dbf, int hash_val)
+{
+  cache_elem *elem = dbf->cache_entry;
+
+  if (elem->ca_filter_valid)
+    bucket_filter_bits (elem->ca_filter, bucket_filter_size (dbf),
+			hash_val, 1);
+}
+
+/* Free the filters of all cache entries. */
+void
+_gdbm_bucket_filter_free (GDBM_FILE dbf)
+{
+  size_t index;
+
+  if (dbf->bucket_cache == NULL)
+    return;
+  for (index = 0; index < dbf->cache_size; index++)
+    {
+      free (dbf->bucket_cache[index].ca_filter);
+      dbf->bucket_cache[index].ca_filter = NULL;
+      dbf->bucket_cache[index].ca_filter_valid = FALSE;
+    }
+}
+
+/* Probing buckets.
+
+   An element is looked for in a bucket starting at its home location
+   and going on to the next elements until an empty one is found.
+   Scanning the 24-byte elements one by one is slow in big buckets.
+   Instead, the hash values of the elements of a cached bucket with at
+   least PROBE_ARRAY_MIN elements are copied to an array in the cache
+   entry, which is scanned several elements at a time with SSE2, AVX2
+   or NEON instructions, if available.  The array is built when the
+   bucket is first probed, updated when an element is added, and
+   rebuilt after an element is removed. */
+
+#if defined __AVX2__
+# include <immintrin.h>
+#elif defined __SSE2__
+# include <emmintrin.h>
+#elif defined __ARM_NEON && defined __aarch64__
+# include <arm_neon.h>
+#endif
+
+/* Return the index of the first of the N elements of HASHES equal to
+   HASH_VAL or to -1, or N if there is none. */
+static inline int
+probe_array (const int *hashes, int n, int hash_val)
+{
+  int i = 0;
+  
+#if defined __AVX2__
+  __m256i want = _mm256_set1_epi32 (hash_val);
+  __m256i empty = _mm256_set1_epi32 (-1);
+
+  for (; i + 8 <= n; i += 8)
+    {
+      __m256i v = _mm256_loadu_si256 ((const __m256i *) (hashes + i));
+      unsigned mask = _mm256_movemask_ps
+	(_mm256_castsi256_ps (_mm256_or_si256 (_mm256_cmpeq_epi32 (v, want),
+					       _mm256_cmpeq_epi32 (v, empty))));
+      if (mask)
+	{
+	  while (!(mask & 1))
+	    {
+	      mask >>= 1;
+	      i++;
+	    }
+	  return i;
+	}
+    }
+#elif defined __SSE2__
+  __m128i want = _mm_set1_epi32 (hash_val);
+  __m128i empty = _mm_set1_epi32 (-1);
+
+  for (; i + 4 <= n; i += 4)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) (hashes + i));
+      unsigned mask = _mm_movemask_ps
+	(_mm_castsi128_ps (_mm_or_si128 (_mm_cmpeq_epi32 (v, want),
+					 _mm_cmpeq_epi32 (v, empty))));
+      if (mask)
+	{
+	  while (!(mask & 1))
+	    {
+	      mask >>= 1;
+	      i++;
+	    }
+	  return i;
+	}
+    }
+#elif defined __ARM_NEON && defined __aarch64__
+  int32x4_t want = vdupq_n_s32 (hash_val);
+  int32x4_t empty = vdupq_n_s32 (-1);
+
+  for (; i + 4 <= n; i += 4)
+    {
+      int32x4_t v = vld1q_s32 (hashes + i);
+      if (vmaxvq_u32 (vorrq_u32 (vceqq_s32 (v, want), vceqq_s32 (v, empty))))
+	break;
+    }
+#endif
+  for (; i < n; i++)
+    if (hashes[i] == hash_val || hashes[i] == -1)
+      break;
+  return i;
+}
+
+/* Return the array of hash values of the current bucket, building it
+   if necessary, or NULL if the bucket is probed without it. */
+static int *
+probe_hashes (GDBM_FILE dbf)
+{
+  cache_elem *elem = dbf->cache_entry;
+  int i;
+
+  if (elem->ca_hashes_valid)
+    return elem->ca_hashes;
+  if (dbf->header->bucket_elems < PROBE_ARRAY_MIN)
+    return NULL;
+  if (elem->ca_hashes == NULL)
+    {
+      elem->ca_hashes = malloc (dbf->header->bucket_elems * sizeof (int));
+      if (elem->ca_hashes == NULL)
+	return NULL;
+    }
+  for (i = 0; i < dbf->header->bucket_elems; i++)
+    elem->ca_hashes[i] = dbf->bucket->h_table[i].hash_value;
+  elem->ca_hashes_valid = TRUE;
+  return elem->ca_hashes;
+}
+
+/* Look through at most COUNT elements of the current bucket, starting
+   at location LOC and wrapping around at its end, for an element with
+   hash value HASH_VAL.  Return its location, or -1 if an empty element
+   is found first or there is none.  If HASH_VAL is -1, return the
+   location of the first empty element. */
+int
+_gdbm_bucket_probe (GDBM_FILE dbf, int hash_val, int loc, int count)
+{
+  int elems = dbf->header->bucket_elems;
+  int *hashes = probe_hashes (dbf);
+
+  while (count > 0)
+    {
+      int n = elems - loc;
+      int i;
+
+      if (n > count)
+	n = count;
+      if (hashes)
+	i = probe_array (hashes + loc, n, hash_val);
+      else
+	{
+	  for (i = 0; i < n; i++)
+	    {
+	      int h = dbf->bucket->h_table[loc + i].hash_value;
+	      if (h == hash_val || h == -1)
+		break;
+	    }
+	}
+      if (i < n)
+	return dbf->bucket->h_table[loc + i].hash_value == hash_val
+	         ? loc + i : -1;
+      count -= n;
+      loc = 0;
+    }
+  return -1;
+}
+
+/* The element at LOC in the current bucket has been set.  Update the
+   array of hash values. */
+void
+_gdbm_bucket_probe_set (GDBM_FILE dbf, int loc)
+{
+  if (dbf->cache_entry->ca_hashes_valid)
+    dbf->cache_entry->ca_hashes[loc] = dbf->bucket->h_table[loc].hash_value;
+}
+
+/* Check the header and the avail table of BUCKET.  Return 0 if it is
+   valid, and -1 (setting gdbm_errno) otherwise. */
+static int
+validate_bucket (GDBM_FILE dbf, hash_bucket *bucket)
+{
+  if (!(bucket->count >= 0
+	&& bucket->count <= dbf->header->bucket_elems
+	&& bucket->bucket_bits >= 0
+	&& bucket->bucket_bits <= dbf->header->dir_bits))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_BAD_BUCKET, TRUE);
+      return -1;
+    }
+  /* Validate bucket_avail table */
+  return gdbm_bucket_avail_table_validate (dbf, bucket);
+}
+
+/* Load the buckets at the N addresses ADR into the cache, so that
+   subsequent _gdbm_get_bucket calls find them there.  The buckets that
+   are not cached are read with a single _gdbm_io_run call.  At most
+   half of the cache is used: the remaining addresses are ignored.  The
+   current bucket does not change.  Return 0 on success and -1 on
+   error. */
+int
+_gdbm_cache_prefetch (GDBM_FILE dbf, off_t const *adr, size_t n)
+{
+  struct gdbm_io_req *req;
+  int *slot;
+  size_t i, j, count = 0;
+  int current;
+  int rc = 0;
+
+  /* Buckets changed by a transaction may be kept aside (see
+     gdbmtxn.c), and mapped buckets need not be read. */
+  if (dbf->txn_state != TXN_NONE || cache_zero_copy (dbf))
+    return 0;
+  if (n > dbf->cache_size / 2)
+    n = dbf->cache_size / 2;
+  if (n < 2)
+    return 0;
+
+  req = calloc (n, sizeof (req[0]));
+  slot = calloc (n, sizeof (slot[0]));
+  if (!req || !slot)
+    {
+      free (req);
+      free (slot);
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+      return -1;
+    }
+
+  current = dbf->cache_entry ? dbf->cache_entry - dbf->bucket_cache : -1;
+  for (i = 0; i < n; i++)
+    {
+      int index;
+
+      if (_gdbm_cache_lookup (dbf, adr[i]) != -1)
+	continue;
+      for (j = 0; j < count; j++)
+	if (req[j].off == adr[i])
+	  break;
+      if (j < count)
+	continue;
+
+      index = cache_evict (dbf, current);
+      if (index == -1)
+	{
+	  rc = -1;
+	  break;
+	}
+      /* Stop if the replacement policy selects an entry reserved
+	 earlier. */
+      for (j = 0; j < count; j++)
+	if (slot[j] == index)
+	  break;
+      if (j < count)
+	break;
+      if (cache_entry_buffer (dbf, index))
+	{
+	  rc = -1;
+	  break;
+	}
+      _gdbm_io_req_init (&req[count], FALSE,
+			 dbf->bucket_cache[index].ca_bucket,
+			 dbf->header->bucket_size, adr[i]);
+      slot[count++] = index;
+    }
+
+  if (rc == 0 && count > 0)
+    {
+      dbf->cache_stats.misses += count;
+      rc = _gdbm_io_run (dbf, req, count);
+      if (rc)
+	{
+	  GDBM_DEBUG (GDBM_DEBUG_ERR,
+		      "%s: error reading buckets: %s",
+		      dbf->name, gdbm_db_strerror (dbf));
+	  dbf->need_recovery = TRUE;
+	  _gdbm_fatal (dbf, gdbm_db_strerror (dbf));
+	}
+      for (i = 0; rc == 0 && i < count; i++)
+	{
+	  cache_elem *elem = &dbf->bucket_cache[slot[i]];
+
+	  rc = validate_bucket (dbf, elem->ca_bucket);
+	  if (rc == 0)
+	    {
+	      _gdbm_cache_entry_set_adr (dbf, slot[i], req[i].off);
+	      if (dbf->bucket_filter)
+		bucket_filter_build (dbf, elem);
+	    }
+	}
+    }
+
+  free (req);
+  free (slot);
+  return rc;
+}
+
 /* Find a bucket for DBF that is pointed to by the bucket directory from
    location DIR_INDEX.   The bucket cache is first checked to see if it
    is already in memory.  If not, a bucket may be tossed to read the new
@@ -69,8 +1370,8 @@ _gdbm_get_bucket (GDBM_FILE dbf, int dir_index)
 {
   int rc;
   off_t bucket_adr;	/* The address of the correct hash bucket.  */
-  off_t	file_pos;	/* The return address for lseek. */
   int   index;		/* Loop index. */
+  int   saved = FALSE;	/* Bucket comes from _gdbm_txn_load_bucket. */
 
   if (!gdbm_dir_entry_valid_p (dbf, dir_index))
     {
@@ -85,83 +1386,96 @@ _gdbm_get_bucket (GDBM_FILE dbf, int dir_index)
   
   if (dbf->bucket_cache == NULL)
     {
-      if (_gdbm_init_cache (dbf, DEFAULT_CACHESIZE) == -1)
+      if (_gdbm_init_cache (dbf, cache_initial_size (dbf)) == -1)
 	{
 	  _gdbm_fatal (dbf, _("couldn't init cache"));
 	  return -1;
 	}
     }
+  else if (dbf->cache_bytes && cache_auto_tune (dbf))
+    return -1;
 
   /* If that one is not already current, we must find it. */
   if (dbf->cache_entry->ca_adr != bucket_adr)
     {
-      size_t lru;
+      int lru;
       hash_bucket *bucket;
       
       /* Look in the cache. */
-      for (index = 0; index < dbf->cache_size; index++)
-        {
-	  if (dbf->bucket_cache[index].ca_adr == bucket_adr)
-	    {
-	      dbf->bucket = dbf->bucket_cache[index].ca_bucket;
-	      dbf->cache_entry = &dbf->bucket_cache[index];
-	      return 0;
-	    }
-        }
+      index = _gdbm_cache_lookup (dbf, bucket_adr);
+      if (index != -1)
+	{
+	  dbf->cache_stats.hits++;
+	  cache_touch (dbf, index);
+	  dbf->bucket = dbf->bucket_cache[index].ca_bucket;
+	  dbf->cache_entry = &dbf->bucket_cache[index];
+	  return 0;
+	}
 
       /* It is not in the cache, read it from the disk. */
+      dbf->cache_stats.misses++;
+
+      /* Flush and drop the cache entry selected by the replacement
+	 policy. */
+      lru = cache_evict (dbf, -1);
+      if (lru == -1)
+	return -1;
 
-      /* Position the file pointer */
-      file_pos = gdbm_file_seek (dbf, bucket_adr, SEEK_SET);
-      if (file_pos != bucket_adr)
+      bucket = cache_zero_copy (dbf) ? cache_mapped_bucket (dbf, bucket_adr)
+	                             : NULL;
+      if (bucket)
 	{
-	  GDBM_SET_ERRNO (dbf, GDBM_FILE_SEEK_ERROR, TRUE);
-	  _gdbm_fatal (dbf, _("lseek error"));
-	  return -1;
+	  /* Use the bucket image in the mapped region. */
+	  free (dbf->bucket_cache[lru].ca_bucket);
+	  dbf->bucket_cache[lru].ca_bucket = bucket;
+	  dbf->bucket_cache[lru].ca_mapped = TRUE;
 	}
-      
-      /* Flush and drop the last recently used cache entry */
-      lru = (dbf->last_read + 1) % dbf->cache_size;
-      if (dbf->bucket_cache[lru].ca_changed)
+      else
 	{
-	  if (_gdbm_write_bucket (dbf, &dbf->bucket_cache[lru]))
+	  if (cache_entry_buffer (dbf, lru))
 	    return -1;
+
+	  /* A bucket changed during the current transaction and dropped
+	     from the cache is not in the file yet. */
+	  if (dbf->txn_state != TXN_NONE)
+	    saved = _gdbm_txn_load_bucket (dbf, bucket_adr,
+					   dbf->bucket_cache[lru].ca_bucket);
 	}
-      _gdbm_cache_entry_invalidate (dbf, lru);
-      
-      /* Read the bucket. */
-      rc = _gdbm_full_read (dbf, dbf->bucket_cache[lru].ca_bucket,
-			    dbf->header->bucket_size);
-      if (rc)
+
+      if (!bucket && !saved)
 	{
-	  GDBM_DEBUG (GDBM_DEBUG_ERR,
-		      "%s: error reading bucket: %s",
-		      dbf->name, gdbm_db_strerror (dbf));
-	  dbf->need_recovery = TRUE;
-	  _gdbm_fatal (dbf, gdbm_db_strerror (dbf));
-	  return -1;
+	  /* Read the bucket. */
+	  rc = _gdbm_full_pread (dbf, dbf->bucket_cache[lru].ca_bucket,
+				 dbf->header->bucket_size, bucket_adr);
+	  if (rc)
+	    {
+	      GDBM_DEBUG (GDBM_DEBUG_ERR,
+			  "%s: error reading bucket: %s",
+			  dbf->name, gdbm_db_strerror (dbf));
+	      dbf->need_recovery = TRUE;
+	      _gdbm_fatal (dbf, gdbm_db_strerror (dbf));
+	      return -1;
+	    }
 	}
       /* Validate the bucket */
       bucket = dbf->bucket_cache[lru].ca_bucket;
-      if (!(bucket->count >= 0
-	    && bucket->count <= dbf->header->bucket_elems
-	    && bucket->bucket_bits >= 0
-	    && bucket->bucket_bits <= dbf->header->dir_bits))
-	{
-	  GDBM_SET_ERRNO (dbf, GDBM_BAD_BUCKET, TRUE);
-	  return -1;
-	}
-      /* Validate bucket_avail table */
-      if (gdbm_bucket_avail_table_validate (dbf, bucket))
+      if (validate_bucket (dbf, bucket))
 	return -1;
 
       /* Finally, store it in cache */
-      dbf->last_read = lru;
-      dbf->bucket_cache[lru].ca_adr = bucket_adr;
+      _gdbm_cache_entry_set_adr (dbf, lru, bucket_adr);
       dbf->bucket = dbf->bucket_cache[lru].ca_bucket;
       dbf->cache_entry = &dbf->bucket_cache[lru];
-      dbf->cache_entry->ca_data.elem_loc = -1;
-      dbf->cache_entry->ca_changed = FALSE;
+      if (saved)
+	_gdbm_cache_set_changed (dbf, dbf->cache_entry);
+      if (dbf->bucket_filter)
+	bucket_filter_build (dbf, dbf->cache_entry);
+    }
+  else
+    {
+      /* Count the current bucket as used in this tuning window. */
+      dbf->cache_stats.hits++;
+      dbf->cache_entry->ca_epoch = dbf->cache_epoch;
     }
   return 0;
 }
@@ -170,7 +1484,6 @@ int
 _gdbm_read_bucket_at (GDBM_FILE dbf, off_t off, hash_bucket *bucket,
 		      size_t size)
 {
-  off_t file_pos;
   int i;
 
   if (dbf->cache_entry && dbf->cache_entry->ca_adr == off)
@@ -180,23 +1493,18 @@ _gdbm_read_bucket_at (GDBM_FILE dbf, off_t off, hash_bucket *bucket,
     }
 
   /* Look in the cache. */
-  for (i = 0; i < dbf->cache_size; i++)
+  i = _gdbm_cache_lookup (dbf, off);
+  if (i != -1)
     {
-      if (dbf->bucket_cache[i].ca_adr == off)
-	{
-	  memcpy (bucket, dbf->bucket_cache[i].ca_bucket, size);
-	  return 0;
-	}
+      memcpy (bucket, dbf->bucket_cache[i].ca_bucket, size);
+      return 0;
     }
 
+  if (dbf->txn_state != TXN_NONE && _gdbm_txn_load_bucket (dbf, off, bucket))
+    return 0;
+
   /* Read the bucket. */
-  file_pos = gdbm_file_seek (dbf, off, SEEK_SET);
-  if (file_pos != off)
-    {
-      GDBM_SET_ERRNO (dbf, GDBM_FILE_SEEK_ERROR, TRUE);
-      return -1;
-    }
-  if (_gdbm_full_read (dbf, bucket, size))
+  if (_gdbm_full_pread (dbf, bucket, size, off))
     {
       GDBM_DEBUG (GDBM_DEBUG_ERR,
 		  "%s: error reading bucket: %s",
@@ -244,7 +1552,7 @@ _gdbm_split_bucket (GDBM_FILE dbf, int next_insert)
 
   if (dbf->bucket_cache == NULL)
     {
-      if (_gdbm_init_cache (dbf, DEFAULT_CACHESIZE) == -1)
+      if (_gdbm_init_cache (dbf, cache_initial_size (dbf)) == -1)
 	{
 	  _gdbm_fatal (dbf, _("couldn't init cache"));
 	  return -1;
@@ -254,41 +1562,25 @@ _gdbm_split_bucket (GDBM_FILE dbf, int next_insert)
   while (dbf->bucket->count == dbf->header->bucket_elems)
     {
       /* Initialize the "new" buckets in the cache. */
-      do
-	{
-	  dbf->last_read = (dbf->last_read + 1) % dbf->cache_size;
-	  cache_0 = dbf->last_read;
-	}      
-      while (dbf->bucket_cache[cache_0].ca_bucket == dbf->bucket);
+      cache_0 = cache_evict (dbf, -1);
+      if (cache_0 == -1 || cache_entry_buffer (dbf, cache_0))
+	return -1;
       bucket[0] = dbf->bucket_cache[cache_0].ca_bucket;
-      if (dbf->bucket_cache[cache_0].ca_changed)
-	{
-	  if (_gdbm_write_bucket (dbf, &dbf->bucket_cache[cache_0]))
-	    return -1;
-	}
-      do
-	{
-	  dbf->last_read = (dbf->last_read + 1) % dbf->cache_size;
-	  cache_1 = dbf->last_read;
-	}      
-      while (dbf->bucket_cache[cache_1].ca_bucket == dbf->bucket);
+      cache_1 = cache_evict (dbf, cache_0);
+      if (cache_1 == -1 || cache_entry_buffer (dbf, cache_1))
+	return -1;
       bucket[1] = dbf->bucket_cache[cache_1].ca_bucket;
-      if (dbf->bucket_cache[cache_1].ca_changed)
-	{
-	  if (_gdbm_write_bucket (dbf, &dbf->bucket_cache[cache_1]))
-	    return -1;
-	}
       new_bits = dbf->bucket->bucket_bits + 1;
       _gdbm_new_bucket (dbf, bucket[0], new_bits);
       _gdbm_new_bucket (dbf, bucket[1], new_bits);
       adr_0 = _gdbm_alloc (dbf, dbf->header->bucket_size);
       if (adr_0 == 0)
 	return -1;
-      dbf->bucket_cache[cache_0].ca_adr = adr_0;
+      _gdbm_cache_entry_set_adr (dbf, cache_0, adr_0);
       adr_1 = _gdbm_alloc (dbf, dbf->header->bucket_size);
       if (adr_1 == 0)
 	return -1;
-      dbf->bucket_cache[cache_1].ca_adr = adr_1;
+      _gdbm_cache_entry_set_adr (dbf, cache_1, adr_1);
 
       /* Double the directory size if necessary. */
       if (dbf->header->dir_bits == dbf->bucket->bucket_bits)
@@ -337,20 +1629,26 @@ _gdbm_split_bucket (GDBM_FILE dbf, int next_insert)
 	{
 	  old_el = &dbf->bucket->h_table[index];
 	  select = (old_el->hash_value >> (GDBM_HASH_BITS - new_bits)) & 1;
-	  elem_loc = old_el->hash_value % dbf->header->bucket_elems;
+	  elem_loc = GDBM_BUCKET_HOME (dbf, old_el->hash_value);
 	  while (bucket[select]->h_table[elem_loc].hash_value != -1)
-	    elem_loc = (elem_loc + 1) % dbf->header->bucket_elems;
+	    elem_loc = GDBM_BUCKET_NEXT (dbf, elem_loc);
 	  bucket[select]->h_table[elem_loc] = *old_el;
 	  bucket[select]->count++;
+	  _gdbm_data_cache_move (dbf, dbf->cache_entry->ca_adr, index,
+				 select ? adr_1 : adr_0, elem_loc);
 	}
       
-      /* Allocate avail space for the bucket[1]. */
-      bucket[1]->bucket_avail[0].av_adr
-	= _gdbm_alloc (dbf, dbf->header->block_size);
-      if (bucket[1]->bucket_avail[0].av_adr == 0)
-	return -1;
-      bucket[1]->bucket_avail[0].av_size = dbf->header->block_size;
-      bucket[1]->av_count = 1;
+      /* Allocate avail space for the bucket[1], unless the free space
+	 is kept by the size-class allocator. */
+      if (!dbf->fsm)
+	{
+	  bucket[1]->bucket_avail[0].av_adr
+	    = _gdbm_alloc (dbf, dbf->header->block_size);
+	  if (bucket[1]->bucket_avail[0].av_adr == 0)
+	    return -1;
+	  bucket[1]->bucket_avail[0].av_size = dbf->header->block_size;
+	  bucket[1]->av_count = 1;
+	}
       
       /* Copy the avail elements in dbf->bucket to bucket[0]. */
       bucket[0]->av_count = dbf->bucket->av_count;
@@ -382,9 +1680,12 @@ _gdbm_split_bucket (GDBM_FILE dbf, int next_insert)
 	dbf->dir[index] = adr_1;
       
       
+      if (dbf->bucket_count)
+	dbf->bucket_count++;
+
       /* Set changed flags. */
-      dbf->bucket_cache[cache_0].ca_changed = TRUE;
-      dbf->bucket_cache[cache_1].ca_changed = TRUE;
+      _gdbm_cache_set_changed (dbf, &dbf->bucket_cache[cache_0]);
+      _gdbm_cache_set_changed (dbf, &dbf->bucket_cache[cache_1]);
       dbf->bucket_changed = TRUE;
       dbf->directory_changed = TRUE;
       dbf->second_changed = TRUE;
@@ -395,28 +1696,26 @@ _gdbm_split_bucket (GDBM_FILE dbf, int next_insert)
       /* Invalidate old cache entry. */
       old_bucket.av_adr  = dbf->cache_entry->ca_adr;
       old_bucket.av_size = dbf->header->bucket_size;
-      dbf->cache_entry->ca_adr = 0;
-      dbf->cache_entry->ca_changed = FALSE;
+      _gdbm_cache_entry_invalidate (dbf,
+				    dbf->cache_entry - dbf->bucket_cache);
       
-      /* Set dbf->bucket to the proper bucket. */
-      if (dbf->dir[dbf->bucket_dir] == adr_0)
+      /* Set dbf->bucket to the proper bucket and give the space of the
+	 old bucket to the other one.  Within a transaction, the old
+	 bucket is still in use by the file until the commit.  With the
+	 size-class allocator, the space goes to its free lists. */
+      select = dbf->dir[dbf->bucket_dir] != adr_0;
+      dbf->bucket = bucket[select];
+      dbf->cache_entry = &dbf->bucket_cache[select ? cache_1 : cache_0];
+      if (dbf->txn_state == TXN_ACTIVE || dbf->fsm)
 	{
-	  dbf->bucket = bucket[0];
-	  dbf->cache_entry = &dbf->bucket_cache[cache_0];
-	  _gdbm_put_av_elem (old_bucket,
-			     bucket[1]->bucket_avail,
-			     &bucket[1]->av_count, 
-                             dbf->coalesce_blocks);
+	  if (_gdbm_free (dbf, old_bucket.av_adr, old_bucket.av_size))
+	    return -1;
 	}
       else
-	{
-	  dbf->bucket = bucket[1];
-	  dbf->cache_entry = &dbf->bucket_cache[cache_1];
-	  _gdbm_put_av_elem (old_bucket,
-			     bucket[0]->bucket_avail,
-			     &bucket[0]->av_count, 
-                             dbf->coalesce_blocks);
-	}
+	_gdbm_put_av_elem (old_bucket,
+			   bucket[!select]->bucket_avail,
+			   &bucket[!select]->av_count,
+			   dbf->coalesce_blocks);
       
     }
 
@@ -436,16 +1735,18 @@ int
 _gdbm_write_bucket (GDBM_FILE dbf, cache_elem *ca_entry)
 {
   int rc;
-  off_t file_pos;	/* The return value for lseek. */
 
-  file_pos = gdbm_file_seek (dbf, ca_entry->ca_adr, SEEK_SET);
-  if (file_pos != ca_entry->ca_adr)
+  /* Within a transaction, keep the bucket until the commit. */
+  if (dbf->txn_state != TXN_NONE)
     {
-      GDBM_SET_ERRNO (dbf, GDBM_FILE_SEEK_ERROR, TRUE);
-      _gdbm_fatal (dbf, _("lseek error"));
-      return -1;
+      if (_gdbm_txn_save_bucket (dbf, ca_entry))
+	return -1;
+      ca_entry->ca_changed = FALSE;
+      return 0;
     }
-  rc = _gdbm_full_write (dbf, ca_entry->ca_bucket, dbf->header->bucket_size);
+
+  rc = _gdbm_full_pwrite (dbf, ca_entry->ca_bucket, dbf->header->bucket_size,
+			  ca_entry->ca_adr);
   if (rc)
     {
       GDBM_DEBUG (GDBM_DEBUG_STORE|GDBM_DEBUG_ERR,
@@ -456,7 +1757,5 @@ _gdbm_write_bucket (GDBM_FILE dbf, cache_elem *ca_entry)
     }
 
   ca_entry->ca_changed = FALSE;
-  ca_entry->ca_data.hash_val = -1;
-  ca_entry->ca_data.elem_loc = -1;
   return 0;
 }
@@ -0,0 +1,296 @@
+/* datacache.c - The cache of key/data pairs read from the file. */
+
+/* This file is part of GDBM, the GNU data base manager.
+   Copyright (C) 2018 Free Software Foundation, Inc.
+
+   GDBM is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   GDBM is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GDBM. If not, see <http://www.gnu.org/licenses/>.   */
+
+/* Include system configuration before all else. */
+#include "autoconf.h"
+
+#include "gdbmdefs.h"
+#include <stddef.h>
+
+/* The data cache keeps key/data pairs recently read from the file.  An
+   entry is identified by the address of the bucket and the location of
+   the element in it.  When looking up an entry, the copy of the bucket
+   element kept in it is compared with the actual element, so that an
+   entry describing a record which has since been replaced is never
+   returned.  In addition, entries are invalidated when the record is
+   replaced or deleted, and moved along with the bucket elements.
+
+   The cache is bounded by the amount of memory its entries occupy.
+   The least recently used entries are dropped first.  The entry most
+   recently returned by _gdbm_data_cache_alloc is never dropped to make
+   room for others, because its data pointer must stay valid until the
+   next call. */
+
+/* Initial number of hash chains. */
+#define DATA_CACHE_INITIAL_SIZE 64
+
+/* Memory occupied by an entry holding SIZE bytes of key and data. */
+#define DATA_CACHE_ENTRY_SIZE(size) \
+  (offsetof (data_cache_elem, dptr) + (size))
+
+static inline size_t
+data_cache_hash (GDBM_FILE dbf, off_t adr, int elem_loc)
+{
+  unsigned long long h = adr * 0x9e3779b97f4a7c15ULL + elem_loc;
+
+  h ^= h >> 29;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 32;
+  return h & (dbf->data_cache_size - 1);
+}
+
+/* Return a pointer to the chain link pointing to the entry for
+   ELEM_LOC in the bucket at ADR, or to the terminating NULL link if
+   there is no such entry. */
+static data_cache_elem **
+data_cache_link (GDBM_FILE dbf, off_t adr, int elem_loc)
+{
+  data_cache_elem **pp;
+
+  for (pp = &dbf->data_cache[data_cache_hash (dbf, adr, elem_loc)];
+       *pp; pp = &(*pp)->next)
+    if ((*pp)->adr == adr && (*pp)->elem_loc == elem_loc)
+      break;
+  return pp;
+}
+
+static void
+lru_unlink (GDBM_FILE dbf, data_cache_elem *elem)
+{
+  if (elem->lru_prev)
+    elem->lru_prev->lru_next = elem->lru_next;
+  else
+    dbf->data_cache_head = elem->lru_next;
+  if (elem->lru_next)
+    elem->lru_next->lru_prev = elem->lru_prev;
+  else
+    dbf->data_cache_tail = elem->lru_prev;
+}
+
+static void
+lru_push (GDBM_FILE dbf, data_cache_elem *elem)
+{
+  elem->lru_prev = NULL;
+  elem->lru_next = dbf->data_cache_head;
+  if (dbf->data_cache_head)
+    dbf->data_cache_head->lru_prev = elem;
+  else
+    dbf->data_cache_tail = elem;
+  dbf->data_cache_head = elem;
+}
+
+/* Remove the entry pointed to by *PP from the cache and free it. */
+static void
+data_cache_remove (GDBM_FILE dbf, data_cache_elem **pp)
+{
+  data_cache_elem *elem = *pp;
+
+  *pp = elem->next;
+  lru_unlink (dbf, elem);
+  dbf->data_cache_count--;
+  dbf->data_cache_bytes -= DATA_CACHE_ENTRY_SIZE (elem->key_size
+						  + elem->data_size);
+  free (elem);
+}
+
+/* Drop least recently used entries, other than KEEP, until the cache
+   fits in its memory budget. */
+static void
+data_cache_shrink (GDBM_FILE dbf, data_cache_elem *keep)
+{
+  while (dbf->data_cache_bytes > dbf->data_cache_max
+	 && dbf->data_cache_tail
+	 && dbf->data_cache_tail != keep)
+    {
+      data_cache_elem *elem = dbf->data_cache_tail;
+      data_cache_remove (dbf,
+			 data_cache_link (dbf, elem->adr, elem->elem_loc));
+    }
+}
+
+/* Double the number of hash chains. */
+static void
+data_cache_rehash (GDBM_FILE dbf)
+{
+  data_cache_elem **old_tab = dbf->data_cache;
+  size_t old_size = dbf->data_cache_size;
+  data_cache_elem **new_tab;
+  size_t i;
+
+  new_tab = calloc (old_size * 2, sizeof (new_tab[0]));
+  if (!new_tab)
+    return; /* Not fatal: the chains will just be longer. */
+  dbf->data_cache = new_tab;
+  dbf->data_cache_size = old_size * 2;
+  for (i = 0; i < old_size; i++)
+    {
+      data_cache_elem *elem, *next;
+
+      for (elem = old_tab[i]; elem; elem = next)
+	{
+	  size_t h = data_cache_hash (dbf, elem->adr, elem->elem_loc);
+	  next = elem->next;
+	  elem->next = new_tab[h];
+	  new_tab[h] = elem;
+	}
+    }
+  free (old_tab);
+}
+
+/* Look up the data cache entry for the element ELEM_LOC of the bucket
+   at ADR.  BUCKET is the bucket itself.  Return the entry, or NULL if
+   it is not cached. */
+data_cache_elem *
+_gdbm_data_cache_lookup (GDBM_FILE dbf, off_t adr, hash_bucket *bucket,
+			 int elem_loc)
+{
+  data_cache_elem **pp, *elem;
+  bucket_element *be = &bucket->h_table[elem_loc];
+
+  if (dbf->data_cache == NULL)
+    return NULL;
+  pp = data_cache_link (dbf, adr, elem_loc);
+  elem = *pp;
+  if (elem == NULL)
+    return NULL;
+  if (elem->hash_val != be->hash_value
+      || elem->data_pointer != be->data_pointer
+      || elem->key_size != be->key_size
+      || elem->data_size != be->data_size)
+    {
+      /* Stale entry */
+      data_cache_remove (dbf, pp);
+      return NULL;
+    }
+  if (dbf->data_cache_head != elem)
+    {
+      lru_unlink (dbf, elem);
+      lru_push (dbf, elem);
+    }
+  return elem;
+}
+
+/* Create a data cache entry for the element ELEM_LOC of the bucket
+   BUCKET at address ADR.  The caller is supposed to read the key and
+   data into its dptr buffer.  Return NULL on memory allocation
+   failure. */
+data_cache_elem *
+_gdbm_data_cache_alloc (GDBM_FILE dbf, off_t adr, hash_bucket *bucket,
+			int elem_loc)
+{
+  data_cache_elem **pp, *elem;
+  bucket_element *be = &bucket->h_table[elem_loc];
+  size_t size = DATA_CACHE_ENTRY_SIZE (be->key_size + be->data_size);
+
+  if (dbf->data_cache == NULL)
+    {
+      dbf->data_cache = calloc (DATA_CACHE_INITIAL_SIZE,
+				sizeof (dbf->data_cache[0]));
+      if (!dbf->data_cache)
+	return NULL;
+      dbf->data_cache_size = DATA_CACHE_INITIAL_SIZE;
+    }
+
+  pp = data_cache_link (dbf, adr, elem_loc);
+  if (*pp)
+    data_cache_remove (dbf, pp);
+
+  elem = malloc (size);
+  if (!elem)
+    return NULL;
+  elem->adr = adr;
+  elem->elem_loc = elem_loc;
+  elem->hash_val = be->hash_value;
+  elem->data_pointer = be->data_pointer;
+  elem->key_size = be->key_size;
+  elem->data_size = be->data_size;
+  elem->next = *pp;
+  *pp = elem;
+  lru_push (dbf, elem);
+  dbf->data_cache_count++;
+  dbf->data_cache_bytes += size;
+
+  data_cache_shrink (dbf, elem);
+  if (dbf->data_cache_count > dbf->data_cache_size)
+    data_cache_rehash (dbf);
+
+  return elem;
+}
+
+/* Remove the entry for the element ELEM_LOC of the bucket at ADR. */
+void
+_gdbm_data_cache_invalidate (GDBM_FILE dbf, off_t adr, int elem_loc)
+{
+  data_cache_elem **pp;
+
+  if (dbf->data_cache == NULL)
+    return;
+  pp = data_cache_link (dbf, adr, elem_loc);
+  if (*pp)
+    data_cache_remove (dbf, pp);
+}
+
+/* The bucket element ELEM_LOC of the bucket at ADR has been moved to
+   location NEW_LOC in the bucket at NEW_ADR.  Update its cache entry,
+   if any. */
+void
+_gdbm_data_cache_move (GDBM_FILE dbf, off_t adr, int elem_loc,
+		       off_t new_adr, int new_loc)
+{
+  data_cache_elem **pp, *elem;
+
+  if (dbf->data_cache == NULL)
+    return;
+  _gdbm_data_cache_invalidate (dbf, new_adr, new_loc);
+  pp = data_cache_link (dbf, adr, elem_loc);
+  if ((elem = *pp) == NULL)
+    return;
+  *pp = elem->next;
+  elem->adr = new_adr;
+  elem->elem_loc = new_loc;
+  pp = &dbf->data_cache[data_cache_hash (dbf, new_adr, new_loc)];
+  elem->next = *pp;
+  *pp = elem;
+}
+
+/* Set the memory budget of the data cache. */
+void
+_gdbm_data_cache_set_max (GDBM_FILE dbf, size_t size)
+{
+  dbf->data_cache_max = size;
+  data_cache_shrink (dbf, NULL);
+}
+
+/* Remove all entries from the data cache and free the memory. */
+void
+_gdbm_data_cache_free (GDBM_FILE dbf)
+{
+  data_cache_elem *elem, *next;
+
+  for (elem = dbf->data_cache_head; elem; elem = next)
+    {
+      next = elem->lru_next;
+      free (elem);
+    }
+  free (dbf->data_cache);
+  dbf->data_cache = NULL;
+  dbf->data_cache_size = 0;
+  dbf->data_cache_count = 0;
+  dbf->data_cache_bytes = 0;
+  dbf->data_cache_head = dbf->data_cache_tail = NULL;
+}
@@ -31,6 +31,8 @@ static avail_elem get_block (int, GDBM_FILE);
 static int push_avail_block (GDBM_FILE);
 static int pop_avail_block (GDBM_FILE);
 static int adjust_bucket_avail (GDBM_FILE);
+static int free_space (GDBM_FILE, off_t, int);
+static void punch_note (GDBM_FILE, off_t, int);
 
 /* Allocate space in the file DBF for a block NUM_BYTES in length.  Return
    the file address of the start of the block.  
@@ -46,7 +48,10 @@ static int adjust_bucket_avail (GDBM_FILE);
    "guarantees" that an allocation does not cross a block boundary unless
    the size is larger than a single block.  The avail structure is
    changed by this routine if a change is needed.  If an error occurs,
-   the value of 0 will be returned.  */
+   the value of 0 will be returned.
+
+   With the size-class allocator (see fsm.c), the space is taken from
+   its free lists instead of the avail tables. */
 
 off_t
 _gdbm_alloc (GDBM_FILE dbf, int num_bytes)
@@ -54,26 +59,43 @@ _gdbm_alloc (GDBM_FILE dbf, int num_bytes)
   off_t file_adr;		/* The address of the block. */
   avail_elem av_el;		/* For temporary use. */
 
-  /* The current bucket is the first place to look for space. */
-  av_el = get_elem (num_bytes, dbf->bucket->bucket_avail,
-		    &dbf->bucket->av_count);
+  if (dbf->fsm)
+    {
+      if (_gdbm_fsm_get (dbf, num_bytes, &av_el))
+	return 0;
+      if (av_el.av_size == 0)
+	{
+	  av_el = get_block (num_bytes, dbf);
+	  if (_gdbm_file_grow (dbf, dbf->header->next_block))
+	    return 0;
+	}
+    }
+  else
+    /* The current bucket is the first place to look for space. */
+    av_el = get_elem (num_bytes, dbf->bucket->bucket_avail,
+		      &dbf->bucket->av_count);
 
   /* If we did not find some space, we have more work to do. */
   if (av_el.av_size == 0)
     {
       /* If the header avail table is less than half full, and there's
 	 something on the stack. */
-      if ((dbf->header->avail.count <= (dbf->header->avail.size >> 1))
-          && (dbf->header->avail.next_block != 0))
+      if ((dbf->avail->count <= (dbf->avail->size >> 1))
+          && (dbf->avail->next_block != 0))
         if (pop_avail_block (dbf))
 	  return 0;
 
       /* check the header avail table next */
-      av_el = get_elem (num_bytes, dbf->header->avail.av_table,
-      			&dbf->header->avail.count);
+      av_el = get_elem (num_bytes, dbf->avail->av_table,
+      			&dbf->avail->count);
       if (av_el.av_size == 0)
-        /* Get another full block from end of file. */
-        av_el = get_block (num_bytes, dbf);
+	{
+	  /* Get another full block from end of file, growing the file
+	     in advance of the writes to it. */
+	  av_el = get_block (num_bytes, dbf);
+	  if (_gdbm_file_grow (dbf, dbf->header->next_block))
+	    return 0;
+	}
 
       dbf->header_changed = TRUE;
     }
@@ -84,9 +106,13 @@ _gdbm_alloc (GDBM_FILE dbf, int num_bytes)
   /* Put the unused space back in the avail block. */
   av_el.av_adr += num_bytes;
   av_el.av_size -= num_bytes;
-  if (_gdbm_free (dbf, av_el.av_adr, av_el.av_size))
+  if (free_space (dbf, av_el.av_adr, av_el.av_size))
     return 0;
 
+  /* A compaction pass in progress must not give this space back. */
+  if (dbf->compact)
+    _gdbm_compact_note (dbf, file_adr, num_bytes);
+
   /* Return the address. */
   return file_adr;
   
@@ -94,13 +120,36 @@ _gdbm_alloc (GDBM_FILE dbf, int num_bytes)
 
 /* Free space of size NUM_BYTES in the file DBF at file address FILE_ADR.  Make
    it avaliable for reuse through _gdbm_alloc.  This routine changes the
-   avail structure. */
+   avail structure.  Within a transaction, the space is still in use by
+   the file as of the last commit, so it is not made available before the
+   transaction is committed. */
 
 int
 _gdbm_free (GDBM_FILE dbf, off_t file_adr, int num_bytes)
+{
+  if (dbf->txn_state == TXN_ACTIVE)
+    return _gdbm_txn_free (dbf, file_adr, num_bytes);
+
+  /* Large blocks have their disk space deallocated when the update is
+     written (see _gdbm_punch_holes). */
+  if (dbf->punch_hole && num_bytes >= dbf->header->block_size)
+    punch_note (dbf, file_adr, num_bytes);
+
+  return free_space (dbf, file_adr, num_bytes);
+}
+
+/* Make NUM_BYTES at FILE_ADR avaliable for reuse.  This is used directly
+   for space that was not in use (e.g. the rest of a block from which
+   space has been allocated). */
+
+static int
+free_space (GDBM_FILE dbf, off_t file_adr, int num_bytes)
 {
   avail_elem temp;
 
+  if (dbf->fsm)
+    return _gdbm_fsm_put (dbf, file_adr, num_bytes);
+
   /* Is it too small to worry about? */
   if (num_bytes <= IGNORE_SIZE)
     return 0;
@@ -112,13 +161,13 @@ _gdbm_free (GDBM_FILE dbf, off_t file_adr, int num_bytes)
   /* Is the freed space large or small? */
   if ((num_bytes >= dbf->header->block_size) || dbf->central_free)
     {
-      if (dbf->header->avail.count == dbf->header->avail.size)
+      if (dbf->avail->count == dbf->avail->size)
 	{
 	  if (push_avail_block (dbf))
 	    return -1;
 	}
-      _gdbm_put_av_elem (temp, dbf->header->avail.av_table,
-			 &dbf->header->avail.count, dbf->coalesce_blocks);
+      _gdbm_put_av_elem (temp, dbf->avail->av_table,
+			 &dbf->avail->count, dbf->coalesce_blocks);
       dbf->header_changed = TRUE;
     }
   else
@@ -129,13 +178,13 @@ _gdbm_free (GDBM_FILE dbf, off_t file_adr, int num_bytes)
 			   &dbf->bucket->av_count, dbf->coalesce_blocks);
       else
 	{
-	  if (dbf->header->avail.count == dbf->header->avail.size)
+	  if (dbf->avail->count == dbf->avail->size)
 	    {
 	      if (push_avail_block (dbf))
 		return -1;
 	    }
-	  _gdbm_put_av_elem (temp, dbf->header->avail.av_table,
-			     &dbf->header->avail.count, dbf->coalesce_blocks);
+	  _gdbm_put_av_elem (temp, dbf->avail->av_table,
+			     &dbf->avail->count, dbf->coalesce_blocks);
 	  dbf->header_changed = TRUE;
 	}
     }
@@ -161,12 +210,11 @@ static int
 pop_avail_block (GDBM_FILE dbf)
 {
   int rc;
-  off_t file_pos;		/* For use with the lseek system call. */
   avail_elem new_el;
   avail_block *new_blk;
   int index;
   
-  if (dbf->header->avail.count == dbf->header->avail.size)
+  if (dbf->avail->count == dbf->avail->size)
     {
       /* We're kind of stuck here, so we re-split the header in order to
          avoid crashing.  Sigh. */
@@ -175,8 +223,8 @@ pop_avail_block (GDBM_FILE dbf)
     }
 
   /* Set up variables. */
-  new_el.av_adr = dbf->header->avail.next_block;
-  new_el.av_size = ( ( (dbf->header->avail.size * sizeof (avail_elem)) >> 1)
+  new_el.av_adr = dbf->avail->next_block;
+  new_el.av_size = ( ( (dbf->avail->size * sizeof (avail_elem)) >> 1)
 			+ sizeof (avail_block));
 
   /* Allocate space for the block. */
@@ -189,16 +237,7 @@ pop_avail_block (GDBM_FILE dbf)
     }
 
   /* Read the block. */
-  file_pos = gdbm_file_seek (dbf, new_el.av_adr, SEEK_SET);
-  if (file_pos != new_el.av_adr)
-    {
-      GDBM_SET_ERRNO (dbf, GDBM_FILE_SEEK_ERROR, TRUE);
-      free (new_blk);
-      _gdbm_fatal (dbf, _("lseek error"));
-      return -1;
-    }
-
-  rc = _gdbm_full_read (dbf, new_blk, new_el.av_size);
+  rc = _gdbm_full_pread (dbf, new_blk, new_el.av_size, new_el.av_adr);
   if (rc)
     {
       free (new_blk);
@@ -218,15 +257,15 @@ pop_avail_block (GDBM_FILE dbf)
   while (index < new_blk->count)
     {
       while (index < new_blk->count
-	     && dbf->header->avail.count < dbf->header->avail.size)
+	     && dbf->avail->count < dbf->avail->size)
 	{
 	   /* With luck, this will merge a lot of blocks! */
 	   _gdbm_put_av_elem (new_blk->av_table[index],
-			      dbf->header->avail.av_table,
-			      &dbf->header->avail.count, TRUE);
+			      dbf->avail->av_table,
+			      &dbf->avail->count, TRUE);
 	   index++;
 	}
-      if (dbf->header->avail.count == dbf->header->avail.size)
+      if (dbf->avail->count == dbf->avail->size)
         {
           /* We're kind of stuck here, so we re-split the header in order to
              avoid crashing.  Sigh. */
@@ -239,14 +278,14 @@ pop_avail_block (GDBM_FILE dbf)
     }
 
   /* Fix next_block, as well. */
-  dbf->header->avail.next_block = new_blk->next_block;
+  dbf->avail->next_block = new_blk->next_block;
 
   /* We changed the header. */
   dbf->header_changed = TRUE;
 
   /* Free the previous avail block.   It is possible that the header table
      is now FULL, which will cause us to overflow it! */
-  if (dbf->header->avail.count == dbf->header->avail.size)
+  if (dbf->avail->count == dbf->avail->size)
     {
       /* We're kind of stuck here, so we re-split the header in order to
          avoid crashing.  Sigh. */
@@ -257,9 +296,11 @@ pop_avail_block (GDBM_FILE dbf)
 	}
     }
 
-  _gdbm_put_av_elem (new_el, dbf->header->avail.av_table,
-		     &dbf->header->avail.count, TRUE);
   free (new_blk);
+  if (dbf->txn_state == TXN_ACTIVE)
+    return _gdbm_txn_free (dbf, new_el.av_adr, new_el.av_size);
+  _gdbm_put_av_elem (new_el, dbf->avail->av_table,
+		     &dbf->avail->count, TRUE);
 
   return 0;
 }
@@ -273,18 +314,17 @@ push_avail_block (GDBM_FILE dbf)
   int  av_size;
   off_t av_adr;
   int  index;
-  off_t file_pos;
   avail_block *temp;
   avail_elem  new_loc;
   int rc;
 
   /* Caclulate the size of the split block. */
-  av_size = ( (dbf->header->avail.size * sizeof (avail_elem)) >> 1)
+  av_size = ( (dbf->avail->size * sizeof (avail_elem)) >> 1)
             + sizeof (avail_block);
 
   /* Get address in file for new av_size bytes. */
-  new_loc = get_elem (av_size, dbf->header->avail.av_table,
-		      &dbf->header->avail.count);
+  new_loc = get_elem (av_size, dbf->avail->av_table,
+		      &dbf->avail->count);
   if (new_loc.av_size == 0)
     new_loc = get_block (av_size, dbf);
   av_adr = new_loc.av_adr;
@@ -299,19 +339,19 @@ push_avail_block (GDBM_FILE dbf)
     }
 
   /* Set the size to be correct AFTER the pop_avail_block. */
-  temp->size = dbf->header->avail.size;
+  temp->size = dbf->avail->size;
   temp->count = 0;
-  temp->next_block = dbf->header->avail.next_block;
-  dbf->header->avail.next_block = av_adr;
-  for (index = 1; index < dbf->header->avail.count; index++)
+  temp->next_block = dbf->avail->next_block;
+  dbf->avail->next_block = av_adr;
+  for (index = 1; index < dbf->avail->count; index++)
     if ( (index & 0x1) == 1)	/* Index is odd. */
-      temp->av_table[temp->count++] = dbf->header->avail.av_table[index];
+      temp->av_table[temp->count++] = dbf->avail->av_table[index];
     else
-      dbf->header->avail.av_table[index>>1]
-	= dbf->header->avail.av_table[index];
+      dbf->avail->av_table[index>>1]
+	= dbf->avail->av_table[index];
 
   /* Update the header avail count to previous size divided by 2. */
-  dbf->header->avail.count >>= 1;
+  dbf->avail->count >>= 1;
 
   rc = 0;
   do
@@ -319,23 +359,14 @@ push_avail_block (GDBM_FILE dbf)
       /* Free the unneeded space. */
       new_loc.av_adr += av_size;
       new_loc.av_size -= av_size;
-      if (_gdbm_free (dbf, new_loc.av_adr, new_loc.av_size))
+      if (free_space (dbf, new_loc.av_adr, new_loc.av_size))
 	{
 	  rc = -1;
 	  break;
 	}
   
       /* Update the disk. */
-      file_pos = gdbm_file_seek (dbf, av_adr, SEEK_SET);
-      if (file_pos != av_adr)
-	{
-	  GDBM_SET_ERRNO (dbf, GDBM_FILE_SEEK_ERROR, TRUE);
-	  _gdbm_fatal (dbf, _("lseek error"));
-	  rc = -1;
-	  break;
-	}
-
-      rc = _gdbm_full_write (dbf, temp, av_size);
+      rc = _gdbm_full_pwrite (dbf, temp, av_size, av_adr);
       if (rc)
 	{
 	  GDBM_DEBUG (GDBM_DEBUG_STORE|GDBM_DEBUG_ERR,
@@ -344,6 +375,8 @@ push_avail_block (GDBM_FILE dbf)
 	  _gdbm_fatal (dbf, gdbm_db_strerror (dbf));
 	  rc = -1;
 	}
+      else
+	rc = _gdbm_journal_log (dbf, av_adr, temp, av_size);
     }
   while (0);
   
@@ -505,10 +538,10 @@ adjust_bucket_avail (GDBM_FILE dbf)
   /* Can we add more entries to the bucket? */
   if (dbf->bucket->av_count < third)
     {
-      if (dbf->header->avail.count > 0)
+      if (dbf->avail->count > 0)
 	{
-	  dbf->header->avail.count -= 1;
-	  av_el = dbf->header->avail.av_table[dbf->header->avail.count];
+	  dbf->avail->count -= 1;
+	  av_el = dbf->avail->av_table[dbf->avail->count];
 	  _gdbm_put_av_elem (av_el, dbf->bucket->bucket_avail,
 			     &dbf->bucket->av_count, dbf->coalesce_blocks);
 	  dbf->bucket_changed = TRUE;
@@ -518,7 +551,7 @@ adjust_bucket_avail (GDBM_FILE dbf)
 
   /* Is there too much in the bucket? */
   while (dbf->bucket->av_count > BUCKET_AVAIL-third
-	 && dbf->header->avail.count < dbf->header->avail.size)
+	 && dbf->avail->count < dbf->avail->size)
     {
       av_el = get_elem (0, dbf->bucket->bucket_avail, &dbf->bucket->av_count);
       if (av_el.av_size == 0)
@@ -526,10 +559,233 @@ adjust_bucket_avail (GDBM_FILE dbf)
 	  GDBM_SET_ERRNO (dbf, GDBM_BAD_AVAIL, TRUE);
 	  return -1;
 	}
-      _gdbm_put_av_elem (av_el, dbf->header->avail.av_table,
-			 &dbf->header->avail.count,
+      _gdbm_put_av_elem (av_el, dbf->avail->av_table,
+			 &dbf->avail->count,
 			 dbf->coalesce_blocks);
       dbf->bucket_changed = TRUE;
     }
   return 0;
 }
+
+/* Return the lowest value next_block can be moved down to: the file
+   must extend past the directory (see validate_header in gdbmopen.c). */
+off_t
+_gdbm_next_block_min (GDBM_FILE dbf)
+{
+  int block_size = dbf->header->block_size;
+
+  return (dbf->header->dir + dbf->header->dir_size) / block_size
+         * block_size + block_size;
+}
+
+/* Give back the free space at the end of the file.  Return 1 if
+   next_block has been moved down, 0 if not, and -1 on error. */
+int
+_gdbm_avail_trim (GDBM_FILE dbf)
+{
+  off_t next_block = dbf->header->next_block;
+  int block_size = dbf->header->block_size;
+  off_t end, min;
+  avail_elem el;
+  int i;
+
+  if (dbf->fsm)
+    {
+      if (_gdbm_fsm_merge (dbf))
+	return -1;
+      return dbf->header->next_block < next_block;
+    }
+
+  /* Take the blocks that end where the free space found so far
+     begins.  They need not have been coalesced. */
+  end = next_block;
+  for (i = 0; i < dbf->avail->count; )
+    {
+      avail_elem *av = &dbf->avail->av_table[i];
+
+      if (av->av_adr + av->av_size == end
+	  && next_block - av->av_adr <= INT_MAX)
+	{
+	  end = av->av_adr;
+	  avail_move (dbf->avail->av_table, &dbf->avail->count, i + 1, i);
+	  i = 0;
+	}
+      else
+	i++;
+    }
+  if (end == next_block)
+    return 0;
+
+  /* Keep whole blocks, and keep the file past the directory. */
+  el.av_adr = end;
+  end = (end + block_size - 1) / block_size * block_size;
+  min = _gdbm_next_block_min (dbf);
+  if (end < min)
+    end = min;
+  if (end > next_block)
+    end = next_block;
+  el.av_size = end - el.av_adr;
+  _gdbm_put_av_elem (el, dbf->avail->av_table, &dbf->avail->count, FALSE);
+  dbf->header_changed = TRUE;
+  if (end == next_block)
+    return 0;
+  dbf->header->next_block = end;
+  return 1;
+}
+
+static int
+avail_adr_cmp (void const *a, void const *b)
+{
+  avail_elem const *x = a;
+  avail_elem const *y = b;
+
+  if (x->av_adr < y->av_adr)
+    return -1;
+  return x->av_adr > y->av_adr;
+}
+
+/* Remember that NUM_BYTES at FILE_ADR have been freed, so that their
+   disk space is deallocated when the update is written.  If memory is
+   short, the block is simply left alone. */
+static void
+punch_note (GDBM_FILE dbf, off_t file_adr, int num_bytes)
+{
+  if (dbf->punch_count == dbf->punch_max)
+    {
+      size_t n = dbf->punch_max ? 2 * dbf->punch_max : 16;
+      avail_elem *p = realloc (dbf->punch_list, n * sizeof (p[0]));
+
+      if (!p)
+	return;
+      dbf->punch_list = p;
+      dbf->punch_max = n;
+    }
+  dbf->punch_list[dbf->punch_count].av_adr = file_adr;
+  dbf->punch_list[dbf->punch_count].av_size = num_bytes;
+  dbf->punch_count++;
+}
+
+/* Forget the blocks freed since the last update and release the
+   memory used to track them. */
+void
+_gdbm_punch_free (GDBM_FILE dbf)
+{
+  free (dbf->punch_list);
+  dbf->punch_list = NULL;
+  dbf->punch_count = 0;
+  dbf->punch_max = 0;
+}
+
+/* Deallocate the disk space of the blocks freed since the last update
+   (see punch_note).  Only the parts that are still free are taken,
+   and only if they lie in a run of adjacent free blocks of at least
+   dbf->punch_hole bytes.  Space freed by earlier updates has been
+   dealt with already, and is left alone, except for the pages the
+   new blocks share with it.  If TRIMMED is true,
+   next_block has been moved down by _gdbm_avail_trim, and the file is
+   shortened as well.  Called when an update has been written. */
+int
+_gdbm_punch_holes (GDBM_FILE dbf, int trimmed)
+{
+  avail_elem *tab;
+  avail_elem *freed = dbf->punch_list;
+  size_t nfreed = dbf->punch_count;
+  size_t count, i, j, k;
+  off_t page_size = sysconf (_SC_PAGESIZE);
+  int rc = 0;
+
+  dbf->punch_count = 0;
+
+  /* The header must be on disk before the file is shortened, or else
+     it would point past the end of the file after a crash. */
+  if (trimmed
+      && (gdbm_file_sync (dbf)
+	  || _gdbm_file_truncate (dbf, dbf->header->next_block)))
+    return -1;
+
+  if (dbf->punch_hole == 0)
+    return 0;
+
+  if (dbf->fsm)
+    {
+      if (_gdbm_fsm_table (dbf, &tab, &count, FALSE))
+	return -1;
+    }
+  else
+    {
+      count = dbf->avail->count;
+      tab = malloc ((count + 1) * sizeof (tab[0]));
+      if (!tab)
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+	  return -1;
+	}
+      memcpy (tab, dbf->avail->av_table, count * sizeof (tab[0]));
+      qsort (tab, count, sizeof (tab[0]), avail_adr_cmp);
+    }
+  qsort (freed, nfreed, sizeof (freed[0]), avail_adr_cmp);
+
+  k = 0;
+  for (i = 0; i < count && k < nfreed && rc == 0; i = j)
+    {
+      off_t start = tab[i].av_adr;
+      off_t end = start + tab[i].av_size;
+
+      for (j = i + 1; j < count && tab[j].av_adr == end; j++)
+	end += tab[j].av_size;
+
+      /* Skip the freed blocks that end before this run. */
+      while (k < nfreed && freed[k].av_adr + freed[k].av_size <= start)
+	k++;
+      if (end - start < dbf->punch_hole)
+	continue;
+
+      /* Punch the parts of the run freed since the last update.  The
+	 blocks in FREED may overlap, if the same space has been freed,
+	 allocated and freed again. */
+      while (k < nfreed && freed[k].av_adr < end)
+	{
+	  off_t a = freed[k].av_adr;
+	  off_t b = a + freed[k].av_size;
+
+	  while (k + 1 < nfreed && freed[k + 1].av_adr <= b)
+	    {
+	      k++;
+	      if (freed[k].av_adr + freed[k].av_size > b)
+		b = freed[k].av_adr + freed[k].av_size;
+	    }
+	  if (a < start)
+	    a = start;
+	  if (b > end)
+	    {
+	      /* The rest may lie in the next run. */
+	      freed[k].av_adr = end;
+	      freed[k].av_size = b - end;
+	      b = end;
+	    }
+	  else
+	    k++;
+
+	  /* A block smaller than a page is punched along with the free
+	     space around it, up to the page boundaries. */
+	  a = a / page_size * page_size;
+	  if (a < start)
+	    a = start;
+	  b = (b + page_size - 1) / page_size * page_size;
+	  if (b > end)
+	    b = end;
+	  if ((rc = _gdbm_file_punch (dbf, a, b - a)) != 0)
+	    break;
+	}
+    }
+  free (tab);
+
+  if (rc == 1)
+    {
+      /* The file system does not support it.  Don't try again. */
+      dbf->punch_hole = 0;
+      _gdbm_punch_free (dbf);
+      rc = 0;
+    }
+  return rc;
+}
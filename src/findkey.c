@@ -38,7 +38,9 @@ gdbm_bucket_element_valid_p (GDBM_FILE dbf, int elem_loc)
 }
   
 /* Read the data found in bucket entry ELEM_LOC in file DBF and
-   return a pointer to it.  Also, cache the read value. */
+   return a pointer to it.  Also, cache the read value.  The returned
+   pointer remains valid until the next call to this function, or until
+   the database is modified. */
 
 char *
 _gdbm_read_entry (GDBM_FILE dbf, int elem_loc)
@@ -46,13 +48,16 @@ _gdbm_read_entry (GDBM_FILE dbf, int elem_loc)
   int rc;
   int key_size;
   int data_size;
-  size_t dsize;
-  off_t file_pos;
   data_cache_elem *data_ca;
 
   /* Is it already in the cache? */
-  if (dbf->cache_entry->ca_data.elem_loc == elem_loc)
-    return dbf->cache_entry->ca_data.dptr;
+  data_ca = _gdbm_data_cache_lookup (dbf, dbf->cache_entry->ca_adr,
+				     dbf->bucket, elem_loc);
+  if (data_ca)
+    {
+      dbf->cache_stats.data_hits++;
+      return data_ca->dptr;
+    }
 
   if (!gdbm_bucket_element_valid_p (dbf, elem_loc))
     {
@@ -63,59 +68,24 @@ _gdbm_read_entry (GDBM_FILE dbf, int elem_loc)
   /* Set sizes and pointers. */
   key_size = dbf->bucket->h_table[elem_loc].key_size;
   data_size = dbf->bucket->h_table[elem_loc].data_size;
-  dsize = key_size + data_size;
-  data_ca = &dbf->cache_entry->ca_data;
 
   /* Set up the cache. */
-  data_ca->key_size = key_size;
-  data_ca->data_size = data_size;
-  data_ca->elem_loc = elem_loc;
-  data_ca->hash_val = dbf->bucket->h_table[elem_loc].hash_value;
-
-  if (dsize <= data_ca->dsize)
+  data_ca = _gdbm_data_cache_alloc (dbf, dbf->cache_entry->ca_adr,
+				    dbf->bucket, elem_loc);
+  if (!data_ca)
     {
-      if (data_ca->dsize == 0)
-	{
-	  data_ca->dptr = malloc (1);
-	  if (data_ca->dptr)
-	    data_ca->dsize = 1;
-	  else
-	    {
-	      GDBM_SET_ERRNO2 (dbf, GDBM_MALLOC_ERROR, FALSE, GDBM_DEBUG_LOOKUP);
-	      _gdbm_fatal (dbf, _("malloc error"));
-	      return NULL;
-	    }
-	}
-    }
-  else
-    {
-      char *p = realloc (data_ca->dptr, dsize);
-      if (p)
-	{
-	  data_ca->dptr = p;
-	  data_ca->dsize = dsize;
-	}
-      else
-	{
-	  GDBM_SET_ERRNO2 (dbf, GDBM_MALLOC_ERROR, FALSE, GDBM_DEBUG_LOOKUP);
-	  _gdbm_fatal (dbf, _("malloc error"));
-	  return NULL;
-	}
+      GDBM_SET_ERRNO2 (dbf, GDBM_MALLOC_ERROR, FALSE, GDBM_DEBUG_LOOKUP);
+      _gdbm_fatal (dbf, _("malloc error"));
+      return NULL;
     }
 
   /* Read into the cache. */
-  file_pos = gdbm_file_seek (dbf, dbf->bucket->h_table[elem_loc].data_pointer, 
-		      SEEK_SET);
-  if (file_pos != dbf->bucket->h_table[elem_loc].data_pointer)
-    {
-      GDBM_SET_ERRNO2 (dbf, GDBM_FILE_SEEK_ERROR, TRUE, GDBM_DEBUG_LOOKUP);
-      _gdbm_fatal (dbf, _("lseek error"));
-      return NULL;
-    }
-  
-  rc = _gdbm_full_read (dbf, data_ca->dptr, key_size+data_size);
+  dbf->cache_stats.data_misses++;
+  rc = _gdbm_full_pread (dbf, data_ca->dptr, key_size+data_size,
+			 dbf->bucket->h_table[elem_loc].data_pointer);
   if (rc)
     {
+      _gdbm_data_cache_invalidate (dbf, dbf->cache_entry->ca_adr, elem_loc);
       GDBM_DEBUG (GDBM_DEBUG_ERR|GDBM_DEBUG_LOOKUP|GDBM_DEBUG_READ,
 		  "%s: error reading entry: %s",
 		  dbf->name, gdbm_db_strerror (dbf));
@@ -139,13 +109,15 @@ _gdbm_read_entry (GDBM_FILE dbf, int elem_loc)
 int
 _gdbm_findkey (GDBM_FILE dbf, datum key, char **ret_dptr, int *ret_hash_val)
 {
-  int    bucket_hash_val;	/* The hash value from the bucket. */
   int    new_hash_val;          /* Computed hash value for the key */
   char  *file_key;		/* The complete key as stored in the file. */
   int    bucket_dir;            /* Number of the bucket in directory. */
   int    elem_loc;		/* The location in the bucket. */
   int    home_loc;		/* The home location in the bucket. */
+  int    count;			/* Number of locations left to probe. */
   int    key_size;		/* Size of the key on the file.  */
+  char   key_check[SMALL];	/* Expected key_start of the element. */
+  int    key_check_len;         /* Number of significant bytes in it. */
 
   GDBM_DEBUG_DATUM (GDBM_DEBUG_LOOKUP, key, "%s: fetching key:", dbf->name);
   
@@ -159,39 +131,26 @@ _gdbm_findkey (GDBM_FILE dbf, datum key, char **ret_dptr, int *ret_hash_val)
     *ret_hash_val = new_hash_val;
   if (_gdbm_get_bucket (dbf, bucket_dir))
     return -1;
-  
-  /* Is the element the last one found for this bucket? */
-  if (dbf->cache_entry->ca_data.elem_loc != -1 
-      && new_hash_val == dbf->cache_entry->ca_data.hash_val
-      && dbf->cache_entry->ca_data.key_size == key.dsize
-      && dbf->cache_entry->ca_data.dptr != NULL
-      && memcmp (dbf->cache_entry->ca_data.dptr, key.dptr, key.dsize) == 0)
+
+  /* Consult the bucket filter. */
+  if (dbf->bucket_filter && !_gdbm_bucket_filter_test (dbf, new_hash_val))
     {
-      GDBM_DEBUG (GDBM_DEBUG_LOOKUP, "%s: found in cache", dbf->name);
-      /* This is it. Return the cache pointer. */
-      if (ret_dptr)
-	*ret_dptr = dbf->cache_entry->ca_data.dptr + key.dsize;
-      return dbf->cache_entry->ca_data.elem_loc;
+      dbf->cache_stats.filter_rejects++;
+      GDBM_SET_ERRNO2 (dbf, GDBM_ITEM_NOT_FOUND, FALSE, GDBM_DEBUG_LOOKUP);
+      return -1;
     }
-      
-  /* It is not the cached value, search for element in the bucket. */
+  
+  /* Search for element in the bucket. */
+  key_check_len = _gdbm_key_check (dbf, key, key_check);
   home_loc = elem_loc;
-  bucket_hash_val = dbf->bucket->h_table[elem_loc].hash_value;
-  while (bucket_hash_val != -1)
+  count = dbf->header->bucket_elems;
+  while ((elem_loc = _gdbm_bucket_probe (dbf, new_hash_val, elem_loc, count))
+	 != -1)
     {
       key_size = dbf->bucket->h_table[elem_loc].key_size;
-      if (bucket_hash_val != new_hash_val
-	 || key_size != key.dsize
-	 || memcmp (dbf->bucket->h_table[elem_loc].key_start, key.dptr,
-			(SMALL < key_size ? SMALL : key_size)) != 0) 
-	{
-	  /* Current elem_loc is not the item, go to next item. */
-	  elem_loc = (elem_loc + 1) % dbf->header->bucket_elems;
-	  if (elem_loc == home_loc)
-	    break;
-	  bucket_hash_val = dbf->bucket->h_table[elem_loc].hash_value;
-	}
-      else
+      if (key_size == key.dsize
+	  && memcmp (dbf->bucket->h_table[elem_loc].key_start, key_check,
+		     key_check_len) == 0)
 	{
 	  /* This may be the one we want.
 	     The only way to tell is to read it. */
@@ -210,17 +169,15 @@ _gdbm_findkey (GDBM_FILE dbf, datum key, char **ret_dptr, int *ret_hash_val)
 		*ret_dptr = file_key + key.dsize;
 	      return elem_loc;
 	    }
-	  else
-	    {
-	      /* Not the item, try the next one.  Return if not found. */
-	      elem_loc = (elem_loc + 1) % dbf->header->bucket_elems;
-	      if (elem_loc == home_loc)
-		break;
-	      bucket_hash_val = dbf->bucket->h_table[elem_loc].hash_value;
-	    }
 	}
+
+      /* Not the item, try the next one.  Return if not found. */
+      count = home_loc - elem_loc - 1;
+      if (count < 0)
+	count += dbf->header->bucket_elems;
+      elem_loc = GDBM_BUCKET_NEXT (dbf, elem_loc);
       GDBM_DEBUG (GDBM_DEBUG_LOOKUP, "%s: next location = %#4x:%d:%d",
-		  dbf->name, bucket_hash_val, bucket_dir, elem_loc);
+		  dbf->name, new_hash_val, bucket_dir, elem_loc);
     }
 
   /* If we get here, we never found the key. */
@@ -0,0 +1,671 @@
+/* fsm.c - The size-class free-space allocator. */
+
+/* This file is part of GDBM, the GNU data base manager.
+   Copyright (C) 2018 Free Software Foundation, Inc.
+
+   GDBM is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   GDBM is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GDBM. If not, see <http://www.gnu.org/licenses/>.    */
+
+/* Include system configuration before all else. */
+#include "autoconf.h"
+
+#include "gdbmdefs.h"
+#include <limits.h>
+
+/* In a database created with GDBM_SIZECLASS, the free space is not kept
+   in the avail tables of the header and of the buckets.  The free
+   extents are kept in memory instead, in one list per size class, and
+   a bitmap tells which lists are not empty.  Allocating and freeing
+   space take a bounded number of steps, however many extents there
+   are, and an allocation is served from the smallest class that can
+   satisfy it.
+
+   The lists are saved in the file (the "free-space map") when the
+   database is synchronized or closed.  Adjacent extents are merged
+   then, and the free space at the end of the file is given back.  The
+   extension header points to the map, which is read back when the
+   database is opened by a writer.  The pointer is cleared in the file
+   before the free space changes, so the map never describes space in
+   use.  If the database is not closed properly, the space that was
+   free is lost until the database is reorganized. */
+
+/* Sizes below FSM_SMALL_MAX fall into classes FSM_SMALL_STEP bytes
+   wide.  Larger ones are divided into FSM_SUB classes per power of
+   two. */
+#define FSM_SMALL_STEP    8
+#define FSM_SMALL_LOG     11
+#define FSM_SMALL_MAX     (1 << FSM_SMALL_LOG)
+#define FSM_SMALL_CLASSES (FSM_SMALL_MAX / FSM_SMALL_STEP)
+#define FSM_SUB_LOG       2
+#define FSM_SUB           (1 << FSM_SUB_LOG)
+#define FSM_CLASSES       (FSM_SMALL_CLASSES + (31 - FSM_SMALL_LOG) * FSM_SUB)
+
+/* Number of extents looked at in the class of the requested size
+   before resorting to a larger class. */
+#define FSM_PROBE 4
+
+#define FSM_WORD_BITS (CHAR_BIT * sizeof (unsigned long))
+#define FSM_MAP_WORDS ((FSM_CLASSES + FSM_WORD_BITS - 1) / FSM_WORD_BITS)
+
+struct fsm_list
+{
+  avail_elem *tab;	/* Extents of this class. */
+  size_t count;		/* Number of extents. */
+  size_t max;		/* Allocated size of tab. */
+  size_t base;		/* Number of extents when the current transaction
+			   started. */
+};
+
+/* A slot of a list overwritten during a transaction, and its former
+   contents. */
+struct fsm_undo
+{
+  int cls;
+  size_t idx;
+  avail_elem elem;
+};
+
+struct gdbm_fsm
+{
+  struct fsm_list list[FSM_CLASSES];
+  unsigned long nonempty[FSM_MAP_WORDS];  /* Bitmap of non-empty lists. */
+  size_t count;		/* Total number of extents. */
+  int saved;		/* The map in the file describes the lists. */
+  int transient;	/* The lists are not saved in the file. */
+  int txn;		/* A transaction is in progress. */
+  struct fsm_undo *undo;  /* Changes to undo if it is aborted. */
+  size_t undo_count;
+  size_t undo_max;
+};
+
+/* Return the class of extents of SIZE bytes. */
+static int
+fsm_class (int size)
+{
+  int log;
+
+  if (size < FSM_SMALL_MAX)
+    return size / FSM_SMALL_STEP;
+  for (log = FSM_SMALL_LOG; (size >> log) > 1; log++)
+    ;
+  return FSM_SMALL_CLASSES + (log - FSM_SMALL_LOG) * FSM_SUB
+         + ((size >> (log - FSM_SUB_LOG)) & (FSM_SUB - 1));
+}
+
+static inline void
+fsm_mark (struct gdbm_fsm *fsm, int c, int set)
+{
+  unsigned long bit = 1UL << (c % FSM_WORD_BITS);
+  if (set)
+    fsm->nonempty[c / FSM_WORD_BITS] |= bit;
+  else
+    fsm->nonempty[c / FSM_WORD_BITS] &= ~bit;
+}
+
+/* Return the first non-empty class starting at C, or -1 if there is
+   none. */
+static int
+fsm_find (struct gdbm_fsm *fsm, int c)
+{
+  size_t w;
+  unsigned long bits;
+
+  if (c >= FSM_CLASSES)
+    return -1;
+  w = c / FSM_WORD_BITS;
+  bits = fsm->nonempty[w] & (~0UL << (c % FSM_WORD_BITS));
+  while (bits == 0)
+    {
+      if (++w == FSM_MAP_WORDS)
+	return -1;
+      bits = fsm->nonempty[w];
+    }
+  c = w * FSM_WORD_BITS;
+#if __GNUC__ >= 4
+  c += __builtin_ctzl (bits);
+#else
+  while (!(bits & 1))
+    {
+      bits >>= 1;
+      c++;
+    }
+#endif
+  return c;
+}
+
+/* Add the extent EL to its list. */
+static int
+fsm_push (GDBM_FILE dbf, avail_elem el)
+{
+  struct gdbm_fsm *fsm = dbf->fsm;
+  int c = fsm_class (el.av_size);
+  struct fsm_list *l = &fsm->list[c];
+
+  if (l->count == l->max)
+    {
+      size_t n = l->max ? 2 * l->max : 16;
+      avail_elem *p = realloc (l->tab, n * sizeof (p[0]));
+      if (!p)
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, TRUE);
+	  return -1;
+	}
+      l->tab = p;
+      l->max = n;
+    }
+  l->tab[l->count++] = el;
+  fsm_mark (fsm, c, TRUE);
+  fsm->count++;
+  return 0;
+}
+
+/* Remember the contents of slot IDX of class C, if it is about to be
+   changed by the current transaction for the first time. */
+static int
+fsm_undo_log (GDBM_FILE dbf, int c, size_t idx)
+{
+  struct gdbm_fsm *fsm = dbf->fsm;
+
+  if (!fsm->txn || idx >= fsm->list[c].base)
+    return 0;
+  if (fsm->undo_count == fsm->undo_max)
+    {
+      size_t n = fsm->undo_max ? 2 * fsm->undo_max : 64;
+      struct fsm_undo *p = realloc (fsm->undo, n * sizeof (p[0]));
+      if (!p)
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, TRUE);
+	  return -1;
+	}
+      fsm->undo = p;
+      fsm->undo_max = n;
+    }
+  fsm->undo[fsm->undo_count].cls = c;
+  fsm->undo[fsm->undo_count].idx = idx;
+  fsm->undo[fsm->undo_count].elem = fsm->list[c].tab[idx];
+  fsm->undo_count++;
+  return 0;
+}
+
+/* Remove the extent at IDX in class C and return it in RET. */
+static int
+fsm_take (GDBM_FILE dbf, int c, size_t idx, avail_elem *ret)
+{
+  struct gdbm_fsm *fsm = dbf->fsm;
+  struct fsm_list *l = &fsm->list[c];
+  size_t top = l->count - 1;
+
+  if (fsm_undo_log (dbf, c, top)
+      || (idx != top && fsm_undo_log (dbf, c, idx)))
+    return -1;
+  *ret = l->tab[idx];
+  l->tab[idx] = l->tab[top];
+  l->count = top;
+  if (top == 0)
+    fsm_mark (fsm, c, FALSE);
+  fsm->count--;
+  return 0;
+}
+
+/* Write the extension header of DBF. */
+static int
+fsm_write_xheader (GDBM_FILE dbf)
+{
+  if (_gdbm_full_pwrite (dbf, dbf->xheader, sizeof (*dbf->xheader),
+			 (char *) dbf->xheader - (char *) dbf->header))
+    {
+      _gdbm_fatal (dbf, gdbm_db_strerror (dbf));
+      return -1;
+    }
+  if (!dbf->fast_write)
+    return gdbm_file_sync (dbf);
+  return 0;
+}
+
+/* Clear the pointer to the free-space map in the file, before the free
+   lists change, and make the space of the map available. */
+static int
+fsm_release (GDBM_FILE dbf)
+{
+  avail_elem el;
+
+  dbf->fsm->saved = FALSE;
+  if (dbf->xheader->fsm_adr == 0)
+    return 0;
+  el.av_adr = dbf->xheader->fsm_adr;
+  el.av_size = dbf->xheader->fsm_size;
+  dbf->xheader->fsm_adr = 0;
+  dbf->xheader->fsm_size = 0;
+  if (fsm_write_xheader (dbf))
+    return -1;
+  return fsm_push (dbf, el);
+}
+
+/* Read the free-space map of DBF into the free lists.  Return 0 if it
+   is valid, 1 if it is not, and -1 on error. */
+static int
+fsm_load (GDBM_FILE dbf)
+{
+  off_t adr = dbf->xheader->fsm_adr;
+  int size = dbf->xheader->fsm_size;
+  avail_block *blk;
+  int i, rc;
+
+  if (!(adr >= dbf->header->block_size
+	&& size >= sizeof (avail_block)
+	&& off_t_sum_ok (adr, size)
+	&& adr + size <= dbf->header->next_block))
+    return 1;
+
+  blk = malloc (size);
+  if (!blk)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+      return -1;
+    }
+  rc = 1;
+  if (_gdbm_full_pread (dbf, blk, size, adr) == 0
+      && blk->size > 0
+      && blk->count >= 0
+      && blk->count <= blk->size
+      && size == sizeof (avail_block) + (blk->size - 1) * sizeof (avail_elem)
+      && gdbm_avail_table_valid_p (dbf, blk->av_table, blk->count))
+    {
+      rc = 0;
+      for (i = 0; i < blk->count; i++)
+	if (blk->av_table[i].av_size > IGNORE_SIZE
+	    && fsm_push (dbf, blk->av_table[i]))
+	  {
+	    rc = -1;
+	    break;
+	  }
+    }
+  else
+    gdbm_set_errno (dbf, GDBM_NO_ERROR, FALSE);
+  free (blk);
+  return rc;
+}
+
+/* Set up the size-class allocator of DBF, reading its free-space map
+   if there is one. */
+int
+_gdbm_fsm_init (GDBM_FILE dbf)
+{
+  dbf->fsm = calloc (1, sizeof (*dbf->fsm));
+  if (!dbf->fsm)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+      return -1;
+    }
+  if (dbf->xheader->fsm_adr == 0)
+    return 0;
+  switch (fsm_load (dbf))
+    {
+    case 0:
+      dbf->fsm->saved = TRUE;
+      return 0;
+
+    case 1:
+      /* A damaged map is dropped.  The space it describes is lost. */
+      GDBM_DEBUG (GDBM_DEBUG_ERR|GDBM_DEBUG_OPEN,
+		  "%s: ignoring invalid free-space map", dbf->name);
+      dbf->xheader->fsm_adr = 0;
+      dbf->xheader->fsm_size = 0;
+      return fsm_write_xheader (dbf);
+    }
+  return -1;
+}
+
+/* Set up empty free lists for DBF, which are not saved in the file.
+   This is used while compacting a database that does not use the
+   size-class allocator (see gdbmcompact.c). */
+int
+_gdbm_fsm_attach (GDBM_FILE dbf)
+{
+  dbf->fsm = calloc (1, sizeof (*dbf->fsm));
+  if (!dbf->fsm)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+      return -1;
+    }
+  dbf->fsm->transient = TRUE;
+  return 0;
+}
+
+/* Free the memory used by the size-class allocator of DBF. */
+void
+_gdbm_fsm_free (GDBM_FILE dbf)
+{
+  int c;
+
+  if (!dbf->fsm)
+    return;
+  for (c = 0; c < FSM_CLASSES; c++)
+    free (dbf->fsm->list[c].tab);
+  free (dbf->fsm->undo);
+  free (dbf->fsm);
+  dbf->fsm = NULL;
+}
+
+/* Find a free extent of at least SIZE bytes and remove it from the free
+   lists.  Return it in RET, or set RET->av_size to 0 if there is
+   none. */
+int
+_gdbm_fsm_get (GDBM_FILE dbf, int size, avail_elem *ret)
+{
+  struct gdbm_fsm *fsm = dbf->fsm;
+  struct fsm_list *l;
+  size_t i, n;
+  int c;
+
+  ret->av_adr = 0;
+  ret->av_size = 0;
+  if (fsm->saved && fsm_release (dbf))
+    return -1;
+
+  /* An extent of the class of SIZE may be too small, but the first one
+     found in a larger class fits. */
+  c = fsm_class (size);
+  l = &fsm->list[c];
+  for (i = l->count, n = 0; i > 0 && n < FSM_PROBE; i--, n++)
+    if (l->tab[i - 1].av_size >= size)
+      return fsm_take (dbf, c, i - 1, ret);
+  c = fsm_find (fsm, c + 1);
+  if (c == -1)
+    return 0;
+  return fsm_take (dbf, c, fsm->list[c].count - 1, ret);
+}
+
+/* Find a free extent of at least SIZE bytes, the first SIZE bytes of
+   which lie below LIMIT, and remove it from the free lists.  Return it
+   in RET, or set RET->av_size to 0 if there is none.  Unlike
+   _gdbm_fsm_get, this may look at all the extents of a class.  It is
+   used by the compaction (see gdbmcompact.c). */
+int
+_gdbm_fsm_get_below (GDBM_FILE dbf, int size, off_t limit, avail_elem *ret)
+{
+  struct gdbm_fsm *fsm = dbf->fsm;
+  size_t i;
+  int c;
+
+  ret->av_adr = 0;
+  ret->av_size = 0;
+  if (fsm->saved && fsm_release (dbf))
+    return -1;
+
+  for (c = fsm_find (fsm, fsm_class (size)); c != -1;
+       c = fsm_find (fsm, c + 1))
+    {
+      struct fsm_list *l = &fsm->list[c];
+      for (i = l->count; i > 0; i--)
+	if (l->tab[i - 1].av_size >= size
+	    && l->tab[i - 1].av_adr + size <= limit)
+	  return fsm_take (dbf, c, i - 1, ret);
+    }
+  return 0;
+}
+
+/* Return the total size of the free extents of DBF. */
+off_t
+_gdbm_fsm_free_size (GDBM_FILE dbf)
+{
+  struct gdbm_fsm *fsm = dbf->fsm;
+  off_t total = 0;
+  size_t i;
+  int c;
+
+  for (c = 0; c < FSM_CLASSES; c++)
+    for (i = 0; i < fsm->list[c].count; i++)
+      total += fsm->list[c].tab[i].av_size;
+  return total;
+}
+
+/* Make NUM_BYTES at FILE_ADR available for reuse. */
+int
+_gdbm_fsm_put (GDBM_FILE dbf, off_t file_adr, int num_bytes)
+{
+  avail_elem el;
+
+  if (num_bytes <= IGNORE_SIZE)
+    return 0;
+  if (dbf->fsm->saved && fsm_release (dbf))
+    return -1;
+  el.av_adr = file_adr;
+  el.av_size = num_bytes;
+  return fsm_push (dbf, el);
+}
+
+static int
+fsm_adr_comp (void const *a, void const *b)
+{
+  avail_elem const *ava = a;
+  avail_elem const *avb = b;
+  if (ava->av_adr < avb->av_adr)
+    return -1;
+  return ava->av_adr > avb->av_adr;
+}
+
+/* Return in *PTAB a copy of all the free extents of DBF, sorted by
+   address, and their number in *PCOUNT.  If REMOVE is true, the extents
+   are removed from the lists. */
+int
+_gdbm_fsm_table (GDBM_FILE dbf, avail_elem **ptab, size_t *pcount,
+		 int remove)
+{
+  struct gdbm_fsm *fsm = dbf->fsm;
+  avail_elem *tab;
+  size_t n;
+  int c;
+
+  tab = malloc ((fsm->count + 1) * sizeof (tab[0]));
+  if (!tab)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+      return -1;
+    }
+  for (c = n = 0; c < FSM_CLASSES; c++)
+    {
+      struct fsm_list *l = &fsm->list[c];
+      if (l->count == 0)
+	continue;
+      memcpy (tab + n, l->tab, l->count * sizeof (tab[0]));
+      n += l->count;
+      if (remove)
+	l->count = 0;
+    }
+  if (remove)
+    {
+      memset (fsm->nonempty, 0, sizeof (fsm->nonempty));
+      fsm->count = 0;
+    }
+  qsort (tab, n, sizeof (tab[0]), fsm_adr_comp);
+  *ptab = tab;
+  *pcount = n;
+  return 0;
+}
+
+/* Merge the adjacent extents of TAB, which holds COUNT extents sorted by
+   address, and put them back into the free lists.  Free space at the
+   end of the file is given back, provided that the file still extends
+   past the directory. */
+static int
+fsm_rebuild (GDBM_FILE dbf, avail_elem *tab, size_t count)
+{
+  size_t i, n;
+
+  for (i = n = 0; i < count; i++)
+    {
+      if (n > 0
+	  && tab[n-1].av_adr + tab[n-1].av_size == tab[i].av_adr
+	  && tab[n-1].av_size <= INT_MAX - tab[i].av_size)
+	tab[n-1].av_size += tab[i].av_size;
+      else
+	tab[n++] = tab[i];
+    }
+
+  if (n > 0 && tab[n-1].av_adr + tab[n-1].av_size == dbf->header->next_block)
+    {
+      int block_size = dbf->header->block_size;
+      off_t end = (tab[n-1].av_adr + block_size - 1) / block_size * block_size;
+      off_t min = _gdbm_next_block_min (dbf);
+      if (end < min)
+	end = min;
+      if (end < dbf->header->next_block)
+	{
+	  dbf->header->next_block = end;
+	  dbf->header_changed = TRUE;
+	  if (end > tab[n-1].av_adr)
+	    tab[n-1].av_size = end - tab[n-1].av_adr;
+	  else
+	    n--;
+	}
+    }
+
+  for (i = 0; i < n; i++)
+    if (tab[i].av_size > IGNORE_SIZE && fsm_push (dbf, tab[i]))
+      return -1;
+  return 0;
+}
+
+/* Merge the adjacent free extents of DBF and give back the free space
+   at the end of the file. */
+int
+_gdbm_fsm_merge (GDBM_FILE dbf)
+{
+  avail_elem *tab;
+  size_t count;
+  int rc;
+
+  if (dbf->fsm->saved && fsm_release (dbf))
+    return -1;
+  if (_gdbm_fsm_table (dbf, &tab, &count, TRUE))
+    return -1;
+  rc = fsm_rebuild (dbf, tab, count);
+  free (tab);
+  return rc;
+}
+
+/* Save the free lists of DBF in the file, and write the header pointing
+   to them.  Must not be called within a transaction. */
+int
+_gdbm_fsm_save (GDBM_FILE dbf)
+{
+  struct gdbm_fsm *fsm = dbf->fsm;
+  avail_block *blk;
+  avail_elem *tab;
+  size_t count, cap;
+  off_t adr;
+  int size;
+  int rc;
+
+  if (!fsm || fsm->saved || fsm->transient)
+    return 0;
+
+  if (_gdbm_fsm_merge (dbf))
+    return -1;
+
+  /* Allocating the map can split one more extent. */
+  cap = fsm->count + 1;
+  if (cap > (INT_MAX - sizeof (avail_block)) / sizeof (avail_elem))
+    return 0;
+  size = sizeof (avail_block) + (cap - 1) * sizeof (avail_elem);
+  adr = _gdbm_alloc (dbf, size);
+  if (adr == 0)
+    return -1;
+
+  if (_gdbm_fsm_table (dbf, &tab, &count, FALSE))
+    return -1;
+  blk = calloc (1, size);
+  if (!blk)
+    {
+      free (tab);
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+      return -1;
+    }
+  blk->size = cap;
+  blk->count = count;
+  memcpy (blk->av_table, tab, count * sizeof (tab[0]));
+  free (tab);
+
+  /* The map must be in the file before the header points to it. */
+  rc = _gdbm_full_pwrite (dbf, blk, size, adr);
+  free (blk);
+  if (rc == 0 && !dbf->fast_write)
+    rc = gdbm_file_sync (dbf);
+  if (rc == 0)
+    {
+      dbf->xheader->fsm_adr = adr;
+      dbf->xheader->fsm_size = size;
+      rc = _gdbm_full_pwrite (dbf, dbf->header, dbf->header->block_size, 0);
+    }
+  if (rc)
+    {
+      _gdbm_fatal (dbf, gdbm_db_strerror (dbf));
+      return -1;
+    }
+  dbf->header_changed = FALSE;
+  fsm->saved = TRUE;
+  return 0;
+}
+
+/* Start recording the changes to the free lists, so that they can be
+   undone if the transaction is aborted. */
+int
+_gdbm_fsm_txn_begin (GDBM_FILE dbf)
+{
+  struct gdbm_fsm *fsm = dbf->fsm;
+  int c;
+
+  if (!fsm)
+    return 0;
+  /* The file must not refer to the map while the transaction can
+     reuse its space. */
+  if (fsm->saved && fsm_release (dbf))
+    return -1;
+  for (c = 0; c < FSM_CLASSES; c++)
+    fsm->list[c].base = fsm->list[c].count;
+  fsm->undo_count = 0;
+  fsm->txn = TRUE;
+  return 0;
+}
+
+/* End the current transaction.  If ABORT is true, restore the free
+   lists to their state at its start. */
+void
+_gdbm_fsm_txn_end (GDBM_FILE dbf, int abort)
+{
+  struct gdbm_fsm *fsm = dbf->fsm;
+
+  if (!fsm || !fsm->txn)
+    return;
+  if (abort)
+    {
+      size_t i = fsm->undo_count;
+      int c;
+
+      while (i-- > 0)
+	{
+	  struct fsm_undo *u = &fsm->undo[i];
+	  fsm->list[u->cls].tab[u->idx] = u->elem;
+	}
+      fsm->count = 0;
+      for (c = 0; c < FSM_CLASSES; c++)
+	{
+	  fsm->list[c].count = fsm->list[c].base;
+	  fsm->count += fsm->list[c].count;
+	  fsm_mark (fsm, c, fsm->list[c].count > 0);
+	}
+    }
+  fsm->undo_count = 0;
+  fsm->txn = FALSE;
+}
@@ -17,17 +17,17 @@
 #include "autoconf.h"
 #include "gdbmdefs.h"
 
-/* Read exactly SIZE bytes of data into BUFFER.  Return value is 0 on
-   success, and -1 on error.  In the latter case, gdbm_errno is set to
-   GDBM_FILE_EOF, if not enough data is available, and to
-   GDBM_FILE_READ_ERROR, if a read error occurs. */
+/* Read exactly SIZE bytes of data at offset OFF into BUFFER.  Return
+   value is 0 on success, and -1 on error.  In the latter case,
+   gdbm_errno is set to GDBM_FILE_EOF, if not enough data is available,
+   and to GDBM_FILE_READ_ERROR, if a read error occurs. */
 int
-_gdbm_full_read (GDBM_FILE dbf, void *buffer, size_t size)
+_gdbm_full_pread (GDBM_FILE dbf, void *buffer, size_t size, off_t off)
 {
   char *ptr = buffer;
   while (size)
     {
-      ssize_t rdbytes = gdbm_file_read (dbf, ptr, size);
+      ssize_t rdbytes = gdbm_file_pread (dbf, ptr, size, off);
       if (rdbytes == -1)
 	{
 	  if (errno == EINTR)
@@ -43,19 +43,21 @@ _gdbm_full_read (GDBM_FILE dbf, void *buffer, size_t size)
 	}
       ptr += rdbytes;
       size -= rdbytes;
+      off += rdbytes;
     }
   return 0;
 }
 
-/* Write exactly SIZE bytes of data from BUFFER tp DBF.  Return 0 on
-   success, and -1 (setting gdbm_errno to GDBM_FILE_READ_ERROR) on error. */
+/* Write exactly SIZE bytes of data from BUFFER to DBF at offset OFF.
+   Return 0 on success, and -1 (setting gdbm_errno to
+   GDBM_FILE_WRITE_ERROR) on error. */
 int
-_gdbm_full_write (GDBM_FILE dbf, void *buffer, size_t size)
+_gdbm_full_pwrite (GDBM_FILE dbf, void *buffer, size_t size, off_t off)
 {
   char *ptr = buffer;
   while (size)
     {
-      ssize_t wrbytes = gdbm_file_write (dbf, ptr, size);
+      ssize_t wrbytes = gdbm_file_pwrite (dbf, ptr, size, off);
       if (wrbytes == -1)
 	{
 	  if (errno == EINTR)
@@ -72,6 +74,99 @@ _gdbm_full_write (GDBM_FILE dbf, void *buffer, size_t size)
 	}
       ptr += wrbytes;
       size -= wrbytes;
+      off += wrbytes;
+    }
+  return 0;
+}
+
+/* Write the IOVCNT buffers described by IOV one after another to DBF,
+   starting at offset OFF.  The IOV array is modified.  Return 0 on
+   success, and -1 (setting gdbm_errno to GDBM_FILE_WRITE_ERROR) on
+   error. */
+int
+_gdbm_full_pwritev (GDBM_FILE dbf, struct iovec *iov, int iovcnt, off_t off)
+{
+#if HAVE_PWRITEV
+  if (!dbf->memory_mapping)
+    {
+      while (iovcnt)
+	{
+	  ssize_t wrbytes = pwritev (dbf->desc, iov, iovcnt, off);
+	  if (wrbytes == -1)
+	    {
+	      if (errno == EINTR)
+		continue;
+	      GDBM_SET_ERRNO (dbf, GDBM_FILE_WRITE_ERROR, TRUE);
+	      return -1;
+	    }
+	  if (wrbytes == 0)
+	    {
+	      errno = ENOSPC;
+	      GDBM_SET_ERRNO (dbf, GDBM_FILE_WRITE_ERROR, TRUE);
+	      return -1;
+	    }
+	  off += wrbytes;
+	  /* Skip the data written so far. */
+	  while (iovcnt && (size_t) wrbytes >= iov->iov_len)
+	    {
+	      wrbytes -= iov->iov_len;
+	      iov++;
+	      iovcnt--;
+	    }
+	  if (iovcnt)
+	    {
+	      iov->iov_base = (char*) iov->iov_base + wrbytes;
+	      iov->iov_len -= wrbytes;
+	    }
+	}
+      return 0;
+    }
+#endif
+  /* When the file is mapped, this involves no system calls anyway. */
+  for (; iovcnt; iov++, iovcnt--)
+    {
+      if (_gdbm_full_pwrite (dbf, iov->iov_base, iov->iov_len, off))
+	return -1;
+      off += iov->iov_len;
+    }
+  return 0;
+}
+
+/* Serve the N requests in REQ.  If an io_uring instance is set up, they
+   are all submitted at once, otherwise they are served one by one.
+   Return 0 if all requests succeeded, and -1 (setting gdbm_errno as
+   _gdbm_full_pread or _gdbm_full_pwrite would) otherwise.  The iov
+   arrays of the requests are modified. */
+int
+_gdbm_io_run (GDBM_FILE dbf, struct gdbm_io_req *req, size_t n)
+{
+  size_t i;
+  int j;
+
+#if HAVE_LINUX_IO_URING_H
+  /* The mapped region is accessed directly. */
+  if (dbf->uring && !dbf->memory_mapping && n > 1)
+    return _gdbm_uring_run (dbf, req, n);
+#endif
+  for (i = 0; i < n; i++)
+    {
+      if (req[i].write)
+	{
+	  if (_gdbm_full_pwritev (dbf, req[i].iov, req[i].iovcnt, req[i].off))
+	    return -1;
+	}
+      else
+	{
+	  off_t off = req[i].off;
+
+	  for (j = 0; j < req[i].iovcnt; j++)
+	    {
+	      if (_gdbm_full_pread (dbf, req[i].iov[j].iov_base,
+				    req[i].iov[j].iov_len, off))
+		return -1;
+	      off += req[i].iov[j].iov_len;
+	    }
+	}
     }
   return 0;
 }
@@ -91,6 +186,29 @@ _gdbm_file_extend (GDBM_FILE dbf, off_t size)
       GDBM_SET_ERRNO (dbf, GDBM_FILE_SEEK_ERROR, FALSE);
       return -1;
     }
+  dbf->file_size = file_end;
+  if (size <= file_end)
+    return 0;
+
+#if HAVE_POSIX_FALLOCATE
+  /* Allocate the space at once, without writing it.  Fall back to
+     writing zeros if the file system does not support this. */
+  {
+    int rc = posix_fallocate (dbf->desc, file_end, size - file_end);
+    if (rc == 0)
+      {
+	dbf->file_size = size;
+	return 0;
+      }
+    if (rc != EINVAL && rc != EOPNOTSUPP)
+      {
+	errno = rc;
+	GDBM_SET_ERRNO (dbf, GDBM_FILE_WRITE_ERROR, TRUE);
+	return -1;
+      }
+  }
+#endif
+
   size -= file_end;
   if (size > 0)
     {
@@ -105,19 +223,110 @@ _gdbm_file_extend (GDBM_FILE dbf, off_t size)
 
       while (size)
 	{
-	  ssize_t n = write (dbf->desc, buf,
-			     size < page_size ? size : page_size);
+	  ssize_t n = pwrite (dbf->desc, buf,
+			      size < page_size ? size : page_size, file_end);
 	  if (n <= 0)
 	    {
 	      GDBM_SET_ERRNO (dbf, GDBM_FILE_WRITE_ERROR, TRUE);
 	      break;
 	    }
 	  size -= n;
+	  file_end += n;
 	}
       free (buf);
       if (size)
 	return -1;
+      dbf->file_size = file_end;
     }
   return 0;
 }
+
+/* Make sure the disk file of DBF is at least SIZE bytes long.  If it
+   has to grow, grow it by at least dbf->grow_chunk bytes or
+   dbf->grow_percent percent of its size, so that a growing database is
+   extended (and remapped, see _gdbm_mapped_remap) in large steps, and
+   its space is allocated on disk in large extents.  The space past
+   dbf->header->next_block is free, and is trimmed by gdbm_close. */
+int
+_gdbm_file_grow (GDBM_FILE dbf, off_t size)
+{
+  off_t file_end, step;
+  int block_size = dbf->header->block_size;
+
+  if (size <= dbf->file_size)
+    return 0;
+  file_end = lseek (dbf->desc, 0, SEEK_END);
+  if (file_end == -1)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_FILE_SEEK_ERROR, TRUE);
+      return -1;
+    }
+  dbf->file_size = file_end;
+  if (size <= file_end)
+    return 0;
+
+  step = file_end / 100 * dbf->grow_percent;
+  if (step < dbf->grow_chunk)
+    step = dbf->grow_chunk;
+  if (size - file_end < step && off_t_sum_ok (file_end, step))
+    size = file_end + step;
+  size = (size + block_size - 1) / block_size * block_size;
+  return _gdbm_file_extend (dbf, size);
+}
   
+
+/* Deallocate the disk space of the pages of DBF that lie entirely
+   within the SIZE bytes at ADR, keeping the size of the file.  Reading
+   them returns zeros afterwards.  Return 1 if the file system does not
+   support this. */
+int
+_gdbm_file_punch (GDBM_FILE dbf, off_t adr, off_t size)
+{
+#if HAVE_FALLOCATE && defined (FALLOC_FL_PUNCH_HOLE)
+  off_t page_size = sysconf (_SC_PAGESIZE);
+  off_t start = (adr + page_size - 1) / page_size * page_size;
+  off_t end = (adr + size) / page_size * page_size;
+
+  if (end <= start)
+    return 0;
+  if (fallocate (dbf->desc, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		 start, end - start) == 0)
+    return 0;
+  if (errno == EOPNOTSUPP || errno == ENOSYS)
+    return 1;
+  GDBM_SET_ERRNO (dbf, GDBM_FILE_WRITE_ERROR, TRUE);
+  return -1;
+#else
+  return 1;
+#endif
+}
+
+/* Shrink the disk file of DBF to SIZE bytes in length, if it is
+   longer than that. */
+int
+_gdbm_file_truncate (GDBM_FILE dbf, off_t size)
+{
+  struct stat st;
+
+  if (fstat (dbf->desc, &st))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_FILE_STAT_ERROR, FALSE);
+      return -1;
+    }
+  if (st.st_size <= size)
+    return 0;
+#if HAVE_MMAP
+  _gdbm_mapped_unmap (dbf);
+#endif
+  dbf->file_size = 0;
+  if (ftruncate (dbf->desc, size))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_FILE_TRUNCATE_ERROR, TRUE);
+      return -1;
+    }
+#if HAVE_MMAP
+  if (dbf->memory_mapping)
+    _gdbm_mapped_init (dbf);
+#endif
+  return 0;
+}
@@ -39,6 +39,8 @@ struct gdbm_option optab[] = {
   { 'M', "mmap", NULL, N_("use memory mapping") },
   { 'c', "cache-size", N_("NUM"), N_("set the cache size") },
   { 'b', "block-size", N_("NUM"), N_("set the block size") },
+  { 'H', "hash", N_("NAME"), N_("set the hash function (fast or legacy)") },
+  { 'f', "fingerprint", NULL, N_("keep fingerprints of the keys in buckets") },
   { 0 }
 };
 
@@ -122,6 +124,22 @@ main (int argc, char **argv)
 	cache_size = get_int (optarg);
 	break;
 
+      case 'f':
+	oflags |= GDBM_FINGERPRINT;
+	break;
+
+      case 'H':
+	if (strcmp (optarg, "fast") == 0)
+	  oflags |= GDBM_FASTHASH;
+	else if (strcmp (optarg, "legacy") == 0)
+	  oflags &= ~GDBM_FASTHASH;
+	else
+	  {
+	    error (_("unknown hash function: %s"), optarg);
+	    exit (EXIT_USAGE);
+	  }
+	break;
+
       case 'm':
 	{
 	  errno = 0;
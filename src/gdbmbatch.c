@@ -0,0 +1,147 @@
+/* gdbmbatch.c - Batched updates. */
+
+/* This file is part of GDBM, the GNU data base manager.
+   Copyright (C) 2018 Free Software Foundation, Inc.
+
+   GDBM is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   GDBM is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GDBM. If not, see <http://www.gnu.org/licenses/>.   */
+
+/* Include system configuration before all else. */
+#include "autoconf.h"
+
+#include "gdbmdefs.h"
+
+/* Normally, each gdbm_store and gdbm_delete call writes the changed
+   bucket, and possibly the directory and the header, to disk before
+   returning.  Within a batch, the changes are kept in the bucket cache
+   instead, and written when the batch ends.  Buckets dropped from the
+   cache during the batch are written when they are dropped.
+
+   Batches can be nested.  The changes are written when the outermost
+   batch ends. */
+
+/* Start an update batch. */
+int
+gdbm_batch_begin (GDBM_FILE dbf)
+{
+  /* Return immediately if the database needs recovery */	
+  GDBM_ASSERT_CONSISTENCY (dbf, -1);
+
+  if (dbf->read_write == GDBM_READER)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_READER_CANT_STORE, FALSE);
+      return -1;
+    }
+  gdbm_set_errno (dbf, GDBM_NO_ERROR, FALSE);
+  dbf->batch_level++;
+  return 0;
+}
+
+/* End an update batch.  If it is the outermost one, write all the
+   changes to disk. */
+int
+gdbm_batch_end (GDBM_FILE dbf)
+{
+  /* Return immediately if the database needs recovery */	
+  GDBM_ASSERT_CONSISTENCY (dbf, -1);
+
+  gdbm_set_errno (dbf, GDBM_NO_ERROR, FALSE);
+  if (dbf->batch_level == 0)
+    return 0;
+  if (--dbf->batch_level)
+    return 0;
+  return _gdbm_flush_batch (dbf);
+}
+
+struct store_req
+{
+  size_t index;    /* Index of the pair in the input arrays. */
+  int hash_val;    /* Hash value of the key. */
+};
+
+static int
+store_req_cmp (const void *a, const void *b)
+{
+  struct store_req const *ra = a;
+  struct store_req const *rb = b;
+
+  if (ra->hash_val < rb->hash_val)
+    return -1;
+  if (ra->hash_val > rb->hash_val)
+    return 1;
+  if (ra->index < rb->index)
+    return -1;
+  return ra->index > rb->index;
+}
+
+/* Store N key/content pairs from the arrays KEYS and CONTENTS in a
+   single batch.  FLAGS is as for gdbm_store.  The pairs are stored in
+   the order of their hash values, so that the pairs falling into the
+   same bucket are stored one after another.  Pairs with equal keys are
+   stored in the order they appear in the arrays.
+
+   Return the number of pairs stored.  Pairs not stored because their
+   key already exists and FLAGS is GDBM_INSERT are not counted.  On
+   error, return -1.  The pairs stored before the error remain in the
+   database. */
+int
+gdbm_store_many (GDBM_FILE dbf, datum const *keys, datum const *contents,
+		 size_t n, int flags)
+{
+  struct store_req *req;
+  size_t i;
+  int stored = 0;
+  int rc;
+
+  if (gdbm_batch_begin (dbf))
+    return -1;
+
+  req = calloc (n ? n : 1, sizeof (req[0]));
+  if (!req)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+      gdbm_batch_end (dbf);
+      return -1;
+    }
+  for (i = 0; i < n; i++)
+    {
+      req[i].index = i;
+      req[i].hash_val = keys[i].dptr ? dbf->hash (keys[i]) : 0;
+    }
+  qsort (req, n, sizeof (req[0]), store_req_cmp);
+
+  for (i = 0; i < n; i++)
+    {
+      rc = gdbm_store (dbf, keys[req[i].index], contents[req[i].index],
+		       flags);
+      if (rc == 0)
+	stored++;
+      else if (rc == -1)
+	{
+	  stored = -1;
+	  break;
+	}
+    }
+  free (req);
+
+  if (stored == -1)
+    {
+      /* Write the pairs stored so far, keeping the error state. */
+      if (--dbf->batch_level == 0 && !dbf->need_recovery)
+	_gdbm_flush_batch (dbf);
+      return -1;
+    }
+  if (gdbm_batch_end (dbf))
+    return -1;
+  return stored;
+}
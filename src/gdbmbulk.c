@@ -0,0 +1,1316 @@
+/* gdbmbulk.c - Build a database from a stream of records. */
+
+/* This file is part of GDBM, the GNU data base manager.
+   Copyright (C) 2018 Free Software Foundation, Inc.
+
+   GDBM is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   GDBM is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GDBM. If not, see <http://www.gnu.org/licenses/>.   */
+
+/* Include system configuration before all else. */
+#include "autoconf.h"
+
+#include "gdbmdefs.h"
+
+/* Storing records one by one makes buckets split over and over, and
+   the directory double several times, while the database grows.  When
+   the database is empty, gdbm_bulk_load builds it directly instead:
+
+   1. The records are read into memory.  Each time the memory budget
+      (GDBM_SETBULKBUFSIZE) is exhausted, they are sorted by the hash
+      value of their keys and written to a temporary file as a "run".
+
+   2. The runs are merged, so that the records come in the order of
+      their hash values.  As the bucket of a key is selected by the top
+      bits of its hash value, the records belonging to the same bucket
+      come one after another.
+
+   3. Each record is written to the database file, and each bucket is
+      written after its records, as soon as it is complete.  The
+      number of hash bits of the buckets is chosen from the total
+      number of records, so that they are about three-fourths full.
+      A bucket that would overflow is divided into smaller ones.
+
+   4. Finally the directory is written and the header is updated.
+
+   Until the header is written, the file contains the original empty
+   database, with unused space at its end. */
+
+#define TMPNAME "gdbmXXXXXX"
+#ifndef P_tmpdir
+# define P_tmpdir "/tmp"
+#endif
+
+/* Size of the output buffer. */
+#define BULK_OUT_SIZE (1024 * 1024)
+
+/* Initial size of the read buffer of a run. */
+#define BULK_RUN_READ_SIZE (64 * 1024)
+
+/* Header of a record in the temporary file.  It is followed by the key
+   and the content. */
+struct bulk_rec
+{
+  gdbm_count_t seq;      /* Number of the record in the input. */
+  int hash;              /* Hash value of the key. */
+  int key_size;          /* Size of the key. */
+  int data_size;         /* Size of the content. */
+};
+
+/* A record kept in memory: its header, and the offset of its key
+   (followed by the content) in a buffer. */
+struct bulk_entry
+{
+  struct bulk_rec rec;
+  size_t off;
+};
+
+/* A sorted run of records being merged.  Runs written to the temporary
+   file are read through a buffer.  The last run stays in memory. */
+struct bulk_run
+{
+  /* Run in the temporary file. */
+  off_t off;             /* Offset of the data not read yet. */
+  off_t end;             /* End of the run. */
+  char *buf;             /* Read buffer (NULL for the in-memory run). */
+  size_t bufsize;        /* Size of the buffer. */
+  size_t start;          /* Offset of the current record in buf. */
+  size_t level;          /* Amount of data in buf. */
+
+  /* In-memory run. */
+  struct bulk_entry *ent;
+  size_t pos;
+  size_t count;
+
+  /* The current record and its key (followed by the content). */
+  struct bulk_rec rec;
+  char *dptr;
+};
+
+/* A bucket written to the database file. */
+struct bulk_bucket
+{
+  off_t adr;             /* Its address. */
+  int bits;              /* Its number of hash bits. */
+};
+
+struct bulk_load
+{
+  GDBM_FILE dbf;
+  int flag;              /* GDBM_INSERT or GDBM_REPLACE. */
+  gdbm_count_t count;    /* Number of records read. */
+  gdbm_count_t dups;     /* Number of duplicate keys. */
+
+  /* Records read since the last run was written. */
+  char *buf;
+  size_t buf_size;
+  size_t buf_level;
+  struct bulk_entry *ent;
+  size_t ent_count;
+  size_t ent_max;
+
+  /* The temporary file (-1 if not created) and the runs in it. */
+  int fd;
+  off_t fd_size;
+  struct bulk_run *runs;
+  size_t run_count;
+  size_t run_max;
+
+  /* Priority queue of the runs being merged, by their current record. */
+  struct bulk_run **heap;
+  size_t heap_count;
+
+  /* Output buffer: its contents go to offset out_off of the temporary
+     file while writing runs, and of the database file afterwards. */
+  char *out;
+  size_t out_level;
+  off_t out_off;
+  int out_started;       /* Writing to the database file has begun. */
+  off_t old_next_block;  /* End of the database before. */
+
+  /* Records with the same hash value, checked for duplicate keys. */
+  char *group_buf;
+  size_t group_buf_size;
+  size_t group_buf_level;
+  struct bulk_entry *group;
+  size_t group_count;
+  size_t group_max;
+
+  /* Elements written to the file, waiting to be put in buckets. */
+  bucket_element *queue;
+  size_t queue_head;
+  size_t queue_tail;
+  size_t queue_max;
+
+  unsigned long pos;     /* First hash value of the next bucket. */
+  int base_bits;         /* Minimal number of hash bits of a bucket. */
+  int max_bits;          /* Maximal number of hash bits of a bucket. */
+  hash_bucket *bucket;   /* Bucket being built. */
+
+  /* The buckets written so far. */
+  struct bulk_bucket *buckets;
+  size_t bucket_count;
+  size_t bucket_max;
+};
+
+#define HASH_SPACE (1UL << GDBM_HASH_BITS)
+
+static int
+bulk_rec_cmp (struct bulk_rec const *a, struct bulk_rec const *b)
+{
+  if (a->hash < b->hash)
+    return -1;
+  if (a->hash > b->hash)
+    return 1;
+  if (a->seq < b->seq)
+    return -1;
+  return a->seq > b->seq;
+}
+
+static int
+bulk_entry_cmp (const void *a, const void *b)
+{
+  return bulk_rec_cmp (&((struct bulk_entry const *)a)->rec,
+		       &((struct bulk_entry const *)b)->rec);
+}
+
+static void
+bulk_free (struct bulk_load *bl)
+{
+  size_t i;
+
+  free (bl->buf);
+  free (bl->ent);
+  if (bl->fd != -1)
+    close (bl->fd);
+  for (i = 0; i < bl->run_count; i++)
+    free (bl->runs[i].buf);
+  free (bl->runs);
+  free (bl->heap);
+  free (bl->out);
+  free (bl->group_buf);
+  free (bl->group);
+  free (bl->queue);
+  free (bl->bucket);
+  free (bl->buckets);
+}
+
+/* Make sure the array *PTR of *PMAX elements of SIZE bytes has room
+   for N more elements after the first COUNT ones. */
+static int
+bulk_grow (GDBM_FILE dbf, void *ptr, size_t *pmax, size_t count, size_t n,
+	   size_t size)
+{
+  void **pp = ptr;
+  void *p;
+  size_t max = *pmax;
+
+  if (count + n <= max)
+    return 0;
+  if (max == 0)
+    max = 64;
+  while (count + n > max)
+    {
+      if (max > SIZE_T_MAX / 2 / size)
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+	  return -1;
+	}
+      max *= 2;
+    }
+  p = realloc (*pp, max * size);
+  if (!p)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+      return -1;
+    }
+  *pp = p;
+  *pmax = max;
+  return 0;
+}
+
+/* Write SIZE bytes from BUF at offset OFF of the temporary file. */
+static int
+tmp_pwrite (struct bulk_load *bl, char const *buf, size_t size, off_t off)
+{
+  while (size)
+    {
+      ssize_t n = pwrite (bl->fd, buf, size, off);
+      if (n == -1)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  GDBM_SET_ERRNO (bl->dbf, GDBM_FILE_WRITE_ERROR, FALSE);
+	  return -1;
+	}
+      if (n == 0)
+	{
+	  errno = ENOSPC;
+	  GDBM_SET_ERRNO (bl->dbf, GDBM_FILE_WRITE_ERROR, FALSE);
+	  return -1;
+	}
+      buf += n;
+      size -= n;
+      off += n;
+    }
+  return 0;
+}
+
+/* Write out the output buffer. */
+static int
+out_flush (struct bulk_load *bl)
+{
+  int rc;
+
+  if (bl->out_level == 0)
+    return 0;
+  if (bl->out_started)
+    rc = _gdbm_full_pwrite (bl->dbf, bl->out, bl->out_level, bl->out_off);
+  else
+    rc = tmp_pwrite (bl, bl->out, bl->out_level, bl->out_off);
+  if (rc)
+    return -1;
+  bl->out_off += bl->out_level;
+  bl->out_level = 0;
+  return 0;
+}
+
+/* Append SIZE bytes from DATA to the output.  Store the file offset
+   where they go in *ADR, unless it is NULL. */
+static int
+out_write (struct bulk_load *bl, void const *data, size_t size, off_t *adr)
+{
+  if (adr)
+    *adr = bl->out_off + bl->out_level;
+  if (bl->out_level + size > BULK_OUT_SIZE)
+    {
+      if (out_flush (bl))
+	return -1;
+      if (size > BULK_OUT_SIZE)
+	{
+	  int rc;
+
+	  if (bl->out_started)
+	    rc = _gdbm_full_pwrite (bl->dbf, (void *) data, size,
+				    bl->out_off);
+	  else
+	    rc = tmp_pwrite (bl, data, size, bl->out_off);
+	  if (rc)
+	    return -1;
+	  bl->out_off += size;
+	  return 0;
+	}
+    }
+  memcpy (bl->out + bl->out_level, data, size);
+  bl->out_level += size;
+  return 0;
+}
+
+/* Create the temporary file in the directory named by the TMPDIR
+   environment variable, or in the default temporary directory.  The
+   database may be opened by descriptor (gdbm_fd_open), so that its
+   name is not that of a file, or sit in a read-only directory. */
+static int
+tmp_create (struct bulk_load *bl)
+{
+  GDBM_FILE dbf = bl->dbf;
+  char const *dir;
+  char *name;
+
+  dir = getenv ("TMPDIR");
+  if (!dir || !*dir)
+    dir = P_tmpdir;
+  name = malloc (strlen (dir) + 1 + sizeof (TMPNAME));
+  if (!name)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+      return -1;
+    }
+  strcat (strcat (strcpy (name, dir), "/"), TMPNAME);
+  bl->fd = mkstemp (name);
+  if (bl->fd == -1)
+    {
+      SAVE_ERRNO (free (name));
+      GDBM_SET_ERRNO (dbf, GDBM_FILE_OPEN_ERROR, FALSE);
+      return -1;
+    }
+  unlink (name);
+  free (name);
+  if (dbf->cloexec)
+    fcntl (bl->fd, F_SETFD, fcntl (bl->fd, F_GETFD) | FD_CLOEXEC);
+  bl->fd_size = 0;
+  return 0;
+}
+
+/* Sort the records in memory and write them to the temporary file as
+   a new run. */
+static int
+bulk_spill (struct bulk_load *bl)
+{
+  struct bulk_run *run;
+  size_t i;
+
+  if (bl->fd == -1 && tmp_create (bl))
+    return -1;
+  if (bulk_grow (bl->dbf, &bl->runs, &bl->run_max, bl->run_count, 1,
+		 sizeof (bl->runs[0])))
+    return -1;
+
+  qsort (bl->ent, bl->ent_count, sizeof (bl->ent[0]), bulk_entry_cmp);
+  bl->out_off = bl->fd_size;
+  for (i = 0; i < bl->ent_count; i++)
+    {
+      struct bulk_entry *ent = &bl->ent[i];
+
+      if (out_write (bl, &ent->rec, sizeof (ent->rec), NULL)
+	  || out_write (bl, bl->buf + ent->off,
+			ent->rec.key_size + ent->rec.data_size, NULL))
+	return -1;
+    }
+  if (out_flush (bl))
+    return -1;
+
+  run = &bl->runs[bl->run_count++];
+  memset (run, 0, sizeof (*run));
+  run->off = bl->fd_size;
+  run->end = bl->out_off;
+  bl->fd_size = bl->out_off;
+
+  bl->buf_level = 0;
+  bl->ent_count = 0;
+  return 0;
+}
+
+/* Add a record to memory, writing a run first if the memory budget is
+   exhausted. */
+static int
+bulk_add (struct bulk_load *bl, datum key, datum content)
+{
+  GDBM_FILE dbf = bl->dbf;
+  struct bulk_entry *ent;
+  size_t size;
+
+  if (key.dptr == NULL || content.dptr == NULL
+      || key.dsize < 0 || content.dsize < 0)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_ILLEGAL_DATA, FALSE);
+      return -1;
+    }
+  size = (size_t) key.dsize + content.dsize;
+
+  if (bl->ent_count
+      && bl->buf_level + size
+         + (bl->ent_count + 1) * sizeof (bl->ent[0]) > dbf->bulk_buf_size
+      && bulk_spill (bl))
+    return -1;
+
+  if (bl->buf_level + size > bl->buf_size)
+    {
+      size_t n = bl->buf_size ? bl->buf_size : BULK_RUN_READ_SIZE;
+      char *p;
+
+      while (bl->buf_level + size > n)
+	n *= 2;
+      p = realloc (bl->buf, n);
+      if (!p)
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+	  return -1;
+	}
+      bl->buf = p;
+      bl->buf_size = n;
+    }
+  if (bulk_grow (dbf, &bl->ent, &bl->ent_max, bl->ent_count, 1,
+		 sizeof (bl->ent[0])))
+    return -1;
+
+  ent = &bl->ent[bl->ent_count++];
+  ent->rec.seq = bl->count++;
+  ent->rec.hash = dbf->hash (key);
+  ent->rec.key_size = key.dsize;
+  ent->rec.data_size = content.dsize;
+  ent->off = bl->buf_level;
+  memcpy (bl->buf + bl->buf_level, key.dptr, key.dsize);
+  memcpy (bl->buf + bl->buf_level + key.dsize, content.dptr, content.dsize);
+  bl->buf_level += size;
+  return 0;
+}
+
+/* Make sure that at least NEED bytes from the current record of RUN
+   are in its buffer.  Return 1 if so, 0 if the run is exhausted, and
+   -1 on error. */
+static int
+run_fill (struct bulk_load *bl, struct bulk_run *run, size_t need)
+{
+  if (run->level - run->start >= need)
+    return 1;
+
+  memmove (run->buf, run->buf + run->start, run->level - run->start);
+  run->level -= run->start;
+  run->start = 0;
+  if (need > run->bufsize)
+    {
+      char *p = realloc (run->buf, need);
+      if (!p)
+	{
+	  GDBM_SET_ERRNO (bl->dbf, GDBM_MALLOC_ERROR, FALSE);
+	  return -1;
+	}
+      run->buf = p;
+      run->bufsize = need;
+    }
+
+  while (run->level < need)
+    {
+      size_t size = run->bufsize - run->level;
+      ssize_t n;
+
+      if (run->end - run->off < size)
+	size = run->end - run->off;
+      if (size == 0)
+	break;
+      n = pread (bl->fd, run->buf + run->level, size, run->off);
+      if (n == -1)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  GDBM_SET_ERRNO (bl->dbf, GDBM_FILE_READ_ERROR, FALSE);
+	  return -1;
+	}
+      if (n == 0)
+	break;
+      run->level += n;
+      run->off += n;
+    }
+
+  if (run->level == 0)
+    return 0;
+  if (run->level < need)
+    {
+      GDBM_SET_ERRNO (bl->dbf, GDBM_FILE_EOF, FALSE);
+      return -1;
+    }
+  return 1;
+}
+
+/* Advance RUN to its next record.  Return 1 on success, 0 if the run is
+   exhausted, and -1 on error. */
+static int
+run_next (struct bulk_load *bl, struct bulk_run *run)
+{
+  int rc;
+
+  if (!run->buf)
+    {
+      struct bulk_entry *ent;
+
+      if (run->pos == run->count)
+	return 0;
+      ent = &run->ent[run->pos++];
+      run->rec = ent->rec;
+      run->dptr = bl->buf + ent->off;
+      return 1;
+    }
+
+  if (run->dptr)
+    run->start += sizeof (run->rec) + run->rec.key_size
+                  + run->rec.data_size;
+  run->dptr = NULL;
+  rc = run_fill (bl, run, sizeof (run->rec));
+  if (rc != 1)
+    return rc;
+  memcpy (&run->rec, run->buf + run->start, sizeof (run->rec));
+  rc = run_fill (bl, run, sizeof (run->rec) + run->rec.key_size
+		          + run->rec.data_size);
+  if (rc == 0)
+    {
+      GDBM_SET_ERRNO (bl->dbf, GDBM_FILE_EOF, FALSE);
+      rc = -1;
+    }
+  if (rc != 1)
+    return rc;
+  run->dptr = run->buf + run->start + sizeof (run->rec);
+  return 1;
+}
+
+/* Restore the heap order, starting from element I. */
+static void
+heap_down (struct bulk_load *bl, size_t i)
+{
+  struct bulk_run **heap = bl->heap;
+
+  for (;;)
+    {
+      size_t min = i;
+      size_t l = 2 * i + 1;
+      struct bulk_run *t;
+
+      if (l < bl->heap_count
+	  && bulk_rec_cmp (&heap[l]->rec, &heap[min]->rec) < 0)
+	min = l;
+      if (l + 1 < bl->heap_count
+	  && bulk_rec_cmp (&heap[l + 1]->rec, &heap[min]->rec) < 0)
+	min = l + 1;
+      if (min == i)
+	break;
+      t = heap[i];
+      heap[i] = heap[min];
+      heap[min] = t;
+      i = min;
+    }
+}
+
+/* Write out the bucket being built, which has BITS hash bits. */
+static int
+bucket_append (struct bulk_load *bl, int bits)
+{
+  struct bulk_bucket *b;
+
+  if (bulk_grow (bl->dbf, &bl->buckets, &bl->bucket_max, bl->bucket_count,
+		 1, sizeof (bl->buckets[0])))
+    return -1;
+  b = &bl->buckets[bl->bucket_count++];
+  b->bits = bits;
+  return out_write (bl, bl->bucket, bl->dbf->header->bucket_size, &b->adr);
+}
+
+/* Write a bucket with the first N elements from the queue, covering
+   the hash values from bl->pos on, using BITS bits. */
+static int
+bucket_write (struct bulk_load *bl, size_t n, int bits)
+{
+  GDBM_FILE dbf = bl->dbf;
+  hash_bucket *bucket = bl->bucket;
+  size_t i;
+
+  memset (bucket, 0, dbf->header->bucket_size);
+  _gdbm_new_bucket (dbf, bucket, bits);
+  for (i = 0; i < n; i++)
+    {
+      bucket_element *elem = &bl->queue[bl->queue_head + i];
+      int loc = GDBM_BUCKET_HOME (dbf, elem->hash_value);
+
+      while (bucket->h_table[loc].hash_value != -1)
+	loc = GDBM_BUCKET_NEXT (dbf, loc);
+      bucket->h_table[loc] = *elem;
+    }
+  bucket->count = n;
+  bl->queue_head += n;
+  return bucket_append (bl, bits);
+}
+
+/* Write the buckets whose elements are all in the queue.  If FINAL is
+   true, no more elements will come, so write all remaining buckets. */
+static int
+bucket_emit (struct bulk_load *bl, int final)
+{
+  size_t elems = bl->dbf->header->bucket_elems;
+
+  while (bl->pos < HASH_SPACE)
+    {
+      int bits = bl->base_bits;
+      size_t avail = bl->queue_tail - bl->queue_head;
+
+      /* The bucket starting at pos covers the largest range allowed by
+	 the alignment of pos. */
+      while (bl->pos & ((1UL << (GDBM_HASH_BITS - bits)) - 1))
+	bits++;
+
+      for (;;)
+	{
+	  unsigned long end = bl->pos + (1UL << (GDBM_HASH_BITS - bits));
+	  size_t n;
+
+	  for (n = 0; n < avail && n <= elems; n++)
+	    if ((unsigned long) bl->queue[bl->queue_head + n].hash_value >= end)
+	      break;
+	  if (n > elems)
+	    {
+	      /* Too many elements: divide the range. */
+	      if (bits == bl->max_bits)
+		{
+		  GDBM_SET_ERRNO (bl->dbf, GDBM_DIR_OVERFLOW, FALSE);
+		  return -1;
+		}
+	      bits++;
+	      continue;
+	    }
+	  if (n == avail && !final)
+	    /* More elements may come in this range. */
+	    goto out;
+	  if (bucket_write (bl, n, bits))
+	    return -1;
+	  bl->pos = end;
+	  break;
+	}
+    }
+
+ out:
+  if (bl->queue_head == bl->queue_tail)
+    bl->queue_head = bl->queue_tail = 0;
+  else if (bl->queue_head > bl->queue_max / 2)
+    {
+      memmove (bl->queue, bl->queue + bl->queue_head,
+	       (bl->queue_tail - bl->queue_head) * sizeof (bl->queue[0]));
+      bl->queue_tail -= bl->queue_head;
+      bl->queue_head = 0;
+    }
+  return 0;
+}
+
+/* Return true if record I of the group is to be dropped as a duplicate
+   of another one. */
+static int
+group_dup_p (struct bulk_load *bl, size_t i)
+{
+  struct bulk_entry *a = &bl->group[i];
+  size_t j, from, to;
+
+  /* With GDBM_INSERT the first of the records with equal keys is kept,
+     with GDBM_REPLACE the last one. */
+  if (bl->flag == GDBM_REPLACE)
+    {
+      from = i + 1;
+      to = bl->group_count;
+    }
+  else
+    {
+      from = 0;
+      to = i;
+    }
+  for (j = from; j < to; j++)
+    {
+      struct bulk_entry *b = &bl->group[j];
+
+      if (a->rec.key_size == b->rec.key_size
+	  && memcmp (bl->group_buf + a->off, bl->group_buf + b->off,
+		     a->rec.key_size) == 0)
+	return TRUE;
+    }
+  return FALSE;
+}
+
+/* Write the records of the group to the file, and queue them for
+   putting in buckets. */
+static int
+group_flush (struct bulk_load *bl)
+{
+  size_t i;
+
+  if (bulk_grow (bl->dbf, &bl->queue, &bl->queue_max, bl->queue_tail,
+		 bl->group_count, sizeof (bl->queue[0])))
+    return -1;
+
+  for (i = 0; i < bl->group_count; i++)
+    {
+      struct bulk_entry *ent = &bl->group[i];
+      bucket_element *elem;
+      char *dptr = bl->group_buf + ent->off;
+      datum key;
+
+      if (bl->group_count > 1 && group_dup_p (bl, i))
+	{
+	  if (bl->flag != GDBM_REPLACE)
+	    bl->dups++;
+	  continue;
+	}
+
+      elem = &bl->queue[bl->queue_tail++];
+      memset (elem, 0, sizeof (*elem));
+      elem->hash_value = ent->rec.hash;
+      key.dptr = dptr;
+      key.dsize = ent->rec.key_size;
+      _gdbm_key_check (bl->dbf, key, elem->key_start);
+      elem->key_size = ent->rec.key_size;
+      elem->data_size = ent->rec.data_size;
+      if (out_write (bl, dptr, ent->rec.key_size + ent->rec.data_size,
+		     &elem->data_pointer))
+	return -1;
+    }
+  bl->group_count = 0;
+  bl->group_buf_level = 0;
+
+  if (bl->queue_tail - bl->queue_head > bl->dbf->header->bucket_elems)
+    return bucket_emit (bl, FALSE);
+  return 0;
+}
+
+/* Add the current record of RUN to the group. */
+static int
+group_add (struct bulk_load *bl, struct bulk_run *run)
+{
+  size_t size = (size_t) run->rec.key_size + run->rec.data_size;
+  struct bulk_entry *ent;
+
+  if (bulk_grow (bl->dbf, &bl->group, &bl->group_max, bl->group_count, 1,
+		 sizeof (bl->group[0]))
+      || bulk_grow (bl->dbf, &bl->group_buf, &bl->group_buf_size,
+		    bl->group_buf_level, size, 1))
+    return -1;
+  ent = &bl->group[bl->group_count++];
+  ent->rec = run->rec;
+  ent->off = bl->group_buf_level;
+  memcpy (bl->group_buf + bl->group_buf_level, run->dptr, size);
+  bl->group_buf_level += size;
+  return 0;
+}
+
+/* Merge the runs, writing the records and the buckets to the file. */
+static int
+bulk_merge (struct bulk_load *bl)
+{
+  size_t i;
+
+  if (bl->ent_count)
+    {
+      struct bulk_run *run;
+
+      /* The records still in memory form the last run. */
+      qsort (bl->ent, bl->ent_count, sizeof (bl->ent[0]), bulk_entry_cmp);
+      if (bulk_grow (bl->dbf, &bl->runs, &bl->run_max, bl->run_count, 1,
+		     sizeof (bl->runs[0])))
+	return -1;
+      run = &bl->runs[bl->run_count++];
+      memset (run, 0, sizeof (*run));
+      run->ent = bl->ent;
+      run->count = bl->ent_count;
+    }
+
+  bl->heap = calloc (bl->run_count, sizeof (bl->heap[0]));
+  if (!bl->heap)
+    {
+      GDBM_SET_ERRNO (bl->dbf, GDBM_MALLOC_ERROR, FALSE);
+      return -1;
+    }
+  for (i = 0; i < bl->run_count; i++)
+    {
+      struct bulk_run *run = &bl->runs[i];
+      int rc;
+
+      if (!run->ent)
+	{
+	  run->buf = malloc (BULK_RUN_READ_SIZE);
+	  if (!run->buf)
+	    {
+	      GDBM_SET_ERRNO (bl->dbf, GDBM_MALLOC_ERROR, FALSE);
+	      return -1;
+	    }
+	  run->bufsize = BULK_RUN_READ_SIZE;
+	}
+      rc = run_next (bl, run);
+      if (rc == -1)
+	return -1;
+      if (rc == 1)
+	bl->heap[bl->heap_count++] = run;
+    }
+  for (i = bl->heap_count; i > 0; i--)
+    heap_down (bl, i - 1);
+
+  /* From now on, the output goes to the database file. */
+  bl->out_started = TRUE;
+  bl->out_off = bl->old_next_block;
+
+  while (bl->heap_count)
+    {
+      struct bulk_run *run = bl->heap[0];
+      int rc;
+
+      if (bl->group_count && run->rec.hash != bl->group[0].rec.hash
+	  && group_flush (bl))
+	return -1;
+      if (group_add (bl, run))
+	return -1;
+
+      rc = run_next (bl, run);
+      if (rc == -1)
+	return -1;
+      if (rc == 0)
+	bl->heap[0] = bl->heap[--bl->heap_count];
+      heap_down (bl, 0);
+    }
+  if (bl->group_count && group_flush (bl))
+    return -1;
+  return bucket_emit (bl, TRUE);
+}
+
+/* Write the directory, and replace the structure of the database with
+   the new one. */
+static int
+bulk_install (struct bulk_load *bl)
+{
+  GDBM_FILE dbf = bl->dbf;
+  int block_size = dbf->header->block_size;
+  int dir_size, dir_bits;
+  off_t *dir;
+  off_t dir_adr, end, next_block;
+  off_t old_dir_adr, old_bucket_adr;
+  int old_dir_size;
+  avail_elem old_avail[BUCKET_AVAIL];
+  int old_av_count;
+  size_t i, n;
+  int k;
+
+  /* The directory has at least the minimal size for the block size,
+     and as many bits as the deepest bucket. */
+  dir_size = 8 * sizeof (off_t);
+  dir_bits = 3;
+  while (dir_size < block_size && dir_bits < GDBM_HASH_BITS - 3)
+    {
+      dir_size <<= 1;
+      dir_bits++;
+    }
+  for (i = 0; i < bl->bucket_count; i++)
+    if (bl->buckets[i].bits > dir_bits)
+      {
+	dir_size <<= bl->buckets[i].bits - dir_bits;
+	dir_bits = bl->buckets[i].bits;
+      }
+
+  dir = malloc (dir_size);
+  if (!dir)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+      return -1;
+    }
+  for (i = n = 0; i < bl->bucket_count; i++)
+    {
+      size_t count = (size_t) 1 << (dir_bits - bl->buckets[i].bits);
+      while (count--)
+	dir[n++] = bl->buckets[i].adr;
+    }
+
+  if (out_write (bl, dir, dir_size, &dir_adr) || out_flush (bl))
+    {
+      free (dir);
+      return -1;
+    }
+
+  /* The file must extend past the directory.  The space left in the
+     last block is made available. */
+  end = bl->out_off;
+  next_block = (end / block_size + 1) * block_size;
+  if (_gdbm_file_extend (dbf, next_block))
+    {
+      free (dir);
+      return -1;
+    }
+
+  /* Wait for all the data to reach the disk before writing the new
+     header. */
+  if (!dbf->fast_write && gdbm_file_sync (dbf))
+    {
+      free (dir);
+      return -1;
+    }
+
+  /* Install the new structure.  The space used by the old one becomes
+     available. */
+  old_dir_adr = dbf->header->dir;
+  old_dir_size = dbf->header->dir_size;
+  old_bucket_adr = dbf->dir[0];
+  old_av_count = dbf->bucket->av_count;
+  memcpy (old_avail, dbf->bucket->bucket_avail, sizeof (old_avail));
+
+  free (dbf->dir);
+  dbf->dir = dir;
+  dbf->header->dir = dir_adr;
+  dbf->header->dir_size = dir_size;
+  dbf->header->dir_bits = dir_bits;
+  dbf->header->next_block = next_block;
+  dbf->header_changed = TRUE;
+  bl->out_started = FALSE;
+
+  _gdbm_cache_discard (dbf);
+  _gdbm_data_cache_free (dbf);
+  dbf->bucket_count = bl->bucket_count;
+  if (_gdbm_get_bucket (dbf, 0))
+    return -1;
+
+  if (_gdbm_free (dbf, old_dir_adr, old_dir_size)
+      || _gdbm_free (dbf, old_bucket_adr, dbf->header->bucket_size)
+      || _gdbm_free (dbf, end, next_block - end))
+    return -1;
+  for (k = 0; k < old_av_count; k++)
+    if (_gdbm_free (dbf, old_avail[k].av_adr, old_avail[k].av_size))
+      return -1;
+  _gdbm_cache_set_changed (dbf, dbf->cache_entry);
+  dbf->bucket_changed = TRUE;
+
+  return _gdbm_end_update (dbf);
+}
+
+/* Undo the writes made to the database file. */
+static void
+bulk_truncate (struct bulk_load *bl)
+{
+  GDBM_FILE dbf = bl->dbf;
+
+  if (!bl->out_started)
+    return;
+  dbf->file_size = 0;
+  SAVE_ERRNO (if (ftruncate (dbf->desc, bl->old_next_block) == 0)
+		{
+#if HAVE_MMAP
+		  if (dbf->memory_mapping)
+		    {
+		      _gdbm_mapped_unmap (dbf);
+		      _gdbm_mapped_init (dbf);
+		    }
+#endif
+		});
+}
+
+/* Return 1 if DBF contains no records and has its initial structure (a
+   single bucket), 0 if not, and -1 on error. */
+static int
+db_empty_p (GDBM_FILE dbf)
+{
+  size_t i, n = GDBM_DIR_COUNT (dbf);
+
+  for (i = 1; i < n; i++)
+    if (dbf->dir[i] != dbf->dir[0])
+      return 0;
+  if (_gdbm_get_bucket (dbf, 0))
+    return -1;
+  return dbf->bucket->count == 0;
+}
+
+/* Prepare BL for changing the structure of DBF. */
+static int
+bulk_init (struct bulk_load *bl, GDBM_FILE dbf)
+{
+  memset (bl, 0, sizeof (*bl));
+  bl->dbf = dbf;
+  bl->fd = -1;
+  bl->old_next_block = dbf->header->next_block;
+  bl->out = malloc (BULK_OUT_SIZE);
+  bl->bucket = malloc (dbf->header->bucket_size);
+  if (!bl->out || !bl->bucket)
+    {
+      bulk_free (bl);
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+      return -1;
+    }
+  return 0;
+}
+
+/* Select the number of hash bits of the buckets, so that they are
+   about three-fourths full on the average with COUNT records. */
+static void
+bulk_set_bits (struct bulk_load *bl, gdbm_count_t count)
+{
+  size_t elems = bl->dbf->header->bucket_elems;
+
+  bl->max_bits = 0;
+  while (bl->max_bits < GDBM_HASH_BITS
+	 && (sizeof (off_t) << (bl->max_bits + 1)) <= GDBM_MAX_DIR_SIZE)
+    bl->max_bits++;
+  bl->base_bits = 0;
+  while (bl->base_bits < bl->max_bits
+	 && ((gdbm_count_t) elems * 3 << bl->base_bits) < count * 4)
+    bl->base_bits++;
+}
+
+/* Value returned by bulk_build if the database is not empty. */
+#define BULK_NOT_EMPTY 2
+
+/* Build the database DBF from the records returned by NEXT.  Return 0
+   on success, BULK_NOT_EMPTY if DBF is not empty, and -1 on error. */
+static int
+bulk_build (GDBM_FILE dbf, int (*next) (void *, datum *, datum *),
+	    void *data, int flag, gdbm_count_t *dups)
+{
+  struct bulk_load bl;
+  int rc;
+
+  /* Make sure committed transactions are in the file before changing
+     it. */
+  if (_gdbm_journal_checkpoint (dbf))
+    return -1;
+
+  rc = db_empty_p (dbf);
+  if (rc != 1)
+    return rc == 0 ? BULK_NOT_EMPTY : -1;
+
+  if (bulk_init (&bl, dbf))
+    return -1;
+  bl.flag = flag;
+
+  /* Read the input. */
+  for (;;)
+    {
+      datum key, content;
+
+      rc = next (data, &key, &content);
+      if (rc == 1)
+	break;
+      if (rc != 0 || bulk_add (&bl, key, content))
+	{
+	  bulk_free (&bl);
+	  return -1;
+	}
+    }
+
+  if (bl.count == 0)
+    {
+      bulk_free (&bl);
+      return 0;
+    }
+
+  bulk_set_bits (&bl, bl.count);
+  rc = bulk_merge (&bl);
+  if (rc == 0)
+    rc = bulk_install (&bl);
+  if (rc)
+    bulk_truncate (&bl);
+  else if (dups)
+    *dups = bl.dups;
+  bulk_free (&bl);
+  return rc;
+}
+
+/* Give the empty database DBF the structure it would have with RECORDS
+   records of RECORD_SIZE bytes (key and content) on the average: the
+   directory and the buckets are created at once, instead of growing
+   as records are stored.  Each bucket is followed by space for its
+   share of the records, which is put in its avail table, so that the
+   records are stored next to their bucket.  With the size-class
+   allocator, the space is put in its free lists instead.
+
+   Return 0 on success, BULK_NOT_EMPTY if DBF is not empty, and -1 on
+   error. */
+static int
+bulk_presize (GDBM_FILE dbf, gdbm_count_t records, size_t record_size)
+{
+  struct bulk_load bl;
+  int block_size = dbf->header->block_size;
+  gdbm_count_t per_bucket;
+  off_t reserve;
+  size_t i, n;
+  int rc;
+
+  if (_gdbm_journal_checkpoint (dbf))
+    return -1;
+
+  rc = db_empty_p (dbf);
+  if (rc != 1)
+    return rc == 0 ? BULK_NOT_EMPTY : -1;
+
+  if (bulk_init (&bl, dbf))
+    return -1;
+  bulk_set_bits (&bl, records);
+  n = (size_t) 1 << bl.base_bits;
+
+  /* Space reserved after each bucket, rounded up to whole blocks so
+     that the buckets remain aligned.  An avail entry cannot describe
+     more than INT_MAX bytes. */
+  per_bucket = (records + n - 1) / n;
+  if (per_bucket > dbf->header->bucket_elems)
+    per_bucket = dbf->header->bucket_elems;
+  if (record_size > (INT_MAX - block_size) / (per_bucket ? per_bucket : 1))
+    reserve = INT_MAX / block_size * block_size;
+  else
+    reserve = (per_bucket * record_size + block_size - 1)
+                / block_size * block_size;
+
+  bl.out_started = TRUE;
+  bl.out_off = bl.old_next_block;
+  for (i = 0; i < n; i++)
+    {
+      memset (bl.bucket, 0, dbf->header->bucket_size);
+      _gdbm_new_bucket (dbf, bl.bucket, bl.base_bits);
+      if (reserve && !dbf->fsm)
+	{
+	  bl.bucket->av_count = 1;
+	  bl.bucket->bucket_avail[0].av_adr = bl.out_off + bl.out_level
+	                                        + dbf->header->bucket_size;
+	  bl.bucket->bucket_avail[0].av_size = reserve;
+	}
+      if (bucket_append (&bl, bl.base_bits))
+	break;
+      if (reserve)
+	{
+	  /* Leave the space unwritten. */
+	  if (out_flush (&bl))
+	    break;
+	  bl.out_off += reserve;
+	}
+    }
+  if (i == n)
+    rc = bulk_install (&bl);
+  else
+    rc = -1;
+  if (rc)
+    bulk_truncate (&bl);
+  else if (reserve && dbf->fsm)
+    {
+      for (i = 0; i < n; i++)
+	if ((rc = _gdbm_free (dbf, bl.buckets[i].adr + dbf->header->bucket_size,
+			      reserve)) != 0)
+	  break;
+    }
+  bulk_free (&bl);
+  return rc;
+}
+
+/* Store the records returned by NEXT one by one. */
+static int
+bulk_store (GDBM_FILE dbf, int (*next) (void *, datum *, datum *),
+	    void *data, int flag, gdbm_count_t *dups)
+{
+  int batch = dbf->txn_state == TXN_NONE;
+  gdbm_count_t n = 0;
+  int rc;
+
+  if (batch && gdbm_batch_begin (dbf))
+    return -1;
+  for (;;)
+    {
+      datum key, content;
+
+      rc = next (data, &key, &content);
+      if (rc == 1)
+	{
+	  rc = 0;
+	  break;
+	}
+      if (rc != 0)
+	{
+	  rc = -1;
+	  break;
+	}
+      rc = gdbm_store (dbf, key, content, flag);
+      if (rc == 1)
+	n++;
+      else if (rc == -1)
+	break;
+    }
+
+  if (batch)
+    {
+      if (rc == -1)
+	{
+	  /* Write the records stored so far, keeping the error state. */
+	  if (--dbf->batch_level == 0 && !dbf->need_recovery)
+	    _gdbm_flush_batch (dbf);
+	}
+      else if (gdbm_batch_end (dbf))
+	rc = -1;
+    }
+  if (rc == 0 && dups)
+    *dups = n;
+  return rc;
+}
+
+/* Load the records returned by NEXT into the database DBF.  NEXT is
+   called with DATA as its first argument.  It stores the key and the
+   content of the next record in its second and third arguments and
+   returns 0, or returns 1 at the end of input and -1 on error (setting
+   gdbm_errno).  The datums it returns need only remain valid until the
+   next call.
+
+   FLAG tells which record is kept when several have the same key:
+   with GDBM_INSERT, the one already in the database or the first one
+   from the input, with GDBM_REPLACE the last one.  Unless DUPS is
+   NULL, the number of records not stored because their key was
+   already present (always 0 with GDBM_REPLACE) is stored in *DUPS.
+
+   If the database is empty, it is built directly from the records
+   (see above); otherwise they are stored one by one, as with
+   gdbm_store.  This is also the case within a transaction or a batch.
+
+   Return 0 on success.  If FLAG is GDBM_INSERT and some records were
+   dropped, return 1 and set gdbm_errno to GDBM_CANNOT_REPLACE.  On
+   error, return -1.  When the database is built directly, it remains
+   empty after an error. */
+int
+gdbm_bulk_load (GDBM_FILE dbf, int (*next) (void *, datum *, datum *),
+		void *data, int flag, gdbm_count_t *dups)
+{
+  gdbm_count_t n = 0;
+  int rc = BULK_NOT_EMPTY;
+
+  /* Return immediately if the database needs recovery */
+  GDBM_ASSERT_CONSISTENCY (dbf, -1);
+
+  if (dbf->read_write == GDBM_READER)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_READER_CANT_STORE, FALSE);
+      return -1;
+    }
+  gdbm_set_errno (dbf, GDBM_NO_ERROR, FALSE);
+
+  if (dbf->txn_state == TXN_NONE && dbf->batch_level == 0)
+    {
+#if HAVE_PTHREAD_H
+      if (dbf->group_commit)
+	{
+	  _gdbm_group_lock (dbf);
+	  rc = _gdbm_group_commit (dbf, bulk_build (dbf, next, data, flag,
+						    &n));
+	}
+      else
+#endif
+	rc = bulk_build (dbf, next, data, flag, &n);
+    }
+  if (rc == BULK_NOT_EMPTY)
+    rc = bulk_store (dbf, next, data, flag, &n);
+  if (rc)
+    return rc;
+
+  if (dups)
+    *dups = n;
+  if (n && flag != GDBM_REPLACE)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_CANNOT_REPLACE, FALSE);
+      return 1;
+    }
+  return 0;
+}
+
+/* Prepare the empty database DBF for holding RECORDS records of
+   RECORD_SIZE bytes on the average (GDBM_SETCAPACITY). */
+int
+_gdbm_set_capacity (GDBM_FILE dbf, gdbm_count_t records, size_t record_size)
+{
+  int rc;
+
+  GDBM_ASSERT_CONSISTENCY (dbf, -1);
+
+  if (dbf->read_write == GDBM_READER)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_READER_CANT_STORE, FALSE);
+      return -1;
+    }
+  if (dbf->txn_state != TXN_NONE || dbf->batch_level)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_OPT_ALREADY_SET, FALSE);
+      return -1;
+    }
+
+#if HAVE_PTHREAD_H
+  if (dbf->group_commit)
+    {
+      _gdbm_group_lock (dbf);
+      rc = _gdbm_group_commit (dbf, bulk_presize (dbf, records,
+						  record_size));
+    }
+  else
+#endif
+    rc = bulk_presize (dbf, records, record_size);
+  if (rc == BULK_NOT_EMPTY)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_OPT_ALREADY_SET, FALSE);
+      rc = -1;
+    }
+  return rc;
+}
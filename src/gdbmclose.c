@@ -29,8 +29,11 @@
 int
 gdbm_close (GDBM_FILE dbf)
 {
-  int index;	/* For freeing the bucket cache. */
   int syserrno;
+  /* Write pending batched updates, unless the database is broken. */
+  int flush_batch = dbf->batch_level && !dbf->need_recovery;
+  /* If it is, keep the journal so that it gets replayed. */
+  int keep_journal = dbf->need_recovery;
   
   gdbm_set_errno (dbf, GDBM_NO_ERROR, FALSE);
 
@@ -38,10 +41,26 @@ gdbm_close (GDBM_FILE dbf)
     {
       /* Make sure the database is all on disk. */
       if (dbf->read_write != GDBM_READER)
-	gdbm_file_sync (dbf);
+	{
+	  /* Changes made by an uncommitted transaction are discarded. */
+	  if (dbf->txn_state != TXN_NONE)
+	    gdbm_txn_abort (dbf);
+	  if (!dbf->need_recovery)
+	    _gdbm_compact_abort (dbf);
+	  if (flush_batch)
+	    _gdbm_flush_batch (dbf);
+	  _gdbm_journal_close (dbf, keep_journal);
+	  if (!dbf->need_recovery)
+	    _gdbm_fsm_save (dbf);
+	  /* Give back the space allocated in advance by _gdbm_file_grow. */
+	  if (dbf->header && !dbf->need_recovery)
+	    _gdbm_file_truncate (dbf, dbf->header->next_block);
+	  gdbm_file_sync (dbf);
+	}
 
       /* Close the file and free all malloced memory. */
 #if HAVE_MMAP
+      _gdbm_cache_free (dbf);
       _gdbm_mapped_unmap (dbf);
 #endif
       if (dbf->file_locking)
@@ -58,15 +77,17 @@ gdbm_close (GDBM_FILE dbf)
   free (dbf->name);
   free (dbf->dir);
 
-  if (dbf->bucket_cache != NULL)
-    {
-      for (index = 0; index < dbf->cache_size; index++)
-	{
-	  free (dbf->bucket_cache[index].ca_bucket);
-	  free (dbf->bucket_cache[index].ca_data.dptr);
-	}
-      free (dbf->bucket_cache);
-    }
+  _gdbm_cache_free (dbf);
+  _gdbm_data_cache_free (dbf);
+  _gdbm_fsm_free (dbf);
+  _gdbm_compact_free (dbf);
+  _gdbm_punch_free (dbf);
+#if HAVE_PTHREAD_H
+  _gdbm_group_free (dbf);
+#endif
+#if HAVE_LINUX_IO_URING_H
+  _gdbm_uring_free (dbf);
+#endif
   free (dbf->header);
   free (dbf);
   if (gdbm_errno)
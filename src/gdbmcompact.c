@@ -0,0 +1,616 @@
+/* gdbmcompact.c - Incremental compaction of the database file. */
+
+/* This file is part of GDBM, the GNU data base manager.
+   Copyright (C) 2018 Free Software Foundation, Inc.
+
+   GDBM is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   GDBM is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GDBM. If not, see <http://www.gnu.org/licenses/>.   */
+
+/* Include system configuration before all else. */
+#include "autoconf.h"
+#include "gdbmdefs.h"
+
+/* gdbm_reorganize copies the whole database to a new file.  The
+   compaction works in place instead, a few buckets at a time, so that
+   it can be interleaved with other uses of the database.
+
+   A compaction pass takes all free space out of the avail tables and
+   the avail stack into the free lists of the size-class allocator (see fsm.c).  A database
+   that does not use that allocator is given temporary free lists for
+   the duration of the pass, which are filled by visiting all buckets.
+   The pass then chooses a limit below the end of the used space, such
+   that the free space below the limit is about twice the data above
+   it, and keeps the free space past the limit aside.  The directory is
+   moved below the limit, and the buckets are visited in directory
+   order, moving each bucket and the records it points to out of the
+   space past the limit.  When all buckets have been visited, the free
+   space at the end of the file is given back and the file is
+   truncated.
+   Anything that cannot be moved, for lack of a suitable free block,
+   stays where it is, and so does the space allocated past the limit
+   in the course of the pass.  All other space past the limit is known
+   to be unused at the end of the pass, including the slivers too small
+   to be kept in the free lists.
+
+   If a database is not closed properly during a pass, the space that
+   was free is lost until the database is reorganized. */
+
+enum compact_phase
+  {
+    COMPACT_IDLE,	/* No pass in progress. */
+    COMPACT_GATHER,	/* Collecting the free space of the buckets. */
+    COMPACT_MOVE	/* Moving data below the limit. */
+  };
+
+struct gdbm_compact
+{
+  enum compact_phase phase;
+  off_t limit;		/* Data past this offset are being moved. */
+  off_t end;		/* End of the used space when the pass started. */
+  off_t pinned;		/* End of the data left past the limit. */
+  int next;		/* Next directory entry to visit. */
+  int dir_bits;		/* Directory depth NEXT refers to. */
+  avail_elem *vacated;	/* Free space past the limit. */
+  size_t count;		/* Number of elements in VACATED. */
+  size_t max;		/* Allocated size of VACATED. */
+};
+
+/* Size of the buffer used for copying records. */
+#define COMPACT_COPY_SIZE 8192
+
+/* Keep the NUM_BYTES at FILE_ADR aside until the end of the pass. */
+static int
+compact_vacate (GDBM_FILE dbf, off_t file_adr, int num_bytes)
+{
+  struct gdbm_compact *cp = dbf->compact;
+
+  if (num_bytes <= IGNORE_SIZE)
+    return 0;
+  if (cp->count == cp->max)
+    {
+      size_t n = cp->max ? 2 * cp->max : 64;
+      avail_elem *p = realloc (cp->vacated, n * sizeof (p[0]));
+      if (!p)
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+	  return -1;
+	}
+      cp->vacated = p;
+      cp->max = n;
+    }
+  cp->vacated[cp->count].av_adr = file_adr;
+  cp->vacated[cp->count].av_size = num_bytes;
+  cp->count++;
+  return 0;
+}
+
+/* Allocate NUM_BYTES of free space below the limit.  Store its address
+   in *PADR, or 0 if there is no suitable free block. */
+static int
+compact_alloc (GDBM_FILE dbf, int num_bytes, off_t *padr)
+{
+  avail_elem av_el;
+
+  *padr = 0;
+  if (_gdbm_fsm_get_below (dbf, num_bytes, dbf->compact->limit, &av_el))
+    return -1;
+  if (av_el.av_size == 0)
+    return 0;
+  *padr = av_el.av_adr;
+  return _gdbm_fsm_put (dbf, av_el.av_adr + num_bytes,
+			av_el.av_size - num_bytes);
+}
+
+/* Copy SIZE bytes from the file offset SRC to DST. */
+static int
+compact_copy (GDBM_FILE dbf, off_t src, off_t dst, int size)
+{
+  char buf[COMPACT_COPY_SIZE];
+
+  while (size > 0)
+    {
+      int n = size < sizeof (buf) ? size : sizeof (buf);
+
+      if (_gdbm_full_pread (dbf, buf, n, src)
+	  || _gdbm_full_pwrite (dbf, buf, n, dst))
+	{
+	  GDBM_DEBUG (GDBM_DEBUG_STORE|GDBM_DEBUG_ERR,
+		      "%s: error moving data: %s",
+		      dbf->name, gdbm_db_strerror (dbf));
+	  _gdbm_fatal (dbf, gdbm_db_strerror (dbf));
+	  return -1;
+	}
+      src += n;
+      dst += n;
+      size -= n;
+    }
+  return 0;
+}
+
+/* Move the bucket referred to by the directory entry DIR_INDEX and the
+   records it points to below the limit. */
+static int
+compact_bucket (GDBM_FILE dbf, int dir_index)
+{
+  off_t limit = dbf->compact->limit;
+  int bucket_size = dbf->header->bucket_size;
+  hash_bucket *bucket;
+  off_t adr, new_adr;
+  int i;
+
+  if (_gdbm_get_bucket (dbf, dir_index))
+    return -1;
+  bucket = dbf->bucket;
+
+  adr = dbf->dir[dir_index];
+  if (adr + bucket_size > limit)
+    {
+      if (compact_alloc (dbf, bucket_size, &new_adr))
+	return -1;
+      if (new_adr == 0)
+	_gdbm_compact_note (dbf, adr, bucket_size);
+      else
+	{
+	  /* All directory entries of a bucket are adjacent. */
+	  for (i = dir_index;
+	       i < GDBM_DIR_COUNT (dbf) && dbf->dir[i] == adr; i++)
+	    dbf->dir[i] = new_adr;
+	  dbf->directory_changed = TRUE;
+	  _gdbm_cache_entry_relocate (dbf,
+				      dbf->cache_entry - dbf->bucket_cache,
+				      new_adr);
+	  for (i = 0; i < dbf->header->bucket_elems; i++)
+	    _gdbm_data_cache_move (dbf, adr, i, new_adr, i);
+	  if (compact_vacate (dbf, adr, bucket_size))
+	    return -1;
+	}
+    }
+
+  for (i = 0; i < dbf->header->bucket_elems; i++)
+    {
+      bucket_element *elem = &bucket->h_table[i];
+      int size = elem->key_size + elem->data_size;
+
+      if (elem->hash_value == -1 || elem->data_pointer + size <= limit)
+	continue;
+      if (compact_alloc (dbf, size, &new_adr))
+	return -1;
+      if (new_adr == 0)
+	{
+	  _gdbm_compact_note (dbf, elem->data_pointer, size);
+	  continue;
+	}
+      if (compact_copy (dbf, elem->data_pointer, new_adr, size)
+	  || compact_vacate (dbf, elem->data_pointer, size))
+	return -1;
+      elem->data_pointer = new_adr;
+      _gdbm_data_cache_invalidate (dbf, dbf->cache_entry->ca_adr, i);
+      _gdbm_cache_set_changed (dbf, dbf->cache_entry);
+    }
+  return 0;
+}
+
+/* Move the free blocks of the bucket referred to by the directory
+   entry DIR_INDEX to the free lists. */
+static int
+compact_gather (GDBM_FILE dbf, int dir_index)
+{
+  hash_bucket *bucket;
+  int i;
+
+  if (_gdbm_get_bucket (dbf, dir_index))
+    return -1;
+  bucket = dbf->bucket;
+  if (bucket->av_count == 0)
+    return 0;
+  for (i = 0; i < bucket->av_count; i++)
+    if (_gdbm_fsm_put (dbf, bucket->bucket_avail[i].av_adr,
+		       bucket->bucket_avail[i].av_size))
+      return -1;
+  bucket->av_count = 0;
+  _gdbm_cache_set_changed (dbf, dbf->cache_entry);
+  return 0;
+}
+
+/* Move the free space of the avail blocks kept in the file (see
+   push_avail_block in falloc.c), and the space of the blocks
+   themselves, to the free lists. */
+static int
+compact_take_stack (GDBM_FILE dbf)
+{
+  int size = ((dbf->avail->size * sizeof (avail_elem)) >> 1)
+             + sizeof (avail_block);
+  avail_block *blk;
+  off_t adr;
+  int i;
+
+  if (dbf->avail->next_block == 0)
+    return 0;
+  blk = malloc (size);
+  if (!blk)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+      return -1;
+    }
+
+  while ((adr = dbf->avail->next_block) != 0)
+    {
+      if (_gdbm_full_pread (dbf, blk, size, adr)
+	  || gdbm_avail_block_validate (dbf, blk))
+	{
+	  free (blk);
+	  _gdbm_fatal (dbf, gdbm_db_strerror (dbf));
+	  return -1;
+	}
+      for (i = 0; i < blk->count; i++)
+	if (_gdbm_fsm_put (dbf, blk->av_table[i].av_adr,
+			   blk->av_table[i].av_size))
+	  break;
+      if (i < blk->count || _gdbm_fsm_put (dbf, adr, size))
+	{
+	  free (blk);
+	  return -1;
+	}
+      dbf->avail->next_block = blk->next_block;
+      dbf->header_changed = TRUE;
+    }
+  free (blk);
+  return 0;
+}
+
+/* Start a compaction pass. */
+static int
+compact_start (GDBM_FILE dbf)
+{
+  struct gdbm_compact *cp = dbf->compact;
+  int i;
+
+  cp->end = dbf->header->next_block;
+  cp->next = 0;
+  cp->dir_bits = dbf->header->dir_bits;
+  if (_gdbm_get_bucket (dbf, 0))
+    return -1;
+
+  if (dbf->fsm)
+    {
+      cp->phase = COMPACT_MOVE;
+      return 0;
+    }
+
+  /* Take the free space of the header avail table and of the avail
+     stack.  That of the buckets is collected in the COMPACT_GATHER
+     phase. */
+  if (_gdbm_fsm_attach (dbf))
+    return -1;
+  cp->phase = COMPACT_GATHER;
+  for (i = 0; i < dbf->avail->count; i++)
+    if (_gdbm_fsm_put (dbf, dbf->avail->av_table[i].av_adr,
+		       dbf->avail->av_table[i].av_size))
+      return -1;
+  dbf->avail->count = 0;
+  dbf->header_changed = TRUE;
+  return compact_take_stack (dbf);
+}
+
+/* Choose the limit, keep the free space past it aside and move the
+   directory below it.  Return 1 if there is too little free space to
+   move anything. */
+static int
+compact_setup (GDBM_FILE dbf)
+{
+  struct gdbm_compact *cp = dbf->compact;
+  avail_elem *tab;
+  size_t count, i;
+  off_t free_size, adr;
+  int rc = 0;
+
+  if (_gdbm_fsm_merge (dbf))
+    return -1;
+  free_size = _gdbm_fsm_free_size (dbf);
+  if (free_size < dbf->header->block_size)
+    return 1;
+
+  cp->phase = COMPACT_MOVE;
+  cp->limit = dbf->header->next_block - free_size / 2;
+  cp->pinned = 0;
+  cp->next = 0;
+  cp->dir_bits = dbf->header->dir_bits;
+
+  if (_gdbm_fsm_table (dbf, &tab, &count, TRUE))
+    return -1;
+  for (i = 0; i < count; i++)
+    {
+      avail_elem av = tab[i];
+
+      if (av.av_adr + av.av_size > cp->limit)
+	{
+	  off_t lo = av.av_adr < cp->limit ? cp->limit - av.av_adr : 0;
+	  if (compact_vacate (dbf, av.av_adr + lo, av.av_size - lo))
+	    {
+	      rc = -1;
+	      break;
+	    }
+	  av.av_size = lo;
+	}
+      if (_gdbm_fsm_put (dbf, av.av_adr, av.av_size))
+	{
+	  rc = -1;
+	  break;
+	}
+    }
+  free (tab);
+  if (rc)
+    return -1;
+
+  if (dbf->header->dir + dbf->header->dir_size > cp->limit)
+    {
+      if (compact_alloc (dbf, dbf->header->dir_size, &adr))
+	return -1;
+      if (adr == 0)
+	_gdbm_compact_note (dbf, dbf->header->dir, dbf->header->dir_size);
+      else
+	{
+	  if (compact_vacate (dbf, dbf->header->dir, dbf->header->dir_size))
+	    return -1;
+	  dbf->header->dir = adr;
+	  dbf->header_changed = TRUE;
+	  dbf->directory_changed = TRUE;
+	}
+    }
+  return 0;
+}
+
+static int
+avail_size_cmp (void const *a, void const *b)
+{
+  avail_elem const *x = a;
+  avail_elem const *y = b;
+
+  return y->av_size - x->av_size;
+}
+
+/* Give back all space past the limit that is not in use.  Called when
+   all buckets have been visited. */
+static int
+compact_cut (GDBM_FILE dbf)
+{
+  struct gdbm_compact *cp = dbf->compact;
+  int block_size = dbf->header->block_size;
+  off_t end = cp->pinned > cp->limit ? cp->pinned : cp->limit;
+  off_t min;
+  avail_elem *tab;
+  size_t count, i;
+  int rc = 0;
+
+  end = (end + block_size - 1) / block_size * block_size;
+  min = _gdbm_next_block_min (dbf);
+  if (end < min)
+    end = min;
+  if (end >= dbf->header->next_block)
+    return 0;
+  if (_gdbm_fsm_table (dbf, &tab, &count, TRUE))
+    return -1;
+  for (i = 0; i < count && tab[i].av_adr < end; i++)
+    {
+      if (tab[i].av_adr + tab[i].av_size > end)
+	tab[i].av_size = end - tab[i].av_adr;
+      if (_gdbm_fsm_put (dbf, tab[i].av_adr, tab[i].av_size))
+	{
+	  rc = -1;
+	  break;
+	}
+    }
+  free (tab);
+  dbf->header->next_block = end;
+  dbf->header_changed = TRUE;
+  return rc;
+}
+
+/* Return the space kept aside to the free space and give back the free
+   space at the end of the file.  COMPLETE is true if all buckets have
+   been visited.  Take down the temporary free lists, if any. */
+static int
+compact_release (GDBM_FILE dbf, int complete)
+{
+  struct gdbm_compact *cp = dbf->compact;
+  avail_elem *tab;
+  size_t count, i;
+  int rc = 0;
+
+  /* Merging the free lists gives back the free space at the end of
+     the file. */
+  cp->phase = COMPACT_IDLE;
+  for (i = 0; i < cp->count; i++)
+    if (_gdbm_fsm_put (dbf, cp->vacated[i].av_adr, cp->vacated[i].av_size))
+      return -1;
+  cp->count = 0;
+  if (_gdbm_fsm_merge (dbf)
+      || (complete && compact_cut (dbf)))
+    return -1;
+  cp->limit = 0;
+
+  if (dbf->xheader && (dbf->xheader->features & GDBM_FEAT_SIZECLASS))
+    return 0;
+
+  /* Return the free space to the avail tables, largest blocks first,
+     so that the header avail table can always hold the blocks pushed
+     out of it. */
+  if (_gdbm_fsm_table (dbf, &tab, &count, TRUE))
+    return -1;
+  _gdbm_fsm_free (dbf);
+  qsort (tab, count, sizeof (tab[0]), avail_size_cmp);
+  for (i = 0; i < count; i++)
+    if (_gdbm_free (dbf, tab[i].av_adr, tab[i].av_size))
+      {
+	rc = -1;
+	break;
+      }
+  free (tab);
+  return rc;
+}
+
+/* End the compaction pass and truncate the file.  COMPLETE is true if
+   all buckets have been visited.  Return 1 if the file has become
+   shorter, and 0 otherwise. */
+static int
+compact_finish (GDBM_FILE dbf, int complete)
+{
+  if (compact_release (dbf, complete) || _gdbm_end_update (dbf)
+      || _gdbm_file_truncate (dbf, dbf->header->next_block))
+    return -1;
+  return dbf->header->next_block < dbf->compact->end;
+}
+
+static int
+compact_step (GDBM_FILE dbf, size_t budget)
+{
+  struct gdbm_compact *cp = dbf->compact;
+
+  /* Make sure committed transactions are in the file before changing
+     it. */
+  if (_gdbm_journal_checkpoint (dbf))
+    return -1;
+
+  if (!cp)
+    {
+      cp = dbf->compact = calloc (1, sizeof (*cp));
+      if (!cp)
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+	  return -1;
+	}
+    }
+
+  if (cp->phase == COMPACT_IDLE && compact_start (dbf))
+    return -1;
+
+  for (;;)
+    {
+      /* The directory may have grown since the last step. */
+      if (dbf->header->dir_bits != cp->dir_bits)
+	{
+	  cp->next <<= dbf->header->dir_bits - cp->dir_bits;
+	  cp->dir_bits = dbf->header->dir_bits;
+	}
+
+      if (cp->phase == COMPACT_MOVE && cp->limit == 0)
+	{
+	  switch (compact_setup (dbf))
+	    {
+	    case 0:
+	      break;
+	    case 1:
+	      return compact_finish (dbf, FALSE);
+	    default:
+	      return -1;
+	    }
+	}
+
+      while (budget > 0 && cp->next < GDBM_DIR_COUNT (dbf))
+	{
+	  int i = cp->next++;
+
+	  if (i > 0 && dbf->dir[i] == dbf->dir[i - 1])
+	    continue;
+	  if (cp->phase == COMPACT_GATHER
+	      ? compact_gather (dbf, i) : compact_bucket (dbf, i))
+	    return -1;
+	  budget--;
+	}
+
+      if (cp->next < GDBM_DIR_COUNT (dbf))
+	return _gdbm_end_update (dbf) ? -1 : 1;
+
+      if (cp->phase == COMPACT_MOVE)
+	break;
+      cp->phase = COMPACT_MOVE;
+    }
+
+  return compact_finish (dbf, TRUE);
+}
+
+/* Do a part of the compaction of the database DBF, visiting at most
+   BUDGET buckets (at least one).  Return 1 if the compaction should
+   continue, 0 if it is complete (i.e. the last pass did not make the
+   file any shorter), and -1 on error. */
+int
+gdbm_compact_step (GDBM_FILE dbf, size_t budget)
+{
+  /* Return immediately if the database needs recovery */
+  GDBM_ASSERT_CONSISTENCY (dbf, -1);
+
+  if (dbf->read_write == GDBM_READER)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_READER_CANT_REORGANIZE, FALSE);
+      return -1;
+    }
+  if (dbf->txn_state != TXN_NONE || dbf->batch_level)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_TXN_ACTIVE, FALSE);
+      return -1;
+    }
+  if (budget == 0)
+    budget = 1;
+
+#if HAVE_PTHREAD_H
+  if (dbf->group_commit)
+    {
+      int rc;
+
+      _gdbm_group_lock (dbf);
+      rc = compact_step (dbf, budget);
+      if (_gdbm_group_commit (dbf, rc == -1 ? -1 : 0))
+	return -1;
+      return rc;
+    }
+#endif
+  return compact_step (dbf, budget);
+}
+
+/* Abandon the compaction pass in progress, if any, returning the space
+   kept aside to the free space. */
+int
+_gdbm_compact_abort (GDBM_FILE dbf)
+{
+  struct gdbm_compact *cp = dbf->compact;
+
+  if (!cp || cp->phase == COMPACT_IDLE)
+    return 0;
+  if (compact_release (dbf, FALSE))
+    return -1;
+  return _gdbm_end_update (dbf);
+}
+
+/* Note that NUM_BYTES at FILE_ADR are in use.  Called for the space
+   allocated while a compaction pass is in progress. */
+void
+_gdbm_compact_note (GDBM_FILE dbf, off_t file_adr, int num_bytes)
+{
+  struct gdbm_compact *cp = dbf->compact;
+
+  if (cp->phase == COMPACT_MOVE && cp->limit != 0
+      && file_adr + num_bytes > cp->pinned)
+    cp->pinned = file_adr + num_bytes;
+}
+
+/* Free the compaction state of DBF. */
+void
+_gdbm_compact_free (GDBM_FILE dbf)
+{
+  if (dbf->compact)
+    {
+      free (dbf->compact->vacated);
+      free (dbf->compact);
+      dbf->compact = NULL;
+    }
+}
@@ -35,6 +35,14 @@
 #define GDBM_MAGIC32_SWAP	0xcd9a5713	/* MAGIC32 swapped. */
 #define GDBM_MAGIC64_SWAP	0xcf9a5713	/* MAGIC64 swapped. */
 
+/* Databases with an extension header (see gdbm_ext_header) use these
+   instead. */
+#define GDBM_EXT_MAGIC32	0x13579ad0	/* Extended 32bit magic number. */
+#define GDBM_EXT_MAGIC64	0x13579ad1	/* Extended 64bit magic number. */
+
+#define GDBM_EXT_MAGIC32_SWAP	0xd09a5713	/* EXT_MAGIC32 swapped. */
+#define GDBM_EXT_MAGIC64_SWAP	0xd19a5713	/* EXT_MAGIC64 swapped. */
+
 /* Size of a hash value, in bits */
 #define GDBM_HASH_BITS 31
 
@@ -51,8 +59,29 @@
 /* The number of bucket_avail entries in a hash bucket. */
 #define BUCKET_AVAIL 6
 
+/* Buckets with at least this many elements are probed using a copy of
+   their hash values (see _gdbm_bucket_probe). */
+#define PROBE_ARRAY_MIN 32
+
 /* The size of the bucket cache. */
 #define DEFAULT_CACHESIZE  100
 
+/* Minimal size of the bucket cache. */
+#define GDBM_MIN_CACHESIZE 10
+
+/* Default memory budget of the data cache, in bytes. */
+#define DEFAULT_DATA_CACHE_SIZE (1024 * 1024)
+
+/* Maximum size of the hash directory, in bytes. */
+#define GDBM_MAX_DIR_SIZE INT_MAX
+#define GDBM_MAX_DIR_HALF (GDBM_MAX_DIR_SIZE / 2)
+
+/* Default amount of memory used by gdbm_bulk_load for sorting. */
+#define DEFAULT_BULK_BUF_SIZE (64 * 1024 * 1024)
+
+/* Default growth step of the database file. */
+#define DEFAULT_GROW_CHUNK (1024 * 1024)
+#define DEFAULT_GROW_PERCENT 10
+
 /* Maximum size representable by a size_t variable */
 #define SIZE_T_MAX ((size_t)-1)
@@ -91,22 +91,60 @@ typedef struct
   int   bucket_size;   /* Size in bytes of a hash bucket struct. */
   int   bucket_elems;  /* Number of elements in a hash bucket. */
   off_t next_block;    /* The next unallocated block address. */
+} gdbm_file_header;
+
+/* Databases with the GDBM_EXT_MAGIC magic number have an extension
+   header between the file header and the avail block.  It records the
+   optional features the database was created with. */
+
+typedef struct
+{
+  int   version;       /* Version of the extension header (0). */
+  unsigned features;   /* GDBM_FEAT_ bits. */
+  off_t fsm_adr;       /* File address of the saved free-space map, or 0. */
+  int   fsm_size;      /* Size in bytes of the free-space map. */
+  int   reserved[11];  /* Reserved for future use.  Must be zero. */
+} gdbm_ext_header;
+
+/* Features of an extended database. */
+#define GDBM_FEAT_SIZECLASS 0x01  /* Size-class free-space allocator. */
+#define GDBM_FEAT_FASTHASH  0x02  /* Keys are hashed by _gdbm_fast_hash. */
+#define GDBM_FEAT_FINGERPRINT 0x04 /* Bucket elements hold key fingerprints. */
+#define GDBM_FEAT_POW2BUCKETS 0x08 /* bucket_elems is a power of two. */
+
+#define GDBM_FEAT_MASK \
+  (GDBM_FEAT_SIZECLASS | GDBM_FEAT_FASTHASH | GDBM_FEAT_FINGERPRINT \
+   | GDBM_FEAT_POW2BUCKETS)
+
+/* The first block of the file, in both formats. */
+typedef struct
+{
+  gdbm_file_header hdr;
   avail_block avail;   /* This must be last because of the pseudo
                           array in avail.  This avail grows to fill
                           the entire block. */
-} gdbm_file_header;
+} gdbm_file_standard_header;
+
+typedef struct
+{
+  gdbm_file_header hdr;
+  gdbm_ext_header ext;
+  avail_block avail;   /* Same as above. */
+} gdbm_file_extended_header;
 
 
 /* The dbm hash bucket element contains the full 31 bit hash value, the
    "pointer" to the key and data (stored together) with their sizes.  It also
    has a small part of the actual key value.  It is used to verify the first
    part of the key has the correct value without having to read the actual
-   key. */
+   key.  In databases created with GDBM_FINGERPRINT, a hash of the whole key
+   is kept instead (see _gdbm_key_check). */
 
 typedef struct
 {
   int   hash_value;       /* The complete 31 bit value. */
-  char  key_start[SMALL]; /* Up to the first SMALL bytes of the key.  */
+  char  key_start[SMALL]; /* Up to the first SMALL bytes of the key,
+			     or its fingerprint.  */
   off_t data_pointer;     /* The file address of the key record. The
 			     data record directly follows the key.  */
   int   key_size;         /* Size of key data in the file. */
@@ -137,34 +175,98 @@ typedef struct
 } hash_bucket;
 
 /* We want to keep from reading buckets as much as possible.  The following is
-   to implement a bucket cache.  When full, buckets will be dropped in a
-   least recently read from disk order.  */
+   to implement a bucket cache.  When full, buckets will be dropped in the
+   order determined by the cache replacement policy (see bucket.c).  */
 
 /* To speed up fetching and "sequential" access, we need to implement a
    data cache for key/data pairs read from the file.  To find a key, we
    must exactly match the key from the file.  To reduce overhead, the
    data will be read at the same time.  Both key and data will be stored
-   in a data cache.  Each bucket cached will have a one element data
-   cache.  */
+   in the data cache.  The data cache is shared by all buckets.  Its
+   entries are identified by the bucket address and the location of the
+   element in the bucket (see datacache.c). */
 
-typedef struct
+typedef struct data_cache_elem data_cache_elem;
+
+struct data_cache_elem
 {
-  int     hash_val;
-  int     data_size;
+  off_t   adr;              /* Address of the bucket. */
+  int     elem_loc;         /* Location of the element in the bucket. */
+  int     hash_val;         /* Copy of the bucket element, used to */
+  off_t   data_pointer;     /* verify that the entry is up to date. */
   int     key_size;
-  char    *dptr;
-  size_t  dsize;
-  int     elem_loc;
-} data_cache_elem;
+  int     data_size;
+  data_cache_elem *next;    /* Next entry in the hash chain. */
+  data_cache_elem *lru_prev;/* Previous (more recently used) entry. */
+  data_cache_elem *lru_next;/* Next (less recently used) entry. */
+  char    dptr[1];          /* Key followed by data. */
+};
 
 typedef struct
 {
   hash_bucket *   ca_bucket;
   off_t           ca_adr;
   char            ca_changed;   /* Data in the bucket changed. */
-  data_cache_elem ca_data;
+  char            ca_ref;       /* Reference bit (CLOCK policy). */
+  char            ca_list;      /* Recency list the entry belongs to. */
+  char            ca_mapped;    /* ca_bucket points into the mapped region. */
+  char            ca_filter_valid; /* ca_filter describes the bucket. */
+  char            ca_dirty;     /* The entry is on the dirty list. */
+  char            ca_hashes_valid; /* ca_hashes describes the bucket. */
+  unsigned char * ca_filter;    /* Negative lookup filter (may be NULL). */
+  int *           ca_hashes;    /* Hash values of the elements (may be
+				   NULL). */
+  unsigned        ca_epoch;     /* Tuning window of the last access. */
+  int             ca_prev;      /* Previous (more recently used) entry. */
+  int             ca_next;      /* Next (less recently used) entry. */
 } cache_elem;
 
+/* A doubly linked list of bucket cache entries, ordered from the most
+   recently used one (head) to the least recently used one (tail).
+   Entries are linked by their indices in the bucket cache. */
+typedef struct
+{
+  int    head;
+  int    tail;
+  size_t count;
+} cache_list;
+
+/* Changed buckets dropped from the bucket cache during a transaction
+   cannot be written to the file before the transaction is committed.
+   They are kept in a hash table of txn_bucket entries instead (see
+   gdbmtxn.c). */
+typedef struct txn_bucket txn_bucket;
+
+struct txn_bucket
+{
+  txn_bucket  *next;        /* Next entry in the hash chain. */
+  off_t        adr;         /* Address of the bucket. */
+  hash_bucket  bucket;      /* The bucket itself (bucket_size bytes). */
+};
+
+/* Transaction states. */
+enum
+  {
+    TXN_NONE,               /* No transaction. */
+    TXN_ACTIVE,             /* A transaction is in progress. */
+    TXN_COMMIT              /* The transaction is being committed. */
+  };
+
+/* A request for _gdbm_io_run: read or write the buffers described by
+   IOV at offset OFF.  A single buffer can be kept in IOV1. */
+struct gdbm_io_req
+{
+  int          write;       /* Nonzero for writes. */
+  off_t        off;         /* File offset. */
+  struct iovec *iov;        /* Buffers. */
+  int          iovcnt;      /* Number of buffers. */
+  struct iovec iov1;        /* Storage for a single buffer. */
+};
+
+struct gdbm_uring;
+struct gdbm_fsm;
+struct gdbm_compact;
+
 /* This final structure contains all main memory based information for
    a gdbm file.  This allows multiple gdbm files to be opened at the same
    time by one program. */
@@ -176,6 +278,10 @@ struct gdbm_file_info
   /* The file name. */
   char *name;
 
+  /* True if the file was opened by gdbm_open, so that name is its
+     path.  The name given to gdbm_fd_open may not be one. */
+  int name_is_path;
+
   /* The reader/writer status. */
   unsigned read_write :2;
 
@@ -199,6 +305,97 @@ struct gdbm_file_info
 
   /* Last error was fatal, the database needs recovery */
   unsigned need_recovery :1;
+
+  /* Use negative lookup filters on cached buckets */
+  unsigned bucket_filter :1;
+
+  /* Group commit mutex and conditions have been initialized */
+  unsigned group_init :1;
+
+  /* Transaction state (one of TXN_* constants) */
+  unsigned txn_state :2;
+
+  /* The journal contains committed transactions */
+  unsigned journal_pending :1;
+
+  /* Bucket elements hold key fingerprints (GDBM_FEAT_FINGERPRINT) */
+  unsigned key_fingerprint :1;
+
+  /* Nesting level of update batches (gdbm_batch_begin) */
+  unsigned batch_level;
+
+  /* Group commit is enabled (see group.c), and an update made under it
+     is in progress, so that the file is synchronized by
+     _gdbm_group_commit.  These are not bit fields, because they are
+     accessed by several threads. */
+  int group_commit;
+  int group_update;
+
+  /* The transaction journal (see journal.c): its descriptor (-1 if not
+     open), its size, the offset where the current transaction begins
+     and the checksum of the records written so far by it. */
+  int journal_fd;
+  off_t journal_size;
+  off_t txn_start;
+  unsigned txn_sum;
+
+  /* Space freed during the current transaction.  It is returned to the
+     avail lists when the transaction is committed. */
+  avail_elem *txn_free;
+  size_t txn_free_count;
+  size_t txn_free_max;
+
+  /* Changed buckets dropped from the cache during the current
+     transaction: a hash table of txn_bucket_size chains. */
+  txn_bucket **txn_bucket;
+  size_t txn_bucket_size;
+  size_t txn_bucket_count;
+
+#if HAVE_PTHREAD_H
+  /* Group commit: gdbm_store and gdbm_delete hold GROUP_MUTEX.  Updates
+     are numbered; GROUP_SYNCED is the number of the last one covered by
+     a synchronization of the file, and GROUP_SYNCS the number of
+     synchronizations done so far.  The thread doing the synchronization
+     (the leader) waits on GROUP_JOIN for other updates to join it, the
+     others wait on GROUP_DONE for it to finish. */
+  pthread_mutex_t group_mutex;
+  pthread_cond_t group_join;
+  pthread_cond_t group_done;
+  unsigned group_max_count;
+  unsigned group_max_wait;
+  unsigned long group_seq;
+  unsigned long group_synced;
+  unsigned long group_syncs;
+  int group_leader;
+  gdbm_error group_error;
+#endif
+
+  /* The io_uring instance used for batched I/O (see uring.c), or NULL
+     if requests are served one by one. */
+  struct gdbm_uring *uring;
+
+  /* Amount of memory gdbm_bulk_load uses for sorting records. */
+  size_t bulk_buf_size;
+
+  /* When the file must grow, it is extended by at least grow_chunk
+     bytes, or grow_percent percent of its size, whichever is more.
+     file_size is its size as last seen, or 0 if unknown. */
+  size_t grow_chunk;
+  unsigned grow_percent;
+  off_t file_size;
+
+  /* Free blocks of at least punch_hole bytes have the disk space of
+     their pages deallocated (0 to disable).  punch_list holds the
+     blocks of block_size bytes or more freed since the last update
+     was written: only these are deallocated then. */
+  size_t punch_hole;
+  avail_elem *punch_list;
+  size_t punch_count;
+  size_t punch_max;
+
+  /* State of the incremental compaction (see gdbmcompact.c), or NULL
+     if gdbm_compact_step has not been called. */
+  struct gdbm_compact *compact;
   
   /* Last GDBM error number */
   gdbm_error last_error;
@@ -219,6 +416,32 @@ struct gdbm_file_info
 
   /* The file header holds information about the database. */
   gdbm_file_header *header;
+
+  /* The extension header and the active avail block, both within the
+     header block.  XHEADER is NULL for a standard database. */
+  gdbm_ext_header *xheader;
+  avail_block *avail;
+
+  /* The free lists of the size-class allocator (see fsm.c), or NULL if
+     the database does not use it or is open for reading. */
+  struct gdbm_fsm *fsm;
+
+  /* The hash function of the database (see hash.c), and the one
+     gdbm_reorganize gives to the new file (GDBM_HASH_ constant, or -1
+     to keep the current one). */
+  int (*hash) (datum);
+  int reorg_hash;
+
+  /* Whether gdbm_reorganize gives key fingerprints to the new file
+     (GDBM_SETFINGERPRINT), or -1 to keep the current setting. */
+  int reorg_fingerprint;
+
+  /* If the number of elements in a bucket is a power of two
+     (GDBM_FEAT_POW2BUCKETS), one less than it and the number of bits
+     to drop from a 32-bit product to get a location in the bucket
+     (see GDBM_BUCKET_HOME).  Otherwise, both are 0. */
+  int bucket_mask;
+  int bucket_shift;
   
   /* The hash table directory from extendable hashing.  See Fagin et al, 
      ACM Trans on Database Systems, Vol 4, No 3. Sept 1979, 315-344 */
@@ -229,6 +452,59 @@ struct gdbm_file_info
   size_t cache_size;
   size_t last_read;
 
+  /* Index of the bucket cache by bucket address.  This is an open
+     addressing hash table with linear probing.  Each slot holds an
+     index into bucket_cache, or -1 if the slot is empty.  The number
+     of slots is a power of two at least twice as big as cache_size. */
+  int *cache_index;
+  size_t cache_index_size;
+
+  /* Indices of the bucket cache entries changed since the last write
+     of updates, in no particular order.  An entry is listed at most
+     once (see ca_dirty), so the list has room for cache_size indices.
+     Entries written out in the meantime stay listed, but have
+     ca_changed cleared. */
+  int *cache_dirty;
+  size_t cache_dirty_count;
+
+  /* Cache replacement policy (one of GDBM_CACHE_* constants) and its
+     state.  The LRU policy uses cache_lru[0] only.  The SLRU policy
+     keeps probationary entries in cache_lru[0] and protected ones in
+     cache_lru[1].  The FIFO and CLOCK policies use last_read as the
+     clock hand. */
+  int cache_policy;
+  cache_list cache_lru[2];
+
+  /* Cache statistics. */
+  struct gdbm_cache_stats cache_stats;
+
+  /* Automatic cache sizing.  If cache_bytes is not 0, the cache size
+     is adjusted between GDBM_MIN_CACHESIZE and the number of entries
+     that fit in cache_bytes bytes, depending on the miss rate and on
+     the number of cache entries used during the last tuning window.
+     The window begins when the cache_stats counters were equal to
+     cache_tune_hits and cache_tune_misses. */
+  size_t cache_bytes;
+  unsigned cache_epoch;
+  gdbm_count_t cache_tune_hits;
+  gdbm_count_t cache_tune_misses;
+
+  /* Number of distinct buckets in the directory, or 0 if not yet
+     known. */
+  size_t bucket_count;
+
+  /* The data cache: a hash table of data_cache_size chains, and a list
+     of all its entries, from the most recently used one to the least
+     recently used one.  The entries occupy data_cache_bytes bytes of
+     memory, which is kept below data_cache_max whenever possible. */
+  data_cache_elem **data_cache;
+  size_t data_cache_size;
+  size_t data_cache_count;
+  size_t data_cache_bytes;
+  size_t data_cache_max;
+  data_cache_elem *data_cache_head;
+  data_cache_elem *data_cache_tail;
+
   /* Points to the current hash bucket in the cache. */
   hash_bucket *bucket;
 
@@ -256,6 +532,20 @@ struct gdbm_file_info
 
 #define GDBM_DIR_COUNT(db) ((db)->header->dir_size / sizeof (off_t))
 
+/* The home location of the hash value HASH in a bucket, and the location
+   that follows LOC.  When the number of elements in a bucket is a power
+   of two, they are computed without a division: the home location is
+   taken from the top bits of the hash value multiplied by a Fibonacci
+   constant, which depend on all of its bits. */
+#define GDBM_BUCKET_HOME(db, hash)					\
+  ((db)->bucket_shift							\
+   ? (int) (((unsigned) (hash) * 0x9e3779b1u) >> (db)->bucket_shift)	\
+   : (hash) % (db)->header->bucket_elems)
+#define GDBM_BUCKET_NEXT(db, loc)					\
+  ((db)->bucket_mask							\
+   ? ((loc) + 1) & (db)->bucket_mask					\
+   : ((loc) + 1 == (db)->header->bucket_elems ? 0 : (loc) + 1))
+
 /* Execute CODE without clobbering errno */
 #define SAVE_ERRNO(code)                        \
   do                                            \
@@ -22,12 +22,9 @@
 
 #include "gdbmdefs.h"
 
-/* Remove the KEYed item and the KEY from the database DBF.  The file on disk
-   is updated to reflect the structure of the new database before returning
-   from this procedure.  */
-
-int
-gdbm_delete (GDBM_FILE dbf, datum key)
+/* Remove KEY from the database.  See gdbm_delete, below. */
+static int
+delete_record (GDBM_FILE dbf, datum key)
 {
   int elem_loc;		/* The location in the current hash bucket. */
   int last_loc;		/* Last location emptied by the delete.  */
@@ -48,6 +45,11 @@ gdbm_delete (GDBM_FILE dbf, datum key)
   /* Initialize the gdbm_errno variable. */
   gdbm_set_errno (dbf, GDBM_NO_ERROR, FALSE);
 
+  /* Make sure committed transactions are in the file before changing
+     it outside of a transaction. */
+  if (dbf->txn_state == TXN_NONE && _gdbm_journal_checkpoint (dbf))
+    return -1;
+
   /* Find the item. */
   elem_loc = _gdbm_findkey (dbf, key, NULL, NULL);
   if (elem_loc == -1)
@@ -57,26 +59,30 @@ gdbm_delete (GDBM_FILE dbf, datum key)
   elem = dbf->bucket->h_table[elem_loc];
 
   /* Delete the element.  */
+  _gdbm_data_cache_invalidate (dbf, dbf->cache_entry->ca_adr, elem_loc);
   dbf->bucket->h_table[elem_loc].hash_value = -1;
   dbf->bucket->count--;
+  dbf->cache_entry->ca_filter_valid = FALSE;
+  dbf->cache_entry->ca_hashes_valid = FALSE;
 
   /* Move other elements to guarantee that they can be found. */
   last_loc = elem_loc;
-  elem_loc = (elem_loc + 1) % dbf->header->bucket_elems;
+  elem_loc = GDBM_BUCKET_NEXT (dbf, elem_loc);
   while (elem_loc != last_loc
 	 && dbf->bucket->h_table[elem_loc].hash_value != -1)
     {
-      home = dbf->bucket->h_table[elem_loc].hash_value
-	     % dbf->header->bucket_elems;
+      home = GDBM_BUCKET_HOME (dbf, dbf->bucket->h_table[elem_loc].hash_value);
       if ( (last_loc < elem_loc && (home <= last_loc || home > elem_loc))
 	  || (last_loc > elem_loc && home <= last_loc && home > elem_loc))
 	
 	{
 	  dbf->bucket->h_table[last_loc] = dbf->bucket->h_table[elem_loc];
 	  dbf->bucket->h_table[elem_loc].hash_value = -1;
+	  _gdbm_data_cache_move (dbf, dbf->cache_entry->ca_adr, elem_loc,
+				 dbf->cache_entry->ca_adr, last_loc);
 	  last_loc = elem_loc;
 	}
-      elem_loc = (elem_loc + 1) % dbf->header->bucket_elems;
+      elem_loc = GDBM_BUCKET_NEXT (dbf, elem_loc);
     }
 
   /* Free the file space. */
@@ -88,11 +94,23 @@ gdbm_delete (GDBM_FILE dbf, datum key)
   /* Set the flags. */
   dbf->bucket_changed = TRUE;
 
-  /* Invalidate data cache for the current bucket. */
-  dbf->cache_entry->ca_data.hash_val = -1;
-  dbf->cache_entry->ca_data.key_size = 0;
-  dbf->cache_entry->ca_data.elem_loc = -1;
-
   /* Do the writes. */
   return _gdbm_end_update (dbf);
 }
+
+/* Remove the KEYed item and the KEY from the database DBF.  The file on disk
+   is updated to reflect the structure of the new database before returning
+   from this procedure.  */
+
+int
+gdbm_delete (GDBM_FILE dbf, datum key)
+{
+#if HAVE_PTHREAD_H
+  if (dbf->group_commit)
+    {
+      _gdbm_group_lock (dbf);
+      return _gdbm_group_commit (dbf, delete_record (dbf, key));
+    }
+#endif
+  return delete_record (dbf, key);
+}
@@ -139,7 +139,9 @@ const char * const gdbm_errlist[_GDBM_MAX_ERRNO+1] = {
   [GDBM_BAD_DIR_ENTRY]          = N_("Invalid directory entry"),
   [GDBM_FILE_CLOSE_ERROR]       = N_("Error closing file"),
   [GDBM_FILE_SYNC_ERROR]        = N_("Error synchronizing file"),
-  [GDBM_FILE_TRUNCATE_ERROR]    = N_("Error truncating file")
+  [GDBM_FILE_TRUNCATE_ERROR]    = N_("Error truncating file"),
+  [GDBM_TXN_ACTIVE]             = N_("Transaction in progress"),
+  [GDBM_NO_TXN]                 = N_("No transaction in progress")
 };
 
 const char *
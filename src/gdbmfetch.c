@@ -22,6 +22,33 @@
 
 #include "gdbmdefs.h"
 
+/* Look up KEY and store in RET the associated data, as found in the
+   internal cache.  Return 0 on success and -1 on error or if KEY is not
+   found. */
+static int
+fetch_data (GDBM_FILE dbf, datum key, datum *ret)
+{
+  int    elem_loc;		/* The location in the bucket. */
+  char  *find_data;		/* Returned from find_key. */
+
+  /* Return immediately if the database needs recovery */	
+  GDBM_ASSERT_CONSISTENCY (dbf, -1);
+  
+  /* Initialize the gdbm_errno variable. */
+  gdbm_set_errno (dbf, GDBM_NO_ERROR, FALSE);
+
+  /* Find the key and return a pointer to the data. */
+  elem_loc = _gdbm_findkey (dbf, key, &find_data, NULL);
+  if (elem_loc < 0)
+    {
+      GDBM_DEBUG (GDBM_DEBUG_READ, "%s: key not found", dbf->name);
+      return -1;
+    }
+  ret->dptr = find_data;
+  ret->dsize = dbf->bucket->h_table[elem_loc].data_size;
+  return 0;
+}
+
 /* Look up a given KEY and return the information associated with that KEY.
    The pointer in the structure that is  returned is a pointer to dynamically
    allocated memory block.  */
@@ -30,8 +57,7 @@ datum
 gdbm_fetch (GDBM_FILE dbf, datum key)
 {
   datum  return_val;		/* The return value. */
-  int    elem_loc;		/* The location in the bucket. */
-  char  *find_data;		/* Returned from find_key. */
+  datum  data;			/* The data in the cache. */
 
   GDBM_DEBUG_DATUM (GDBM_DEBUG_READ, key, "%s: fetching key:", dbf->name);
 
@@ -39,20 +65,11 @@ gdbm_fetch (GDBM_FILE dbf, datum key)
   return_val.dptr  = NULL;
   return_val.dsize = 0;
 
-  /* Return immediately if the database needs recovery */	
-  GDBM_ASSERT_CONSISTENCY (dbf, return_val);
-  
-  /* Initialize the gdbm_errno variable. */
-  gdbm_set_errno (dbf, GDBM_NO_ERROR, FALSE);
-
-  /* Find the key and return a pointer to the data. */
-  elem_loc = _gdbm_findkey (dbf, key, &find_data, NULL);
-
   /* Copy the data if the key was found.  */
-  if (elem_loc >= 0)
+  if (fetch_data (dbf, key, &data) == 0)
     {
       /* This is the item.  Return the associated data. */
-      return_val.dsize = dbf->bucket->h_table[elem_loc].data_size;
+      return_val.dsize = data.dsize;
       if (return_val.dsize == 0)
 	return_val.dptr = (char *) malloc (1);
       else
@@ -62,13 +79,382 @@ gdbm_fetch (GDBM_FILE dbf, datum key)
 	  GDBM_SET_ERRNO2 (dbf, GDBM_MALLOC_ERROR, FALSE, GDBM_DEBUG_READ);
 	  return return_val;
 	}
-      memcpy (return_val.dptr, find_data, return_val.dsize);
+      memcpy (return_val.dptr, data.dptr, return_val.dsize);
       
       GDBM_DEBUG_DATUM (GDBM_DEBUG_READ, return_val,
 			"%s: found", dbf->name);
     }
-  else
-    GDBM_DEBUG (GDBM_DEBUG_READ, "%s: key not found", dbf->name);
   
   return return_val;
 }
+
+/* Look up KEY and store in RET the associated data, without copying it.
+   The returned pointer refers to the internal cache of DBF.  It remains
+   valid until the next call to any GDBM function for DBF, and must not
+   be freed.  Return 0 on success and -1 on error or if KEY is not
+   found. */
+int
+gdbm_fetch_view (GDBM_FILE dbf, datum key, datum *ret)
+{
+  GDBM_DEBUG_DATUM (GDBM_DEBUG_READ, key, "%s: fetching key:", dbf->name);
+
+  if (fetch_data (dbf, key, ret))
+    return -1;
+  GDBM_DEBUG_DATUM (GDBM_DEBUG_READ, *ret, "%s: found", dbf->name);
+  return 0;
+}
+
+/* Look up KEY and copy the associated data to BUF, which is SIZE bytes
+   long.  If the data are longer than that, only the first SIZE bytes
+   are copied.  If RET_SIZE is not NULL, the actual size of the data is
+   stored in it, so that the caller can tell whether the data have been
+   truncated.  Return 0 on success and -1 on error or if KEY is not
+   found. */
+int
+gdbm_fetch_into (GDBM_FILE dbf, datum key, void *buf, size_t size,
+		 size_t *ret_size)
+{
+  datum data;
+
+  GDBM_DEBUG_DATUM (GDBM_DEBUG_READ, key, "%s: fetching key:", dbf->name);
+
+  if (fetch_data (dbf, key, &data))
+    return -1;
+  memcpy (buf, data.dptr, (size_t) data.dsize < size ? data.dsize : size);
+  if (ret_size)
+    *ret_size = data.dsize;
+  GDBM_DEBUG_DATUM (GDBM_DEBUG_READ, data, "%s: found", dbf->name);
+  return 0;
+}
+
+/* Batched look-ups.
+
+   gdbm_fetch_many looks up all the keys at once.  The keys are sorted
+   by the address of their bucket, so that each bucket is loaded only
+   once and the buckets are read in file order.  Within a bucket, the
+   elements matching each key are located first, and the records are
+   then read in the order of their file offsets.
+
+   When the database uses io_uring (GDBM_IOURING), the buckets of the
+   next FETCH_AHEAD groups of keys are read at once, and the records
+   that are not in the data cache are collected and read in batches of
+   at least FETCH_AHEAD, so that many reads are in flight at a time. */
+
+#define FETCH_AHEAD 32
+
+struct fetch_req
+{
+  size_t index;     /* Index of the key in the input array. */
+  int hash_val;     /* Hash value of the key. */
+  int bucket_dir;   /* Directory entry of its bucket. */
+  int elem_loc;     /* Home location, then location of the element. */
+  off_t adr;        /* Bucket address, then data address. */
+};
+
+static int
+fetch_req_cmp (const void *a, const void *b)
+{
+  struct fetch_req const *ra = a;
+  struct fetch_req const *rb = b;
+
+  if (ra->adr < rb->adr)
+    return -1;
+  if (ra->adr > rb->adr)
+    return 1;
+  if (ra->index < rb->index)
+    return -1;
+  return ra->index > rb->index;
+}
+
+/* Return the location of the first element of the current bucket that
+   may hold KEY, which has hash value HASH_VAL and home location
+   ELEM_LOC, or -1 if there is none.  Only the part of the key stored in
+   the bucket is compared. */
+static int
+find_candidate (GDBM_FILE dbf, datum key, int hash_val, int elem_loc)
+{
+  int home_loc = elem_loc;
+  int count;
+  char key_check[SMALL];
+  int key_check_len;
+
+  if (dbf->bucket_filter && !_gdbm_bucket_filter_test (dbf, hash_val))
+    {
+      dbf->cache_stats.filter_rejects++;
+      return -1;
+    }
+  key_check_len = _gdbm_key_check (dbf, key, key_check);
+  count = dbf->header->bucket_elems;
+  while ((elem_loc = _gdbm_bucket_probe (dbf, hash_val, elem_loc, count))
+	 != -1)
+    {
+      bucket_element *elem = &dbf->bucket->h_table[elem_loc];
+
+      if (elem->key_size == key.dsize
+	  && memcmp (elem->key_start, key_check, key_check_len) == 0)
+	return elem_loc;
+      count = home_loc - elem_loc - 1;
+      if (count < 0)
+	count += dbf->header->bucket_elems;
+      elem_loc = GDBM_BUCKET_NEXT (dbf, elem_loc);
+    }
+  return -1;
+}
+
+/* Store a copy of DSIZE bytes of data at DPTR in RET.  Return 0 on
+   success and -1 on error.  DPTR usually points to a data cache entry,
+   which the next record read may drop, so gdbm_fetch_many copies each
+   record as soon as it is found. */
+static int
+copy_result (GDBM_FILE dbf, char *dptr, int dsize, datum *ret)
+{
+  ret->dptr = malloc (dsize ? dsize : 1);
+  if (ret->dptr == NULL)
+    {
+      GDBM_SET_ERRNO2 (dbf, GDBM_MALLOC_ERROR, FALSE, GDBM_DEBUG_READ);
+      return -1;
+    }
+  memcpy (ret->dptr, dptr, dsize);
+  ret->dsize = dsize;
+  return 0;
+}
+
+/* A record read deferred by gdbm_fetch_many. */
+struct fetch_read
+{
+  size_t index;     /* Index of the key in the input array. */
+  int data_size;    /* Size of the data. */
+  char *buf;        /* Key followed by data. */
+};
+
+/* Read the COUNT records described by RD and IO, and store them in
+   RESULTS.  KEYS are the input keys.  Return the number of keys found,
+   or -1 on error. */
+static int
+fetch_read_run (GDBM_FILE dbf, datum const *keys, datum *results,
+		struct fetch_read *rd, struct gdbm_io_req *io, size_t count)
+{
+  size_t i;
+  int found = 0;
+  int rc;
+
+  rc = _gdbm_io_run (dbf, io, count);
+  for (i = 0; i < count; i++)
+    {
+      datum key = keys[rd[i].index];
+      char *file_key;
+      int elem_loc;
+
+      if (rc == 0 && memcmp (rd[i].buf, key.dptr, key.dsize) == 0)
+	{
+	  memmove (rd[i].buf, rd[i].buf + key.dsize, rd[i].data_size);
+	  results[rd[i].index].dptr = rd[i].buf;
+	  results[rd[i].index].dsize = rd[i].data_size;
+	  found++;
+	  continue;
+	}
+      free (rd[i].buf);
+      if (rc)
+	continue;
+
+      /* Hash collision: do a regular look-up. */
+      elem_loc = _gdbm_findkey (dbf, key, &file_key, NULL);
+      if (elem_loc < 0)
+	{
+	  if (gdbm_errno != GDBM_ITEM_NOT_FOUND)
+	    rc = -1;
+	  continue;
+	}
+      if (copy_result (dbf, file_key,
+		       dbf->bucket->h_table[elem_loc].data_size,
+		       &results[rd[i].index]))
+	rc = -1;
+      else
+	found++;
+    }
+  return rc ? -1 : found;
+}
+
+/* Look up the records for N keys from the array KEYS, and store them
+   in the corresponding elements of RESULTS, as gdbm_fetch would do.
+   The data must be freed by the caller.  For keys that are not found,
+   the dptr member is set to NULL.  Return the number of keys found,
+   or -1 on error, in which case all dptr members are NULL. */
+int
+gdbm_fetch_many (GDBM_FILE dbf, datum const *keys, size_t n, datum *results)
+{
+  struct fetch_req *req;
+  struct fetch_read *rd = NULL;
+  struct gdbm_io_req *io = NULL;
+  size_t nrd = 0;
+  size_t i, j, k;
+  int found = 0;
+  int rc;
+
+  /* Return immediately if the database needs recovery */	
+  GDBM_ASSERT_CONSISTENCY (dbf, -1);
+  
+  /* Initialize the gdbm_errno variable. */
+  gdbm_set_errno (dbf, GDBM_NO_ERROR, FALSE);
+
+  for (i = 0; i < n; i++)
+    {
+      results[i].dptr = NULL;
+      results[i].dsize = 0;
+    }
+  if (n == 0)
+    return 0;
+  
+  req = calloc (n, sizeof (req[0]));
+  if (!req)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+      return -1;
+    }
+  
+  for (i = 0; i < n; i++)
+    {
+      req[i].index = i;
+      _gdbm_hash_key (dbf, keys[i], &req[i].hash_val, &req[i].bucket_dir,
+		      &req[i].elem_loc);
+      req[i].adr = dbf->dir[req[i].bucket_dir];
+    }
+  qsort (req, n, sizeof (req[0]), fetch_req_cmp);
+
+  if (dbf->uring && !dbf->memory_mapping)
+    {
+      rd = calloc (n, sizeof (rd[0]));
+      io = calloc (n, sizeof (io[0]));
+      if (!rd || !io)
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+	  goto err;
+	}
+    }
+
+  for (i = 0; i < n; i = j)
+    {
+      if (rd && nrd >= FETCH_AHEAD)
+	{
+	  rc = fetch_read_run (dbf, keys, results, rd, io, nrd);
+	  nrd = 0;
+	  if (rc == -1)
+	    goto err;
+	  found += rc;
+	}
+      if (rd && _gdbm_cache_lookup (dbf, req[i].adr) == -1)
+	{
+	  /* Read the buckets for the next groups of keys. */
+	  off_t adr[FETCH_AHEAD];
+	  size_t nadr = 0;
+
+	  for (k = i; k < n && nadr < FETCH_AHEAD; k++)
+	    if (nadr == 0 || adr[nadr - 1] != req[k].adr)
+	      adr[nadr++] = req[k].adr;
+	  if (_gdbm_cache_prefetch (dbf, adr, nadr))
+	    goto err;
+	}
+
+      /* Requests I to J-1 refer to the same bucket. */
+      for (j = i + 1; j < n && req[j].adr == req[i].adr; j++)
+	;
+      if (_gdbm_get_bucket (dbf, req[i].bucket_dir))
+	goto err;
+
+      /* Locate the elements and sort them by data address. */
+      for (k = i; k < j; k++)
+	{
+	  req[k].elem_loc = find_candidate (dbf, keys[req[k].index],
+					    req[k].hash_val,
+					    req[k].elem_loc);
+	  req[k].adr = req[k].elem_loc == -1
+	                 ? 0
+	                 : dbf->bucket->h_table[req[k].elem_loc].data_pointer;
+	}
+      qsort (req + i, j - i, sizeof (req[0]), fetch_req_cmp);
+
+      /* Read the records. */
+      for (k = i; k < j; k++)
+	{
+	  datum key = keys[req[k].index];
+	  char *file_key;
+	  int elem_loc = req[k].elem_loc;
+
+	  if (elem_loc == -1)
+	    continue;
+	  if (rd && !_gdbm_data_cache_lookup (dbf, dbf->cache_entry->ca_adr,
+					      dbf->bucket, elem_loc))
+	    {
+	      /* Defer reading the record. */
+	      bucket_element *elem = &dbf->bucket->h_table[elem_loc];
+	      size_t size = elem->key_size + elem->data_size;
+
+	      if (!gdbm_bucket_element_valid_p (dbf, elem_loc))
+		{
+		  GDBM_SET_ERRNO (dbf, GDBM_BAD_HASH_TABLE, TRUE);
+		  goto err;
+		}
+	      rd[nrd].index = req[k].index;
+	      rd[nrd].data_size = elem->data_size;
+	      rd[nrd].buf = malloc (size ? size : 1);
+	      if (!rd[nrd].buf)
+		{
+		  GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+		  goto err;
+		}
+	      _gdbm_io_req_init (&io[nrd], FALSE, rd[nrd].buf, size,
+				 elem->data_pointer);
+	      nrd++;
+	      continue;
+	    }
+	  file_key = _gdbm_read_entry (dbf, elem_loc);
+	  if (!file_key)
+	    goto err;
+	  if (memcmp (file_key, key.dptr, key.dsize) != 0)
+	    {
+	      /* Hash collision: do a regular look-up. */
+	      elem_loc = _gdbm_findkey (dbf, key, &file_key, NULL);
+	      if (elem_loc < 0)
+		{
+		  if (gdbm_errno != GDBM_ITEM_NOT_FOUND)
+		    goto err;
+		  continue;
+		}
+	    }
+	  else
+	    file_key += key.dsize;
+	  if (copy_result (dbf, file_key,
+			   dbf->bucket->h_table[elem_loc].data_size,
+			   &results[req[k].index]))
+	    goto err;
+	  found++;
+	}
+    }
+  if (nrd)
+    {
+      rc = fetch_read_run (dbf, keys, results, rd, io, nrd);
+      nrd = 0;
+      if (rc == -1)
+	goto err;
+      found += rc;
+    }
+  free (req);
+  free (rd);
+  free (io);
+  gdbm_set_errno (dbf, GDBM_NO_ERROR, FALSE);
+  return found;
+
+ err:
+  for (i = 0; i < nrd; i++)
+    free (rd[i].buf);
+  free (req);
+  free (rd);
+  free (io);
+  for (i = 0; i < n; i++)
+    {
+      free (results[i].dptr);
+      results[i].dptr = NULL;
+      results[i].dsize = 0;
+    }
+  return -1;
+}
@@ -24,24 +24,91 @@
 # include "gdbmdefs.h"
 # include "gdbm.h"
 
+/* Records read from a binary flat file, for gdbm_bulk_load. */
+struct import_source
+{
+  FILE *fp;
+  char *kbuffer, *dbuffer;
+  size_t kbufsize, dbufsize;
+  int ec;                   /* Error code */
+  int count;                /* Number of records read */
+};
+
+/* Read a datum from the file of SRC into the buffer *PBUF of *PBUFSIZE
+   bytes, reallocating it if necessary.  Return 0 on success, and the
+   error code otherwise. */
+static int
+import_datum (struct import_source *src, char **pbuf, size_t *pbufsize,
+	      datum *dat)
+{
+  unsigned long rsize, size;
+
+  if (fread (&rsize, sizeof (rsize), 1, src->fp) != 1)
+    return GDBM_FILE_READ_ERROR;
+  size = ntohl (rsize);
+  if (size > INT_MAX)
+    return GDBM_ILLEGAL_DATA;
+  if (size > *pbufsize)
+    {
+      size_t bufsize = size + GDBM_MIN_BLOCK_SIZE;
+      char *buf = realloc (*pbuf, bufsize);
+      if (buf == NULL)
+	return GDBM_MALLOC_ERROR;
+      *pbuf = buf;
+      *pbufsize = bufsize;
+    }
+  if (fread (*pbuf, size, 1, src->fp) != 1)
+    return GDBM_FILE_READ_ERROR;
+  dat->dptr = *pbuf;
+  dat->dsize = (int) size;
+  return 0;
+}
+
+/* Read the next record from SRC into KEY and DATA.  Return 0 on
+   success, 1 at the end of file and -1 on error, storing the error
+   code in SRC->ec. */
+static int
+import_next (void *closure, datum *key, datum *data)
+{
+  struct import_source *src = closure;
+  int c;
+
+  c = fgetc (src->fp);
+  if (c == EOF)
+    {
+      if (!ferror (src->fp))
+	return 1;
+      src->ec = GDBM_FILE_READ_ERROR;
+    }
+  else
+    {
+      ungetc (c, src->fp);
+      src->ec = import_datum (src, &src->kbuffer, &src->kbufsize, key);
+      if (src->ec == GDBM_NO_ERROR)
+	src->ec = import_datum (src, &src->dbuffer, &src->dbufsize, data);
+      if (src->ec == GDBM_NO_ERROR)
+	{
+	  src->count++;
+	  return 0;
+	}
+    }
+  GDBM_SET_ERRNO (NULL, src->ec, FALSE);
+  return -1;
+}
+
 int
 gdbm_import_from_file (GDBM_FILE dbf, FILE *fp, int flag)
 {
   int seenbang, seennewline, rret;
-  unsigned long rsize, size;
-  int ec;
-  char *kbuffer, *dbuffer;
-  size_t kbufsize, dbufsize;
+  struct import_source src;
   datum key, data;
-  int count = 0;
+  int ec;
 
   /* Return immediately if the database needs recovery */	
   GDBM_ASSERT_CONSISTENCY (dbf, -1);
   
   seenbang = 0;
   seennewline = 0;
-  kbuffer = NULL;
-  dbuffer = NULL;
 
   /* Read (and discard) four lines begining with ! and ending with \n. */
   while (1)
@@ -66,103 +133,53 @@ gdbm_import_from_file (GDBM_FILE dbf, FILE *fp, int flag)
     }
 
   /* Allocate buffers. */
-  kbufsize = GDBM_MIN_BLOCK_SIZE;
-  kbuffer = malloc (kbufsize);
-  if (kbuffer == NULL)
+  memset (&src, 0, sizeof (src));
+  src.fp = fp;
+  src.kbufsize = GDBM_MIN_BLOCK_SIZE;
+  src.kbuffer = malloc (src.kbufsize);
+  if (src.kbuffer == NULL)
     {
       GDBM_SET_ERRNO (NULL, GDBM_MALLOC_ERROR, FALSE);
       return -1;
     }
-  dbufsize = GDBM_MIN_BLOCK_SIZE;
-  dbuffer = malloc (dbufsize);
-  if (dbuffer == NULL)
+  src.dbufsize = GDBM_MIN_BLOCK_SIZE;
+  src.dbuffer = malloc (src.dbufsize);
+  if (src.dbuffer == NULL)
     {
-      free (kbuffer);
+      free (src.kbuffer);
       GDBM_SET_ERRNO (NULL, GDBM_MALLOC_ERROR, FALSE);
       return -1;
     }
 
   ec = GDBM_NO_ERROR;
-  /* Insert/replace records in the database until we run out of file. */
-  while ((rret = fread (&rsize, sizeof (rsize), 1, fp)) == 1)
+  if (flag == GDBM_REPLACE)
     {
-      /* Read the key. */
-      size = ntohl (rsize);
-      if (size > INT_MAX)
-	{
-	  ec = GDBM_ILLEGAL_DATA;
-	  break;
-	}
-      
-      if (size > kbufsize)
-	{
-	  kbufsize = (size + GDBM_MIN_BLOCK_SIZE);
-	  kbuffer = realloc (kbuffer, kbufsize);
-	  if (kbuffer == NULL)
-	    {
-	      ec = GDBM_MALLOC_ERROR;
-	      break;
-	    }
-	}
-      if (fread (kbuffer, size, 1, fp) != 1)
-	{
-	  ec = GDBM_FILE_READ_ERROR;
-	  break;
-	}
-
-      key.dptr = kbuffer;
-      key.dsize = (int) size;
-
-      /* Read the data. */
-      if (fread (&rsize, sizeof (rsize), 1, fp) != 1)
-	{
-	  ec = GDBM_FILE_READ_ERROR;
-	  break;
-	}
-
-      size = ntohl (rsize);
-      if (size > INT_MAX)
-	{
-	  ec = GDBM_ILLEGAL_DATA;
-	  break;
-	}
-      if (size > dbufsize)
+      /* The last record with a given key wins, as when storing them one
+	 by one, so an empty database can be built directly. */
+      if (gdbm_bulk_load (dbf, import_next, &src, flag, NULL))
+	ec = src.ec != GDBM_NO_ERROR ? src.ec : gdbm_errno;
+    }
+  else
+    {
+      /* Insert records in the database until we run out of file. */
+      while ((rret = import_next (&src, &key, &data)) == 0)
 	{
-	  dbufsize = (size + GDBM_MIN_BLOCK_SIZE);
-	  dbuffer = realloc (dbuffer, dbufsize);
-	  if (dbuffer == NULL)
+	  if (gdbm_store (dbf, key, data, flag) != 0)
 	    {
-	      ec = GDBM_MALLOC_ERROR;
+	      /* Keep the existing errno. */
+	      ec = gdbm_errno;
 	      break;
 	    }
 	}
-      if (fread (dbuffer, size, 1, fp) != 1)
-	{
-	  ec = GDBM_FILE_READ_ERROR;
-	  break;
-	}
-
-      data.dptr = dbuffer;
-      data.dsize = (int) size;
-
-      if (gdbm_store (dbf, key, data, flag) != 0)
-	{
-	  /* Keep the existing errno. */
-	  ec = gdbm_errno;
-	  break;
-	}
-
-      count++;
+      if (rret == -1)
+	ec = src.ec;
     }
 
-  if (rret < 0)
-    ec = GDBM_FILE_READ_ERROR;
-  
-  free (kbuffer);
-  free (dbuffer);
+  free (src.kbuffer);
+  free (src.dbuffer);
 
   if (ec == GDBM_NO_ERROR)
-    return count;
+    return src.count;
 
   GDBM_SET_ERRNO (NULL, ec, FALSE);
   return -1;
@@ -390,11 +390,46 @@ _set_gdbm_meta_info (GDBM_FILE dbf, char *param, int meta_mask)
   return 0;
 }
 
+/* Records read from an ASCII dump, for gdbm_bulk_load. */
+struct load_source
+{
+  struct dump_file *file;
+  char *param;              /* Parameters of the first record */
+  int rc;                   /* Error code */
+};
+
+/* Read the next record from the dump file of SRC into KEY and CONTENT.
+   Return 0 on success, 1 at the end of input and -1 on error, storing
+   the error code in SRC->rc. */
+static int
+load_next (void *data, datum *key, datum *content)
+{
+  struct load_source *src = data;
+  int rc;
+
+  rc = read_record (src->file, src->param, 0, key);
+  if (rc)
+    {
+      if (rc == GDBM_ITEM_NOT_FOUND && feof (src->file->fp))
+	return 1;
+    }
+  else
+    {
+      src->param = NULL;
+      rc = read_record (src->file, NULL, 1, content);
+      if (rc == 0)
+	return 0;
+    }
+  src->rc = rc;
+  GDBM_SET_ERRNO (NULL, rc, FALSE);
+  return -1;
+}
+
 int
 _gdbm_load_file (struct dump_file *file, GDBM_FILE dbf, GDBM_FILE *ofp,
 		 int replace, int meta_mask)
 {
-  char *param = NULL;
+  struct load_source src;
   int rc;
   GDBM_FILE tmp = NULL;
   
@@ -422,29 +457,32 @@ _gdbm_load_file (struct dump_file *file, GDBM_FILE dbf, GDBM_FILE *ofp,
 	return gdbm_errno;
       dbf = tmp;
     }
-  
-  param = file->header;
-  while (1)
+
+  src.file = file;
+  src.param = file->header;
+  src.rc = 0;
+  if (replace == GDBM_REPLACE)
+    {
+      /* The last record with a given key wins, as when storing them one
+	 by one, so an empty database can be built directly. */
+      if (gdbm_bulk_load (dbf, load_next, &src, replace, NULL))
+	rc = src.rc ? src.rc : gdbm_errno;
+    }
+  else
     {
       datum key, content;
-      rc = read_record (file, param, 0, &key);
-      if (rc)
-	{
-	  if (rc == GDBM_ITEM_NOT_FOUND && feof (file->fp))
-	    rc = 0;
-	  break;
-	}
-      param = NULL;
+      int res;
 
-      rc = read_record (file, NULL, 1, &content);
-      if (rc)
-	break;
-      
-      if (gdbm_store (dbf, key, content, replace))
+      while ((res = load_next (&src, &key, &content)) == 0)
 	{
-	  rc = gdbm_errno;
-	  break;
+	  if (gdbm_store (dbf, key, content, replace))
+	    {
+	      rc = gdbm_errno;
+	      break;
+	    }
 	}
+      if (res == -1)
+	rc = src.rc;
     }
 
   if (rc == 0)
@@ -26,8 +26,10 @@
 /* Determine our native magic number and bail if we can't. */
 #if SIZEOF_OFF_T == 4
 # define GDBM_MAGIC	GDBM_MAGIC32
+# define GDBM_EXT_MAGIC	GDBM_EXT_MAGIC32
 #elif SIZEOF_OFF_T == 8
 # define GDBM_MAGIC	GDBM_MAGIC64
+# define GDBM_EXT_MAGIC	GDBM_EXT_MAGIC64
 #else
 # error "Unsupported off_t size, contact GDBM maintainer.  What crazy system is this?!?"
 #endif
@@ -56,6 +58,22 @@ bucket_element_count (size_t bucket_size)
   return (bucket_size - sizeof (hash_bucket)) / sizeof (bucket_element) + 1;
 }
 
+/* Return the number of elements in a bucket of BUCKET_SIZE bytes of a
+   database with the FEATURES: the largest power of two that fits for
+   GDBM_FEAT_POW2BUCKETS. */
+static int
+bucket_elems_for (size_t bucket_size, unsigned features)
+{
+  int n = bucket_element_count (bucket_size);
+
+  if (features & GDBM_FEAT_POW2BUCKETS)
+    {
+      while (n & (n - 1))
+	n &= n - 1;
+    }
+  return n;
+}
+
 static int
 avail_comp (void const *a, void const *b)
 {
@@ -132,13 +150,41 @@ gdbm_bucket_avail_table_validate (GDBM_FILE dbf, hash_bucket *bucket)
   return 0;
 }
 
+/* Return the size of the header block of the database with the file
+   header HDR, not counting the avail table past its first entry. */
+static size_t
+header_size (gdbm_file_header const *hdr)
+{
+  return hdr->header_magic == GDBM_EXT_MAGIC
+           ? sizeof (gdbm_file_extended_header)
+           : sizeof (gdbm_file_standard_header);
+}
+
+/* Set the pointers to the parts of the header block of DBF. */
+static void
+header_setup (GDBM_FILE dbf)
+{
+  if (dbf->header->header_magic == GDBM_EXT_MAGIC)
+    {
+      gdbm_file_extended_header *xh =
+	(gdbm_file_extended_header *) dbf->header;
+      dbf->xheader = &xh->ext;
+      dbf->avail = &xh->avail;
+    }
+  else
+    {
+      dbf->xheader = NULL;
+      dbf->avail = &((gdbm_file_standard_header *) dbf->header)->avail;
+    }
+}
+
 static int
 validate_header (gdbm_file_header const *hdr, struct stat const *st)
 {
   int dir_size, dir_bits;
   
   /* Is the magic number good? */
-  if (hdr->header_magic != GDBM_MAGIC)
+  if (hdr->header_magic != GDBM_MAGIC && hdr->header_magic != GDBM_EXT_MAGIC)
     {
       switch (hdr->header_magic)
 	{
@@ -149,10 +195,14 @@ validate_header (gdbm_file_header const *hdr, struct stat const *st)
 	case GDBM_OMAGIC_SWAP:
 	case GDBM_MAGIC32_SWAP:
 	case GDBM_MAGIC64_SWAP:
+	case GDBM_EXT_MAGIC32_SWAP:
+	case GDBM_EXT_MAGIC64_SWAP:
 	  return GDBM_BYTE_SWAPPED;
 
 	case GDBM_MAGIC32:
 	case GDBM_MAGIC64:
+	case GDBM_EXT_MAGIC32:
+	case GDBM_EXT_MAGIC64:
 	  return GDBM_BAD_FILE_OFFSET;
 
 	default:
@@ -161,22 +211,23 @@ validate_header (gdbm_file_header const *hdr, struct stat const *st)
     }
   
   if (!(hdr->block_size > 0
-	&& hdr->block_size > sizeof (gdbm_file_header)
-	&& hdr->block_size - sizeof (gdbm_file_header) >=
-	sizeof(hdr->avail.av_table[0])))
+	&& hdr->block_size > header_size (hdr)
+	&& hdr->block_size - header_size (hdr) >= sizeof (avail_elem)))
     {
       return GDBM_BLOCK_SIZE_ERROR;
     }
 
-  if (hdr->next_block != st->st_size)
+  /* The file can be longer than next_block, as it is grown in steps
+     (see _gdbm_file_grow) and trimmed when the database is closed. */
+  if (hdr->next_block > st->st_size)
     /* FIXME: Should return GDBM_NEED_RECOVERY instead? */
     return GDBM_BAD_HEADER;
 
   /* Make sure dir and dir + dir_size fall within the file boundary */
   if (!(hdr->dir > 0
-	&& hdr->dir < st->st_size
+	&& hdr->dir < hdr->next_block
 	&& hdr->dir_size > 0
-	&& hdr->dir + hdr->dir_size < st->st_size))
+	&& hdr->dir + hdr->dir_size < hdr->next_block))
     return GDBM_BAD_HEADER;
 
   compute_directory_size (hdr->block_size, &dir_size, &dir_bits);
@@ -189,15 +240,69 @@ validate_header (gdbm_file_header const *hdr, struct stat const *st)
   if (!(hdr->bucket_size > sizeof(hash_bucket)))
     return GDBM_BAD_HEADER;
 
-  if (hdr->bucket_elems != bucket_element_count (hdr->bucket_size))
+  return 0;
+}
+
+/* Validate the parts of the header block of DBF that follow the file
+   header. */
+static int
+validate_header_block (GDBM_FILE dbf)
+{
+  if (((dbf->header->block_size - header_size (dbf->header))
+       / sizeof (avail_elem) + 1) != dbf->avail->size)
+    return GDBM_BAD_HEADER;
+
+  /* Refuse features this version does not know about. */
+  if (dbf->xheader
+      && (dbf->xheader->version != 0
+	  || (dbf->xheader->features & ~GDBM_FEAT_MASK)))
+    return GDBM_BAD_HEADER;
+
+  if (dbf->header->bucket_elems
+      != bucket_elems_for (dbf->header->bucket_size,
+			   dbf->xheader ? dbf->xheader->features : 0))
     return GDBM_BAD_HEADER;
 
-  if (((hdr->block_size - sizeof (gdbm_file_header)) / sizeof(avail_elem) + 1)
-      != hdr->avail.size)
-    return GDBM_BAD_HEADER;    
-  
   return 0;
 }
+
+/* Return the features to give to a database created with FLAGS. */
+static unsigned
+flags_to_features (int flags)
+{
+  unsigned features = 0;
+
+  if (flags & GDBM_SIZECLASS)
+    features |= GDBM_FEAT_SIZECLASS;
+  if (flags & GDBM_FASTHASH)
+    features |= GDBM_FEAT_FASTHASH;
+  if (flags & GDBM_FINGERPRINT)
+    features |= GDBM_FEAT_FINGERPRINT;
+  if (flags & GDBM_POW2BUCKETS)
+    features |= GDBM_FEAT_POW2BUCKETS;
+  return features;
+}
+
+/* Return the gdbm_open flags that create a database with the same
+   features as DBF. */
+int
+_gdbm_feature_flags (GDBM_FILE dbf)
+{
+  int flags = 0;
+
+  if (dbf->xheader)
+    {
+      if (dbf->xheader->features & GDBM_FEAT_SIZECLASS)
+	flags |= GDBM_SIZECLASS;
+      if (dbf->xheader->features & GDBM_FEAT_FASTHASH)
+	flags |= GDBM_FASTHASH;
+      if (dbf->xheader->features & GDBM_FEAT_FINGERPRINT)
+	flags |= GDBM_FINGERPRINT;
+      if (dbf->xheader->features & GDBM_FEAT_POW2BUCKETS)
+	flags |= GDBM_POW2BUCKETS;
+    }
+  return flags;
+}
   
 /* Do we have ftruncate? */
 static inline int
@@ -214,13 +319,14 @@ _gdbm_ftruncate (GDBM_FILE dbf)
 #endif
 }
 
-GDBM_FILE 
-gdbm_fd_open (int fd, const char *file_name, int block_size,
-	      int flags, void (*fatal_func) (const char *))
+/* Open the database file FD, whose name is FILE_NAME.  NAMED is true
+   if FILE_NAME is the path of the file. */
+static GDBM_FILE
+fd_open (int fd, const char *file_name, int block_size,
+	 int flags, void (*fatal_func) (const char *), int named)
 {
   GDBM_FILE dbf;		/* The record to return. */
   struct stat file_stat;	/* Space for the stat information. */
-  off_t       file_pos;		/* Used with seeks. */
   int 	      index;		/* Used as a loop index. */
   
   /* Initialize the gdbm_errno variable. */
@@ -254,6 +360,24 @@ gdbm_fd_open (int fd, const char *file_name, int block_size,
   dbf->header = NULL;
   dbf->bucket_cache = NULL;
   dbf->cache_size = 0;
+  dbf->cache_index = NULL;
+  dbf->cache_index_size = 0;
+  dbf->cache_policy = GDBM_CACHE_FIFO;
+  dbf->data_cache_max = DEFAULT_DATA_CACHE_SIZE;
+  dbf->bulk_buf_size = DEFAULT_BULK_BUF_SIZE;
+  dbf->grow_chunk = DEFAULT_GROW_CHUNK;
+  dbf->grow_percent = DEFAULT_GROW_PERCENT;
+  dbf->punch_hole = 0;
+  dbf->punch_list = NULL;
+  dbf->punch_count = 0;
+  dbf->punch_max = 0;
+  dbf->hash = _gdbm_hash;
+  dbf->reorg_hash = -1;
+  dbf->key_fingerprint = FALSE;
+  dbf->reorg_fingerprint = -1;
+  dbf->bucket_mask = 0;
+  dbf->bucket_shift = 0;
+  dbf->journal_fd = -1;
 
   dbf->memory_mapping = FALSE;
   dbf->mapped_size_max = SIZE_T_MAX;
@@ -272,6 +396,7 @@ gdbm_fd_open (int fd, const char *file_name, int block_size,
       GDBM_SET_ERRNO2 (NULL, GDBM_MALLOC_ERROR, FALSE, GDBM_DEBUG_OPEN);
       return NULL;
     }
+  dbf->name_is_path = named;
 
   /* Initialize the fatal error routine. */
   dbf->fatal_err = fatal_func;
@@ -355,6 +480,25 @@ gdbm_fd_open (int fd, const char *file_name, int block_size,
 	}
     }
 
+  /* Write the transactions committed to the journal to the file. */
+  switch (_gdbm_journal_replay (dbf, file_stat.st_size == 0))
+    {
+    case 0:
+      break;
+
+    case 1:
+      if (fstat (dbf->desc, &file_stat) == 0)
+	break;
+      GDBM_SET_ERRNO2 (dbf, GDBM_FILE_STAT_ERROR, FALSE, GDBM_DEBUG_OPEN);
+      /* fall through */
+    default:
+      if (flags & GDBM_CLOERROR)
+	SAVE_ERRNO (close (dbf->desc));
+      free (dbf->name);
+      free (dbf);
+      return NULL;
+    }
+
   /* Decide if this is a new file or an old file. */
   if (file_stat.st_size == 0)
     {
@@ -399,11 +543,16 @@ gdbm_fd_open (int fd, const char *file_name, int block_size,
 	  return NULL;
 	}
 
-      /* Set the magic number and the block_size. */
-      dbf->header->header_magic = GDBM_MAGIC;
+      /* Set the magic number and the block_size.  A database with
+	 optional features has an extension header. */
+      dbf->header->header_magic =
+	flags_to_features (flags) ? GDBM_EXT_MAGIC : GDBM_MAGIC;
       dbf->header->block_size = block_size;
       dbf->header->dir_size = dir_size;
       dbf->header->dir_bits = dir_bits;
+      header_setup (dbf);
+      if (dbf->xheader)
+	dbf->xheader->features = flags_to_features (flags);
 
       /* Allocate the space for the directory. */
       dbf->dir = (off_t *) malloc (dbf->header->dir_size);
@@ -418,7 +567,8 @@ gdbm_fd_open (int fd, const char *file_name, int block_size,
       dbf->header->dir = dbf->header->block_size;
 
       /* Create the first and only hash bucket. */
-      dbf->header->bucket_elems = bucket_element_count (dbf->header->block_size);
+      dbf->header->bucket_elems =
+	bucket_elems_for (dbf->header->block_size, flags_to_features (flags));
       dbf->header->bucket_size  = dbf->header->block_size;
       dbf->bucket = calloc (1, dbf->header->bucket_size);
       if (dbf->bucket == NULL)
@@ -430,25 +580,31 @@ gdbm_fd_open (int fd, const char *file_name, int block_size,
 	  return NULL;
 	}
       _gdbm_new_bucket (dbf, dbf->bucket, 0);
-      dbf->bucket->av_count = 1;
-      dbf->bucket->bucket_avail[0].av_adr = 3*dbf->header->block_size;
-      dbf->bucket->bucket_avail[0].av_size = dbf->header->block_size;
+      /* The size-class allocator does not use the avail tables of the
+	 buckets, so no spare block is needed. */
+      if (!(flags & GDBM_SIZECLASS))
+	{
+	  dbf->bucket->av_count = 1;
+	  dbf->bucket->bucket_avail[0].av_adr = 3*dbf->header->block_size;
+	  dbf->bucket->bucket_avail[0].av_size = dbf->header->block_size;
+	}
 
       /* Set table entries to point to hash buckets. */
       for (index = 0; index < GDBM_DIR_COUNT (dbf); index++)
 	dbf->dir[index] = 2*dbf->header->block_size;
 
       /* Initialize the active avail block. */
-      dbf->header->avail.size
-	= ( (dbf->header->block_size - sizeof (gdbm_file_header))
+      dbf->avail->size
+	= ( (dbf->header->block_size - header_size (dbf->header))
 	 / sizeof (avail_elem)) + 1;
-      dbf->header->avail.count = 0;
-      dbf->header->avail.next_block = 0;
-      dbf->header->next_block  = 4*dbf->header->block_size;
+      dbf->avail->count = 0;
+      dbf->avail->next_block = 0;
+      dbf->header->next_block = (dbf->bucket->av_count ? 4 : 3)
+	                          * dbf->header->block_size;
 
       /* Write initial configuration to the file. */
       /* Block 0 is the file header and active avail block. */
-      if (_gdbm_full_write (dbf, dbf->header, dbf->header->block_size))
+      if (_gdbm_full_pwrite (dbf, dbf->header, dbf->header->block_size, 0))
 	{
 	  GDBM_DEBUG (GDBM_DEBUG_OPEN|GDBM_DEBUG_ERR,
 		      "%s: error writing header: %s",
@@ -460,7 +616,8 @@ gdbm_fd_open (int fd, const char *file_name, int block_size,
 	}
 
       /* Block 1 is the initial bucket directory. */
-      if (_gdbm_full_write (dbf, dbf->dir, dbf->header->dir_size))
+      if (_gdbm_full_pwrite (dbf, dbf->dir, dbf->header->dir_size,
+			     dbf->header->dir))
 	{
 	  GDBM_DEBUG (GDBM_DEBUG_OPEN|GDBM_DEBUG_ERR,
 		      "%s: error writing directory: %s",
@@ -472,7 +629,8 @@ gdbm_fd_open (int fd, const char *file_name, int block_size,
 	}
 
       /* Block 2 is the only bucket. */
-      if (_gdbm_full_write (dbf, dbf->bucket, dbf->header->bucket_size))
+      if (_gdbm_full_pwrite (dbf, dbf->bucket, dbf->header->bucket_size,
+			     dbf->dir[0]))
 	{
 	  GDBM_DEBUG (GDBM_DEBUG_OPEN|GDBM_DEBUG_ERR,
 		      "%s: error writing bucket: %s",
@@ -508,7 +666,8 @@ gdbm_fd_open (int fd, const char *file_name, int block_size,
       int rc;
       
       /* Read the partial file header. */
-      if (_gdbm_full_read (dbf, &partial_header, sizeof (gdbm_file_header)))
+      if (_gdbm_full_pread (dbf, &partial_header, sizeof (gdbm_file_header),
+			    0))
 	{
 	  GDBM_DEBUG (GDBM_DEBUG_ERR|GDBM_DEBUG_OPEN,
 		      "%s: error reading partial header: %s",
@@ -542,8 +701,9 @@ gdbm_fd_open (int fd, const char *file_name, int block_size,
 	}
       
       memcpy (dbf->header, &partial_header, sizeof (gdbm_file_header));
-      if (_gdbm_full_read (dbf, &dbf->header->avail.av_table[1],
-			   dbf->header->block_size - sizeof (gdbm_file_header)))
+      if (_gdbm_full_pread (dbf, dbf->header + 1,
+			    dbf->header->block_size - sizeof (gdbm_file_header),
+			    sizeof (gdbm_file_header)))
 	{
 	  GDBM_DEBUG (GDBM_DEBUG_ERR|GDBM_DEBUG_OPEN,
 		      "%s: error reading av_table: %s",
@@ -554,7 +714,18 @@ gdbm_fd_open (int fd, const char *file_name, int block_size,
 	  return NULL;
 	}
 
-      if (gdbm_avail_block_validate (dbf, &dbf->header->avail))
+      header_setup (dbf);
+      rc = validate_header_block (dbf);
+      if (rc != GDBM_NO_ERROR)
+	{
+	  if (!(flags & GDBM_CLOERROR))
+	    dbf->desc = -1;
+	  gdbm_close (dbf);
+	  GDBM_SET_ERRNO2 (NULL, rc, FALSE, GDBM_DEBUG_OPEN);
+	  return NULL;
+	}
+
+      if (gdbm_avail_block_validate (dbf, dbf->avail))
 	{
 	  if (!(flags & GDBM_CLOERROR))
 	    dbf->desc = -1;
@@ -574,17 +745,8 @@ gdbm_fd_open (int fd, const char *file_name, int block_size,
 	}
 
       /* Read the hash table directory. */
-      file_pos = gdbm_file_seek (dbf, dbf->header->dir, SEEK_SET);
-      if (file_pos != dbf->header->dir)
-	{
-	  if (!(flags & GDBM_CLOERROR))
-	    dbf->desc = -1;
-	  SAVE_ERRNO (gdbm_close (dbf));
-	  GDBM_SET_ERRNO2 (NULL, GDBM_FILE_SEEK_ERROR, FALSE, GDBM_DEBUG_OPEN);
-	  return NULL;
-	}
-
-      if (_gdbm_full_read (dbf, dbf->dir, dbf->header->dir_size))
+      if (_gdbm_full_pread (dbf, dbf->dir, dbf->header->dir_size,
+			    dbf->header->dir))
 	{
 	  GDBM_DEBUG (GDBM_DEBUG_ERR|GDBM_DEBUG_OPEN,
 		      "%s: error reading dir: %s",
@@ -597,6 +759,14 @@ gdbm_fd_open (int fd, const char *file_name, int block_size,
 
     }
 
+#if HAVE_LINUX_IO_URING_H
+  /* Requests submitted through io_uring bypass the memory mapping, so
+     the file is not mapped if the ring is set up.  Otherwise, I/O is
+     done synchronously. */
+  if ((flags & GDBM_IOURING) && _gdbm_uring_init (dbf) == 0)
+    flags |= GDBM_NOMMAP;
+#endif
+
 #if HAVE_MMAP
   if (!(flags & GDBM_NOMMAP))
     {
@@ -627,12 +797,49 @@ gdbm_fd_open (int fd, const char *file_name, int block_size,
   dbf->bucket_changed = FALSE;
   dbf->second_changed = FALSE;
 
+  if (dbf->xheader)
+    {
+      if (dbf->xheader->features & GDBM_FEAT_FASTHASH)
+	dbf->hash = _gdbm_fast_hash;
+      if (dbf->xheader->features & GDBM_FEAT_FINGERPRINT)
+	dbf->key_fingerprint = TRUE;
+      if (dbf->xheader->features & GDBM_FEAT_POW2BUCKETS)
+	{
+	  int n;
+
+	  dbf->bucket_mask = dbf->header->bucket_elems - 1;
+	  for (n = dbf->header->bucket_elems; n > 1; n >>= 1)
+	    dbf->bucket_shift++;
+	  dbf->bucket_shift = 32 - dbf->bucket_shift;
+	}
+    }
+
+  /* A writer keeps the free space of a database using the size-class
+     allocator in its free lists. */
+  if (dbf->read_write != GDBM_READER
+      && dbf->xheader
+      && (dbf->xheader->features & GDBM_FEAT_SIZECLASS)
+      && _gdbm_fsm_init (dbf))
+    {
+      if (!(flags & GDBM_CLOERROR))
+	dbf->desc = -1;
+      SAVE_ERRNO (gdbm_close (dbf));
+      return NULL;
+    }
+
   GDBM_DEBUG (GDBM_DEBUG_ALL, "%s: opened successfully", dbf->name);
 
   /* Everything is fine, return the pointer to the file
      information structure.  */
   return dbf;
 }
+
+GDBM_FILE 
+gdbm_fd_open (int fd, const char *file_name, int block_size,
+	      int flags, void (*fatal_func) (const char *))
+{
+  return fd_open (fd, file_name, block_size, flags, fatal_func, FALSE);
+}
   
 /* Initialize dbm system.  FILE is a pointer to the file name.  If the file
    has a size of zero bytes, a file initialization procedure is performed,
@@ -688,50 +895,6 @@ gdbm_open (const char *file, int block_size, int flags, int mode,
       GDBM_SET_ERRNO2 (NULL, GDBM_FILE_OPEN_ERROR, FALSE, GDBM_DEBUG_OPEN);
       return NULL;
     }
-  return gdbm_fd_open (fd, file, block_size, flags | GDBM_CLOERROR,
-		       fatal_func);
-}
-
-/* Initialize the bucket cache. */
-int
-_gdbm_init_cache (GDBM_FILE dbf, size_t size)
-{
-  int index;
-
-  if (dbf->bucket_cache == NULL)
-    {
-      dbf->bucket_cache = calloc (size, sizeof(cache_elem));
-      if (dbf->bucket_cache == NULL)
-        {
-          GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, TRUE);
-          return -1;
-        }
-      dbf->cache_size = size;
-
-      for (index = 0; index < size; index++)
-        {
-	  (dbf->bucket_cache[index]).ca_bucket =
-	    malloc (dbf->header->bucket_size);
-          if ((dbf->bucket_cache[index]).ca_bucket == NULL)
-	    {
-              GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, TRUE);
-	      return -1;
-            }
-	  dbf->bucket_cache[index].ca_data.dptr = NULL;
-	  dbf->bucket_cache[index].ca_data.dsize = 0;
-	  _gdbm_cache_entry_invalidate (dbf, index);
-        }
-      dbf->bucket = dbf->bucket_cache[0].ca_bucket;
-      dbf->cache_entry = &dbf->bucket_cache[0];
-    }
-  return 0;
-}
-
-void
-_gdbm_cache_entry_invalidate (GDBM_FILE dbf, int index)
-{
-  dbf->bucket_cache[index].ca_adr = 0;
-  dbf->bucket_cache[index].ca_changed = FALSE;
-  dbf->bucket_cache[index].ca_data.hash_val = -1;
-  dbf->bucket_cache[index].ca_data.elem_loc = -1;
+  return fd_open (fd, file, block_size, flags | GDBM_CLOERROR,
+		  fatal_func, TRUE);
 }
@@ -22,6 +22,26 @@
 
 #include "gdbmdefs.h"
 
+/* Number of buckets read ahead during a scan (see scan_prefetch). */
+#define SCAN_AHEAD 32
+
+/* When the database uses io_uring (GDBM_IOURING), read the buckets
+   that the scan visits next at once.  Return 0 on success and -1 on
+   error. */
+static int
+scan_prefetch (GDBM_FILE dbf)
+{
+  off_t adr[SCAN_AHEAD];
+  size_t n = 0;
+  int dir_index;
+
+  for (dir_index = dbf->bucket_dir;
+       dir_index < GDBM_DIR_COUNT (dbf) && n < SCAN_AHEAD; dir_index++)
+    if (n == 0 || adr[n - 1] != dbf->dir[dir_index])
+      adr[n++] = dbf->dir[dir_index];
+  return _gdbm_cache_prefetch (dbf, adr, n);
+}
+
 /* Find and read the next entry in the hash structure for DBF starting
    at ELEM_LOC of the current bucket and using RETURN_VAL as the place to
    put the data that is found.
@@ -58,6 +78,10 @@ get_next_key (GDBM_FILE dbf, int elem_loc, datum *return_val)
 	  /* Check to see if there was a next bucket. */
 	  if (dbf->bucket_dir < GDBM_DIR_COUNT (dbf))
 	    {
+	      if (dbf->uring && !dbf->memory_mapping
+		  && _gdbm_cache_lookup (dbf, dbf->dir[dbf->bucket_dir]) == -1
+		  && scan_prefetch (dbf))
+		return;
 	      if (_gdbm_get_bucket (dbf, dbf->bucket_dir))
 		return;
 	    }
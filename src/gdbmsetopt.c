@@ -66,7 +66,9 @@ setopt_gdbm_setcachesize (GDBM_FILE dbf, void *optval, int optlen)
       GDBM_SET_ERRNO (dbf, GDBM_OPT_ILLEGAL, FALSE);
       return -1;
     }  
-  return _gdbm_init_cache (dbf, (sz > 9) ? sz : 10);
+  dbf->cache_bytes = 0;
+  return _gdbm_init_cache (dbf, (sz >= GDBM_MIN_CACHESIZE)
+			          ? sz : GDBM_MIN_CACHESIZE);
 }
 
 static int
@@ -81,6 +83,351 @@ setopt_gdbm_getcachesize (GDBM_FILE dbf, void *optval, int optlen)
   return 0;
 }
 
+/* Memory budget for automatic cache sizing */
+static int
+setopt_gdbm_setcachebytes (GDBM_FILE dbf, void *optval, int optlen)
+{
+  size_t sz;
+
+  if (get_size (optval, optlen, &sz))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_OPT_ILLEGAL, FALSE);
+      return -1;
+    }
+  return _gdbm_cache_set_bytes (dbf, sz);
+}
+
+static int
+setopt_gdbm_getcachebytes (GDBM_FILE dbf, void *optval, int optlen)
+{
+  if (!optval || optlen != sizeof (size_t))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_OPT_ILLEGAL, FALSE);
+      return -1;
+    }
+  *(size_t*) optval = dbf->cache_bytes;
+  return 0;
+}
+
+/* Memory budget of the data cache */
+static int
+setopt_gdbm_setdatacachesize (GDBM_FILE dbf, void *optval, int optlen)
+{
+  size_t sz;
+
+  if (get_size (optval, optlen, &sz))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_OPT_ILLEGAL, FALSE);
+      return -1;
+    }
+  _gdbm_data_cache_set_max (dbf, sz);
+  return 0;
+}
+
+static int
+setopt_gdbm_getdatacachesize (GDBM_FILE dbf, void *optval, int optlen)
+{
+  if (!optval || optlen != sizeof (size_t))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_OPT_ILLEGAL, FALSE);
+      return -1;
+    }
+  *(size_t*) optval = dbf->data_cache_max;
+  return 0;
+}
+
+/* Negative lookup filters */
+static int
+setopt_gdbm_setbucketfilter (GDBM_FILE dbf, void *optval, int optlen)
+{
+  int n;
+
+  if ((n = getbool (optval, optlen)) == -1)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_OPT_ILLEGAL, FALSE);
+      return -1;
+    }
+  dbf->bucket_filter = n;
+  if (!n)
+    _gdbm_bucket_filter_free (dbf);
+  return 0;
+}
+
+static int
+setopt_gdbm_getbucketfilter (GDBM_FILE dbf, void *optval, int optlen)
+{
+  if (!optval || optlen != sizeof (int))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_OPT_ILLEGAL, FALSE);
+      return -1;
+    }
+  *(int*) optval = dbf->bucket_filter;
+  return 0;
+}
+
+/* Bucket cache replacement policy */
+static int
+setopt_gdbm_setcachepolicy (GDBM_FILE dbf, void *optval, int optlen)
+{
+  int n;
+
+  if (!optval || optlen != sizeof (int))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_OPT_ILLEGAL, FALSE);
+      return -1;
+    }
+  n = *(int*) optval;
+  switch (n)
+    {
+    case GDBM_CACHE_FIFO:
+    case GDBM_CACHE_LRU:
+    case GDBM_CACHE_CLOCK:
+    case GDBM_CACHE_SLRU:
+      break;
+
+    default:
+      GDBM_SET_ERRNO (dbf, GDBM_OPT_ILLEGAL, FALSE);
+      return -1;
+    }
+  if (n != dbf->cache_policy)
+    {
+      dbf->cache_policy = n;
+      if (dbf->bucket_cache != NULL)
+	_gdbm_cache_policy_reset (dbf);
+    }
+  return 0;
+}
+
+static int
+setopt_gdbm_getcachepolicy (GDBM_FILE dbf, void *optval, int optlen)
+{
+  if (!optval || optlen != sizeof (int))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_OPT_ILLEGAL, FALSE);
+      return -1;
+    }
+  *(int*) optval = dbf->cache_policy;
+  return 0;
+}
+
+static int
+setopt_gdbm_getcachestats (GDBM_FILE dbf, void *optval, int optlen)
+{
+  if (!optval || optlen != sizeof (struct gdbm_cache_stats))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_OPT_ILLEGAL, FALSE);
+      return -1;
+    }
+  *(struct gdbm_cache_stats*) optval = dbf->cache_stats;
+  return 0;
+}
+
+/* Group commit */
+static int
+setopt_gdbm_setgroupcommit (GDBM_FILE dbf, void *optval, int optlen)
+{
+  if (!optval || optlen != sizeof (struct gdbm_group_commit))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_OPT_ILLEGAL, FALSE);
+      return -1;
+    }
+#if HAVE_PTHREAD_H
+  return _gdbm_group_setup (dbf, optval);
+#else
+  GDBM_SET_ERRNO (dbf, GDBM_OPT_ILLEGAL, FALSE);
+  return -1;
+#endif
+}
+
+static int
+setopt_gdbm_getgroupcommit (GDBM_FILE dbf, void *optval, int optlen)
+{
+  struct gdbm_group_commit *gc = optval;
+  
+  if (!optval || optlen != sizeof (struct gdbm_group_commit))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_OPT_ILLEGAL, FALSE);
+      return -1;
+    }
+#if HAVE_PTHREAD_H
+  _gdbm_group_get (dbf, gc);
+#else
+  gc->max_count = 0;
+  gc->max_wait = 0;
+  gc->updates = 0;
+  gc->syncs = 0;
+#endif
+  return 0;
+}
+
+/* Return TRUE if requests are served using io_uring. */
+static int
+setopt_gdbm_getiouring (GDBM_FILE dbf, void *optval, int optlen)
+{
+  if (!optval || optlen != sizeof (int))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_OPT_ILLEGAL, FALSE);
+      return -1;
+    }
+  *(int*) optval = dbf->uring != NULL && !dbf->memory_mapping;
+  return 0;
+}
+
+/* Memory budget of gdbm_bulk_load */
+static int
+setopt_gdbm_setbulkbufsize (GDBM_FILE dbf, void *optval, int optlen)
+{
+  size_t sz;
+
+  if (get_size (optval, optlen, &sz) || sz == 0)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_OPT_ILLEGAL, FALSE);
+      return -1;
+    }
+  dbf->bulk_buf_size = sz;
+  return 0;
+}
+
+static int
+setopt_gdbm_getbulkbufsize (GDBM_FILE dbf, void *optval, int optlen)
+{
+  if (!optval || optlen != sizeof (size_t))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_OPT_ILLEGAL, FALSE);
+      return -1;
+    }
+  *(size_t*) optval = dbf->bulk_buf_size;
+  return 0;
+}
+
+/* Lay out an empty database for the expected number of records. */
+static int
+setopt_gdbm_setcapacity (GDBM_FILE dbf, void *optval, int optlen)
+{
+  struct gdbm_capacity *cap = optval;
+
+  if (!optval || optlen != sizeof (struct gdbm_capacity))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_OPT_ILLEGAL, FALSE);
+      return -1;
+    }
+  return _gdbm_set_capacity (dbf, cap->records, cap->record_size);
+}
+
+static int
+setopt_gdbm_setfilegrowth (GDBM_FILE dbf, void *optval, int optlen)
+{
+  struct gdbm_file_growth *fg = optval;
+
+  if (!optval || optlen != sizeof (struct gdbm_file_growth))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_OPT_ILLEGAL, FALSE);
+      return -1;
+    }
+  dbf->grow_chunk = fg->chunk;
+  dbf->grow_percent = fg->percent;
+  return 0;
+}
+
+static int
+setopt_gdbm_getfilegrowth (GDBM_FILE dbf, void *optval, int optlen)
+{
+  struct gdbm_file_growth *fg = optval;
+
+  if (!optval || optlen != sizeof (struct gdbm_file_growth))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_OPT_ILLEGAL, FALSE);
+      return -1;
+    }
+  fg->chunk = dbf->grow_chunk;
+  fg->percent = dbf->grow_percent;
+  return 0;
+}
+
+static int
+setopt_gdbm_setpunchhole (GDBM_FILE dbf, void *optval, int optlen)
+{
+  size_t sz;
+
+  if (get_size (optval, optlen, &sz))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_OPT_ILLEGAL, FALSE);
+      return -1;
+    }
+  dbf->punch_hole = sz;
+  return 0;
+}
+
+static int
+setopt_gdbm_getpunchhole (GDBM_FILE dbf, void *optval, int optlen)
+{
+  if (!optval || optlen != sizeof (size_t))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_OPT_ILLEGAL, FALSE);
+      return -1;
+    }
+  *(size_t*) optval = dbf->punch_hole;
+  return 0;
+}
+
+/* The hash function of a database is fixed when it is created.  This
+   selects the one gdbm_reorganize gives to the new file. */
+static int
+setopt_gdbm_sethash (GDBM_FILE dbf, void *optval, int optlen)
+{
+  int n;
+
+  if (!optval || optlen != sizeof (int)
+      || ((n = *(int*)optval) != GDBM_HASH_LEGACY && n != GDBM_HASH_FAST))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_OPT_ILLEGAL, FALSE);
+      return -1;
+    }
+  dbf->reorg_hash = n;
+  return 0;
+}
+
+static int
+setopt_gdbm_gethash (GDBM_FILE dbf, void *optval, int optlen)
+{
+  if (!optval || optlen != sizeof (int))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_OPT_ILLEGAL, FALSE);
+      return -1;
+    }
+  *(int*) optval = dbf->hash == _gdbm_fast_hash
+                     ? GDBM_HASH_FAST : GDBM_HASH_LEGACY;
+  return 0;
+}
+
+/* Likewise, key fingerprints are given to or taken from a database by
+   gdbm_reorganize. */
+static int
+setopt_gdbm_setfingerprint (GDBM_FILE dbf, void *optval, int optlen)
+{
+  int n;
+
+  if ((n = getbool (optval, optlen)) == -1)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_OPT_ILLEGAL, FALSE);
+      return -1;
+    }
+  dbf->reorg_fingerprint = n;
+  return 0;
+}
+
+static int
+setopt_gdbm_getfingerprint (GDBM_FILE dbf, void *optval, int optlen)
+{
+  if (!optval || optlen != sizeof (int))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_OPT_ILLEGAL, FALSE);
+      return -1;
+    }
+  *(int*) optval = dbf->key_fingerprint;
+  return 0;
+}
+
 /* Obsolete form of GDBM_SETSYNCMODE. */
 static int
 setopt_gdbm_fastmode (GDBM_FILE dbf, void *optval, int optlen)
@@ -267,6 +614,9 @@ setopt_gdbm_getflags (GDBM_FILE dbf, void *optval, int optlen)
 	flags |= GDBM_NOLOCK;
       if (!dbf->memory_mapping)
 	flags |= GDBM_NOMMAP;
+      if (dbf->uring)
+	flags |= GDBM_IOURING;
+      flags |= _gdbm_feature_flags (dbf);
       *(int*) optval = flags;
     }
   return 0;
@@ -327,6 +677,29 @@ static setopt_handler setopt_handler_tab[] = {
   [GDBM_GETFLAGS]        = setopt_gdbm_getflags,
   [GDBM_GETDBNAME]       = setopt_gdbm_getdbname,
   [GDBM_GETBLOCKSIZE]    = setopt_gdbm_getblocksize,
+  [GDBM_SETCACHEPOLICY]  = setopt_gdbm_setcachepolicy,
+  [GDBM_GETCACHEPOLICY]  = setopt_gdbm_getcachepolicy,
+  [GDBM_GETCACHESTATS]   = setopt_gdbm_getcachestats,
+  [GDBM_SETCACHEBYTES]   = setopt_gdbm_setcachebytes,
+  [GDBM_GETCACHEBYTES]   = setopt_gdbm_getcachebytes,
+  [GDBM_SETDATACACHESIZE] = setopt_gdbm_setdatacachesize,
+  [GDBM_GETDATACACHESIZE] = setopt_gdbm_getdatacachesize,
+  [GDBM_SETBUCKETFILTER] = setopt_gdbm_setbucketfilter,
+  [GDBM_GETBUCKETFILTER] = setopt_gdbm_getbucketfilter,
+  [GDBM_SETGROUPCOMMIT]  = setopt_gdbm_setgroupcommit,
+  [GDBM_GETGROUPCOMMIT]  = setopt_gdbm_getgroupcommit,
+  [GDBM_GETIOURING]      = setopt_gdbm_getiouring,
+  [GDBM_SETBULKBUFSIZE]  = setopt_gdbm_setbulkbufsize,
+  [GDBM_GETBULKBUFSIZE]  = setopt_gdbm_getbulkbufsize,
+  [GDBM_SETCAPACITY]     = setopt_gdbm_setcapacity,
+  [GDBM_SETFILEGROWTH]   = setopt_gdbm_setfilegrowth,
+  [GDBM_GETFILEGROWTH]   = setopt_gdbm_getfilegrowth,
+  [GDBM_SETPUNCHHOLE]    = setopt_gdbm_setpunchhole,
+  [GDBM_GETPUNCHHOLE]    = setopt_gdbm_getpunchhole,
+  [GDBM_SETHASH]         = setopt_gdbm_sethash,
+  [GDBM_GETHASH]         = setopt_gdbm_gethash,
+  [GDBM_SETFINGERPRINT]  = setopt_gdbm_setfingerprint,
+  [GDBM_GETFINGERPRINT]  = setopt_gdbm_getfingerprint,
 };
   
 int
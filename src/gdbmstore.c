@@ -22,27 +22,14 @@
 
 #include "gdbmdefs.h"
 
-
-/* Add a new element to the database.  CONTENT is keyed by KEY.  The
-   file on disk is updated to reflect the structure of the new database
-   before returning from this procedure.  The FLAGS define the action to
-   take when the KEY is already in the database.  The value GDBM_REPLACE
-   asks that the old data be replaced by the new CONTENT.  The value
-   GDBM_INSERT asks that an error be returned and no action taken.
-
-   On success (the item was stored), 0 is returned. If the item could
-   not be stored because a matching key already exists and GDBM_REPLACE
-   was not given, 1 is returned and gdbm_errno (as well as the database
-   errno value) is set to GDBM_CANNOT_REPLACE. Otherwise, if another
-   error occurred, -1 is returned. */
-
-int
-gdbm_store (GDBM_FILE dbf, datum key, datum content, int flags)
+/* Store CONTENT under KEY.  See gdbm_store, below. */
+static int
+store_record (GDBM_FILE dbf, datum key, datum content, int flags)
 {
   int  new_hash_val;		/* The new hash value. */
   int  elem_loc;		/* The location in hash bucket. */
   off_t file_adr;		/* The address of new space in the file.  */
-  off_t file_pos;		/* The position after a lseek. */
+  struct iovec iov[2];		/* Key and content to write. */
   off_t free_adr;		/* For keeping track of a freed section. */
   int  free_size;
   int   new_size;		/* Used in allocating space. */
@@ -73,6 +60,11 @@ gdbm_store (GDBM_FILE dbf, datum key, datum content, int flags)
   /* Initialize the gdbm_errno variable. */
   gdbm_set_errno (dbf, GDBM_NO_ERROR, FALSE);
 
+  /* Make sure committed transactions are in the file before changing
+     it outside of a transaction. */
+  if (dbf->txn_state == TXN_NONE && _gdbm_journal_checkpoint (dbf))
+    return -1;
+
   /* Look for the key in the file.
      A side effect loads the correct bucket and calculates the hash value. */
   elem_loc = _gdbm_findkey (dbf, key, NULL, &new_hash_val);
@@ -90,7 +82,9 @@ gdbm_store (GDBM_FILE dbf, datum key, datum content, int flags)
 	  free_adr = dbf->bucket->h_table[elem_loc].data_pointer;
 	  free_size = dbf->bucket->h_table[elem_loc].key_size
 	              + dbf->bucket->h_table[elem_loc].data_size;
-	  if (free_size != new_size)
+	  /* Within a transaction, the old data must remain intact
+	     until the commit. */
+	  if (free_size != new_size || dbf->txn_state == TXN_ACTIVE)
 	    {
 	      if (_gdbm_free (dbf, free_adr, free_size))
 		return -1;
@@ -125,8 +119,6 @@ gdbm_store (GDBM_FILE dbf, datum key, datum content, int flags)
   /* If this is a new entry in the bucket, we need to do special things. */
   if (elem_loc == -1)
     {
-      int start_loc;
-      
       if (dbf->bucket->count == dbf->header->bucket_elems)
 	{
 	  /* Split the current bucket. */
@@ -135,65 +127,82 @@ gdbm_store (GDBM_FILE dbf, datum key, datum content, int flags)
 	}
       
       /* Find space to insert into bucket and set elem_loc to that place. */
-      elem_loc = start_loc = new_hash_val % dbf->header->bucket_elems;
-      while (dbf->bucket->h_table[elem_loc].hash_value != -1)
+      elem_loc = _gdbm_bucket_probe (dbf, -1,
+				     GDBM_BUCKET_HOME (dbf, new_hash_val),
+				     dbf->header->bucket_elems);
+      if (elem_loc == -1)
 	{
-	  elem_loc = (elem_loc + 1) % dbf->header->bucket_elems;
-	  if (elem_loc == start_loc)
-	    {
-	      GDBM_SET_ERRNO (dbf, GDBM_BAD_HASH_TABLE, TRUE);
-	      return -1;
-	    }
+	  GDBM_SET_ERRNO (dbf, GDBM_BAD_HASH_TABLE, TRUE);
+	  return -1;
 	}
       
       /* We now have another element in the bucket.  Add the new information.*/
       dbf->bucket->count++;
       dbf->bucket->h_table[elem_loc].hash_value = new_hash_val;
-      memcpy (dbf->bucket->h_table[elem_loc].key_start, key.dptr,
-	     (SMALL < key.dsize ? SMALL : key.dsize));
+      _gdbm_key_check (dbf, key, dbf->bucket->h_table[elem_loc].key_start);
+      _gdbm_bucket_filter_add (dbf, new_hash_val);
+      _gdbm_bucket_probe_set (dbf, elem_loc);
     }
 
 
+  /* Drop the old data from the data cache. */
+  _gdbm_data_cache_invalidate (dbf, dbf->cache_entry->ca_adr, elem_loc);
+
   /* Update current bucket data pointer and sizes. */
   dbf->bucket->h_table[elem_loc].data_pointer = file_adr;
   dbf->bucket->h_table[elem_loc].key_size = key.dsize;
   dbf->bucket->h_table[elem_loc].data_size = content.dsize;
 
-  /* Write the data to the file. */
-  file_pos = gdbm_file_seek (dbf, file_adr, SEEK_SET);
-  if (file_pos != file_adr)
-    {
-      GDBM_DEBUG (GDBM_DEBUG_STORE|GDBM_DEBUG_ERR,
-		  "%s: lseek: %s", dbf->name, strerror (errno));      
-      GDBM_SET_ERRNO2 (dbf, GDBM_FILE_SEEK_ERROR, TRUE, GDBM_DEBUG_STORE);
-      _gdbm_fatal (dbf, _("lseek error"));
-      return -1;
-    }
-
-  rc = _gdbm_full_write (dbf, key.dptr, key.dsize);
+  /* Write the key and the data to the file. */
+  iov[0].iov_base = key.dptr;
+  iov[0].iov_len = key.dsize;
+  iov[1].iov_base = content.dptr;
+  iov[1].iov_len = content.dsize;
+  rc = _gdbm_full_pwritev (dbf, iov, 2, file_adr);
   if (rc)
     {
       GDBM_DEBUG (GDBM_DEBUG_STORE|GDBM_DEBUG_ERR,
-		  "%s: error writing key: %s",
+		  "%s: error writing record: %s",
 		  dbf->name, gdbm_db_strerror (dbf));      
       _gdbm_fatal (dbf, gdbm_db_strerror (dbf));
       return -1;
     }
 
-  rc = _gdbm_full_write (dbf, content.dptr, content.dsize);
-  if (rc)
-    {
-      GDBM_DEBUG (GDBM_DEBUG_STORE|GDBM_DEBUG_ERR,
-		  "%s: error writing content: %s",
-		  dbf->name, gdbm_db_strerror (dbf));      
-      _gdbm_fatal (dbf, gdbm_db_strerror (dbf));
-      return -1;
-    }
+  if (_gdbm_journal_log (dbf, file_adr, key.dptr, key.dsize)
+      || _gdbm_journal_log (dbf, file_adr + key.dsize,
+			    content.dptr, content.dsize))
+    return -1;
 
   /* Current bucket has changed. */
-  dbf->cache_entry->ca_changed = TRUE;
+  _gdbm_cache_set_changed (dbf, dbf->cache_entry);
   dbf->bucket_changed = TRUE;
 
   /* Write everything that is needed to the disk. */
   return _gdbm_end_update (dbf);
 }
+
+/* Add a new element to the database.  CONTENT is keyed by KEY.  The
+   file on disk is updated to reflect the structure of the new database
+   before returning from this procedure.  The FLAGS define the action to
+   take when the KEY is already in the database.  The value GDBM_REPLACE
+   asks that the old data be replaced by the new CONTENT.  The value
+   GDBM_INSERT asks that an error be returned and no action taken.
+
+   On success (the item was stored), 0 is returned. If the item could
+   not be stored because a matching key already exists and GDBM_REPLACE
+   was not given, 1 is returned and gdbm_errno (as well as the database
+   errno value) is set to GDBM_CANNOT_REPLACE. Otherwise, if another
+   error occurred, -1 is returned. */
+
+int
+gdbm_store (GDBM_FILE dbf, datum key, datum content, int flags)
+{
+#if HAVE_PTHREAD_H
+  if (dbf->group_commit)
+    {
+      _gdbm_group_lock (dbf);
+      return _gdbm_group_commit (dbf, store_record (dbf, key, content, flags));
+    }
+#endif
+  return store_record (dbf, key, content, flags);
+}
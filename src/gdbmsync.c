@@ -33,6 +33,20 @@ gdbm_sync (GDBM_FILE dbf)
   /* Initialize the gdbm_errno variable. */
   gdbm_set_errno (dbf, GDBM_NO_ERROR, FALSE);
 
+  /* Write the changes made so far in the current update batch. */
+  if (dbf->batch_level && _gdbm_flush_batch (dbf))
+    return -1;
+
+  /* Save the free lists of the size-class allocator.  Within a
+     transaction, they are not final yet. */
+  if (dbf->txn_state == TXN_NONE && _gdbm_fsm_save (dbf))
+    return -1;
+
+  /* If there are committed transactions in the journal, write them
+     out for good. */
+  if (dbf->journal_pending)
+    return _gdbm_journal_checkpoint (dbf);
+
   /* Do the sync on the file. */
   return gdbm_file_sync (dbf);
 }
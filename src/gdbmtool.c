@@ -126,6 +126,12 @@ opendb (char *dbname)
       if (gdbm_setopt (db, GDBM_SETCENTFREE, &t, sizeof (t)) == -1)
 	terror (_("gdbm_setopt failed: %s"), gdbm_strerror (gdbm_errno));
     }
+  if (variable_is_true ("filter"))
+    {
+      int t = 1;
+      if (gdbm_setopt (db, GDBM_SETBUCKETFILTER, &t, sizeof (t)) == -1)
+	terror (_("gdbm_setopt failed: %s"), gdbm_strerror (gdbm_errno));
+    }
   
   if (gdbm_file)
     gdbm_close (gdbm_file);
@@ -228,25 +234,30 @@ _gdbm_avail_list_size (GDBM_FILE dbf, size_t min_size)
   avail_block    *av_stk;
   size_t          lines;
   
-  lines = 4 + dbf->header->avail.count;
+  lines = 4 + dbf->avail->count;
+  if (dbf->fsm)
+    {
+      avail_elem *tab;
+      size_t n;
+
+      if (_gdbm_fsm_table (dbf, &tab, &n, FALSE) == 0)
+	{
+	  lines += 3 + n;
+	  free (tab);
+	}
+    }
   if (lines > min_size)
     return lines;
   /* Initialize the variables for a pass throught the avail stack. */
-  temp = dbf->header->avail.next_block;
-  size = (((dbf->header->avail.size * sizeof (avail_elem)) >> 1)
+  temp = dbf->avail->next_block;
+  size = (((dbf->avail->size * sizeof (avail_elem)) >> 1)
 	  + sizeof (avail_block));
   av_stk = emalloc (size);
 
   /* Traverse the stack. */
   while (temp)
     {
-      if (gdbm_file_seek (dbf, temp, SEEK_SET) != temp)
-	{
-	  terror ("lseek: %s", strerror (errno));
-	  break;
-	}
-      
-      if (_gdbm_full_read (dbf, av_stk, size))
+      if (_gdbm_full_pread (dbf, av_stk, size, temp))
 	{
 	  terror ("read: %s", gdbm_db_strerror (dbf));
 	  break;
@@ -286,25 +297,35 @@ _gdbm_print_avail_list (FILE *fp, GDBM_FILE dbf)
   
   /* Print the the header avail block.  */
   fprintf (fp, _("\nheader block\nsize  = %d\ncount = %d\n"),
-	   dbf->header->avail.size, dbf->header->avail.count);
-  av_table_display (dbf->header->avail.av_table, dbf->header->avail.count, fp);
+	   dbf->avail->size, dbf->avail->count);
+  av_table_display (dbf->avail->av_table, dbf->avail->count, fp);
+
+  /* Print the free lists of the size-class allocator. */
+  if (dbf->fsm)
+    {
+      avail_elem *tab;
+      size_t n;
+
+      if (_gdbm_fsm_table (dbf, &tab, &n, FALSE))
+	terror ("%s", gdbm_db_strerror (dbf));
+      else
+	{
+	  fprintf (fp, _("\nfree lists\ncount = %lu\n"), (unsigned long) n);
+	  av_table_display (tab, n, fp);
+	  free (tab);
+	}
+    }
 
   /* Initialize the variables for a pass throught the avail stack. */
-  temp = dbf->header->avail.next_block;
-  size = (dbf->header->avail.size * sizeof (avail_elem))
+  temp = dbf->avail->next_block;
+  size = (dbf->avail->size * sizeof (avail_elem))
 	  + sizeof (avail_block);
   av_stk = emalloc (size);
 
   /* Print the stack. */
   while (temp)
     {
-      if (gdbm_file_seek (dbf, temp, SEEK_SET) != temp)
-	{
-	  terror ("lseek: %s", strerror (errno));
-	  break;
-	}
-      
-      if (_gdbm_full_read (dbf, av_stk, size))
+      if (_gdbm_full_pread (dbf, av_stk, size, temp))
 	{
           terror ("read: %s", gdbm_db_strerror (dbf));
 	  break;
@@ -331,16 +352,15 @@ _gdbm_print_bucket_cache (FILE *fp, GDBM_FILE dbf)
   if (dbf->bucket_cache != NULL)
     {
       fprintf (fp,
-	_("Bucket Cache (size %zu):\n  Index:         Address  Changed  Data_Hash \n"),
+	_("Bucket Cache (size %zu):\n  Index:         Address  Changed\n"),
 	 dbf->cache_size);
       for (index = 0; index < dbf->cache_size; index++)
 	{
 	  changed = dbf->bucket_cache[index].ca_changed;
-	  fprintf (fp, "  %5d:  %15lu %7s  %x\n",
+	  fprintf (fp, "  %5d:  %15lu %7s\n",
 		   index,
 		   (unsigned long) dbf->bucket_cache[index].ca_adr,
-		   (changed ? _("True") : _("False")),
-		   dbf->bucket_cache[index].ca_data.hash_val);
+		   (changed ? _("True") : _("False")));
 	}
     }
   else
@@ -830,7 +850,7 @@ print_header_begin (struct handler_param *param GDBM_ARG_UNUSED, size_t *exp_cou
   if (checkdb ())
     return 1;
   if (exp_count)
-    *exp_count = 14;
+    *exp_count = gdbm_file->xheader ? 17 : 14;
   return 0;
 }
 
@@ -850,10 +870,17 @@ print_header_handler (struct handler_param *param)
   fprintf (fp, _("  header magic = %x\n"), gdbm_file->header->header_magic);
   fprintf (fp, _("  next block   = %lu\n"),
 	   (unsigned long) gdbm_file->header->next_block);
-  fprintf (fp, _("  avail size   = %d\n"), gdbm_file->header->avail.size);
-  fprintf (fp, _("  avail count  = %d\n"), gdbm_file->header->avail.count);
+  fprintf (fp, _("  avail size   = %d\n"), gdbm_file->avail->size);
+  fprintf (fp, _("  avail count  = %d\n"), gdbm_file->avail->count);
   fprintf (fp, _("  avail nx blk = %lu\n"),
-	   (unsigned long) gdbm_file->header->avail.next_block);
+	   (unsigned long) gdbm_file->avail->next_block);
+  if (gdbm_file->xheader)
+    {
+      fprintf (fp, _("  features     = %x\n"), gdbm_file->xheader->features);
+      fprintf (fp, _("  free map     = %lu\n"),
+	       (unsigned long) gdbm_file->xheader->fsm_adr);
+      fprintf (fp, _("  free map size= %d\n"), gdbm_file->xheader->fsm_size);
+    }
 }  
 
 /* hash KEY - hash the key */
@@ -868,7 +895,7 @@ hash_handler (struct handler_param *param)
       fprintf (param->fp, _("hash value = %x, bucket #%u, slot %u"),
 		hashval,
 		hashval >> (GDBM_HASH_BITS - gdbm_file->header->dir_bits),
-		hashval % gdbm_file->header->bucket_elems);
+		off);
     }
   else
     fprintf (param->fp, _("hash value = %x"),
@@ -893,6 +920,58 @@ print_cache_handler (struct handler_param *param)
   _gdbm_print_bucket_cache (param->fp, gdbm_file);
 }
 
+/* stats - print bucket cache statistics */
+static void
+print_stat (FILE *fp, char const *title, gdbm_count_t n)
+{
+  char buf[128];
+  char *p = count_to_str (n, buf, sizeof buf);
+
+  fprintf (fp, "%-18s %s\n", title, p ? p : "?");
+}
+
+static void
+print_ratio (FILE *fp, char const *title, gdbm_count_t a, gdbm_count_t b)
+{
+  if (a + b)
+    fprintf (fp, "%-18s %.2f%%\n", title, (double) a * 100 / (a + b));
+  else
+    fprintf (fp, "%-18s -\n", title);
+}
+
+void
+print_stats_handler (struct handler_param *param)
+{
+  static char const *policy_name[] = {
+    [GDBM_CACHE_FIFO]  = "fifo",
+    [GDBM_CACHE_LRU]   = "lru",
+    [GDBM_CACHE_CLOCK] = "clock",
+    [GDBM_CACHE_SLRU]  = "slru"
+  };
+  struct gdbm_cache_stats st;
+  size_t size;
+  int policy;
+
+  if (gdbm_setopt (gdbm_file, GDBM_GETCACHESIZE, &size, sizeof (size))
+      || gdbm_setopt (gdbm_file, GDBM_GETCACHEPOLICY, &policy, sizeof (policy))
+      || gdbm_setopt (gdbm_file, GDBM_GETCACHESTATS, &st, sizeof (st)))
+    {
+      terror (_("gdbm_setopt failed: %s"), gdbm_strerror (gdbm_errno));
+      return;
+    }
+  fprintf (param->fp, _("Bucket cache size %zu, policy %s\n"),
+	   size, policy_name[policy]);
+  print_stat (param->fp, _("Hits:"), st.hits);
+  print_stat (param->fp, _("Misses:"), st.misses);
+  print_ratio (param->fp, _("Hit ratio:"), st.hits, st.misses);
+  print_stat (param->fp, _("Evictions:"), st.evictions);
+  print_stat (param->fp, _("Write-backs:"), st.writebacks);
+  print_stat (param->fp, _("Data hits:"), st.data_hits);
+  print_stat (param->fp, _("Data misses:"), st.data_misses);
+  print_ratio (param->fp, _("Data hit ratio:"), st.data_hits, st.data_misses);
+  print_stat (param->fp, _("Filter rejects:"), st.filter_rejects);
+}
+
 /* version - print GDBM version */
 void
 print_version_handler (struct handler_param *param)
@@ -1318,6 +1397,12 @@ struct command command_tab[] = {
     FALSE,
     REPEAT_NEVER,
     N_("print the bucket cache") },
+  { S(stats), T_CMD,
+    checkdb_begin, print_stats_handler, NULL,
+    { { NULL } },
+    FALSE,
+    REPEAT_NEVER,
+    N_("print bucket cache statistics") },
   { S(status), T_CMD,
     NULL, status_handler, NULL,
     { { NULL } },
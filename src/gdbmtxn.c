@@ -0,0 +1,449 @@
+/* gdbmtxn.c - Transactions. */
+
+/* This file is part of GDBM, the GNU data base manager.
+   Copyright (C) 2018 Free Software Foundation, Inc.
+
+   GDBM is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   GDBM is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GDBM. If not, see <http://www.gnu.org/licenses/>.   */
+
+/* Include system configuration before all else. */
+#include "autoconf.h"
+
+#include "gdbmdefs.h"
+#include <stddef.h>
+
+/* A transaction groups several updates into a unit which is either
+   applied entirely or not at all.  Until it is committed, the database
+   file is only written to in places that the committed database does
+   not use:
+
+   - the changed buckets, the directory and the header are kept in
+     memory.  Changed buckets dropped from the bucket cache are saved
+     by _gdbm_txn_save_bucket;
+   - the space freed during the transaction is not reused before the
+     commit (see _gdbm_txn_free), so that keys and contents are written
+     to unused space.
+
+   On commit, the changes are first written to the journal, which is
+   synchronized (see journal.c), and then to the database file.  On
+   abort, the changes are discarded and the directory and the header
+   are read again from the file. */
+
+/* Initial number of hash chains of saved buckets. */
+#define TXN_BUCKET_INITIAL_SIZE 64
+
+static inline size_t
+txn_bucket_hash (GDBM_FILE dbf, off_t adr)
+{
+  unsigned long long h = adr * 0x9e3779b97f4a7c15ULL;
+
+  h ^= h >> 32;
+  return h & (dbf->txn_bucket_size - 1);
+}
+
+/* Return a pointer to the chain link pointing to the saved bucket at
+   ADR, or to the terminating NULL link if there is none. */
+static txn_bucket **
+txn_bucket_link (GDBM_FILE dbf, off_t adr)
+{
+  txn_bucket **pp;
+
+  for (pp = &dbf->txn_bucket[txn_bucket_hash (dbf, adr)]; *pp;
+       pp = &(*pp)->next)
+    if ((*pp)->adr == adr)
+      break;
+  return pp;
+}
+
+/* Double the number of hash chains. */
+static void
+txn_bucket_rehash (GDBM_FILE dbf)
+{
+  txn_bucket **old_tab = dbf->txn_bucket;
+  size_t old_size = dbf->txn_bucket_size;
+  txn_bucket **new_tab;
+  size_t i;
+
+  new_tab = calloc (old_size * 2, sizeof (new_tab[0]));
+  if (!new_tab)
+    return; /* Not fatal: the chains will just be longer. */
+  dbf->txn_bucket = new_tab;
+  dbf->txn_bucket_size = old_size * 2;
+  for (i = 0; i < old_size; i++)
+    {
+      txn_bucket *tb, *next;
+
+      for (tb = old_tab[i]; tb; tb = next)
+	{
+	  size_t h = txn_bucket_hash (dbf, tb->adr);
+	  next = tb->next;
+	  tb->next = new_tab[h];
+	  new_tab[h] = tb;
+	}
+    }
+  free (old_tab);
+}
+
+/* Save the changed bucket of the cache entry CA_ENTRY, which is being
+   dropped from the cache during a transaction. */
+int
+_gdbm_txn_save_bucket (GDBM_FILE dbf, cache_elem *ca_entry)
+{
+  txn_bucket **pp, *tb;
+
+  if (dbf->txn_bucket == NULL)
+    {
+      dbf->txn_bucket = calloc (TXN_BUCKET_INITIAL_SIZE,
+				sizeof (dbf->txn_bucket[0]));
+      if (!dbf->txn_bucket)
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, TRUE);
+	  return -1;
+	}
+      dbf->txn_bucket_size = TXN_BUCKET_INITIAL_SIZE;
+    }
+
+  pp = txn_bucket_link (dbf, ca_entry->ca_adr);
+  tb = *pp;
+  if (tb == NULL)
+    {
+      tb = malloc (offsetof (txn_bucket, bucket) + dbf->header->bucket_size);
+      if (!tb)
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, TRUE);
+	  return -1;
+	}
+      tb->adr = ca_entry->ca_adr;
+      tb->next = NULL;
+      *pp = tb;
+      if (++dbf->txn_bucket_count > dbf->txn_bucket_size)
+	txn_bucket_rehash (dbf);
+    }
+  memcpy (&tb->bucket, ca_entry->ca_bucket, dbf->header->bucket_size);
+  return 0;
+}
+
+/* If the bucket at ADR has been saved by _gdbm_txn_save_bucket, copy it
+   to BUCKET and return 1.  Otherwise, return 0. */
+int
+_gdbm_txn_load_bucket (GDBM_FILE dbf, off_t adr, hash_bucket *bucket)
+{
+  txn_bucket *tb;
+
+  if (dbf->txn_bucket == NULL)
+    return 0;
+  tb = *txn_bucket_link (dbf, adr);
+  if (tb == NULL)
+    return 0;
+  memcpy (bucket, &tb->bucket, dbf->header->bucket_size);
+  return 1;
+}
+
+/* Free all saved buckets. */
+static void
+txn_bucket_free (GDBM_FILE dbf)
+{
+  size_t i;
+
+  if (dbf->txn_bucket == NULL)
+    return;
+  for (i = 0; i < dbf->txn_bucket_size; i++)
+    {
+      txn_bucket *tb, *next;
+
+      for (tb = dbf->txn_bucket[i]; tb; tb = next)
+	{
+	  next = tb->next;
+	  free (tb);
+	}
+    }
+  free (dbf->txn_bucket);
+  dbf->txn_bucket = NULL;
+  dbf->txn_bucket_size = 0;
+  dbf->txn_bucket_count = 0;
+}
+
+/* Free NUM_BYTES at FILE_ADR when the current transaction is committed.
+   If the space held a saved bucket, the bucket is forgotten. */
+int
+_gdbm_txn_free (GDBM_FILE dbf, off_t file_adr, int num_bytes)
+{
+  if (dbf->txn_bucket)
+    {
+      txn_bucket **pp = txn_bucket_link (dbf, file_adr);
+      txn_bucket *tb = *pp;
+      if (tb)
+	{
+	  *pp = tb->next;
+	  free (tb);
+	  dbf->txn_bucket_count--;
+	}
+    }
+
+  if (dbf->txn_free_count == dbf->txn_free_max)
+    {
+      size_t n = dbf->txn_free_max ? 2 * dbf->txn_free_max : 64;
+      avail_elem *p = realloc (dbf->txn_free, n * sizeof (p[0]));
+      if (!p)
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, TRUE);
+	  return -1;
+	}
+      dbf->txn_free = p;
+      dbf->txn_free_max = n;
+    }
+  dbf->txn_free[dbf->txn_free_count].av_adr = file_adr;
+  dbf->txn_free[dbf->txn_free_count].av_size = num_bytes;
+  dbf->txn_free_count++;
+  return 0;
+}
+
+/* Forget the in-memory state of the current transaction, if any. */
+void
+_gdbm_txn_discard (GDBM_FILE dbf)
+{
+  txn_bucket_free (dbf);
+  free (dbf->txn_free);
+  dbf->txn_free = NULL;
+  dbf->txn_free_count = dbf->txn_free_max = 0;
+  dbf->txn_state = TXN_NONE;
+}
+
+/* Drop all changes kept in memory and read the header and the directory
+   from the file again. */
+static int
+txn_reload (GDBM_FILE dbf)
+{
+  off_t *new_dir;
+
+  _gdbm_cache_discard (dbf);
+  _gdbm_data_cache_free (dbf);
+  dbf->bucket_count = 0;
+  dbf->header_changed = FALSE;
+  dbf->directory_changed = FALSE;
+  dbf->bucket_changed = FALSE;
+  dbf->second_changed = FALSE;
+
+  if (_gdbm_full_pread (dbf, dbf->header, dbf->header->block_size, 0))
+    {
+      dbf->need_recovery = TRUE;
+      return -1;
+    }
+
+  new_dir = realloc (dbf->dir, dbf->header->dir_size);
+  if (!new_dir)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, TRUE);
+      return -1;
+    }
+  dbf->dir = new_dir;
+  if (_gdbm_full_pread (dbf, dbf->dir, dbf->header->dir_size,
+			dbf->header->dir))
+    {
+      dbf->need_recovery = TRUE;
+      return -1;
+    }
+  dbf->bucket_dir = 0;
+
+  /* Give back the space allocated by the transaction. */
+  return _gdbm_file_truncate (dbf, dbf->header->next_block);
+}
+
+/* Start a transaction. */
+int
+gdbm_txn_begin (GDBM_FILE dbf)
+{
+  /* Return immediately if the database needs recovery */
+  GDBM_ASSERT_CONSISTENCY (dbf, -1);
+
+  if (dbf->read_write == GDBM_READER)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_READER_CANT_STORE, FALSE);
+      return -1;
+    }
+  if (dbf->txn_state != TXN_NONE)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_TXN_ACTIVE, FALSE);
+      return -1;
+    }
+  /* The name of the journal is made from that of the database file. */
+  if (!dbf->name_is_path)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_NO_DBNAME, FALSE);
+      return -1;
+    }
+  gdbm_set_errno (dbf, GDBM_NO_ERROR, FALSE);
+
+  /* The changes made so far in an update batch are not part of the
+     transaction. */
+  if (dbf->batch_level && _gdbm_flush_batch (dbf))
+    return -1;
+
+  if (_gdbm_journal_open (dbf) || _gdbm_fsm_txn_begin (dbf))
+    return -1;
+  dbf->txn_state = TXN_ACTIVE;
+  return 0;
+}
+
+/* Write the changes made by the current transaction to the journal.
+   On success, the transaction is committed. */
+static int
+txn_journal (GDBM_FILE dbf)
+{
+  size_t i;
+
+  dbf->txn_state = TXN_COMMIT;
+
+  /* Release the space freed during the transaction.  This can change
+     the current bucket and the header, and write avail blocks. */
+  for (i = 0; i < dbf->txn_free_count; i++)
+    if (_gdbm_free (dbf, dbf->txn_free[i].av_adr, dbf->txn_free[i].av_size))
+      return -1;
+  dbf->txn_free_count = 0;
+  if (dbf->bucket_changed && dbf->cache_entry != NULL)
+    {
+      _gdbm_cache_set_changed (dbf, dbf->cache_entry);
+      dbf->bucket_changed = FALSE;
+    }
+
+  /* Journal the final images of the changed buckets, the directory
+     and the header. */
+  for (i = 0; i < dbf->txn_bucket_size; i++)
+    {
+      txn_bucket *tb;
+
+      for (tb = dbf->txn_bucket[i]; tb; tb = tb->next)
+	if (_gdbm_journal_log (dbf, tb->adr, &tb->bucket,
+			       dbf->header->bucket_size))
+	  return -1;
+    }
+  for (i = 0; i < dbf->cache_size; i++)
+    {
+      cache_elem *elem = &dbf->bucket_cache[i];
+      if (elem->ca_adr && elem->ca_changed
+	  && _gdbm_journal_log (dbf, elem->ca_adr, elem->ca_bucket,
+				dbf->header->bucket_size))
+	return -1;
+    }
+  if (dbf->directory_changed
+      && _gdbm_journal_log (dbf, dbf->header->dir, dbf->dir,
+			    dbf->header->dir_size))
+    return -1;
+  if (dbf->header_changed
+      && _gdbm_journal_log (dbf, 0, dbf->header, dbf->header->block_size))
+    return -1;
+
+  return _gdbm_journal_commit (dbf);
+}
+
+/* Write the changes of the committed transaction to the database
+   file. */
+static int
+txn_apply (GDBM_FILE dbf)
+{
+  size_t i;
+  int fast_write = dbf->fast_write;
+  int rc = 0;
+
+  /* Buckets saved during the transaction. */
+  for (i = 0; i < dbf->txn_bucket_size && rc == 0; i++)
+    {
+      txn_bucket *tb;
+
+      for (tb = dbf->txn_bucket[i]; tb; tb = tb->next)
+	{
+	  cache_elem elem;
+
+	  elem.ca_adr = tb->adr;
+	  elem.ca_bucket = &tb->bucket;
+	  if ((rc = _gdbm_write_bucket (dbf, &elem)) != 0)
+	    break;
+	}
+    }
+
+  /* Everything else.  The journal already makes the changes durable, so
+     the file need not be synchronized. */
+  if (rc == 0)
+    {
+      dbf->fast_write = TRUE;
+      rc = _gdbm_flush_batch (dbf);
+      dbf->fast_write = fast_write;
+    }
+  return rc;
+}
+
+/* Commit the current transaction. */
+int
+gdbm_txn_commit (GDBM_FILE dbf)
+{
+  int rc;
+
+  /* Return immediately if the database needs recovery */
+  GDBM_ASSERT_CONSISTENCY (dbf, -1);
+
+  if (dbf->txn_state != TXN_ACTIVE)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_NO_TXN, FALSE);
+      return -1;
+    }
+  gdbm_set_errno (dbf, GDBM_NO_ERROR, FALSE);
+
+  if (txn_journal (dbf))
+    {
+      /* The transaction could not be committed.  Roll it back, keeping
+	 the error state. */
+      gdbm_error ec = gdbm_last_errno (dbf);
+      int syserr = gdbm_last_syserr (dbf);
+
+      if (gdbm_txn_abort (dbf) == 0)
+	{
+	  errno = syserr;
+	  gdbm_set_errno (dbf, ec, FALSE);
+	}
+      return -1;
+    }
+
+  dbf->txn_state = TXN_NONE;
+  _gdbm_fsm_txn_end (dbf, FALSE);
+  rc = txn_apply (dbf);
+  _gdbm_txn_discard (dbf);
+  if (rc == 0)
+    rc = _gdbm_journal_trim (dbf);
+  return rc;
+}
+
+/* Abort the current transaction, discarding its changes. */
+int
+gdbm_txn_abort (GDBM_FILE dbf)
+{
+  int rc;
+
+  if (dbf->txn_state == TXN_NONE)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_NO_TXN, dbf->need_recovery);
+      return -1;
+    }
+
+  /* The file has not been changed by the transaction, so the database
+     becomes consistent again if its state can be read back. */
+  gdbm_set_errno (dbf, GDBM_NO_ERROR, FALSE);
+  _gdbm_txn_discard (dbf);
+  _gdbm_fsm_txn_end (dbf, TRUE);
+  rc = _gdbm_journal_rollback (dbf);
+  if (txn_reload (dbf))
+    {
+      _gdbm_fatal (dbf, gdbm_db_strerror (dbf));
+      rc = -1;
+    }
+  return rc;
+}
@@ -0,0 +1,205 @@
+/* group.c - Group commit for databases in synchronous mode. */
+
+/* This file is part of GDBM, the GNU data base manager.
+   Copyright (C) 2018 Free Software Foundation, Inc.
+
+   GDBM is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   GDBM is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GDBM. If not, see <http://www.gnu.org/licenses/>.    */
+
+/* Include system configuration before all else. */
+#include "autoconf.h"
+
+#include "gdbmdefs.h"
+
+#if HAVE_PTHREAD_H
+#include <time.h>
+
+/* In synchronous mode, each update synchronizes the database file
+   before returning, so that the number of updates per second is
+   limited by the rate of fsync calls.  With group commit, several
+   threads may update the database through the same handle, and a
+   single synchronization covers all the updates made while it was
+   pending.  The first update that needs the file to be synchronized
+   becomes the leader: it waits until GROUP_MAX_COUNT updates are
+   pending, or GROUP_MAX_WAIT microseconds have elapsed, and then
+   synchronizes the file.  The updates made in the meantime wait for it
+   to finish.  In either case, gdbm_store and gdbm_delete return only
+   when the update is on disk. */
+
+/* Enable group commit with the parameters in GC, or disable it if
+   GC->max_count is 0. */
+int
+_gdbm_group_setup (GDBM_FILE dbf, struct gdbm_group_commit const *gc)
+{
+  if (gc->max_count == 0)
+    {
+      dbf->group_commit = FALSE;
+      return 0;
+    }
+
+  if (!dbf->group_init)
+    {
+      if (pthread_mutex_init (&dbf->group_mutex, NULL))
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+	  return -1;
+	}
+      if (pthread_cond_init (&dbf->group_join, NULL))
+	{
+	  pthread_mutex_destroy (&dbf->group_mutex);
+	  GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+	  return -1;
+	}
+      if (pthread_cond_init (&dbf->group_done, NULL))
+	{
+	  pthread_cond_destroy (&dbf->group_join);
+	  pthread_mutex_destroy (&dbf->group_mutex);
+	  GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+	  return -1;
+	}
+      dbf->group_seq = dbf->group_synced = dbf->group_syncs = 0;
+      dbf->group_leader = FALSE;
+      dbf->group_init = TRUE;
+    }
+
+  /* Other threads may be updating the database. */
+  pthread_mutex_lock (&dbf->group_mutex);
+  dbf->group_max_count = gc->max_count;
+  dbf->group_max_wait = gc->max_wait;
+  dbf->group_error = GDBM_NO_ERROR;
+  dbf->group_commit = TRUE;
+  pthread_mutex_unlock (&dbf->group_mutex);
+  return 0;
+}
+
+/* Store the group commit parameters and counters of DBF in GC. */
+void
+_gdbm_group_get (GDBM_FILE dbf, struct gdbm_group_commit *gc)
+{
+  gc->max_count = 0;
+  gc->max_wait = 0;
+  gc->updates = 0;
+  gc->syncs = 0;
+  if (!dbf->group_init)
+    return;
+
+  /* The counters are updated by the threads storing into DBF. */
+  pthread_mutex_lock (&dbf->group_mutex);
+  if (dbf->group_commit)
+    {
+      gc->max_count = dbf->group_max_count;
+      gc->max_wait = dbf->group_max_wait;
+    }
+  gc->updates = dbf->group_synced;
+  gc->syncs = dbf->group_syncs;
+  pthread_mutex_unlock (&dbf->group_mutex);
+}
+
+/* Free the resources used by group commit. */
+void
+_gdbm_group_free (GDBM_FILE dbf)
+{
+  if (dbf->group_init)
+    {
+      pthread_cond_destroy (&dbf->group_done);
+      pthread_cond_destroy (&dbf->group_join);
+      pthread_mutex_destroy (&dbf->group_mutex);
+      dbf->group_init = FALSE;
+    }
+  dbf->group_commit = FALSE;
+}
+
+/* Start an update. */
+void
+_gdbm_group_lock (GDBM_FILE dbf)
+{
+  pthread_mutex_lock (&dbf->group_mutex);
+  dbf->group_update = TRUE;
+}
+
+/* Act as the leader: wait for other updates to join, then synchronize
+   the file. */
+static void
+group_sync (GDBM_FILE dbf)
+{
+  unsigned long target;
+
+  dbf->group_leader = TRUE;
+  if (dbf->group_max_wait
+      && dbf->group_seq - dbf->group_synced < dbf->group_max_count)
+    {
+      struct timespec deadline;
+
+      clock_gettime (CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += dbf->group_max_wait / 1000000;
+      deadline.tv_nsec += (long) (dbf->group_max_wait % 1000000) * 1000;
+      if (deadline.tv_nsec >= 1000000000)
+	{
+	  deadline.tv_sec++;
+	  deadline.tv_nsec -= 1000000000;
+	}
+      while (dbf->group_seq - dbf->group_synced < dbf->group_max_count)
+	if (pthread_cond_timedwait (&dbf->group_join, &dbf->group_mutex,
+				    &deadline) == ETIMEDOUT)
+	  break;
+    }
+
+  /* The mutex is kept while synchronizing, so that no update modifies
+     the file (or its memory mapping) in the meantime. */
+  target = dbf->group_seq;
+  if (gdbm_file_sync (dbf))
+    dbf->group_error = GDBM_FILE_SYNC_ERROR;
+  dbf->group_syncs++;
+  dbf->group_synced = target;
+  dbf->group_leader = FALSE;
+  pthread_cond_broadcast (&dbf->group_done);
+}
+
+/* Finish an update started by _gdbm_group_lock.  RC is its result.
+   If it succeeded, wait until the file is synchronized.  Return RC, or
+   -1 if the synchronization failed. */
+int
+_gdbm_group_commit (GDBM_FILE dbf, int rc)
+{
+  dbf->group_update = FALSE;
+  /* Batches and transactions take care of writing the changes
+     themselves. */
+  if (rc == 0 && !dbf->fast_write
+      && dbf->batch_level == 0 && dbf->txn_state == TXN_NONE)
+    {
+      unsigned long seq = ++dbf->group_seq;
+
+      if (dbf->group_leader
+	  && dbf->group_seq - dbf->group_synced >= dbf->group_max_count)
+	pthread_cond_signal (&dbf->group_join);
+
+      while (dbf->group_synced < seq)
+	{
+	  if (dbf->group_leader)
+	    pthread_cond_wait (&dbf->group_done, &dbf->group_mutex);
+	  else
+	    group_sync (dbf);
+	}
+
+      /* Once a synchronization fails, it is not known which updates
+	 have reached the disk, so all subsequent ones fail as well. */
+      if (dbf->group_error != GDBM_NO_ERROR)
+	{
+	  GDBM_SET_ERRNO (dbf, dbf->group_error, FALSE);
+	  rc = -1;
+	}
+    }
+  pthread_mutex_unlock (&dbf->group_mutex);
+  return rc;
+}
+#endif
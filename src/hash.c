@@ -44,6 +44,90 @@ _gdbm_hash (datum key)
   return((int) value);
 }
 
+/* The hash function of databases created with GDBM_FASTHASH.  It reads
+   the key eight bytes at a time, mixes each word into a 64-bit state
+   and spreads the state over all bits with the MurmurHash3 finalizer.
+   The words are read in the host byte order, which is also the order
+   of all other numbers in the file.  The top GDBM_HASH_BITS bits of
+   the result are returned. */
+
+#define FH_PRIME1 0x9e3779b97f4a7c15ULL
+#define FH_PRIME2 0xc2b2ae3d27d4eb4fULL
+
+static inline unsigned long long
+fh_rotl (unsigned long long x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline unsigned long long
+fh_mix (unsigned long long h, unsigned long long w)
+{
+  w *= FH_PRIME2;
+  w = fh_rotl (w, 31);
+  w *= FH_PRIME1;
+  h ^= w;
+  return fh_rotl (h, 27) * FH_PRIME1 + 0x52dce729;
+}
+
+static unsigned long long
+fh_hash (datum key, unsigned long long seed)
+{
+  const char *p = key.dptr;
+  size_t n = key.dsize;
+  unsigned long long h, w;
+
+  h = (FH_PRIME1 + seed) ^ (n * FH_PRIME2);
+  for (; n >= sizeof (w); p += sizeof (w), n -= sizeof (w))
+    {
+      memcpy (&w, p, sizeof (w));
+      h = fh_mix (h, w);
+    }
+  if (n)
+    {
+      w = 0;
+      memcpy (&w, p, n);
+      h = fh_mix (h, w);
+    }
+
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+
+  return h;
+}
+
+int
+_gdbm_fast_hash (datum key)
+{
+  return (int) (fh_hash (key, 0) >> (64 - GDBM_HASH_BITS));
+}
+
+/* Store in BUF the SMALL bytes kept in the key_start member of the
+   bucket element of KEY and return the number of them that are
+   significant.  These are the first bytes of the key, or, in databases
+   created with GDBM_FINGERPRINT, a hash of the whole key computed with
+   a different seed than the hash value, so that keys with a common
+   prefix can be told apart without reading them. */
+int
+_gdbm_key_check (GDBM_FILE dbf, datum key, char *buf)
+{
+  if (dbf->key_fingerprint)
+    {
+      unsigned fp = (unsigned) fh_hash (key, FH_PRIME2);
+      memcpy (buf, &fp, SMALL);
+      return SMALL;
+    }
+  else
+    {
+      int n = SMALL < key.dsize ? SMALL : key.dsize;
+      memcpy (buf, key.dptr, n);
+      return n;
+    }
+}
+
 int
 _gdbm_bucket_dir (GDBM_FILE dbf, int hash)
 {
@@ -53,8 +137,8 @@ _gdbm_bucket_dir (GDBM_FILE dbf, int hash)
 void
 _gdbm_hash_key (GDBM_FILE dbf, datum key, int *hash, int *bucket, int *offset)
 {
-  int hashval = _gdbm_hash (key);
+  int hashval = dbf->hash (key);
   *hash = hashval;
   *bucket = _gdbm_bucket_dir (dbf, hashval);
-  *offset = hashval % dbf->header->bucket_elems;
+  *offset = GDBM_BUCKET_HOME (dbf, hashval);
 }
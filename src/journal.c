@@ -0,0 +1,656 @@
+/* journal.c - The transaction journal. */
+
+/* This file is part of GDBM, the GNU data base manager.
+   Copyright (C) 2018 Free Software Foundation, Inc.
+
+   GDBM is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   GDBM is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GDBM. If not, see <http://www.gnu.org/licenses/>.   */
+
+/* Include system configuration before all else. */
+#include "autoconf.h"
+
+#include "gdbmdefs.h"
+
+/* The changes made by a transaction (see gdbmtxn.c) are recorded in a
+   journal file, whose name is that of the database file followed by
+   JOURNAL_SUFFIX.  The journal is a sequence of records.  A JOURNAL_WRITE
+   record is followed by SIZE bytes to be written at offset ADR of the
+   database file.  The keys, contents and avail blocks written during a
+   transaction are journaled as they are written to the file.  When the
+   transaction is committed, the images of the changed buckets, of the
+   directory and of the header are journaled, followed by a
+   JOURNAL_COMMIT record holding the checksum of all records of the
+   transaction.  A transaction whose commit record is missing or whose
+   checksum does not match is ignored.
+
+   Once the journal is synchronized, the transaction is committed.  Its
+   changes are then written to the database file, which is not
+   synchronized.  The journal is emptied by a checkpoint, after
+   synchronizing the database file.  Checkpoints are done when the
+   database is synchronized or closed, before it is changed outside of a
+   transaction, and when the journal becomes bigger than
+   JOURNAL_MAX_SIZE.
+
+   The record headers have a fixed layout, independent of the word size
+   and byte order of the host (see journal_encode).  The data that
+   follow JOURNAL_WRITE records are images of parts of the database
+   file.
+
+   Transactions need the path of the database file, so they are not
+   available for databases opened with gdbm_fd_open.
+
+   When the database is opened for writing, the committed transactions
+   found in the journal are written to the database file again.  Opening
+   it for reading fails while the journal holds any. */
+
+#define JOURNAL_SUFFIX   "-journal"
+#define JOURNAL_MAGIC    0x4a4d4447
+#define JOURNAL_MAX_SIZE (4*1024*1024)
+
+enum
+  {
+    JOURNAL_WRITE = 1,
+    JOURNAL_COMMIT
+  };
+
+struct journal_record
+{
+  unsigned magic;     /* JOURNAL_MAGIC */
+  unsigned type;      /* Record type. */
+  off_t    adr;       /* JOURNAL_WRITE: where to write the data. */
+  size_t   size;      /* JOURNAL_WRITE: size of the data that follow. */
+  unsigned sum;       /* JOURNAL_COMMIT: checksum of the transaction. */
+};
+
+/* In the file, a record header takes JOURNAL_RECORD_SIZE bytes, holding
+   the members above in big-endian order: magic and type in 4 bytes
+   each, adr and size in 8 bytes each, sum in 4 bytes, followed by 4
+   zero bytes. */
+#define JOURNAL_RECORD_SIZE 32
+
+static void
+journal_put (unsigned char *p, unsigned long long val, int n)
+{
+  while (n--)
+    {
+      p[n] = val & 0xff;
+      val >>= 8;
+    }
+}
+
+static unsigned long long
+journal_get (unsigned char const *p, int n)
+{
+  unsigned long long val = 0;
+
+  while (n--)
+    val = (val << 8) | *p++;
+  return val;
+}
+
+static void
+journal_encode (struct journal_record const *rec, unsigned char *buf)
+{
+  journal_put (buf, rec->magic, 4);
+  journal_put (buf + 4, rec->type, 4);
+  journal_put (buf + 8, rec->adr, 8);
+  journal_put (buf + 16, rec->size, 8);
+  journal_put (buf + 24, rec->sum, 4);
+  journal_put (buf + 28, 0, 4);
+}
+
+/* Decode the record header in BUF into REC.  Return -1 if it holds
+   values that do not fit in REC. */
+static int
+journal_decode (unsigned char const *buf, struct journal_record *rec)
+{
+  unsigned long long adr = journal_get (buf + 8, 8);
+  unsigned long long size = journal_get (buf + 16, 8);
+
+  rec->magic = journal_get (buf, 4);
+  rec->type = journal_get (buf + 4, 4);
+  rec->adr = adr;
+  rec->size = size;
+  rec->sum = journal_get (buf + 24, 4);
+  if (rec->adr < 0 || (unsigned long long) rec->adr != adr
+      || rec->size != size)
+    return -1;
+  return 0;
+}
+
+/* Checksum of the records of a transaction (32-bit FNV-1a). */
+#define JOURNAL_SUM_INIT 2166136261U
+
+static unsigned
+journal_sum (unsigned sum, void const *buf, size_t size)
+{
+  unsigned char const *p = buf;
+
+  while (size--)
+    {
+      sum ^= *p++;
+      sum = (sum * 16777619U) & 0xffffffffU;
+    }
+  return sum;
+}
+
+static char *
+journal_name (char const *name)
+{
+  char *s = malloc (strlen (name) + sizeof (JOURNAL_SUFFIX));
+  if (s)
+    strcat (strcpy (s, name), JOURNAL_SUFFIX);
+  return s;
+}
+
+static int
+journal_write (int fd, void const *buf, size_t size)
+{
+  char const *ptr = buf;
+
+  while (size)
+    {
+      ssize_t n = write (fd, ptr, size);
+      if (n == -1)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return -1;
+	}
+      if (n == 0)
+	{
+	  errno = ENOSPC;
+	  return -1;
+	}
+      ptr += n;
+      size -= n;
+    }
+  return 0;
+}
+
+/* Read SIZE bytes from FD.  Return 0 on success, 1 on end of file, and
+   -1 on error. */
+static int
+journal_read (int fd, void *buf, size_t size)
+{
+  char *ptr = buf;
+
+  while (size)
+    {
+      ssize_t n = read (fd, ptr, size);
+      if (n == -1)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return -1;
+	}
+      if (n == 0)
+	return 1;
+      ptr += n;
+      size -= n;
+    }
+  return 0;
+}
+
+static int
+journal_sync (int fd)
+{
+#if HAVE_FSYNC
+  return fsync (fd);
+#else
+  sync ();
+  sync ();
+  return 0;
+#endif
+}
+
+/* Truncate the journal to SIZE bytes and position its descriptor
+   there. */
+static int
+journal_truncate (GDBM_FILE dbf, off_t size)
+{
+  if (ftruncate (dbf->journal_fd, size)
+      || lseek (dbf->journal_fd, size, SEEK_SET) != size)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_FILE_TRUNCATE_ERROR, FALSE);
+      return -1;
+    }
+  dbf->journal_size = size;
+  return 0;
+}
+
+/* Open the journal of DBF for writing, creating it if necessary. */
+int
+_gdbm_journal_open (GDBM_FILE dbf)
+{
+  struct stat st;
+  char *name;
+  int fd;
+
+  if (dbf->journal_fd != -1)
+    return 0;
+
+  if (fstat (dbf->desc, &st))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_FILE_STAT_ERROR, FALSE);
+      return -1;
+    }
+  name = journal_name (dbf->name);
+  if (!name)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+      return -1;
+    }
+  fd = open (name, O_RDWR | O_CREAT | (dbf->cloexec ? O_CLOEXEC : 0),
+	     st.st_mode & 0666);
+  SAVE_ERRNO (free (name));
+  if (fd == -1)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_FILE_OPEN_ERROR, FALSE);
+      return -1;
+    }
+  dbf->journal_fd = fd;
+
+  /* The journal was replayed when the database was opened.  Anything
+     left in it is of no use. */
+  if (journal_truncate (dbf, 0))
+    {
+      close (fd);
+      dbf->journal_fd = -1;
+      return -1;
+    }
+  dbf->txn_start = 0;
+  dbf->txn_sum = JOURNAL_SUM_INIT;
+  dbf->journal_pending = FALSE;
+  return 0;
+}
+
+/* If a transaction is in progress, journal the writing of SIZE bytes
+   from BUF at offset ADR of the database file. */
+int
+_gdbm_journal_log (GDBM_FILE dbf, off_t adr, void const *buf, size_t size)
+{
+  struct journal_record rec;
+  unsigned char hdr[JOURNAL_RECORD_SIZE];
+
+  if (dbf->txn_state == TXN_NONE)
+    return 0;
+
+  memset (&rec, 0, sizeof (rec));
+  rec.magic = JOURNAL_MAGIC;
+  rec.type = JOURNAL_WRITE;
+  rec.adr = adr;
+  rec.size = size;
+  journal_encode (&rec, hdr);
+  if (journal_write (dbf->journal_fd, hdr, sizeof (hdr))
+      || journal_write (dbf->journal_fd, buf, size))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_FILE_WRITE_ERROR, TRUE);
+      return -1;
+    }
+  dbf->txn_sum = journal_sum (journal_sum (dbf->txn_sum, hdr, sizeof (hdr)),
+			      buf, size);
+  dbf->journal_size += sizeof (hdr) + size;
+  return 0;
+}
+
+/* Write the commit record of the current transaction and synchronize
+   the journal.  On success, the transaction is committed. */
+int
+_gdbm_journal_commit (GDBM_FILE dbf)
+{
+  struct journal_record rec;
+  unsigned char hdr[JOURNAL_RECORD_SIZE];
+
+  memset (&rec, 0, sizeof (rec));
+  rec.magic = JOURNAL_MAGIC;
+  rec.type = JOURNAL_COMMIT;
+  rec.sum = dbf->txn_sum;
+  journal_encode (&rec, hdr);
+  if (journal_write (dbf->journal_fd, hdr, sizeof (hdr)))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_FILE_WRITE_ERROR, FALSE);
+      return -1;
+    }
+  dbf->journal_size += sizeof (hdr);
+  if (journal_sync (dbf->journal_fd))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_FILE_SYNC_ERROR, FALSE);
+      return -1;
+    }
+  dbf->txn_start = dbf->journal_size;
+  dbf->txn_sum = JOURNAL_SUM_INIT;
+  dbf->journal_pending = TRUE;
+  return 0;
+}
+
+/* Discard the records of the current transaction. */
+int
+_gdbm_journal_rollback (GDBM_FILE dbf)
+{
+  dbf->txn_sum = JOURNAL_SUM_INIT;
+  if (dbf->journal_fd == -1)
+    return 0;
+  return journal_truncate (dbf, dbf->txn_start);
+}
+
+/* Synchronize the database file and empty the journal.  While a
+   transaction is in progress, only the database file is synchronized. */
+int
+_gdbm_journal_checkpoint (GDBM_FILE dbf)
+{
+  if (!dbf->journal_pending)
+    return 0;
+  if (gdbm_file_sync (dbf))
+    return -1;
+  if (dbf->txn_state != TXN_NONE)
+    return 0;
+  if (journal_truncate (dbf, 0))
+    return -1;
+  if (journal_sync (dbf->journal_fd))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_FILE_SYNC_ERROR, FALSE);
+      return -1;
+    }
+  dbf->txn_start = 0;
+  dbf->journal_pending = FALSE;
+  return 0;
+}
+
+/* Do a checkpoint if the journal has grown too big. */
+int
+_gdbm_journal_trim (GDBM_FILE dbf)
+{
+  if (dbf->journal_size > JOURNAL_MAX_SIZE)
+    return _gdbm_journal_checkpoint (dbf);
+  return 0;
+}
+
+/* Close the journal.  Unless KEEP is true, discard the records of the
+   current transaction, if any, do a checkpoint and remove the journal
+   file.  KEEP is set when the database file may be inconsistent, so
+   that the journal is replayed next time the database is opened. */
+int
+_gdbm_journal_close (GDBM_FILE dbf, int keep)
+{
+  int rc = 0;
+
+  if (dbf->journal_fd == -1)
+    return 0;
+  if (!keep)
+    {
+      rc = _gdbm_journal_rollback (dbf);
+      if (rc == 0)
+	rc = _gdbm_journal_checkpoint (dbf);
+      if (rc == 0 && dbf->journal_size == 0)
+	{
+	  char *name = journal_name (dbf->name);
+	  if (name)
+	    {
+	      unlink (name);
+	      free (name);
+	    }
+	}
+    }
+  close (dbf->journal_fd);
+  dbf->journal_fd = -1;
+  return rc;
+}
+
+/* Read the next record from the journal FD into REC, and its encoded
+   header into HDR.  If it is a JOURNAL_WRITE record, read its data into
+   *PBUF, reallocating it as necessary.  REMAINING is the number of bytes
+   left in the journal.  Return 0 on success, 1 if there are no more
+   valid records, and -1 on error. */
+static int
+journal_next (GDBM_FILE dbf, int fd, struct journal_record *rec,
+	      unsigned char *hdr, char **pbuf, size_t *psize, off_t remaining)
+{
+  int rc;
+
+  if (remaining < JOURNAL_RECORD_SIZE)
+    return 1;
+  rc = journal_read (fd, hdr, JOURNAL_RECORD_SIZE);
+  if (rc)
+    goto err;
+  if (journal_decode (hdr, rec) || rec->magic != JOURNAL_MAGIC)
+    return 1;
+  switch (rec->type)
+    {
+    case JOURNAL_WRITE:
+      if (rec->size > remaining - JOURNAL_RECORD_SIZE)
+	return 1;
+      if (rec->size > *psize)
+	{
+	  char *p = realloc (*pbuf, rec->size);
+	  if (!p)
+	    {
+	      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+	      return -1;
+	    }
+	  *pbuf = p;
+	  *psize = rec->size;
+	}
+      rc = journal_read (fd, *pbuf, rec->size);
+      if (rc)
+	goto err;
+      return 0;
+
+    case JOURNAL_COMMIT:
+      return 0;
+    }
+  return 1;
+
+ err:
+  if (rc == 1)
+    return 1;
+  GDBM_SET_ERRNO (dbf, GDBM_FILE_READ_ERROR, FALSE);
+  return -1;
+}
+
+/* Scan the journal FD of SIZE bytes and store in *END the offset of
+   the end of the last committed transaction in it. */
+static int
+journal_scan (GDBM_FILE dbf, int fd, off_t size, off_t *end)
+{
+  struct journal_record rec;
+  unsigned char hdr[JOURNAL_RECORD_SIZE];
+  char *buf = NULL;
+  size_t bufsize = 0;
+  unsigned sum = JOURNAL_SUM_INIT;
+  off_t pos = 0;
+  int rc;
+
+  *end = 0;
+  while ((rc = journal_next (dbf, fd, &rec, hdr, &buf, &bufsize, size - pos))
+	 == 0)
+    {
+      pos += sizeof (hdr);
+      if (rec.type == JOURNAL_COMMIT)
+	{
+	  if (rec.sum != sum)
+	    break;
+	  *end = pos;
+	  sum = JOURNAL_SUM_INIT;
+	}
+      else
+	{
+	  sum = journal_sum (journal_sum (sum, hdr, sizeof (hdr)),
+			     buf, rec.size);
+	  pos += rec.size;
+	}
+    }
+  free (buf);
+  return rc == -1 ? -1 : 0;
+}
+
+/* Write the JOURNAL_WRITE records found in the first END bytes of the
+   journal FD to the database file. */
+static int
+journal_apply (GDBM_FILE dbf, int fd, off_t end)
+{
+  struct journal_record rec;
+  unsigned char hdr[JOURNAL_RECORD_SIZE];
+  char *buf = NULL;
+  size_t bufsize = 0;
+  off_t pos = 0;
+  int rc = 0;
+
+  if (lseek (fd, 0, SEEK_SET) != 0)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_FILE_SEEK_ERROR, FALSE);
+      return -1;
+    }
+  while (pos < end)
+    {
+      rc = journal_next (dbf, fd, &rec, hdr, &buf, &bufsize, end - pos);
+      if (rc)
+	break;
+      pos += sizeof (hdr);
+      if (rec.type != JOURNAL_WRITE)
+	continue;
+      pos += rec.size;
+
+      rc = _gdbm_full_pwrite (dbf, buf, rec.size, rec.adr);
+      if (rc)
+	break;
+    }
+  free (buf);
+
+  if (rc == 1)
+    {
+      /* The journal was changed while reading it. */
+      GDBM_SET_ERRNO (dbf, GDBM_FILE_EOF, FALSE);
+      rc = -1;
+    }
+  return rc;
+}
+
+/* Make the size of the database file match its header: the committed
+   transactions may have grown it, and the space allocated by an
+   unfinished one is dropped.  Synchronize the file. */
+static int
+journal_fix_size (GDBM_FILE dbf)
+{
+  gdbm_file_header hdr;
+  int rc = 0;
+
+  if (_gdbm_full_pread (dbf, &hdr, sizeof (hdr), 0) == 0
+      && hdr.next_block >= sizeof (hdr))
+    {
+      rc = _gdbm_file_extend (dbf, hdr.next_block);
+      if (rc == 0)
+	rc = _gdbm_file_truncate (dbf, hdr.next_block);
+    }
+  /* Otherwise, let the caller diagnose the broken header. */
+  if (rc == 0)
+    rc = gdbm_file_sync (dbf);
+  return rc;
+}
+
+/* Write the transactions committed in the journal to the database file
+   DBF, which has just been opened and locked, and remove the journal.
+   If DISCARD is true, the database file is new and the journal is
+   removed without replaying it.  A reader cannot write to the file:
+   if the journal holds committed transactions, their changes may be
+   missing from the database file, or written only in part, so the
+   reader fails with GDBM_NEED_RECOVERY until a writer replays them.
+
+   Return 1 if the database file was modified, 0 if it was not, and -1
+   on error. */
+int
+_gdbm_journal_replay (GDBM_FILE dbf, int discard)
+{
+  char *name;
+  int fd;
+  struct stat st;
+  off_t end = 0;
+  int rc = 0;
+
+  /* The journal is found by the name of the database file, which is
+     not known for a database opened by gdbm_fd_open.  Transactions
+     are not allowed there (see gdbm_txn_begin). */
+  if (!dbf->name_is_path)
+    return 0;
+
+  name = journal_name (dbf->name);
+  if (!name)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+      return -1;
+    }
+  fd = open (name, dbf->read_write == GDBM_READER ? O_RDONLY : O_RDWR);
+  if (fd == -1)
+    {
+      if (errno == ENOENT)
+	{
+	  free (name);
+	  return 0;
+	}
+      GDBM_SET_ERRNO (dbf, GDBM_FILE_OPEN_ERROR, FALSE);
+      SAVE_ERRNO (free (name));
+      return -1;
+    }
+
+  if (!discard)
+    {
+      if (fstat (fd, &st))
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_FILE_STAT_ERROR, FALSE);
+	  rc = -1;
+	}
+      else
+	rc = journal_scan (dbf, fd, st.st_size, &end);
+    }
+
+  if (dbf->read_write == GDBM_READER)
+    {
+      if (rc == 0 && end > 0)
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_NEED_RECOVERY, FALSE);
+	  rc = -1;
+	}
+      SAVE_ERRNO (close (fd); free (name));
+      return rc;
+    }
+
+  /* The journal is emptied when the database is closed, so anything
+     left in it means that the program writing to the database died. */
+  if (rc == 0 && !discard && st.st_size > 0)
+    {
+      if ((end == 0 || journal_apply (dbf, fd, end) == 0)
+	  && journal_fix_size (dbf) == 0)
+	rc = 1;
+      else
+	rc = -1;
+    }
+
+  if (rc != -1)
+    {
+      if (ftruncate (fd, 0))
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_FILE_TRUNCATE_ERROR, FALSE);
+	  rc = -1;
+	}
+      else if (journal_sync (fd))
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_FILE_SYNC_ERROR, FALSE);
+	  rc = -1;
+	}
+      else
+	unlink (name);
+    }
+
+  SAVE_ERRNO (close (fd); free (name));
+  return rc;
+}
@@ -69,12 +69,27 @@ _gdbm_file_size (GDBM_FILE dbf, off_t *psize)
   return 0;
 }
 
-/* Unmap the region. Reset all mapped fields to initial values. */
+/* Return a pointer to LEN bytes at offset OFF in the GDBM file DBF,
+   or NULL if they do not lie entirely within the mapped region. */
+void *
+_gdbm_mapped_ptr (GDBM_FILE dbf, off_t off, size_t len)
+{
+  if (dbf->memory_mapping && dbf->mapped_region
+      && _GDBM_IN_MAPPED_REGION_P (dbf, off)
+      && dbf->mapped_size - (off - dbf->mapped_off) >= len)
+    return (char*) dbf->mapped_region + (off - dbf->mapped_off);
+  return NULL;
+}
+
+/* Unmap the region. Reset all mapped fields to initial values.  Cached
+   buckets that point into the region are dropped (see
+   _gdbm_cache_unmap). */
 void
 _gdbm_mapped_unmap (GDBM_FILE dbf)
 {
   if (dbf->mapped_region)
     {
+      _gdbm_cache_unmap (dbf);
       munmap (dbf->mapped_region, dbf->mapped_size);
       dbf->mapped_region = NULL;
       dbf->mapped_size = 0;
@@ -95,6 +110,8 @@ _gdbm_internal_remap (GDBM_FILE dbf, size_t size)
 
   if (dbf->mapped_region)
     {
+      if (_gdbm_cache_unmap (dbf))
+	return -1;
       munmap (dbf->mapped_region, dbf->mapped_size);
       dbf->mapped_region = NULL;
     }
@@ -130,7 +147,8 @@ _gdbm_internal_remap (GDBM_FILE dbf, size_t size)
    If the file is opened with write permissions, FLAG controls how
    it is expanded.  The value _REMAP_DEFAULT truncates SIZE to the
    actual file size.  The value _REMAP_EXTEND extends the file, if
-   necessary, to accomodate max(SIZE,dbf->header->next_block) bytes.
+   necessary, to accomodate max(SIZE,dbf->header->next_block) bytes,
+   and maps the whole file.
    Finally, the value _REMAP_END instructs the function to use 
    max(SIZE, file_size) as the upper bound of the mapped region.
 
@@ -175,15 +193,19 @@ _gdbm_mapped_remap (GDBM_FILE dbf, off_t size, int flag)
 	    {
 	      if (size < dbf->header->next_block)
 		size = dbf->header->next_block;
-	      if (_gdbm_file_extend (dbf, size))
+	      if (_gdbm_file_grow (dbf, size))
 		return -1;
-	      file_size = size;
+	      file_size = dbf->file_size;
 	    }
 	  else
 	    {
 	      return 0;
 	    }
 	}
+      /* The file grows in steps (see _gdbm_file_grow).  Map all of it,
+	 so that the region need not be remapped at each write past its
+	 end. */
+      size = file_size;
     }
   else
     {
@@ -228,17 +250,19 @@ _gdbm_mapped_init (GDBM_FILE dbf)
   return _gdbm_mapped_remap (dbf, 0, _REMAP_END);
 }
 
-/* Read LEN bytes from the GDBM file DBF into BUFFER. If mmapping is
-   not initialized or if it fails, fall back to the classical read(1).
-   Return number of bytes read or -1 on failure. */
+/* Read LEN bytes at offset OFF from the GDBM file DBF into BUFFER. If
+   mmapping is not initialized or if it fails, fall back to the classical
+   pread(2).  Return number of bytes read or -1 on failure. */
 ssize_t
-_gdbm_mapped_read (GDBM_FILE dbf, void *buffer, size_t len)
+_gdbm_mapped_pread (GDBM_FILE dbf, void *buffer, size_t len, off_t off)
 {
   if (dbf->memory_mapping)
     {
       ssize_t total = 0;
       char *cbuf = buffer;
-      
+
+      if (_gdbm_mapped_lseek (dbf, off, SEEK_SET) != off)
+	return -1;
       while (len)
 	{
 	  size_t nbytes;
@@ -256,9 +280,7 @@ _gdbm_mapped_read (GDBM_FILE dbf, void *buffer, size_t len)
 
 		  /* Disable memory mapping and retry */
 		  dbf->memory_mapping = FALSE;
-		  if (lseek (dbf->desc, pos, SEEK_SET) != pos)
-		    return total > 0 ? total : -1;
-		  rc = read (dbf->desc, cbuf, len);
+		  rc = pread (dbf->desc, cbuf, len, pos);
 		  if (rc == -1)
 		    return total > 0 ? total : -1;
 		  return total + rc;
@@ -279,20 +301,22 @@ _gdbm_mapped_read (GDBM_FILE dbf, void *buffer, size_t len)
 	}
       return total;
     }
-  return read (dbf->desc, buffer, len);
+  return pread (dbf->desc, buffer, len, off);
 }
 
-/* Write LEN bytes from BUFFER to the GDBM file DBF. If mmapping is
-   not initialized or if it fails, fall back to the classical write(1).
-   Return number of bytes written or -1 on failure. */
+/* Write LEN bytes from BUFFER to the GDBM file DBF at offset OFF. If
+   mmapping is not initialized or if it fails, fall back to the classical
+   pwrite(2).  Return number of bytes written or -1 on failure. */
 ssize_t
-_gdbm_mapped_write (GDBM_FILE dbf, void *buffer, size_t len)
+_gdbm_mapped_pwrite (GDBM_FILE dbf, void *buffer, size_t len, off_t off)
 {
   if (dbf->memory_mapping)
     {
       ssize_t total = 0;
       char *cbuf = buffer;
 
+      if (_gdbm_mapped_lseek (dbf, off, SEEK_SET) != off)
+	return -1;
       while (len)
 	{
 	  size_t nbytes;
@@ -309,9 +333,7 @@ _gdbm_mapped_write (GDBM_FILE dbf, void *buffer, size_t len)
 		    return -1;
 
 		  dbf->memory_mapping = FALSE;
-		  if (lseek (dbf->desc, pos, SEEK_SET) != pos)
-		    return total > 0 ? total : -1;
-		  rc = write (dbf->desc, cbuf, len);
+		  rc = pwrite (dbf->desc, cbuf, len, pos);
 		  if (rc == -1)
 		    return total > 0 ? total : -1;
 		  return total + rc;
@@ -332,7 +354,7 @@ _gdbm_mapped_write (GDBM_FILE dbf, void *buffer, size_t len)
 	}
       return total;
     }
-  return write (dbf->desc, buffer, len);
+  return pwrite (dbf->desc, buffer, len, off);
 }
 
 /* Seek to the offset OFFSET in the GDBM file DBF, according to the
@@ -381,6 +403,8 @@ _gdbm_mapped_lseek (GDBM_FILE dbf, off_t offset, int whence)
       
       if (!_GDBM_IN_MAPPED_REGION_P (dbf, needle))
 	{
+	  if (_gdbm_cache_unmap (dbf))
+	    return -1;
 	  _gdbm_mapped_unmap (dbf);
 	  dbf->mapped_off = needle;
 	  dbf->mapped_pos = 0;
@@ -26,49 +26,142 @@ int _gdbm_read_bucket_at (GDBM_FILE dbf, off_t off, hash_bucket *bucket,
 
 int _gdbm_split_bucket (GDBM_FILE, int);
 int _gdbm_write_bucket (GDBM_FILE, cache_elem *);
+int _gdbm_init_cache	(GDBM_FILE, size_t);
+void _gdbm_cache_entry_invalidate (GDBM_FILE, int);
+void _gdbm_cache_entry_set_adr (GDBM_FILE, int, off_t);
+void _gdbm_cache_entry_relocate (GDBM_FILE, int, off_t);
+int _gdbm_cache_lookup (GDBM_FILE, off_t);
+void _gdbm_cache_free (GDBM_FILE);
+void _gdbm_cache_discard (GDBM_FILE);
+void _gdbm_cache_set_changed (GDBM_FILE, cache_elem *);
+int _gdbm_cache_prefetch (GDBM_FILE, off_t const *, size_t);
+void _gdbm_cache_policy_reset (GDBM_FILE);
+int _gdbm_cache_resize (GDBM_FILE, size_t);
+int _gdbm_cache_set_bytes (GDBM_FILE, size_t);
+int _gdbm_bucket_filter_test (GDBM_FILE, int);
+void _gdbm_bucket_filter_add (GDBM_FILE, int);
+void _gdbm_bucket_filter_free (GDBM_FILE);
+int _gdbm_bucket_probe (GDBM_FILE, int, int, int);
+void _gdbm_bucket_probe_set (GDBM_FILE, int);
+int _gdbm_cache_unmap (GDBM_FILE);
+
+/* From datacache.c */
+data_cache_elem *_gdbm_data_cache_lookup (GDBM_FILE, off_t, hash_bucket *,
+					  int);
+data_cache_elem *_gdbm_data_cache_alloc (GDBM_FILE, off_t, hash_bucket *,
+					 int);
+void _gdbm_data_cache_invalidate (GDBM_FILE, off_t, int);
+void _gdbm_data_cache_move (GDBM_FILE, off_t, int, off_t, int);
+void _gdbm_data_cache_set_max (GDBM_FILE, size_t);
+void _gdbm_data_cache_free (GDBM_FILE);
 
 /* From falloc.c */
 off_t _gdbm_alloc       (GDBM_FILE, int);
 int  _gdbm_free         (GDBM_FILE, off_t, int);
 void _gdbm_put_av_elem  (avail_elem, avail_elem [], int *, int);
+off_t _gdbm_next_block_min (GDBM_FILE);
+int  _gdbm_avail_trim   (GDBM_FILE);
+int  _gdbm_punch_holes  (GDBM_FILE, int);
+void _gdbm_punch_free   (GDBM_FILE);
+
+/* From fsm.c */
+int _gdbm_fsm_init (GDBM_FILE);
+int _gdbm_fsm_attach (GDBM_FILE);
+void _gdbm_fsm_free (GDBM_FILE);
+int _gdbm_fsm_get (GDBM_FILE, int, avail_elem *);
+int _gdbm_fsm_put (GDBM_FILE, off_t, int);
+int _gdbm_fsm_get_below (GDBM_FILE, int, off_t, avail_elem *);
+off_t _gdbm_fsm_free_size (GDBM_FILE);
+int _gdbm_fsm_merge (GDBM_FILE);
+int _gdbm_fsm_table (GDBM_FILE, avail_elem **, size_t *, int);
+int _gdbm_fsm_save (GDBM_FILE);
+int _gdbm_fsm_txn_begin (GDBM_FILE);
+void _gdbm_fsm_txn_end (GDBM_FILE, int);
+
+/* From gdbmcompact.c */
+int _gdbm_compact_abort (GDBM_FILE);
+void _gdbm_compact_note (GDBM_FILE, off_t, int);
+void _gdbm_compact_free (GDBM_FILE);
 
 /* From findkey.c */
 char *_gdbm_read_entry  (GDBM_FILE, int);
 int _gdbm_findkey       (GDBM_FILE, datum, char **, int *);
 
+/* From group.c */
+#if HAVE_PTHREAD_H
+int _gdbm_group_setup (GDBM_FILE, struct gdbm_group_commit const *);
+void _gdbm_group_get (GDBM_FILE, struct gdbm_group_commit *);
+void _gdbm_group_free (GDBM_FILE);
+void _gdbm_group_lock (GDBM_FILE);
+int _gdbm_group_commit (GDBM_FILE, int);
+#endif
+
+/* From uring.c */
+#if HAVE_LINUX_IO_URING_H
+int _gdbm_uring_init (GDBM_FILE);
+void _gdbm_uring_free (GDBM_FILE);
+int _gdbm_uring_run (GDBM_FILE, struct gdbm_io_req *, size_t);
+#endif
+
+/* From gdbmtxn.c */
+int _gdbm_txn_save_bucket (GDBM_FILE, cache_elem *);
+int _gdbm_txn_load_bucket (GDBM_FILE, off_t, hash_bucket *);
+int _gdbm_txn_free (GDBM_FILE, off_t, int);
+void _gdbm_txn_discard (GDBM_FILE);
+
+/* From gdbmbulk.c */
+int _gdbm_set_capacity (GDBM_FILE, gdbm_count_t, size_t);
+
 /* From hash.c */
 int _gdbm_hash (datum);
+int _gdbm_fast_hash (datum);
+int _gdbm_key_check (GDBM_FILE dbf, datum key, char *buf);
 void _gdbm_hash_key (GDBM_FILE dbf, datum key, int *hash, int *bucket,
 		     int *offset);
 int _gdbm_bucket_dir (GDBM_FILE dbf, int hash);
 
 /* From update.c */
 int _gdbm_end_update   (GDBM_FILE);
+int _gdbm_flush_batch  (GDBM_FILE);
 void _gdbm_fatal	(GDBM_FILE, const char *);
 
-/* From gdbmopen.c */
-int _gdbm_init_cache	(GDBM_FILE, size_t);
-void _gdbm_cache_entry_invalidate (GDBM_FILE, int);
+/* From journal.c */
+int _gdbm_journal_open (GDBM_FILE);
+int _gdbm_journal_log (GDBM_FILE, off_t, void const *, size_t);
+int _gdbm_journal_commit (GDBM_FILE);
+int _gdbm_journal_rollback (GDBM_FILE);
+int _gdbm_journal_checkpoint (GDBM_FILE);
+int _gdbm_journal_trim (GDBM_FILE);
+int _gdbm_journal_close (GDBM_FILE, int);
+int _gdbm_journal_replay (GDBM_FILE, int);
 
+/* From gdbmopen.c */
 int gdbm_avail_block_validate (GDBM_FILE dbf, avail_block *avblk);
 int gdbm_bucket_avail_table_validate (GDBM_FILE dbf, hash_bucket *bucket);
+int _gdbm_feature_flags (GDBM_FILE dbf);
 
 /* From mmap.c */
 int _gdbm_mapped_init	(GDBM_FILE);
 void _gdbm_mapped_unmap	(GDBM_FILE);
-ssize_t _gdbm_mapped_read	(GDBM_FILE, void *, size_t);
-ssize_t _gdbm_mapped_write	(GDBM_FILE, void *, size_t);
+ssize_t _gdbm_mapped_pread	(GDBM_FILE, void *, size_t, off_t);
+ssize_t _gdbm_mapped_pwrite	(GDBM_FILE, void *, size_t, off_t);
 off_t _gdbm_mapped_lseek	(GDBM_FILE, off_t, int);
 int _gdbm_mapped_sync	(GDBM_FILE);
+void *_gdbm_mapped_ptr	(GDBM_FILE, off_t, size_t);
 
 /* From lock.c */
 void _gdbm_unlock_file	(GDBM_FILE);
 int _gdbm_lock_file	(GDBM_FILE);
 
 /* From fullio.c */
-int _gdbm_full_read (GDBM_FILE, void *, size_t);
-int _gdbm_full_write (GDBM_FILE, void *, size_t);
+int _gdbm_full_pread (GDBM_FILE, void *, size_t, off_t);
+int _gdbm_full_pwrite (GDBM_FILE, void *, size_t, off_t);
+int _gdbm_full_pwritev (GDBM_FILE, struct iovec *, int, off_t);
+int _gdbm_io_run (GDBM_FILE, struct gdbm_io_req *, size_t);
 int _gdbm_file_extend (GDBM_FILE dbf, off_t size);
+int _gdbm_file_grow (GDBM_FILE dbf, off_t size);
+int _gdbm_file_truncate (GDBM_FILE dbf, off_t size);
+int _gdbm_file_punch (GDBM_FILE dbf, off_t adr, off_t size);
 
 /* From base64.c */
 int _gdbm_base64_encode (const unsigned char *input, size_t input_len,
@@ -86,33 +179,37 @@ int _gdbm_next_bucket_dir (GDBM_FILE dbf, int bucket_dir);
 
 /* I/O functions */
 static inline ssize_t
-gdbm_file_read (GDBM_FILE dbf, void *buf, size_t size)
+gdbm_file_pread (GDBM_FILE dbf, void *buf, size_t size, off_t off)
 {
 #if HAVE_MMAP
-  return _gdbm_mapped_read (dbf, buf, size);
+  return _gdbm_mapped_pread (dbf, buf, size, off);
 #else
-  return read (dbf->desc, buf, size);
+  return pread (dbf->desc, buf, size, off);
 #endif
 }
 
 static inline ssize_t
-gdbm_file_write (GDBM_FILE dbf, void *buf, size_t size)
+gdbm_file_pwrite (GDBM_FILE dbf, void *buf, size_t size, off_t off)
 {
 #if HAVE_MMAP
-  return _gdbm_mapped_write (dbf, buf, size);
+  return _gdbm_mapped_pwrite (dbf, buf, size, off);
 #else
-  return write (dbf->desc, buf, size);
+  return pwrite (dbf->desc, buf, size, off);
 #endif
 }
 
-static inline off_t
-gdbm_file_seek (GDBM_FILE dbf, off_t off, int whence)
+/* Initialize REQ to read (or write, if WRITE is nonzero) SIZE bytes
+   at offset OFF into (from) BUF. */
+static inline void
+_gdbm_io_req_init (struct gdbm_io_req *req, int write, void *buf, size_t size,
+		   off_t off)
 {
-#if HAVE_MMAP
-  return _gdbm_mapped_lseek (dbf, off, whence);
-#else
-  return lseek (dbf->desc, off, whence);
-#endif
+  req->write = write;
+  req->off = off;
+  req->iov1.iov_base = buf;
+  req->iov1.iov_len = size;
+  req->iov = &req->iov1;
+  req->iovcnt = 1;
 }
 
 static inline int
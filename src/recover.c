@@ -91,8 +91,6 @@ static int
 _gdbm_finish_transfer (GDBM_FILE dbf, GDBM_FILE new_dbf,
 		       gdbm_recovery *rcvr, int flags)
 {
-  int i;
-  
   /* Write everything. */
   if (_gdbm_end_update (new_dbf))
     {
@@ -106,6 +104,14 @@ _gdbm_finish_transfer (GDBM_FILE dbf, GDBM_FILE new_dbf,
       gdbm_close (new_dbf);
       return -1;
     }
+
+  /* The journal refers to the old file: make sure it will not be
+     replayed on top of the new one. */
+  if (_gdbm_journal_close (dbf, FALSE))
+    {
+      gdbm_close (new_dbf);
+      return -1;
+    }
   
 #if HAVE_MMAP
   _gdbm_mapped_unmap (dbf);
@@ -144,29 +150,43 @@ _gdbm_finish_transfer (GDBM_FILE dbf, GDBM_FILE new_dbf,
   close (dbf->desc);
   free (dbf->header);
   free (dbf->dir);
+  _gdbm_fsm_free (dbf);
+  _gdbm_compact_free (dbf);
+  _gdbm_punch_free (dbf);
 
-  if (dbf->bucket_cache != NULL)
-    {
-      for (i = 0; i < dbf->cache_size; i++)
-	 {
-	   free (dbf->bucket_cache[i].ca_bucket);
-	   free (dbf->bucket_cache[i].ca_data.dptr);
-	 }
-      free (dbf->bucket_cache);
-   }
+  _gdbm_cache_free (dbf);
+  _gdbm_data_cache_free (dbf);
+  _gdbm_data_cache_free (new_dbf);
 
    dbf->desc              = new_dbf->desc;
    dbf->header            = new_dbf->header;
+   dbf->xheader           = new_dbf->xheader;
+   dbf->avail             = new_dbf->avail;
+   dbf->fsm               = new_dbf->fsm;
+   dbf->hash              = new_dbf->hash;
+   dbf->key_fingerprint   = new_dbf->key_fingerprint;
+   dbf->bucket_mask       = new_dbf->bucket_mask;
+   dbf->bucket_shift      = new_dbf->bucket_shift;
    dbf->dir               = new_dbf->dir;
    dbf->bucket            = new_dbf->bucket;
    dbf->bucket_dir        = new_dbf->bucket_dir;
    dbf->last_read         = new_dbf->last_read;
    dbf->bucket_cache      = new_dbf->bucket_cache;
    dbf->cache_size        = new_dbf->cache_size;
+   dbf->cache_index       = new_dbf->cache_index;
+   dbf->cache_index_size  = new_dbf->cache_index_size;
+   dbf->cache_dirty       = new_dbf->cache_dirty;
+   dbf->cache_dirty_count = new_dbf->cache_dirty_count;
+   dbf->cache_lru[0]      = new_dbf->cache_lru[0];
+   dbf->cache_lru[1]      = new_dbf->cache_lru[1];
+   dbf->cache_policy      = new_dbf->cache_policy;
+   dbf->bucket_count      = new_dbf->bucket_count;
    dbf->header_changed    = new_dbf->header_changed;
    dbf->directory_changed = new_dbf->directory_changed;
    dbf->bucket_changed    = new_dbf->bucket_changed;
    dbf->second_changed    = new_dbf->second_changed;
+   /* The size of the old file no longer applies (see _gdbm_file_grow). */
+   dbf->file_size         = new_dbf->file_size;
 
    free (new_dbf->name);
    free (new_dbf);
@@ -221,6 +241,7 @@ check_db (GDBM_FILE dbf)
 	      char *dptr;
 	      datum key;
 	      int hashval, bucket, off;
+	      char key_check[SMALL];
 
 	      if (dbf->bucket->h_table[i].hash_value == -1)
 		continue;
@@ -231,8 +252,8 @@ check_db (GDBM_FILE dbf)
 	      key.dptr   = dptr;
 	      key.dsize  = dbf->bucket->h_table[i].key_size;
 
-	      if (memcmp (dbf->bucket->h_table[i].key_start, key.dptr,
-			  (SMALL < key.dsize ? SMALL : key.dsize)))
+	      if (memcmp (dbf->bucket->h_table[i].key_start, key_check,
+			  _gdbm_key_check (dbf, key, key_check)))
 		return 1;
 	      
 	      _gdbm_hash_key (dbf, key, &hashval, &bucket, &off);
@@ -352,6 +373,7 @@ gdbm_recover (GDBM_FILE dbf, gdbm_recovery *rcvr, int flags)
   char *new_name;	     /* A temporary name. */
   size_t len;
   int fd;
+  int nflags;		     /* Feature flags of the new file. */
   int rc;
   gdbm_recovery rs;
   
@@ -362,6 +384,13 @@ gdbm_recover (GDBM_FILE dbf, gdbm_recovery *rcvr, int flags)
       return -1;
     }
 
+  /* Nor can a database with a transaction in progress. */
+  if (dbf->txn_state != TXN_NONE)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_TXN_ACTIVE, dbf->need_recovery);
+      return -1;
+    }
+
   /* Initialize gdbm_recovery structure */
   if (!rcvr)
     {
@@ -396,8 +425,21 @@ gdbm_recover (GDBM_FILE dbf, gdbm_recovery *rcvr, int flags)
 	  return -1;
 	}
   
+      /* The new file has the features of the old one, except those
+	 changed with GDBM_SETHASH and GDBM_SETFINGERPRINT. */
+      nflags = _gdbm_feature_flags (dbf);
+      if (dbf->reorg_hash == GDBM_HASH_FAST)
+	nflags |= GDBM_FASTHASH;
+      else if (dbf->reorg_hash == GDBM_HASH_LEGACY)
+	nflags &= ~GDBM_FASTHASH;
+      if (dbf->reorg_fingerprint == TRUE)
+	nflags |= GDBM_FINGERPRINT;
+      else if (dbf->reorg_fingerprint == FALSE)
+	nflags &= ~GDBM_FINGERPRINT;
+      
       new_dbf = gdbm_fd_open (fd, new_name, dbf->header->block_size,
 			      GDBM_WRCREAT
+			      | nflags
 			      | (dbf->cloexec ? GDBM_CLOEXEC : 0)
 			      | GDBM_CLOERROR, dbf->fatal_err);
   
@@ -409,6 +451,13 @@ gdbm_recover (GDBM_FILE dbf, gdbm_recovery *rcvr, int flags)
 	  return -1;
 	}
 
+      /* Keep the cache replacement policy selected for DBF. */
+      if (new_dbf->cache_policy != dbf->cache_policy)
+	{
+	  new_dbf->cache_policy = dbf->cache_policy;
+	  _gdbm_cache_policy_reset (new_dbf);
+	}
+
       rc = run_recovery (dbf, new_dbf, rcvr, flags);
   
       if (rc == 0)
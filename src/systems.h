@@ -24,6 +24,15 @@
 # include <sys/file.h>
 #endif
 #include <sys/stat.h>
+#if HAVE_SYS_UIO_H
+# include <sys/uio.h>
+#else
+struct iovec
+{
+  void *iov_base;
+  size_t iov_len;
+};
+#endif
 #include <stdlib.h>
 #if HAVE_STRING_H
 # include <string.h>
@@ -34,6 +43,9 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <limits.h>
+#if HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
 
 #ifndef SEEK_SET
 # define SEEK_SET        0
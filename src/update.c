@@ -22,114 +22,240 @@
 
 #include "gdbmdefs.h"
 
-/* This procedure writes the header back to the file described by DBF. */
+/* The changes made in memory are written out in a single pass.  The
+   changed buckets, the directory and the header are collected into a
+   flush plan, which is sorted by file offset.  Adjacent regions are
+   then written with a single call, so that a cascade of bucket splits,
+   which allocates the new buckets one after another, costs a few
+   sequential writes instead of many random ones. */
 
+/* A region of the file to write. */
+struct flush_item
+{
+  off_t adr;
+  void *buf;
+  size_t size;
+};
+
+/* Number of flush_item structures kept on stack. */
+#define FLUSH_PLAN_AUTO 8
+
+/* Maximum number of regions written by one call. */
+#if defined IOV_MAX && IOV_MAX < 64
+# define FLUSH_IOV_MAX IOV_MAX
+#else
+# define FLUSH_IOV_MAX 64
+#endif
+
+static int
+flush_item_cmp (void const *a, void const *b)
+{
+  struct flush_item const *x = a;
+  struct flush_item const *y = b;
+
+  if (x->adr < y->adr)
+    return -1;
+  return x->adr > y->adr;
+}
+
+/* Write the COUNT regions described by PLAN.  Each run of adjacent
+   regions makes up a single request, and all requests are passed to
+   _gdbm_io_run at once. */
 static int
-write_header (GDBM_FILE dbf)
+flush_plan_write (GDBM_FILE dbf, struct flush_item *plan, size_t count)
 {
-  off_t file_pos;	/* Return value for lseek. */
+  struct gdbm_io_req req_buf[FLUSH_PLAN_AUTO];
+  struct gdbm_io_req *req = req_buf;
+  struct iovec iov_buf[FLUSH_PLAN_AUTO];
+  struct iovec *iov = iov_buf;
+  size_t i, n, nreq = 0;
   int rc;
 
-  file_pos = gdbm_file_seek (dbf, 0L, SEEK_SET);
-  if (file_pos != 0)
+  if (count == 0)
+    return 0;
+  if (count == 1)
+    return _gdbm_full_pwrite (dbf, plan[0].buf, plan[0].size, plan[0].adr);
+
+  qsort (plan, count, sizeof (plan[0]), flush_item_cmp);
+  if (count > FLUSH_PLAN_AUTO)
     {
-      GDBM_SET_ERRNO2 (dbf, GDBM_FILE_SEEK_ERROR, TRUE, GDBM_DEBUG_STORE);
-      _gdbm_fatal (dbf, _("lseek error"));
-      return -1;
+      req = calloc (count, sizeof (req[0]));
+      iov = calloc (count, sizeof (iov[0]));
+      if (!req || !iov)
+	{
+	  free (req);
+	  free (iov);
+	  GDBM_SET_ERRNO2 (dbf, GDBM_MALLOC_ERROR, FALSE, GDBM_DEBUG_STORE);
+	  return -1;
+	}
     }
 
-  rc = _gdbm_full_write (dbf, dbf->header, dbf->header->block_size);
-  
-  if (rc)
+  for (i = 0; i < count; i += n)
     {
-      GDBM_DEBUG (GDBM_DEBUG_STORE|GDBM_DEBUG_ERR,
-		  "%s: error writing header: %s",
-		  dbf->name, gdbm_db_strerror (dbf));	        
-      return -1;
-    }
+      off_t end = plan[i].adr + plan[i].size;
 
-  /* Sync the file if fast_write is FALSE. */
-  if (dbf->fast_write == FALSE)
-    gdbm_file_sync (dbf);
+      iov[i].iov_base = plan[i].buf;
+      iov[i].iov_len = plan[i].size;
+      for (n = 1; i + n < count && n < FLUSH_IOV_MAX; n++)
+	{
+	  if (plan[i + n].adr != end)
+	    break;
+	  iov[i + n].iov_base = plan[i + n].buf;
+	  iov[i + n].iov_len = plan[i + n].size;
+	  end += plan[i + n].size;
+	}
+      req[nreq].write = TRUE;
+      req[nreq].off = plan[i].adr;
+      req[nreq].iov = iov + i;
+      req[nreq].iovcnt = n;
+      nreq++;
+    }
 
-  return 0;
+  rc = _gdbm_io_run (dbf, req, nreq);
+  if (req != req_buf)
+    {
+      free (req);
+      free (iov);
+    }
+  return rc;
 }
 
-
-/* After all changes have been made in memory, we now write them
-   all to disk. */
-int
-_gdbm_end_update (GDBM_FILE dbf)
+/* Write all changes made in memory to disk. */
+static int
+write_updates (GDBM_FILE dbf)
 {
-  off_t file_pos;	/* Return value for lseek. */
+  struct flush_item plan_buf[FLUSH_PLAN_AUTO];
+  struct flush_item *plan = plan_buf;
+  size_t count = 0;
+  size_t i;
   int rc;
-  
-  /* Write the current bucket. */
-  if (dbf->bucket_changed && (dbf->cache_entry != NULL))
-    {
-      if (_gdbm_write_bucket (dbf, dbf->cache_entry))
-	return -1;
-      dbf->bucket_changed = FALSE;
-    }
+  int trimmed = 0;
+  /* In synchronous mode, the file is synchronized when the directory
+     or the header is written. */
+  int need_sync = dbf->directory_changed || dbf->header_changed;
 
-  /* Write the other changed buckets if there are any. */
-  if (dbf->second_changed)
-    {
-      if (dbf->bucket_cache != NULL)
-        {
-          int index;
-
-          for (index = 0; index < dbf->cache_size; index++)
-	    {
-	      if (dbf->bucket_cache[index].ca_changed)
-		{
-		  if (_gdbm_write_bucket (dbf, &dbf->bucket_cache[index]))
-		    return -1;
-		}
-            }
-        }
-      dbf->second_changed = FALSE;
-    }
-  
-  /* Write the directory. */
-  if (dbf->directory_changed)
+  /* Give back the free space at the end of the file, if large blocks
+     have been freed (see _gdbm_punch_holes).  This is not done while
+     the journal holds a header, which would point past the end of the
+     file if it were replayed. */
+  if (dbf->punch_count && dbf->journal_size == 0
+      && (trimmed = _gdbm_avail_trim (dbf)) == -1)
+    return -1;
+
+  /* The current bucket is tracked by bucket_changed. */
+  if (dbf->bucket_changed && dbf->cache_entry != NULL)
+    _gdbm_cache_set_changed (dbf, dbf->cache_entry);
+
+  if (dbf->cache_dirty_count + 2 > FLUSH_PLAN_AUTO)
     {
-      file_pos = gdbm_file_seek (dbf, dbf->header->dir, SEEK_SET);
-      if (file_pos != dbf->header->dir)
+      plan = calloc (dbf->cache_dirty_count + 2, sizeof (plan[0]));
+      if (!plan)
 	{
-	  GDBM_SET_ERRNO2 (dbf, GDBM_FILE_SEEK_ERROR, TRUE, GDBM_DEBUG_STORE);
-	  _gdbm_fatal (dbf, _("lseek error"));
+	  GDBM_SET_ERRNO2 (dbf, GDBM_MALLOC_ERROR, FALSE, GDBM_DEBUG_STORE);
 	  return -1;
 	}
+    }
 
-      rc = _gdbm_full_write (dbf, dbf->dir, dbf->header->dir_size);
-      if (rc)
+  for (i = 0; i < dbf->cache_dirty_count; i++)
+    {
+      cache_elem *elem = &dbf->bucket_cache[dbf->cache_dirty[i]];
+      if (elem->ca_changed)
 	{
-	  GDBM_DEBUG (GDBM_DEBUG_STORE|GDBM_DEBUG_ERR,
-		      "%s: error writing directory: %s",
-		      dbf->name, gdbm_db_strerror (dbf));	  	  
-	  _gdbm_fatal (dbf, gdbm_db_strerror (dbf));
-	  return -1;
+	  plan[count].adr = elem->ca_adr;
+	  plan[count].buf = elem->ca_bucket;
+	  plan[count].size = dbf->header->bucket_size;
+	  count++;
 	}
+    }
 
-      dbf->directory_changed = FALSE;
-      if (!dbf->header_changed && dbf->fast_write == FALSE)
-	gdbm_file_sync (dbf);
+  if (dbf->directory_changed)
+    {
+      plan[count].adr = dbf->header->dir;
+      plan[count].buf = dbf->dir;
+      plan[count].size = dbf->header->dir_size;
+      count++;
     }
 
-  /* Final write of the header. */
   if (dbf->header_changed)
     {
-      if (write_header (dbf))
-	return -1;
-      if (_gdbm_file_extend (dbf, dbf->header->next_block))
+      plan[count].adr = 0;
+      plan[count].buf = dbf->header;
+      plan[count].size = dbf->header->block_size;
+      count++;
+    }
+
+  rc = flush_plan_write (dbf, plan, count);
+  if (plan != plan_buf)
+    free (plan);
+  if (rc)
+    {
+      GDBM_DEBUG (GDBM_DEBUG_STORE|GDBM_DEBUG_ERR,
+		  "%s: error writing updates: %s",
+		  dbf->name, gdbm_db_strerror (dbf));
+      _gdbm_fatal (dbf, gdbm_db_strerror (dbf));
+      return -1;
+    }
+
+  for (i = 0; i < dbf->cache_dirty_count; i++)
+    {
+      cache_elem *elem = &dbf->bucket_cache[dbf->cache_dirty[i]];
+      elem->ca_changed = FALSE;
+      elem->ca_dirty = FALSE;
+    }
+  dbf->cache_dirty_count = 0;
+  dbf->bucket_changed = FALSE;
+  dbf->second_changed = FALSE;
+  dbf->directory_changed = FALSE;
+
+  if (dbf->header_changed)
+    {
+      if (_gdbm_file_grow (dbf, dbf->header->next_block))
 	return -1;
       dbf->header_changed = FALSE;
     }
 
+  /* Sync the file if fast_write is FALSE. */
+  if (need_sync && dbf->fast_write == FALSE && !dbf->group_update)
+    gdbm_file_sync (dbf);
+
+  if (dbf->punch_count && _gdbm_punch_holes (dbf, trimmed))
+    return -1;
+
   return 0;
 }
 
+/* After all changes have been made in memory, we now write them
+   all to disk.  Within an update batch, the changes are kept in memory
+   until _gdbm_flush_batch is called.  Within a transaction, they are
+   kept until the transaction is committed. */
+int
+_gdbm_end_update (GDBM_FILE dbf)
+{
+  if (dbf->batch_level || dbf->txn_state != TXN_NONE)
+    {
+      /* The current bucket may be evicted from the cache before the
+	 batch ends.  Mark it so that it is written out then. */
+      if (dbf->bucket_changed && dbf->cache_entry != NULL)
+	{
+	  _gdbm_cache_set_changed (dbf, dbf->cache_entry);
+	  dbf->bucket_changed = FALSE;
+	}
+      return 0;
+    }
+  return write_updates (dbf);
+}
+
+/* Write all changes accumulated during an update batch to disk.  Each
+   changed bucket is written once.  Nothing is written while a
+   transaction is in progress. */
+int
+_gdbm_flush_batch (GDBM_FILE dbf)
+{
+  if (dbf->txn_state != TXN_NONE)
+    return 0;
+  return write_updates (dbf);
+}
+
 
 /* For backward compatibility, if the caller defined fatal_err function,
    call it upon fatal error and exit. */
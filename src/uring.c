@@ -0,0 +1,314 @@
+/* uring.c - Batched I/O using the Linux io_uring interface. */
+
+/* This file is part of GDBM, the GNU data base manager.
+   Copyright (C) 2018 Free Software Foundation, Inc.
+
+   GDBM is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   GDBM is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GDBM. If not, see <http://www.gnu.org/licenses/>.    */
+
+/* Include system configuration before all else. */
+#include "autoconf.h"
+
+#include "gdbmdefs.h"
+
+#if HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+
+/* When a database is opened with GDBM_IOURING, the requests passed to
+   _gdbm_io_run are submitted to the kernel all at once, instead of
+   being served one after another.  This lets the storage device work
+   on many of them in parallel, which matters for solid-state drives.
+   Only the interface of io_uring present since its introduction
+   (Linux 5.1) is used, through the raw system calls.
+
+   A request completed only partially (e.g. a read crossing the end of
+   file) is served again by the synchronous functions, which report
+   the error the usual way. */
+
+/* Maximum number of requests in flight. */
+#define URING_DEPTH 64
+
+struct gdbm_uring
+{
+  int fd;                       /* The io_uring descriptor. */
+  unsigned entries;             /* Number of submission queue entries. */
+
+  void *sq_ring;                /* Submission queue ring. */
+  size_t sq_ring_size;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;    /* Submission queue entries. */
+  size_t sqes_size;
+
+  void *cq_ring;                /* Completion queue ring (may be the
+				   same as sq_ring). */
+  size_t cq_ring_size;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+};
+
+static void
+uring_unmap (struct gdbm_uring *ur)
+{
+  if (ur->sqes)
+    munmap (ur->sqes, ur->sqes_size);
+  if (ur->cq_ring && ur->cq_ring != ur->sq_ring)
+    munmap (ur->cq_ring, ur->cq_ring_size);
+  if (ur->sq_ring)
+    munmap (ur->sq_ring, ur->sq_ring_size);
+}
+
+/* Set up an io_uring instance for DBF.  Return 0 on success, and -1 if
+   io_uring is not available.  Failure is not an error: requests are
+   then served synchronously. */
+int
+_gdbm_uring_init (GDBM_FILE dbf)
+{
+  struct gdbm_uring *ur;
+  struct io_uring_params p;
+  char *sq, *cq;
+
+  ur = calloc (1, sizeof (*ur));
+  if (!ur)
+    return -1;
+
+  memset (&p, 0, sizeof (p));
+  ur->fd = syscall (__NR_io_uring_setup, URING_DEPTH, &p);
+  if (ur->fd == -1)
+    {
+      free (ur);
+      return -1;
+    }
+  if (dbf->cloexec)
+    fcntl (ur->fd, F_SETFD, fcntl (ur->fd, F_GETFD) | FD_CLOEXEC);
+  ur->entries = p.sq_entries;
+
+  ur->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+  ur->cq_ring_size = p.cq_off.cqes
+                       + p.cq_entries * sizeof (struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      if (ur->cq_ring_size > ur->sq_ring_size)
+	ur->sq_ring_size = ur->cq_ring_size;
+      ur->cq_ring_size = ur->sq_ring_size;
+    }
+
+  ur->sq_ring = mmap (NULL, ur->sq_ring_size, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+  if (ur->sq_ring == MAP_FAILED)
+    {
+      ur->sq_ring = NULL;
+      goto err;
+    }
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    ur->cq_ring = ur->sq_ring;
+  else
+    {
+      ur->cq_ring = mmap (NULL, ur->cq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ur->fd,
+			  IORING_OFF_CQ_RING);
+      if (ur->cq_ring == MAP_FAILED)
+	{
+	  ur->cq_ring = NULL;
+	  goto err;
+	}
+    }
+  ur->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+  ur->sqes = mmap (NULL, ur->sqes_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+  if (ur->sqes == MAP_FAILED)
+    {
+      ur->sqes = NULL;
+      goto err;
+    }
+
+  sq = ur->sq_ring;
+  ur->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  ur->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+  ur->sq_array = (unsigned *) (sq + p.sq_off.array);
+  cq = ur->cq_ring;
+  ur->cq_head = (unsigned *) (cq + p.cq_off.head);
+  ur->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+  ur->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+  ur->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+  dbf->uring = ur;
+  return 0;
+
+ err:
+  uring_unmap (ur);
+  close (ur->fd);
+  free (ur);
+  return -1;
+}
+
+/* Free the io_uring instance of DBF. */
+void
+_gdbm_uring_free (GDBM_FILE dbf)
+{
+  struct gdbm_uring *ur = dbf->uring;
+
+  if (ur)
+    {
+      uring_unmap (ur);
+      close (ur->fd);
+      free (ur);
+      dbf->uring = NULL;
+    }
+}
+
+static size_t
+req_length (struct gdbm_io_req *req)
+{
+  size_t len = 0;
+  int i;
+
+  for (i = 0; i < req->iovcnt; i++)
+    len += req->iov[i].iov_len;
+  return len;
+}
+
+/* Take the completed requests off the completion queue of DBF.
+   Requests that failed or were served only partially are run again
+   synchronously; the first failure sets *RC to -1.  Each completed
+   request is marked in DONE.  Return the number of requests taken. */
+static unsigned
+uring_reap (GDBM_FILE dbf, struct gdbm_io_req *req, char *done, int *rc)
+{
+  struct gdbm_uring *ur = dbf->uring;
+  unsigned head, cq_tail;
+  unsigned count = 0;
+
+  head = *ur->cq_head;
+  cq_tail = __atomic_load_n (ur->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != cq_tail; head++)
+    {
+      struct io_uring_cqe *cqe = &ur->cqes[head & *ur->cq_mask];
+      struct gdbm_io_req *r = &req[cqe->user_data];
+
+      if (cqe->res < 0 || (size_t) cqe->res != req_length (r))
+	{
+	  /* Serve the request again, synchronously, so that the
+	     error is reported (or a short transfer completed) the
+	     usual way.  The other requests are still in flight, so
+	     the error is reported after they complete. */
+	  if (*rc == 0 && _gdbm_io_run (dbf, r, 1))
+	    *rc = -1;
+	}
+      done[cqe->user_data] = 1;
+      count++;
+    }
+  __atomic_store_n (ur->cq_head, head, __ATOMIC_RELEASE);
+  return count;
+}
+
+/* Submit the N requests from REQ (N <= URING_DEPTH) and wait for all
+   of them to complete.  Return 0 on success and -1 on error. */
+static int
+uring_run_batch (GDBM_FILE dbf, struct gdbm_io_req *req, unsigned n)
+{
+  struct gdbm_uring *ur = dbf->uring;
+  unsigned tail = *ur->sq_tail;
+  unsigned submitted = 0, completed = 0;
+  unsigned i;
+  char done[URING_DEPTH];
+  int rc = 0;
+
+  for (i = 0; i < n; i++)
+    {
+      unsigned idx = (tail + i) & *ur->sq_mask;
+      struct io_uring_sqe *sqe = &ur->sqes[idx];
+
+      memset (sqe, 0, sizeof (*sqe));
+      sqe->opcode = req[i].write ? IORING_OP_WRITEV : IORING_OP_READV;
+      sqe->fd = dbf->desc;
+      sqe->off = req[i].off;
+      sqe->addr = (unsigned long) req[i].iov;
+      sqe->len = req[i].iovcnt;
+      sqe->user_data = i;
+      ur->sq_array[idx] = idx;
+      done[i] = 0;
+    }
+  __atomic_store_n (ur->sq_tail, tail + n, __ATOMIC_RELEASE);
+
+  while (completed < n)
+    {
+      int ret = syscall (__NR_io_uring_enter, ur->fd, n - submitted,
+			 1, IORING_ENTER_GETEVENTS, NULL, 0);
+      if (ret == -1)
+	{
+	  if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+	    continue;
+	  break;
+	}
+      submitted += ret;
+      completed += uring_reap (dbf, req, done, &rc);
+    }
+
+  if (completed < n)
+    {
+      /* The kernel refused to go on.  The requests it accepted still
+	 refer to the buffers of the caller, so wait until all of them
+	 complete.  The ring cannot be used any more, because the
+	 requests it did not accept remain in the submission queue:
+	 tear it down and serve the rest of the batch synchronously. */
+      while (completed < submitted)
+	{
+	  int ret = syscall (__NR_io_uring_enter, ur->fd, 0,
+			     submitted - completed, IORING_ENTER_GETEVENTS,
+			     NULL, 0);
+	  if (ret == -1 && errno != EINTR)
+	    {
+	      /* Closing the ring cancels the requests in flight. */
+	      _gdbm_uring_free (dbf);
+	      GDBM_SET_ERRNO (dbf, GDBM_FILE_READ_ERROR, TRUE);
+	      return -1;
+	    }
+	  completed += uring_reap (dbf, req, done, &rc);
+	}
+      _gdbm_uring_free (dbf);
+      for (i = 0; i < n; i++)
+	if (!done[i] && rc == 0 && _gdbm_io_run (dbf, &req[i], 1))
+	  rc = -1;
+    }
+  return rc;
+}
+
+/* Serve the N requests from REQ using io_uring.  Return 0 on success
+   and -1 on error. */
+int
+_gdbm_uring_run (GDBM_FILE dbf, struct gdbm_io_req *req, size_t n)
+{
+  while (n)
+    {
+      unsigned count;
+
+      /* A failure of the ring drops it: serve the rest synchronously. */
+      if (!dbf->uring)
+	return _gdbm_io_run (dbf, req, n);
+      count = n < dbf->uring->entries ? n : dbf->uring->entries;
+      if (count > URING_DEPTH)
+	count = URING_DEPTH;
+      if (uring_run_batch (dbf, req, count))
+	return -1;
+      req += count;
+      n -= count;
+    }
+  return 0;
+}
+#endif
@@ -31,6 +31,8 @@ main (int argc, char **argv)
   int flags = 0;
   GDBM_FILE dbf;
   int data_z = 0;
+  size_t compact = 0;
+  size_t punch_hole = 0;
   int rc = 0;
   
   while (--argc)
@@ -39,7 +41,7 @@ main (int argc, char **argv)
 
       if (strcmp (arg, "-h") == 0)
 	{
-	  printf ("usage: %s [-null] [-nolock] [-nommap] [-sync] DBFILE KEY [KEY...]\n",
+	  printf ("usage: %s [-null] [-nolock] [-nommap] [-sync] [-compact=N] [-punchhole=N] DBFILE [KEY...]\n",
 		  progname);
 	  exit (0);
 	}
@@ -51,6 +53,10 @@ main (int argc, char **argv)
 	flags |= GDBM_NOMMAP;
       else if (strcmp (arg, "-sync") == 0)
 	flags |= GDBM_SYNC;
+      else if (strncmp (arg, "-compact=", 9) == 0)
+	compact = strtoul (arg + 9, NULL, 10);
+      else if (strncmp (arg, "-punchhole=", 11) == 0)
+	punch_hole = strtoul (arg + 11, NULL, 10);
       else if (strcmp (arg, "--") == 0)
 	{
 	  --argc;
@@ -66,7 +72,7 @@ main (int argc, char **argv)
 	break;
     }
 
-  if (argc < 2)
+  if (argc < (compact ? 1 : 2))
     {
       fprintf (stderr, "%s: wrong arguments\n", progname);
       exit (1);
@@ -80,6 +86,15 @@ main (int argc, char **argv)
       exit (1);
     }
 
+  if (punch_hole
+      && gdbm_setopt (dbf, GDBM_SETPUNCHHOLE, &punch_hole,
+		      sizeof (punch_hole)))
+    {
+      fprintf (stderr, "GDBM_SETPUNCHHOLE failed: %s\n",
+	       gdbm_strerror (gdbm_errno));
+      exit (1);
+    }
+
   while (--argc)
     {
       char *arg = *++argv;
@@ -94,6 +109,22 @@ main (int argc, char **argv)
 	  rc = 2;
 	}
     }
+
+  /* Compact the database, visiting COMPACT buckets per step. */
+  if (compact)
+    {
+      int res;
+      
+      while ((res = gdbm_compact_step (dbf, compact)) == 1)
+	;
+      if (res == -1)
+	{
+	  fprintf (stderr, "%s: compaction failed: %s\n",
+		   progname, gdbm_strerror (gdbm_errno));
+	  rc = 2;
+	}
+    }
+  
   if (gdbm_close (dbf))
     {
       fprintf (stderr, "gdbm_close: %s; %s\n", gdbm_strerror (gdbm_errno),
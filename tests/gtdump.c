@@ -39,7 +39,7 @@ main (int argc, char **argv)
 
       if (strcmp (arg, "-h") == 0)
 	{
-	  printf ("usage: %s [-nolock] [-nommap] [-delim=CHR] DBFILE\n",
+	  printf ("usage: %s [-nolock] [-nommap] [-iouring] [-delim=CHR] DBFILE\n",
 		  progname);
 	  exit (0);
 	}
@@ -47,6 +47,8 @@ main (int argc, char **argv)
 	flags |= GDBM_NOLOCK;
       else if (strcmp (arg, "-nommap") == 0)
 	flags |= GDBM_NOMMAP;
+      else if (strcmp (arg, "-iouring") == 0)
+	flags |= GDBM_IOURING;
       else if (strcmp (arg, "-sync") == 0)
 	flags |= GDBM_SYNC;
       else if (strncmp (arg, "-delim=", 7) == 0)
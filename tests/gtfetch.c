@@ -46,6 +46,16 @@ main (int argc, char **argv)
   GDBM_FILE dbf;
   int data_z = 0;
   int delim = 0;
+  int view = 0;
+  size_t into = 0;
+  char *buf = NULL;
+  int many = 0;
+  size_t cache_size = 0;
+  size_t data_cache_size = 0;
+  int cache_policy = -1;
+  int stats = 0;
+  datum *keys = NULL, *results = NULL;
+  int i;
   int rc = 0;
   
   while (--argc)
@@ -54,7 +64,7 @@ main (int argc, char **argv)
 
       if (strcmp (arg, "-h") == 0)
 	{
-	  printf ("usage: %s [-nolock] [-nommap] [-null] [-delim=CHR] DBFILE KEY [KEY...]\n",
+	  printf ("usage: %s [-nolock] [-nommap] [-iouring] [-null] [-delim=CHR] [-view] [-into=SIZE] [-many] [-cachesize=N] [-datacachesize=N] [-cachepolicy=fifo|lru|clock|slru] [-stats] DBFILE KEY [KEY...]\n",
 		  progname);
 	  exit (0);
 	}
@@ -62,10 +72,47 @@ main (int argc, char **argv)
 	flags |= GDBM_NOLOCK;
       else if (strcmp (arg, "-nommap") == 0)
 	flags |= GDBM_NOMMAP;
+      else if (strcmp (arg, "-iouring") == 0)
+	flags |= GDBM_IOURING;
       else if (strcmp (arg, "-null") == 0)
 	data_z = 1;
       else if (strncmp (arg, "-delim=", 7) == 0)
 	delim = arg[7];
+      else if (strcmp (arg, "-view") == 0)
+	view = 1;
+      else if (strcmp (arg, "-many") == 0)
+	many = 1;
+      else if (strncmp (arg, "-cachesize=", 11) == 0)
+	cache_size = strtoul (arg + 11, NULL, 10);
+      else if (strncmp (arg, "-datacachesize=", 15) == 0)
+	data_cache_size = strtoul (arg + 15, NULL, 10);
+      else if (strncmp (arg, "-cachepolicy=", 13) == 0)
+	{
+	  static char const *policies[] = { "fifo", "lru", "clock", "slru" };
+	  int n = sizeof (policies) / sizeof (policies[0]);
+
+	  for (cache_policy = 0; cache_policy < n; cache_policy++)
+	    if (strcmp (arg + 13, policies[cache_policy]) == 0)
+	      break;
+	  if (cache_policy == n)
+	    {
+	      fprintf (stderr, "%s: unknown cache policy %s\n", progname,
+		       arg + 13);
+	      exit (1);
+	    }
+	}
+      else if (strcmp (arg, "-stats") == 0)
+	stats = 1;
+      else if (strncmp (arg, "-into=", 6) == 0)
+	{
+	  into = strtoul (arg + 6, NULL, 10);
+	  buf = malloc (into + 1);
+	  if (!buf)
+	    {
+	      fprintf (stderr, "%s: out of memory\n", progname);
+	      exit (1);
+	    }
+	}
       else if (strcmp (arg, "--") == 0)
 	{
 	  --argc;
@@ -95,18 +142,101 @@ main (int argc, char **argv)
       exit (1);
     }
 
-  while (--argc)
+  if (flags & GDBM_IOURING)
+    {
+      int on;
+
+      if (gdbm_setopt (dbf, GDBM_GETIOURING, &on, sizeof (on)))
+	{
+	  fprintf (stderr, "GDBM_GETIOURING failed: %s\n",
+		   gdbm_strerror (gdbm_errno));
+	  exit (1);
+	}
+      if (!on)
+	{
+	  fprintf (stderr, "%s: io_uring is not in use\n", progname);
+	  exit (77);
+	}
+    }
+
+  if (cache_size
+      && gdbm_setopt (dbf, GDBM_SETCACHESIZE, &cache_size,
+		      sizeof (cache_size)))
+    {
+      fprintf (stderr, "GDBM_SETCACHESIZE: %s\n", gdbm_strerror (gdbm_errno));
+      exit (1);
+    }
+  if (data_cache_size
+      && gdbm_setopt (dbf, GDBM_SETDATACACHESIZE, &data_cache_size,
+		      sizeof (data_cache_size)))
+    {
+      fprintf (stderr, "GDBM_SETDATACACHESIZE: %s\n",
+	       gdbm_strerror (gdbm_errno));
+      exit (1);
+    }
+  if (cache_policy != -1
+      && gdbm_setopt (dbf, GDBM_SETCACHEPOLICY, &cache_policy,
+		      sizeof (cache_policy)))
+    {
+      fprintf (stderr, "GDBM_SETCACHEPOLICY: %s\n",
+	       gdbm_strerror (gdbm_errno));
+      exit (1);
+    }
+
+  if (many)
+    {
+      keys = calloc (argc - 1, sizeof (keys[0]));
+      results = calloc (argc - 1, sizeof (results[0]));
+      if (!keys || !results)
+	{
+	  fprintf (stderr, "%s: out of memory\n", progname);
+	  exit (1);
+	}
+      for (i = 0; i < argc - 1; i++)
+	{
+	  keys[i].dptr = argv[i + 1];
+	  keys[i].dsize = strlen (argv[i + 1]) + !!data_z;
+	}
+      if (gdbm_fetch_many (dbf, keys, argc - 1, results) == -1)
+	{
+	  fprintf (stderr, "%s: error: %s\n", progname,
+		   gdbm_strerror (gdbm_errno));
+	  exit (2);
+	}
+    }
+  
+  for (i = 0; --argc; i++)
     {
       char *arg = *++argv;
 
       key.dptr = arg;
       key.dsize = strlen (arg) + !!data_z;
 
-      data = gdbm_fetch (dbf, key);
+      if (many)
+	data = results[i];
+      else if (buf)
+	{
+	  size_t size;
+	  
+	  if (gdbm_fetch_into (dbf, key, buf, into, &size))
+	    data.dptr = NULL;
+	  else
+	    {
+	      data.dptr = buf;
+	      data.dsize = size < into ? size : into;
+	    }
+	}
+      else if (view)
+	{
+	  if (gdbm_fetch_view (dbf, key, &data))
+	    data.dptr = NULL;
+	}
+      else
+	data = gdbm_fetch (dbf, key);
       if (data.dptr == NULL)
 	{
 	  rc = 2;
-	  if (gdbm_errno == GDBM_ITEM_NOT_FOUND)
+	  if (many || gdbm_errno == GDBM_ITEM_NOT_FOUND)
 	    {
 	      fprintf (stderr, "%s: ", progname);
 	      print_key (stderr, key, delim);
@@ -126,11 +256,28 @@ main (int argc, char **argv)
 	}
 
       fwrite (data.dptr, data.dsize - !!data_z, 1, stdout);
-      free (data.dptr);
+      if (!buf && !view)
+	free (data.dptr);
       
       fputc ('\n', stdout);
     }
 
+  if (stats)
+    {
+      struct gdbm_cache_stats st;
+
+      if (gdbm_setopt (dbf, GDBM_GETCACHESTATS, &st, sizeof (st)))
+	{
+	  fprintf (stderr, "GDBM_GETCACHESTATS: %s\n",
+		   gdbm_strerror (gdbm_errno));
+	  exit (1);
+	}
+      printf ("hits=%llu misses=%llu evictions=%llu\n",
+	      (unsigned long long) st.hits,
+	      (unsigned long long) st.misses,
+	      (unsigned long long) st.evictions);
+    }
+
   if (gdbm_close (dbf))
     {
       fprintf (stderr, "gdbm_close: %s; %s\n", gdbm_strerror (gdbm_errno),
@@ -0,0 +1,206 @@
+/* This file is part of GDBM test suite.
+   Copyright (C) 2018 Free Software Foundation, Inc.
+
+   GDBM is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   GDBM is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GDBM. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Store records from several threads through a single handle in
+   synchronous mode with group commit, then check that all of them are
+   found after reopening the database.  Exit with status 77 (skip) if
+   group commit is not available. */
+
+#include "autoconf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gdbm.h"
+#include "progname.h"
+
+const char *progname;
+
+#if HAVE_PTHREAD_H
+#include <pthread.h>
+
+GDBM_FILE dbf;
+int nthreads = 4;
+int count = 100;
+
+static void *
+writer (void *arg)
+{
+  int n = *(int*) arg;
+  int i;
+
+  for (i = 0; i < count; i++)
+    {
+      char buf[64];
+      datum key;
+
+      key.dsize = snprintf (buf, sizeof buf, "%d-%d", n, i);
+      key.dptr = buf;
+      if (gdbm_store (dbf, key, key, GDBM_INSERT))
+	{
+	  fprintf (stderr, "%s: %s: %s\n", progname, buf,
+		   gdbm_strerror (gdbm_errno));
+	  exit (1);
+	}
+    }
+  return NULL;
+}
+
+int
+main (int argc, char **argv)
+{
+  const char *dbname;
+  struct gdbm_group_commit gc;
+  pthread_t *tid;
+  int *num;
+  int i, j;
+  int missing = 0;
+
+  progname = canonical_progname (argv[0]);
+  gc.max_count = 0;
+  gc.max_wait = 100000;
+  while (--argc)
+    {
+      char *arg = *++argv;
+
+      if (strcmp (arg, "-h") == 0)
+	{
+	  printf ("usage: %s [-threads=N] [-count=N] [-maxcount=N] [-maxwait=USEC] DBFILE\n",
+		  progname);
+	  exit (0);
+	}
+      else if (strncmp (arg, "-threads=", 9) == 0)
+	nthreads = atoi (arg + 9);
+      else if (strncmp (arg, "-count=", 7) == 0)
+	count = atoi (arg + 7);
+      else if (strncmp (arg, "-maxcount=", 10) == 0)
+	gc.max_count = atoi (arg + 10);
+      else if (strncmp (arg, "-maxwait=", 9) == 0)
+	gc.max_wait = atoi (arg + 9);
+      else if (strcmp (arg, "--") == 0)
+	{
+	  --argc;
+	  ++argv;
+	  break;
+	}
+      else if (arg[0] == '-')
+	{
+	  fprintf (stderr, "%s: unknown option %s\n", progname, arg);
+	  exit (1);
+	}
+      else
+	break;
+    }
+
+  if (argc != 1 || nthreads <= 0 || count <= 0)
+    {
+      fprintf (stderr, "%s: wrong arguments\n", progname);
+      exit (1);
+    }
+  dbname = *argv;
+  if (gc.max_count == 0)
+    gc.max_count = nthreads;
+
+  dbf = gdbm_open (dbname, 0, GDBM_NEWDB|GDBM_SYNC, 00664, NULL);
+  if (!dbf)
+    {
+      fprintf (stderr, "gdbm_open failed: %s\n", gdbm_strerror (gdbm_errno));
+      exit (1);
+    }
+  if (gdbm_setopt (dbf, GDBM_SETGROUPCOMMIT, &gc, sizeof (gc)))
+    {
+      if (gdbm_errno == GDBM_OPT_ILLEGAL)
+	exit (77);
+      fprintf (stderr, "GDBM_SETGROUPCOMMIT: %s\n",
+	       gdbm_strerror (gdbm_errno));
+      exit (1);
+    }
+
+  tid = calloc (nthreads, sizeof (tid[0]));
+  num = calloc (nthreads, sizeof (num[0]));
+  if (!tid || !num)
+    {
+      fprintf (stderr, "%s: out of memory\n", progname);
+      exit (1);
+    }
+  for (i = 0; i < nthreads; i++)
+    {
+      num[i] = i;
+      if (pthread_create (&tid[i], NULL, writer, &num[i]))
+	{
+	  fprintf (stderr, "%s: cannot create thread\n", progname);
+	  exit (1);
+	}
+    }
+  for (i = 0; i < nthreads; i++)
+    pthread_join (tid[i], NULL);
+
+  if (gdbm_setopt (dbf, GDBM_GETGROUPCOMMIT, &gc, sizeof (gc)))
+    {
+      fprintf (stderr, "GDBM_GETGROUPCOMMIT: %s\n",
+	       gdbm_strerror (gdbm_errno));
+      exit (1);
+    }
+  printf ("updates: %llu\n", (unsigned long long) gc.updates);
+  /* Each synchronization covers the updates of several threads. */
+  printf ("grouped: %s\n",
+	  gc.syncs > 0 && gc.syncs < gc.updates ? "yes" : "no");
+  if (gdbm_close (dbf))
+    {
+      fprintf (stderr, "gdbm_close: %s\n", gdbm_strerror (gdbm_errno));
+      exit (1);
+    }
+
+  dbf = gdbm_open (dbname, 0, GDBM_READER, 0, NULL);
+  if (!dbf)
+    {
+      fprintf (stderr, "gdbm_open failed: %s\n", gdbm_strerror (gdbm_errno));
+      exit (1);
+    }
+  for (i = 0; i < nthreads; i++)
+    for (j = 0; j < count; j++)
+      {
+	char buf[64];
+	datum key, data;
+
+	key.dsize = snprintf (buf, sizeof buf, "%d-%d", i, j);
+	key.dptr = buf;
+	data = gdbm_fetch (dbf, key);
+	if (!data.dptr)
+	  {
+	    fprintf (stderr, "%s: %s: not found\n", progname, buf);
+	    missing++;
+	  }
+	else if (data.dsize != key.dsize
+		 || memcmp (data.dptr, key.dptr, key.dsize))
+	  {
+	    fprintf (stderr, "%s: %s: wrong data\n", progname, buf);
+	    missing++;
+	  }
+	free (data.dptr);
+      }
+  gdbm_close (dbf);
+  printf ("found: %d\n", nthreads * count - missing);
+  return missing ? 2 : 0;
+}
+#else
+int
+main (int argc, char **argv)
+{
+  progname = canonical_progname (argv[0]);
+  return 77;
+}
+#endif
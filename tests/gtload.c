@@ -21,6 +21,8 @@
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include "gdbm.h"
 #include "progname.h"
 
@@ -64,6 +66,28 @@ read_size (char const *arg)
   return ret;
 }
 
+/* Source of records for gdbm_bulk_load. */
+struct bulk_source
+{
+  datum *keys;
+  datum *contents;
+  size_t count;
+  size_t next;
+};
+
+int
+bulk_next (void *data, datum *key, datum *content)
+{
+  struct bulk_source *src = data;
+
+  if (src->next == src->count)
+    return 1;
+  *key = src->keys[src->next];
+  *content = src->contents[src->next];
+  src->next++;
+  return 0;
+}
+
 #ifdef GDBM_DEBUG_ENABLE
 void
 debug_printer (char const *fmt, ...)
@@ -97,6 +121,18 @@ main (int argc, char **argv)
   int recover = 0;
   gdbm_recovery rcvr;
   int rcvr_flags = 0;
+  int batch = 0;
+  int many = 0;
+  int bulk = 0;
+  size_t bulk_buf_size = 0;
+  struct gdbm_capacity capacity = { 0, 0 };
+  int txn = 0;
+  int reorganize = 0;
+  int fdopen = 0;
+  char *image = NULL;
+  size_t image_size = 0;
+  datum *keys = NULL, *contents = NULL;
+  size_t count = 0, max = 0;
   
   progname = canonical_progname (argv[0]);
 #ifdef GDBM_DEBUG_ENABLE
@@ -109,7 +145,7 @@ main (int argc, char **argv)
 
       if (strcmp (arg, "-h") == 0)
 	{
-	  printf ("usage: %s [-replace] [-clear] [-blocksize=N] [-bsexact] [-verbose] [-null] [-nolock] [-nommap] [-maxmap=N] [-sync] [-delim=CHR] DBFILE\n", progname);
+	  printf ("usage: %s [-replace] [-clear] [-blocksize=N] [-bsexact] [-verbose] [-null] [-nolock] [-nommap] [-iouring] [-sizeclass] [-fasthash] [-fingerprint] [-pow2buckets] [-maxmap=N] [-sync] [-delim=CHR] [-batch] [-many] [-bulk] [-bulkbuf=N] [-capacity=N] [-recsize=N] [-txn] [-abort] [-crash] [-reorganize=N] [-fdopen] DBFILE\n", progname);
 	  exit (0);
 	}
       else if (strcmp (arg, "-replace") == 0)
@@ -122,6 +158,16 @@ main (int argc, char **argv)
 	flags |= GDBM_NOLOCK;
       else if (strcmp (arg, "-nommap") == 0)
 	flags |= GDBM_NOMMAP;
+      else if (strcmp (arg, "-iouring") == 0)
+	flags |= GDBM_IOURING;
+      else if (strcmp (arg, "-sizeclass") == 0)
+	flags |= GDBM_SIZECLASS;
+      else if (strcmp (arg, "-fasthash") == 0)
+	flags |= GDBM_FASTHASH;
+      else if (strcmp (arg, "-fingerprint") == 0)
+	flags |= GDBM_FINGERPRINT;
+      else if (strcmp (arg, "-pow2buckets") == 0)
+	flags |= GDBM_POW2BUCKETS;
       else if (strcmp (arg, "-sync") == 0)
 	flags |= GDBM_SYNC;
       else if (strcmp (arg, "-bsexact") == 0)
@@ -136,6 +182,28 @@ main (int argc, char **argv)
 	delim = arg[7];
       else if (strcmp (arg, "-recover") == 0)
 	recover = 1;
+      else if (strcmp (arg, "-batch") == 0)
+	batch = 1;
+      else if (strcmp (arg, "-many") == 0)
+	many = 1;
+      else if (strcmp (arg, "-bulk") == 0)
+	many = bulk = 1;
+      else if (strncmp (arg, "-bulkbuf=", 9) == 0)
+	bulk_buf_size = read_size (arg + 9);
+      else if (strncmp (arg, "-capacity=", 10) == 0)
+	capacity.records = read_size (arg + 10);
+      else if (strncmp (arg, "-recsize=", 9) == 0)
+	capacity.record_size = read_size (arg + 9);
+      else if (strcmp (arg, "-txn") == 0)
+	txn = 1;
+      else if (strcmp (arg, "-abort") == 0)
+	txn = 2;
+      else if (strcmp (arg, "-crash") == 0)
+	txn = 3;
+      else if (strncmp (arg, "-reorganize=", 12) == 0)
+	reorganize = atoi (arg + 12);
+      else if (strcmp (arg, "-fdopen") == 0)
+	fdopen = 1;
       else if (strcmp (arg, "-verbose") == 0)
 	{
 	  verbose = 1;
@@ -196,13 +264,44 @@ main (int argc, char **argv)
     }
   dbname = *argv;
   
-  dbf = gdbm_open (dbname, block_size, mode|flags, 00664, NULL);
+  if (fdopen)
+    {
+      int fd = open (dbname, O_RDWR | O_CREAT, 00664);
+
+      if (fd == -1)
+	{
+	  fprintf (stderr, "%s: can't open %s: %s\n", progname, dbname,
+		   strerror (errno));
+	  exit (1);
+	}
+      dbf = gdbm_fd_open (fd, dbname, block_size,
+			  mode | flags | GDBM_CLOERROR, NULL);
+    }
+  else
+    dbf = gdbm_open (dbname, block_size, mode|flags, 00664, NULL);
   if (!dbf)
     {
       fprintf (stderr, "gdbm_open failed: %s\n", gdbm_strerror (gdbm_errno));
       exit (1);
     }
 
+  if (flags & GDBM_IOURING)
+    {
+      int on;
+
+      if (gdbm_setopt (dbf, GDBM_GETIOURING, &on, sizeof (on)))
+	{
+	  fprintf (stderr, "GDBM_GETIOURING failed: %s\n",
+		   gdbm_strerror (gdbm_errno));
+	  exit (1);
+	}
+      if (!on)
+	{
+	  fprintf (stderr, "%s: io_uring is not in use\n", progname);
+	  exit (77);
+	}
+    }
+
   if (mapped_size_max)
     {
       if (gdbm_setopt (dbf, GDBM_SETMAXMAPSIZE, &mapped_size_max,
@@ -214,6 +313,27 @@ main (int argc, char **argv)
 	}
     }  
 
+  if (bulk_buf_size)
+    {
+      if (gdbm_setopt (dbf, GDBM_SETBULKBUFSIZE, &bulk_buf_size,
+		       sizeof (bulk_buf_size)))
+	{
+	  fprintf (stderr, "GDBM_SETBULKBUFSIZE failed: %s\n",
+		   gdbm_strerror (gdbm_errno));
+	  exit (1);
+	}
+    }
+
+  if (capacity.records)
+    {
+      if (gdbm_setopt (dbf, GDBM_SETCAPACITY, &capacity, sizeof (capacity)))
+	{
+	  fprintf (stderr, "GDBM_SETCAPACITY failed: %s\n",
+		   gdbm_strerror (gdbm_errno));
+	  exit (1);
+	}
+    }
+
   if (verbose)
     {
       if (gdbm_setopt (dbf, GDBM_GETBLOCKSIZE, &blksize, sizeof blksize))
@@ -225,6 +345,45 @@ main (int argc, char **argv)
       printf ("blocksize=%d\n", blksize);
     }
   
+  if (batch && gdbm_batch_begin (dbf))
+    {
+      fprintf (stderr, "gdbm_batch_begin failed: %s\n",
+	       gdbm_strerror (gdbm_errno));
+      exit (1);
+    }
+  
+  if (txn == 3)
+    {
+      /* Save the database file, so that it can be put back after the
+	 commit, as if the system crashed before writing it. */
+      FILE *fp = fopen (dbname, "r");
+      if (!fp)
+	{
+	  perror (dbname);
+	  exit (1);
+	}
+      while ((image = realloc (image, image_size + sizeof buf)) != NULL)
+	{
+	  size_t n = fread (image + image_size, 1, sizeof buf, fp);
+	  image_size += n;
+	  if (n < sizeof buf)
+	    break;
+	}
+      if (!image || ferror (fp))
+	{
+	  fprintf (stderr, "%s: can't read %s\n", progname, dbname);
+	  exit (1);
+	}
+      fclose (fp);
+    }
+  
+  if (txn && gdbm_txn_begin (dbf))
+    {
+      fprintf (stderr, "gdbm_txn_begin failed: %s\n",
+	       gdbm_strerror (gdbm_errno));
+      exit (1);
+    }
+  
   while (fgets (buf, sizeof buf, stdin))
     {
       size_t i, j;
@@ -263,7 +422,33 @@ main (int argc, char **argv)
       key.dsize = j + data_z;
       data.dptr = buf + i + 1;
       data.dsize = strlen (data.dptr) + data_z;
-      if (gdbm_store (dbf, key, data, replace) != 0)
+      if (many)
+	{
+	  if (count == max)
+	    {
+	      max = max ? 2 * max : 64;
+	      keys = realloc (keys, max * sizeof (keys[0]));
+	      contents = realloc (contents, max * sizeof (contents[0]));
+	      if (!keys || !contents)
+		{
+		  fprintf (stderr, "%s: out of memory\n", progname);
+		  exit (1);
+		}
+	    }
+	  keys[count].dptr = malloc (key.dsize + data.dsize + 1);
+	  if (!keys[count].dptr)
+	    {
+	      fprintf (stderr, "%s: out of memory\n", progname);
+	      exit (1);
+	    }
+	  memcpy (keys[count].dptr, key.dptr, key.dsize);
+	  keys[count].dsize = key.dsize;
+	  contents[count].dptr = keys[count].dptr + key.dsize;
+	  memcpy (contents[count].dptr, data.dptr, data.dsize);
+	  contents[count].dsize = data.dsize;
+	  count++;
+	}
+      else if (gdbm_store (dbf, key, data, replace) != 0)
 	{
 	  fprintf (stderr, "%s: %d: item not inserted: %s\n",
 		   progname, line, gdbm_db_strerror (dbf));
@@ -286,7 +471,71 @@ main (int argc, char **argv)
 	      exit (1);
 	    }
 	}
+      else if (line == reorganize && gdbm_reorganize (dbf))
+	{
+	  fprintf (stderr, "%s: gdbm_reorganize failed: %s\n",
+		   progname, gdbm_db_strerror (dbf));
+	  exit (1);
+	}
+    }
+  if (bulk)
+    {
+      struct bulk_source src;
+      gdbm_count_t dups;
+      int rc;
+
+      src.keys = keys;
+      src.contents = contents;
+      src.count = count;
+      src.next = 0;
+      rc = gdbm_bulk_load (dbf, bulk_next, &src, replace, &dups);
+      if (rc == -1)
+	{
+	  fprintf (stderr, "%s: items not inserted: %s\n",
+		   progname, gdbm_db_strerror (dbf));
+	  exit (1);
+	}
+      if (rc == 1)
+	{
+	  fprintf (stderr, "%s: %lu items not inserted: %s\n",
+		   progname, (unsigned long) dups, gdbm_db_strerror (dbf));
+	  exit (1);
+	}
+    }
+  else if (many
+	   && gdbm_store_many (dbf, keys, contents, count, replace) == -1)
+    {
+      fprintf (stderr, "%s: items not inserted: %s\n",
+	       progname, gdbm_db_strerror (dbf));
+      exit (1);
+    }
+  
+  if (batch && gdbm_batch_end (dbf))
+    {
+      fprintf (stderr, "gdbm_batch_end failed: %s\n",
+	       gdbm_strerror (gdbm_errno));
+      exit (1);
+    }
+  
+  if (txn && (txn == 2 ? gdbm_txn_abort (dbf) : gdbm_txn_commit (dbf)))
+    {
+      fprintf (stderr, "gdbm_txn_%s failed: %s\n",
+	       txn == 2 ? "abort" : "commit", gdbm_strerror (gdbm_errno));
+      exit (1);
+    }
+
+  if (image)
+    {
+      FILE *fp = fopen (dbname, "w");
+      if (!fp || fwrite (image, 1, image_size, fp) != image_size
+	  || fclose (fp))
+	{
+	  perror (dbname);
+	  exit (1);
+	}
+      _exit (0);
     }
+  
   if (gdbm_close (dbf))
     {
       fprintf (stderr, "gdbm_close: %s; %s\n", gdbm_strerror (gdbm_errno),
@@ -30,6 +30,8 @@ int mode = GDBM_WRCREAT;        /* gdbm_open mode */
 int block_size = 0;             /* block size for the db. 0 means default */
 size_t mapped_size_max = 32768; /* size of the memory mapped region */
 size_t cache_size = 32;         /* cache size */
+size_t cache_bytes = 1048576;   /* cache memory budget */
+size_t data_cache_size = 65536; /* data cache memory budget */
 
 static size_t
 get_max_mmap_size (const char *arg)
@@ -85,6 +87,9 @@ char *string;
 size_t size;
 int intval;
 int retbool;
+struct gdbm_cache_stats cache_stats;
+struct gdbm_group_commit group_commit;
+struct gdbm_file_growth file_growth;
 
 /* Individual test and initialization functions */
 
@@ -121,6 +126,166 @@ test_getcachesize (void *valptr)
   return *(size_t*) valptr == cache_size ? RES_PASS : RES_FAIL;
 }
 
+int
+test_initial_cachebytes (void *valptr)
+{
+  return *(size_t*) valptr == 0 ? RES_PASS : RES_FAIL;
+}
+
+void
+init_cachebytes (void *valptr, int valsize)
+{
+  *(size_t*) valptr = cache_bytes;
+}
+
+int
+test_cachebytes (void *valptr)
+{
+  return *(size_t*) valptr == cache_bytes ? RES_PASS : RES_FAIL;
+}
+
+int
+test_initial_datacachesize (void *valptr)
+{
+  return *(size_t*) valptr == 1024 * 1024 ? RES_PASS : RES_FAIL;
+}
+
+void
+init_datacachesize (void *valptr, int valsize)
+{
+  *(size_t*) valptr = data_cache_size;
+}
+
+int
+test_datacachesize (void *valptr)
+{
+  return *(size_t*) valptr == data_cache_size ? RES_PASS : RES_FAIL;
+}
+
+int
+test_initial_cachepolicy (void *valptr)
+{
+  return *(int*) valptr == GDBM_CACHE_FIFO ? RES_PASS : RES_FAIL;
+}
+
+void
+init_cachepolicy (void *valptr, int valsize)
+{
+  *(int*) valptr = GDBM_CACHE_CLOCK;
+}
+
+int
+test_cachepolicy (void *valptr)
+{
+  return *(int*) valptr == GDBM_CACHE_CLOCK ? RES_PASS : RES_FAIL;
+}
+
+void
+init_bad_cachepolicy (void *valptr, int valsize)
+{
+  *(int*) valptr = -1;
+}
+
+/* GDBM_SETHASH takes effect at the next reorganization only, so
+   GDBM_GETHASH returns the hash function given by -fasthash both
+   times. */
+int
+test_gethash (void *valptr)
+{
+  int expected = (flags & GDBM_FASTHASH) ? GDBM_HASH_FAST : GDBM_HASH_LEGACY;
+  return *(int*) valptr == expected ? RES_PASS : RES_FAIL;
+}
+
+void
+init_sethash (void *valptr, int valsize)
+{
+  *(int*) valptr = (flags & GDBM_FASTHASH) ? GDBM_HASH_LEGACY : GDBM_HASH_FAST;
+}
+
+void
+init_bad_hash (void *valptr, int valsize)
+{
+  *(int*) valptr = 2;
+}
+
+int
+test_getfingerprint (void *valptr)
+{
+  return *(int*) valptr == !!(flags & GDBM_FINGERPRINT) ? RES_PASS : RES_FAIL;
+}
+
+void
+init_setfingerprint (void *valptr, int valsize)
+{
+  *(int*) valptr = !(flags & GDBM_FINGERPRINT);
+}
+
+int
+test_cachestats (void *valptr)
+{
+  struct gdbm_cache_stats *st = valptr;
+  /* No bucket has been looked up yet.  See cache00.at for the counts
+     after a known sequence of look-ups. */
+  return (st->hits == 0 && st->misses == 0 && st->evictions == 0
+	  && st->writebacks == 0 && st->data_hits == 0
+	  && st->data_misses == 0 && st->filter_rejects == 0)
+	 ? RES_PASS : RES_FAIL;
+}
+
+int
+test_groupcommit_group (void *valptr)
+{
+#ifdef HAVE_PTHREAD_H
+  return RES_PASS;
+#else
+  return RES_SKIP;
+#endif
+}
+
+int
+test_initial_groupcommit (void *valptr)
+{
+  struct gdbm_group_commit *gc = valptr;
+  return gc->max_count == 0 && gc->max_wait == 0 ? RES_PASS : RES_FAIL;
+}
+
+void
+init_groupcommit (void *valptr, int valsize)
+{
+  struct gdbm_group_commit *gc = valptr;
+  gc->max_count = 8;
+  gc->max_wait = 1000;
+}
+
+int
+test_groupcommit (void *valptr)
+{
+  struct gdbm_group_commit *gc = valptr;
+  return gc->max_count == 8 && gc->max_wait == 1000 ? RES_PASS : RES_FAIL;
+}
+
+int
+test_initial_filegrowth (void *valptr)
+{
+  struct gdbm_file_growth *fg = valptr;
+  return fg->chunk == 1024 * 1024 && fg->percent == 10 ? RES_PASS : RES_FAIL;
+}
+
+void
+init_filegrowth (void *valptr, int valsize)
+{
+  struct gdbm_file_growth *fg = valptr;
+  fg->chunk = 65536;
+  fg->percent = 50;
+}
+
+int
+test_filegrowth (void *valptr)
+{
+  struct gdbm_file_growth *fg = valptr;
+  return fg->chunk == 65536 && fg->percent == 50 ? RES_PASS : RES_FAIL;
+}
+
 void
 init_true (void *valptr, int valsize)
 {
@@ -235,9 +400,110 @@ struct optest optest_tab[] = {
     &size, sizeof (size),
     GDBM_OPT_ALREADY_SET, NULL, init_cachesize },
 
+  { "CACHEBYTES" },
+  { "CACHEBYTES", "initial GDBM_GETCACHEBYTES", GDBM_GETCACHEBYTES,
+    &size, sizeof (size), 0,
+    test_initial_cachebytes },
+  { "CACHEBYTES", "GDBM_SETCACHEBYTES", GDBM_SETCACHEBYTES,
+    &size, sizeof (size), 0,
+    NULL, init_cachebytes },
+  { "CACHEBYTES", "GDBM_GETCACHEBYTES", GDBM_GETCACHEBYTES,
+    &size, sizeof (size), 0,
+    test_cachebytes },
+
+  { "DATACACHESIZE" },
+  { "DATACACHESIZE", "initial GDBM_GETDATACACHESIZE", GDBM_GETDATACACHESIZE,
+    &size, sizeof (size), 0,
+    test_initial_datacachesize },
+  { "DATACACHESIZE", "GDBM_SETDATACACHESIZE", GDBM_SETDATACACHESIZE,
+    &size, sizeof (size), 0,
+    NULL, init_datacachesize },
+  { "DATACACHESIZE", "GDBM_GETDATACACHESIZE", GDBM_GETDATACACHESIZE,
+    &size, sizeof (size), 0,
+    test_datacachesize },
+
+  { "CACHEPOLICY" },
+  { "CACHEPOLICY", "initial GDBM_GETCACHEPOLICY", GDBM_GETCACHEPOLICY,
+    &intval, sizeof (intval), 0,
+    test_initial_cachepolicy },
+  { "CACHEPOLICY", "GDBM_SETCACHEPOLICY", GDBM_SETCACHEPOLICY,
+    &intval, sizeof (intval), 0,
+    NULL, init_cachepolicy },
+  { "CACHEPOLICY", "GDBM_GETCACHEPOLICY", GDBM_GETCACHEPOLICY,
+    &intval, sizeof (intval), 0,
+    test_cachepolicy },
+  { "CACHEPOLICY", "invalid GDBM_SETCACHEPOLICY", GDBM_SETCACHEPOLICY,
+    &intval, sizeof (intval),
+    GDBM_OPT_ILLEGAL, NULL, init_bad_cachepolicy },
+
+  { "CACHESTATS" },
+  { "CACHESTATS", "GDBM_GETCACHESTATS", GDBM_GETCACHESTATS,
+    &cache_stats, sizeof (cache_stats), 0,
+    test_cachestats },
+  { "CACHESTATS", "invalid GDBM_GETCACHESTATS", GDBM_GETCACHESTATS,
+    &intval, sizeof (intval),
+    GDBM_OPT_ILLEGAL },
+
+  { "FILEGROWTH" },
+  { "FILEGROWTH", "initial GDBM_GETFILEGROWTH", GDBM_GETFILEGROWTH,
+    &file_growth, sizeof (file_growth), 0,
+    test_initial_filegrowth },
+  { "FILEGROWTH", "GDBM_SETFILEGROWTH", GDBM_SETFILEGROWTH,
+    &file_growth, sizeof (file_growth), 0,
+    NULL, init_filegrowth },
+  { "FILEGROWTH", "GDBM_GETFILEGROWTH", GDBM_GETFILEGROWTH,
+    &file_growth, sizeof (file_growth), 0,
+    test_filegrowth },
+  { "FILEGROWTH", "invalid GDBM_SETFILEGROWTH", GDBM_SETFILEGROWTH,
+    &intval, sizeof (intval),
+    GDBM_OPT_ILLEGAL },
+
+  { "GROUPCOMMIT", NULL, 0, NULL, 0, 0, test_groupcommit_group },
+  { "GROUPCOMMIT", "initial GDBM_GETGROUPCOMMIT", GDBM_GETGROUPCOMMIT,
+    &group_commit, sizeof (group_commit), 0,
+    test_initial_groupcommit },
+  { "GROUPCOMMIT", "GDBM_SETGROUPCOMMIT", GDBM_SETGROUPCOMMIT,
+    &group_commit, sizeof (group_commit), 0,
+    NULL, init_groupcommit },
+  { "GROUPCOMMIT", "GDBM_GETGROUPCOMMIT", GDBM_GETGROUPCOMMIT,
+    &group_commit, sizeof (group_commit), 0,
+    test_groupcommit },
+  { "GROUPCOMMIT", "invalid GDBM_SETGROUPCOMMIT", GDBM_SETGROUPCOMMIT,
+    &intval, sizeof (intval),
+    GDBM_OPT_ILLEGAL },
+
+  { "HASH" },
+  { "HASH", "GDBM_GETHASH", GDBM_GETHASH,
+    &intval, sizeof (intval), 0,
+    test_gethash },
+  { "HASH", "GDBM_SETHASH", GDBM_SETHASH,
+    &intval, sizeof (intval), 0,
+    NULL, init_sethash },
+  { "HASH", "GDBM_GETHASH", GDBM_GETHASH,
+    &intval, sizeof (intval), 0,
+    test_gethash },
+  { "HASH", "invalid GDBM_SETHASH", GDBM_SETHASH,
+    &intval, sizeof (intval),
+    GDBM_OPT_ILLEGAL, NULL, init_bad_hash },
+
+  { "FINGERPRINT" },
+  { "FINGERPRINT", "GDBM_GETFINGERPRINT", GDBM_GETFINGERPRINT,
+    &intval, sizeof (intval), 0,
+    test_getfingerprint },
+  { "FINGERPRINT", "GDBM_SETFINGERPRINT", GDBM_SETFINGERPRINT,
+    &intval, sizeof (intval), 0,
+    NULL, init_setfingerprint },
+  { "FINGERPRINT", "GDBM_GETFINGERPRINT", GDBM_GETFINGERPRINT,
+    &intval, sizeof (intval), 0,
+    test_getfingerprint },
+  { "FINGERPRINT", "invalid GDBM_SETFINGERPRINT", GDBM_SETFINGERPRINT,
+    &intval, sizeof (intval),
+    GDBM_OPT_ILLEGAL, NULL, init_bad_hash },
+
   TEST_BOOL_OPTION (SYNCMODE, GDBM_SETSYNCMODE, GDBM_GETSYNCMODE),
   TEST_BOOL_OPTION (CENTFREE, GDBM_SETCENTFREE, GDBM_GETCENTFREE),
   TEST_BOOL_OPTION (COALESCEBLKS, GDBM_SETCOALESCEBLKS, GDBM_GETCOALESCEBLKS),
+  TEST_BOOL_OPTION (BUCKETFILTER, GDBM_SETBUCKETFILTER, GDBM_GETBUCKETFILTER),
 
   /* MMAP group */
   { "MMAP", NULL, 0, NULL, 0, 0, test_mmap_group }, 
@@ -316,7 +582,7 @@ main (int argc, char **argv)
 
       if (strcmp (arg, "-h") == 0)
 	{
-	  printf ("usage: %s [-blocksize=N] [-nolock] [-sync] [-maxmap=N] DBFILE [GROUP [GROUP...]\n",
+	  printf ("usage: %s [-blocksize=N] [-nolock] [-sync] [-fasthash] [-fingerprint] [-pow2buckets] [-maxmap=N] DBFILE [GROUP [GROUP...]\n",
 		  progname);
 	  exit (0);
 	}
@@ -324,6 +590,12 @@ main (int argc, char **argv)
 	flags |= GDBM_NOLOCK;
       else if (strcmp (arg, "-sync") == 0)
 	flags |= GDBM_SYNC;
+      else if (strcmp (arg, "-fasthash") == 0)
+	flags |= GDBM_FASTHASH;
+      else if (strcmp (arg, "-fingerprint") == 0)
+	flags |= GDBM_FINGERPRINT;
+      else if (strcmp (arg, "-pow2buckets") == 0)
+	flags |= GDBM_POW2BUCKETS;
       else if (strncmp (arg, "-blocksize=", 11) == 0)
 	block_size = atoi (arg + 11);
       else if (strncmp (arg, "-maxmap=", 8) == 0)
@@ -47,6 +47,8 @@ main (int argc, char **argv)
   int open_flags = GDBM_WRITER;
   gdbm_recovery rcvr;
   int rcvr_flags = 0;
+  int hash = -1;
+  int fingerprint = -1;
   char *p;
   
   progname = canonical_progname (argv[0]);
@@ -56,7 +58,7 @@ main (int argc, char **argv)
 
       if (strcmp (arg, "-h") == 0)
 	{
-	  printf ("usage: %s [-nolock] [-nommap] [-verbose] [-backup] [-max-failures=N] [-max-failed-keys=N] [-max-failed-buckets=N] DBFILE\n",
+	  printf ("usage: %s [-nolock] [-nommap] [-verbose] [-backup] [-force] [-hash=NAME] [-fingerprint] [-nofingerprint] [-max-failures=N] [-max-failed-keys=N] [-max-failed-buckets=N] DBFILE\n",
 		  progname);
 	  exit (0);
 	}
@@ -71,6 +73,16 @@ main (int argc, char **argv)
 	}
       else if (strcmp (arg, "-backup") == 0)
 	rcvr_flags |= GDBM_RCVR_BACKUP;
+      else if (strcmp (arg, "-force") == 0)
+	rcvr_flags |= GDBM_RCVR_FORCE;
+      else if (strcmp (arg, "-hash=fast") == 0)
+	hash = GDBM_HASH_FAST;
+      else if (strcmp (arg, "-hash=legacy") == 0)
+	hash = GDBM_HASH_LEGACY;
+      else if (strcmp (arg, "-fingerprint") == 0)
+	fingerprint = 1;
+      else if (strcmp (arg, "-nofingerprint") == 0)
+	fingerprint = 0;
       else if (strncmp (arg, "-max-failures=", 14) == 0)
 	{
 	  rcvr.max_failures = strtoul (arg + 14, &p, 10);
@@ -118,6 +130,22 @@ main (int argc, char **argv)
       exit (1);
     }
 
+  if (hash != -1
+      && gdbm_setopt (dbf, GDBM_SETHASH, &hash, sizeof (hash)))
+    {
+      fprintf (stderr, "GDBM_SETHASH: %s\n", gdbm_strerror (gdbm_errno));
+      exit (1);
+    }
+
+  if (fingerprint != -1
+      && gdbm_setopt (dbf, GDBM_SETFINGERPRINT, &fingerprint,
+		      sizeof (fingerprint)))
+    {
+      fprintf (stderr, "GDBM_SETFINGERPRINT: %s\n",
+	       gdbm_strerror (gdbm_errno));
+      exit (1);
+    }
+
   rc = gdbm_recover (dbf, &rcvr, rcvr_flags);
 
   if (gdbm_close (dbf))